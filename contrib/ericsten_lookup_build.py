@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+
+"""
+Build an ericsten_lookup table from "key value" lines.
+
+    ericsten_lookup_build.py input.txt table.lookup
+
+The input has the format of ericsten_snapshot files: the key is the first
+word of a line, the value the rest of it; empty lines and lines starting
+with "#" are skipped.  The table is written next to the output and renamed
+over it, so that nginx never maps a half-written file.  See
+ngx_http_ericsten_lookup.h for the format.
+"""
+
+import os
+import struct
+import sys
+
+MAGIC = b"ESLOOKUP"
+VERSION = 1
+HEADER = struct.Struct("<8sIIQQQQQ")
+
+M64 = (1 << 64) - 1
+P1 = 0x9E3779B185EBCA87
+P2 = 0xC2B2AE3D27D4EB4F
+P3 = 0x165667B19E3779F9
+P4 = 0x85EBCA77C2B2AE63
+P5 = 0x27D4EB2F165667C5
+
+
+def rotl(x, r):
+    return ((x << r) | (x >> (64 - r))) & M64
+
+
+def round_(acc, lane):
+    acc = (acc + lane * P2) & M64
+    return (rotl(acc, 31) * P1) & M64
+
+
+def merge(acc, val):
+    acc ^= round_(0, val)
+    return (acc * P1 + P4) & M64
+
+
+def xxh64(data, seed=0):
+    n = len(data)
+    i = 0
+
+    if n >= 32:
+        v1 = (seed + P1 + P2) & M64
+        v2 = (seed + P2) & M64
+        v3 = seed
+        v4 = (seed - P1) & M64
+
+        while i + 32 <= n:
+            a, b, c, d = struct.unpack_from("<4Q", data, i)
+            v1 = round_(v1, a)
+            v2 = round_(v2, b)
+            v3 = round_(v3, c)
+            v4 = round_(v4, d)
+            i += 32
+
+        h = (rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18)) & M64
+        for v in (v1, v2, v3, v4):
+            h = merge(h, v)
+    else:
+        h = (seed + P5) & M64
+
+    h = (h + n) & M64
+
+    while i + 8 <= n:
+        (k,) = struct.unpack_from("<Q", data, i)
+        h ^= round_(0, k)
+        h = (rotl(h, 27) * P1 + P4) & M64
+        i += 8
+
+    if i + 4 <= n:
+        (k,) = struct.unpack_from("<I", data, i)
+        h ^= (k * P1) & M64
+        h = (rotl(h, 23) * P2 + P3) & M64
+        i += 4
+
+    while i < n:
+        h ^= (data[i] * P5) & M64
+        h = (rotl(h, 11) * P1) & M64
+        i += 1
+
+    h ^= h >> 33
+    h = (h * P2) & M64
+    h ^= h >> 29
+    h = (h * P3) & M64
+    h ^= h >> 32
+
+    return h
+
+
+def parse(path):
+    entries = {}
+
+    with open(path, "rb") as f:
+        for line in f:
+            line = line.strip()
+            if not line or line.startswith(b"#"):
+                continue
+
+            parts = line.split(None, 1)
+            key = parts[0]
+            value = parts[1] if len(parts) > 1 else b""
+
+            if key in entries:
+                sys.exit("%s: duplicate key %r" % (path, key.decode(errors="replace")))
+
+            entries[key] = value
+
+    return entries
+
+
+def build(entries):
+    items = sorted((xxh64(k), k, v) for k, v in entries.items())
+    count = len(items)
+
+    hashes = HEADER.size
+    records = hashes + 8 * count
+    data = records + 8 * count
+
+    offsets = []
+    body = bytearray()
+
+    for _, key, value in items:
+        offsets.append(data + len(body))
+        body += struct.pack("<II", len(key), len(value)) + key + value
+
+    payload = (struct.pack("<%dQ" % count, *(h for h, _, _ in items))
+               + struct.pack("<%dQ" % count, *offsets)
+               + bytes(body))
+
+    size = HEADER.size + len(payload)
+    header = HEADER.pack(MAGIC, VERSION, 0, count, hashes, records, size, xxh64(payload))
+
+    return header + payload
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s input output" % sys.argv[0])
+
+    table = build(parse(sys.argv[1]))
+    tmp = sys.argv[2] + ".tmp"
+
+    with open(tmp, "wb") as f:
+        f.write(table)
+        f.flush()
+        os.fsync(f.fileno())
+
+    os.rename(tmp, sys.argv[2])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+"""
+Reference sidecar for ericsten_sidecar.
+
+    ericsten_sidecar.py [--processes N] unix:/path/to/socket | host:port
+
+Listens on a Unix domain or TCP socket and runs the calls nginx sends on a
+pool of N single-threaded processes (by default, one per CPU), so that a
+library that is not thread-safe is only ever used by one thread of each
+process.  The calls of a connection run concurrently and are answered as
+they complete, in any order; echo calls are answered directly, without the
+pool.  See ngx_http_ericsten_sidecar.h for the protocol.
+
+A Unix domain socket must be writable by the nginx workers.  A previous
+socket file at the same path is removed.  A bare path is taken as a Unix
+domain socket.
+"""
+
+import argparse
+import asyncio
+import concurrent.futures
+import os
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("!IIHH")
+MAX_BODY = 4096
+
+ECHO = 0
+SLEEP = 1
+
+STATUS_FAILED = 1
+STATUS_UNKNOWN_OP = 2
+
+
+def sleep(body):
+    """The sleep task: 100 to 1000 ms, in 100 ms steps."""
+
+    (value,) = struct.unpack("!I", body)
+    msec = (value % 9 + 1) * 100
+    time.sleep(msec / 1000)
+    return struct.pack("!I", msec)
+
+
+OPS = {
+    SLEEP: sleep,
+}
+
+
+def response(id_, status, body):
+    return HEADER.pack(len(body), id_, status, 0) + body
+
+
+async def serve(reader, writer, pool):
+    loop = asyncio.get_running_loop()
+    calls = set()
+
+    async def run(id_, op, body):
+        try:
+            result = await loop.run_in_executor(pool, OPS[op], body)
+            writer.write(response(id_, 0, result))
+        except Exception as e:
+            writer.write(response(id_, STATUS_FAILED, str(e).encode()[:MAX_BODY]))
+
+    try:
+        while True:
+            length, id_, op, _ = HEADER.unpack(await reader.readexactly(HEADER.size))
+
+            if length > MAX_BODY:
+                break
+
+            body = await reader.readexactly(length)
+
+            if op == ECHO:
+                writer.write(response(id_, 0, body))
+            elif op not in OPS:
+                writer.write(response(id_, STATUS_UNKNOWN_OP, b"unknown operation"))
+            else:
+                call = asyncio.ensure_future(run(id_, op, body))
+                calls.add(call)
+                call.add_done_callback(calls.discard)
+
+    except (asyncio.IncompleteReadError, ConnectionError):
+        pass
+
+    finally:
+        for call in calls:
+            call.cancel()
+
+        writer.close()
+
+
+async def main(address, processes):
+    pool = concurrent.futures.ProcessPoolExecutor(max_workers=processes)
+    handler = lambda r, w: serve(r, w, pool)
+
+    if address.startswith("unix:") or address.startswith("/"):
+        path = address[5:] if address.startswith("unix:") else address
+
+        if os.path.exists(path):
+            os.unlink(path)
+
+        server = await asyncio.start_unix_server(handler, path)
+
+    else:
+        host, _, port = address.rpartition(":")
+        server = await asyncio.start_server(handler, host.strip("[]") or None, int(port))
+
+    print("ericsten sidecar: listening on %s, %d processes" % (address, processes),
+          file=sys.stderr)
+
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--processes", type=int, default=os.cpu_count())
+    parser.add_argument("address")
+    args = parser.parse_args()
+
+    try:
+        asyncio.run(main(args.address, args.processes))
+    except KeyboardInterrupt:
+        pass
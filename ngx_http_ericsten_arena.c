@@ -0,0 +1,281 @@
+/*
+
+Module Description:
+    Per-thread bump arenas for ngx_http_ericsten_module tasks.  See
+    ngx_http_ericsten_arena.h.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_ericsten_arena.h"
+
+#define NGX_HTTP_ERICSTEN_ARENA_BLOCK_SIZE  (64 * 1024)
+#define NGX_HTTP_ERICSTEN_ARENA_LARGE       (NGX_HTTP_ERICSTEN_ARENA_BLOCK_SIZE / 4)
+#define NGX_HTTP_ERICSTEN_ARENA_FREE_MAX    64      // Idle blocks kept per worker.
+
+struct ngx_http_ericsten_arena_block_s
+{
+    ngx_http_ericsten_arena_block_t  *next;     // In the free list.
+    u_char                           *last;     // Next free byte; moved by the owning thread only.
+    u_char                           *end;
+    ngx_uint_t                        refs;     // Atomic.
+};
+
+//
+// A lease's hold on a block, allocated from the block itself.
+//
+struct ngx_http_ericsten_arena_ref_s
+{
+    ngx_http_ericsten_arena_ref_t    *next;
+    ngx_http_ericsten_arena_block_t  *block;
+};
+
+#define NGX_HTTP_ERICSTEN_ARENA_HEADER_SIZE                                   \
+    ngx_align(sizeof(ngx_http_ericsten_arena_block_t), NGX_ALIGNMENT)
+
+#define NGX_HTTP_ERICSTEN_ARENA_REF_SIZE                                      \
+    ngx_align(sizeof(ngx_http_ericsten_arena_ref_t), NGX_ALIGNMENT)
+
+#define ngx_http_ericsten_arena_data(b)                                       \
+    ((u_char *) (b) + NGX_HTTP_ERICSTEN_ARENA_HEADER_SIZE)
+
+//
+// The calling pool thread's current block.
+//
+static __thread ngx_http_ericsten_arena_block_t  *ngx_http_ericsten_arena_current;
+
+//
+// Idle blocks, shared by the threads of the worker.  Taken and given back
+// once per block, not per allocation, so a spinlock is enough.
+//
+static ngx_atomic_t                      ngx_http_ericsten_arena_lock;
+static ngx_http_ericsten_arena_block_t  *ngx_http_ericsten_arena_free;
+static ngx_uint_t                        ngx_http_ericsten_arena_nfree;
+
+static ngx_http_ericsten_arena_block_t *ngx_http_ericsten_arena_get(ngx_log_t *log);
+static void ngx_http_ericsten_arena_unref(ngx_http_ericsten_arena_block_t *b);
+static void ngx_http_ericsten_arena_hold(ngx_http_ericsten_arena_lease_t *lease,
+    ngx_http_ericsten_arena_block_t *b);
+static void ngx_http_ericsten_arena_cleanup(void *data);
+
+void
+ngx_http_ericsten_arena_begin(ngx_http_ericsten_arena_lease_t *lease, ngx_log_t *log)
+{
+    ngx_http_ericsten_arena_block_t  *b = ngx_http_ericsten_arena_current;
+
+    lease->refs = NULL;
+    lease->block = NULL;
+    lease->log = log;
+
+    //
+    // With only our own reference left, every earlier lease on the block
+    // has been released: start over at the beginning.  Nobody else can take
+    // a reference on the current block.
+    //
+
+    if (b != NULL && __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1)
+    {
+        b->last = ngx_http_ericsten_arena_data(b);
+    }
+}
+
+void *
+ngx_http_ericsten_arena_alloc(ngx_http_ericsten_arena_lease_t *lease, size_t size)
+{
+    u_char                           *p;
+    size_t                            need;
+    ngx_http_ericsten_arena_block_t  *b;
+
+    size = ngx_align(size, NGX_ALIGNMENT);
+
+    if (size > NGX_HTTP_ERICSTEN_ARENA_LARGE)
+    {
+        b = ngx_alloc(NGX_HTTP_ERICSTEN_ARENA_HEADER_SIZE + NGX_HTTP_ERICSTEN_ARENA_REF_SIZE + size,
+                      lease->log);
+        if (b == NULL)
+        {
+            return NULL;
+        }
+
+        b->last = ngx_http_ericsten_arena_data(b);
+        b->end = b->last + NGX_HTTP_ERICSTEN_ARENA_REF_SIZE + size;
+        b->refs = 0;
+
+        ngx_http_ericsten_arena_hold(lease, b);
+
+        p = b->last;
+        b->last += size;
+
+        return p;
+    }
+
+    b = ngx_http_ericsten_arena_current;
+
+    need = size + (lease->block == b ? 0 : NGX_HTTP_ERICSTEN_ARENA_REF_SIZE);
+
+    if (b == NULL || (size_t) (b->end - b->last) < need)
+    {
+        //
+        // Move on to a fresh block.  The old one goes back to the free list
+        // once the leases on it are released.
+        //
+
+        b = ngx_http_ericsten_arena_get(lease->log);
+        if (b == NULL)
+        {
+            return NULL;
+        }
+
+        if (ngx_http_ericsten_arena_current != NULL)
+        {
+            ngx_http_ericsten_arena_unref(ngx_http_ericsten_arena_current);
+        }
+
+        ngx_http_ericsten_arena_current = b;
+    }
+
+    if (lease->block != b)
+    {
+        ngx_http_ericsten_arena_hold(lease, b);
+        lease->block = b;
+    }
+
+    p = b->last;
+    b->last += size;
+
+    return p;
+}
+
+void
+ngx_http_ericsten_arena_release(ngx_http_ericsten_arena_lease_t *lease)
+{
+    ngx_http_ericsten_arena_ref_t  *ref, *next;
+
+    for (ref = lease->refs; ref; ref = next)
+    {
+        //
+        // The reference lives in the block it holds.
+        //
+
+        next = ref->next;
+
+        ngx_http_ericsten_arena_unref(ref->block);
+    }
+
+    lease->refs = NULL;
+    lease->block = NULL;
+}
+
+ngx_int_t
+ngx_http_ericsten_arena_adopt(ngx_pool_t *pool, ngx_http_ericsten_arena_lease_t *lease)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_http_ericsten_arena_lease_t));
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(cln->data, lease, sizeof(ngx_http_ericsten_arena_lease_t));
+    cln->handler = ngx_http_ericsten_arena_cleanup;
+
+    lease->refs = NULL;
+    lease->block = NULL;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_arena_cleanup(void *data)
+{
+    ngx_http_ericsten_arena_release(data);
+}
+
+static void
+ngx_http_ericsten_arena_hold(ngx_http_ericsten_arena_lease_t *lease, ngx_http_ericsten_arena_block_t *b)
+{
+    ngx_http_ericsten_arena_ref_t  *ref;
+
+    ref = (ngx_http_ericsten_arena_ref_t *) b->last;
+    b->last += NGX_HTTP_ERICSTEN_ARENA_REF_SIZE;
+
+    ref->block = b;
+    ref->next = lease->refs;
+    lease->refs = ref;
+
+    (void) __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+static ngx_http_ericsten_arena_block_t *
+ngx_http_ericsten_arena_get(ngx_log_t *log)
+{
+    ngx_http_ericsten_arena_block_t  *b;
+
+    ngx_spinlock(&ngx_http_ericsten_arena_lock, 1, 2048);
+
+    b = ngx_http_ericsten_arena_free;
+
+    if (b != NULL)
+    {
+        ngx_http_ericsten_arena_free = b->next;
+        ngx_http_ericsten_arena_nfree--;
+    }
+
+    ngx_memory_barrier();
+
+    ngx_unlock(&ngx_http_ericsten_arena_lock);
+
+    if (b == NULL)
+    {
+        b = ngx_alloc(NGX_HTTP_ERICSTEN_ARENA_BLOCK_SIZE, log);
+        if (b == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    b->last = ngx_http_ericsten_arena_data(b);
+    b->end = (u_char *) b + NGX_HTTP_ERICSTEN_ARENA_BLOCK_SIZE;
+    b->refs = 1;
+
+    return b;
+}
+
+//
+// Drop a reference; the last one frees the block, or keeps it for reuse.
+//
+
+static void
+ngx_http_ericsten_arena_unref(ngx_http_ericsten_arena_block_t *b)
+{
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    if (b->end - (u_char *) b == NGX_HTTP_ERICSTEN_ARENA_BLOCK_SIZE)
+    {
+        ngx_spinlock(&ngx_http_ericsten_arena_lock, 1, 2048);
+
+        if (ngx_http_ericsten_arena_nfree < NGX_HTTP_ERICSTEN_ARENA_FREE_MAX)
+        {
+            b->next = ngx_http_ericsten_arena_free;
+            ngx_http_ericsten_arena_free = b;
+            ngx_http_ericsten_arena_nfree++;
+
+            b = NULL;
+        }
+
+        ngx_memory_barrier();
+
+        ngx_unlock(&ngx_http_ericsten_arena_lock);
+    }
+
+    if (b != NULL)
+    {
+        ngx_free(b);
+    }
+}
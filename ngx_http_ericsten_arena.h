@@ -0,0 +1,64 @@
+/*
+
+Module Description:
+    Per-thread bump arenas for memory allocated by ngx_http_ericsten_module
+    tasks.
+
+    A task cannot allocate from the request pool, which belongs to the
+    event loop.  Instead it allocates from its pool thread's current arena
+    block by bumping a pointer, under a lease.  The lease goes back to the
+    event loop with the task's results, and the memory stays valid until the
+    lease is released: right after the completion handler has copied the
+    results into r->pool, or with the request if ngx_http_ericsten_arena_adopt()
+    hands the lease to its pool.  Memory needed only during the task, such
+    as the page vector of the file residency check, is leased and released
+    by the task itself.
+
+    Blocks are reference counted: one reference per lease that allocated
+    from the block, and one for the thread while the block is its current
+    one.  A thread whose current block has no leases left starts the next
+    task at the beginning of the block again, so a steady stream of tasks
+    keeps reusing the same warm memory.  Blocks given up with leases still
+    on them are recycled once the last lease is released.  Large
+    allocations get a block of their own.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_ARENA_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_ARENA_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+typedef struct ngx_http_ericsten_arena_block_s  ngx_http_ericsten_arena_block_t;
+typedef struct ngx_http_ericsten_arena_ref_s    ngx_http_ericsten_arena_ref_t;
+
+typedef struct
+{
+    ngx_http_ericsten_arena_ref_t    *refs;     // Blocks held, newest first.
+    ngx_http_ericsten_arena_block_t  *block;    // Block of the last allocation.
+    ngx_log_t                        *log;
+} ngx_http_ericsten_arena_lease_t;
+
+//
+// On a pool thread, at the start of a task.
+//
+void ngx_http_ericsten_arena_begin(ngx_http_ericsten_arena_lease_t *lease, ngx_log_t *log);
+
+//
+// On a pool thread, during the task.  Returns NULL if memory is exhausted.
+// The memory is aligned to NGX_ALIGNMENT and not zeroed.
+//
+void *ngx_http_ericsten_arena_alloc(ngx_http_ericsten_arena_lease_t *lease, size_t size);
+
+//
+// Anywhere, once the task is done and the memory is no longer used.
+//
+void ngx_http_ericsten_arena_release(ngx_http_ericsten_arena_lease_t *lease);
+
+//
+// On the event loop: release the lease when the pool is destroyed instead.
+//
+ngx_int_t ngx_http_ericsten_arena_adopt(ngx_pool_t *pool, ngx_http_ericsten_arena_lease_t *lease);
+
+#endif /* _NGX_HTTP_ERICSTEN_ARENA_H_INCLUDED_ */
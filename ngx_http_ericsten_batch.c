@@ -0,0 +1,202 @@
+/*
+
+Module Description:
+    Batched thread pool tasks for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_batch.h.
+
+    With no delay, the flush event is posted, and runs after the handlers of
+    the current event loop iteration: the requests read in one iteration
+    share a batch.  nginx timers count milliseconds, so a delay does too.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_batch.h"
+
+struct ngx_http_ericsten_batch_s
+{
+    ngx_thread_task_t                   task;
+    ngx_http_ericsten_batcher_t        *batcher;
+    ngx_http_ericsten_batch_t          *next;       // In the free list.
+    ngx_int_t                           rc;
+    ngx_uint_t                          n;
+    void                               *items[1];   // batcher->size of them.
+};
+
+static void ngx_http_ericsten_batch_flush_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_batch_dispatch(ngx_http_ericsten_batcher_t *batcher);
+static void ngx_http_ericsten_batch_run(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_batch_completion_handler(ngx_event_t *ev);
+
+ngx_http_ericsten_batcher_t *
+ngx_http_ericsten_batcher_create(ngx_conf_t *cf, ngx_uint_t size, ngx_msec_t delay,
+    ngx_http_ericsten_batch_run_pt run, ngx_http_ericsten_batch_done_pt done)
+{
+    ngx_http_ericsten_batcher_t  *batcher;
+
+    batcher = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_batcher_t));
+    if (batcher == NULL)
+    {
+        return NULL;
+    }
+
+    batcher->size = size;
+    batcher->delay = delay;
+    batcher->run = run;
+    batcher->done = done;
+
+    return batcher;
+}
+
+ngx_int_t
+ngx_http_ericsten_batcher_start(ngx_http_ericsten_batcher_t *batcher, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    batcher->tp = tp;
+    batcher->log = cycle->log;
+
+    batcher->flush.handler = ngx_http_ericsten_batch_flush_handler;
+    batcher->flush.data = batcher;
+    batcher->flush.log = cycle->log;
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_batch_add(ngx_http_ericsten_batcher_t *batcher, void *item)
+{
+    ngx_http_ericsten_batch_t  *batch;
+
+    batch = batcher->current;
+
+    if (batch == NULL)
+    {
+        if (batcher->free)
+        {
+            batch = batcher->free;
+            batcher->free = batch->next;
+        }
+        else
+        {
+            batch = ngx_alloc(offsetof(ngx_http_ericsten_batch_t, items) + batcher->size * sizeof(void *),
+                              batcher->log);
+            if (batch == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(&batch->task, sizeof(ngx_thread_task_t));
+
+            batch->batcher = batcher;
+            batch->task.ctx = batch;
+            batch->task.handler = ngx_http_ericsten_batch_run;
+            batch->task.event.handler = ngx_http_ericsten_batch_completion_handler;
+            batch->task.event.data = batch;
+            batch->task.event.log = batcher->log;
+        }
+
+        batch->n = 0;
+        batch->rc = NGX_OK;
+
+        batcher->current = batch;
+    }
+
+    batch->items[batch->n++] = item;
+
+    if (batch->n == batcher->size)
+    {
+        ngx_http_ericsten_batch_dispatch(batcher);
+        return NGX_OK;
+    }
+
+    if (batch->n == 1)
+    {
+        if (batcher->delay)
+        {
+            ngx_add_timer(&batcher->flush, batcher->delay);
+        }
+        else
+        {
+            ngx_post_event(&batcher->flush, &ngx_posted_events);
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_batch_flush_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_batcher_t  *batcher = ev->data;
+
+    if (batcher->current)
+    {
+        ngx_http_ericsten_batch_dispatch(batcher);
+    }
+}
+
+//
+// Post the current batch.  A batch the pool refuses fails its items from
+// its completion handler, posted to the event loop rather than called, as
+// done must not run from within ngx_http_ericsten_batch_add().
+//
+
+static void
+ngx_http_ericsten_batch_dispatch(ngx_http_ericsten_batcher_t *batcher)
+{
+    ngx_http_ericsten_batch_t  *batch = batcher->current;
+
+    batcher->current = NULL;
+
+    if (batcher->flush.timer_set)
+    {
+        ngx_del_timer(&batcher->flush);
+    }
+
+    if (batcher->flush.posted)
+    {
+        ngx_delete_posted_event(&batcher->flush);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, batcher->log, 0,
+        "ericsten batch: dispatching %ui items", batch->n);
+
+    if (ngx_thread_task_post(batcher->tp, &batch->task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, batcher->log, 0,
+            "ericsten batch: failed to post a batch of %ui items", batch->n);
+
+        batch->rc = NGX_ERROR;
+        ngx_post_event(&batch->task.event, &ngx_posted_events);
+    }
+}
+
+//
+// Thread Pool Task Function.
+//
+
+static void
+ngx_http_ericsten_batch_run(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_batch_t  *batch = data;
+
+    batch->batcher->run(batch->items, batch->n, log);
+}
+
+static void
+ngx_http_ericsten_batch_completion_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                    i;
+    ngx_http_ericsten_batch_t    *batch = ev->data;
+    ngx_http_ericsten_batcher_t  *batcher = batch->batcher;
+
+    for (i = 0; i < batch->n; i++)
+    {
+        batcher->done(batch->items[i], batch->rc);
+    }
+
+    batch->next = batcher->free;
+    batcher->free = batch;
+}
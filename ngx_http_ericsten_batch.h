@@ -0,0 +1,79 @@
+/*
+
+Module Description:
+    Batched thread pool tasks for ngx_http_ericsten_module.
+
+    Every task posted to the thread pool pays for a queue insert, a thread
+    wakeup and a completion event; for a short task, that is most of its
+    cost.  Items added to a batch are instead held on the event loop until
+    the batch is full, or until the end of the event loop iteration (or a
+    delay) once it holds any, and then run as one thread pool task by a
+    handler that takes them all at once.  Its completion event finishes
+    every item.  A backend that can serve several items with one call, as
+    a lookup service answering several keys in one round trip, does one
+    blocking call per batch instead of one per item.
+
+    Batches are per worker.  A batch that cannot be posted fails its items,
+    on the event loop, like any other completion.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_BATCH_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_BATCH_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+typedef struct ngx_http_ericsten_batch_s  ngx_http_ericsten_batch_t;
+
+//
+// In a pool thread: run the n items of a batch.
+//
+typedef void (*ngx_http_ericsten_batch_run_pt)(void **items, ngx_uint_t n, ngx_log_t *log);
+
+//
+// On the event loop: the item's batch ran, if rc is NGX_OK, or could not be
+// posted.
+//
+typedef void (*ngx_http_ericsten_batch_done_pt)(void *item, ngx_int_t rc);
+
+typedef struct
+{
+    ngx_uint_t                          size;       // Items per batch, at most.
+    ngx_msec_t                          delay;      // Before a batch that is not full runs; 0 for the end of
+                                                    // the event loop iteration.
+    ngx_http_ericsten_batch_run_pt      run;
+    ngx_http_ericsten_batch_done_pt     done;
+
+    //
+    // Worker state.
+    //
+
+    ngx_thread_pool_t                  *tp;
+    ngx_log_t                          *log;
+    ngx_http_ericsten_batch_t          *current;    // Filling, or NULL.
+    ngx_http_ericsten_batch_t          *free;
+    ngx_event_t                         flush;
+} ngx_http_ericsten_batcher_t;
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_batcher_t *ngx_http_ericsten_batcher_create(ngx_conf_t *cf, ngx_uint_t size, ngx_msec_t delay,
+    ngx_http_ericsten_batch_run_pt run, ngx_http_ericsten_batch_done_pt done);
+
+//
+// From the module's init_process handler.
+//
+ngx_int_t ngx_http_ericsten_batcher_start(ngx_http_ericsten_batcher_t *batcher, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+//
+// On the event loop: add an item to the current batch.  Once added, the
+// item is finished by exactly one call of done, never before this returns.
+// Returns NGX_ERROR, without adding it, if no batch can be allocated.
+//
+ngx_int_t ngx_http_ericsten_batch_add(ngx_http_ericsten_batcher_t *batcher, void *item);
+
+#endif /* _NGX_HTTP_ERICSTEN_BATCH_H_INCLUDED_ */
@@ -0,0 +1,597 @@
+/*
+
+Module Description:
+    Bloom filter negative cache for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_bloom.h.
+
+    The key of a block is the high half of the key's XXH64, mapped onto the
+    blocks by multiplication; the bit in each word of the block comes from
+    the low half, multiplied by a salt of the word.  These are the salts of
+    the split block filters of Parquet and Impala.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include <sys/mman.h>
+
+#include "ngx_http_ericsten_bloom.h"
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_digest.h"
+
+#define NGX_HTTP_ERICSTEN_BLOOM_BLOCK   64      // Bytes, one cache line.
+#define NGX_HTTP_ERICSTEN_BLOOM_WORDS   8       // 64-bit words per block, one bit set in each.
+#define NGX_HTTP_ERICSTEN_BLOOM_NONE    2       // No filter built yet.
+
+typedef struct
+{
+    ngx_atomic_t        seq;            // Odd while the filter is written.
+    ngx_uint_t          keys;
+    double              fp_rate;
+} ngx_http_ericsten_bloom_filter_t;
+
+//
+// Each worker counts in its own cache line.  The zone outlives reloads, so
+// a worker may share its slot with the old worker of the same number while
+// that one finishes: the counters are updated with atomic adds.
+//
+typedef struct
+{
+    ngx_atomic_t        checks NGX_HTTP_ERICSTEN_CACHE_ALIGNED;
+    ngx_atomic_t        skips;
+} ngx_http_ericsten_bloom_counters_t;
+
+//
+// Head of the zone, followed by the blocks of the two filters.
+//
+struct ngx_http_ericsten_bloom_zone_s
+{
+    ngx_atomic_t        lock;           // Pid of the process rebuilding a filter.
+    ngx_atomic_t        current;        // Filter in use, or NGX_HTTP_ERICSTEN_BLOOM_NONE.
+
+    //
+    // The key file the current filter was built from.  Only read and
+    // written with the lock held.
+    //
+
+    time_t              mtime;
+    off_t               size;
+    ngx_file_uniq_t     uniq;
+
+    ngx_http_ericsten_bloom_filter_t    filter[2];
+    ngx_http_ericsten_bloom_counters_t  counters[NGX_MAX_PROCESSES];
+};
+
+typedef ngx_uint_t (*ngx_http_ericsten_bloom_probe_pt)(uint64_t *block, uint32_t h);
+
+static ngx_int_t ngx_http_ericsten_bloom_init_zone(ngx_http_ericsten_shm_t *shm, ngx_uint_t reused);
+static void ngx_http_ericsten_bloom_update(ngx_http_ericsten_bloom_t *bloom);
+static ngx_int_t ngx_http_ericsten_bloom_build(ngx_http_ericsten_bloom_t *bloom, ngx_fd_t fd, size_t size,
+    ngx_uint_t s);
+static void ngx_http_ericsten_bloom_add(uint64_t *block, uint32_t h);
+static ngx_uint_t ngx_http_ericsten_bloom_probe_scalar(uint64_t *block, uint32_t h);
+static void ngx_http_ericsten_bloom_timer_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_bloom_task(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_bloom_completion_handler(ngx_event_t *ev);
+
+#if (NGX_HTTP_ERICSTEN_X86)
+static ngx_uint_t ngx_http_ericsten_bloom_probe_avx2(uint64_t *block, uint32_t h);
+#endif
+
+static ngx_http_ericsten_bloom_probe_pt  ngx_http_ericsten_bloom_probe = ngx_http_ericsten_bloom_probe_scalar;
+
+static uint32_t  ngx_http_ericsten_bloom_salt[NGX_HTTP_ERICSTEN_BLOOM_WORDS] __attribute__((aligned(32))) = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+void
+ngx_http_ericsten_bloom_init_kernels(ngx_log_t *log)
+{
+#if (NGX_HTTP_ERICSTEN_X86)
+    ngx_uint_t  avx2;
+
+    avx2 = ngx_http_ericsten_cpu_avx2();
+
+    if (avx2)
+    {
+        ngx_http_ericsten_bloom_probe = ngx_http_ericsten_bloom_probe_avx2;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+        "ngx_http_ericsten_bloom_init_kernels: avx2:%ui", avx2);
+#endif
+}
+
+ngx_http_ericsten_bloom_t *
+ngx_http_ericsten_bloom_create(ngx_conf_t *cf, ngx_array_t *zones, ngx_str_t *path, size_t size,
+    ngx_msec_t interval)
+{
+    ngx_str_t                   name;
+    ngx_http_ericsten_bloom_t  *bloom;
+
+    bloom = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_bloom_t));
+    if (bloom == NULL)
+    {
+        return NULL;
+    }
+
+    bloom->path = *path;
+
+    if (ngx_conf_full_name(cf->cycle, &bloom->path, 1) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    bloom->interval = interval;
+    bloom->nblocks = size / NGX_HTTP_ERICSTEN_BLOOM_BLOCK;
+    bloom->log = cf->log;
+
+    ngx_str_set(&name, "ericsten_bloom");
+
+    bloom->shm = ngx_http_ericsten_shm_add(cf, zones, &name,
+                                           sizeof(ngx_http_ericsten_bloom_zone_t)
+                                           + 2 * bloom->nblocks * NGX_HTTP_ERICSTEN_BLOOM_BLOCK);
+    if (bloom->shm == NULL)
+    {
+        return NULL;
+    }
+
+    bloom->shm->init = ngx_http_ericsten_bloom_init_zone;
+    bloom->shm->data = bloom;
+
+    return bloom;
+}
+
+//
+// In the master, once the zone is mapped.  A missing or unreadable key
+// file is not fatal: without a filter every key may be present.
+//
+
+static ngx_int_t
+ngx_http_ericsten_bloom_init_zone(ngx_http_ericsten_shm_t *shm, ngx_uint_t reused)
+{
+    ngx_http_ericsten_bloom_t  *bloom = shm->data;
+
+    bloom->zone = (ngx_http_ericsten_bloom_zone_t *) shm->addr;
+    bloom->blocks[0] = (uint64_t *) (bloom->zone + 1);
+    bloom->blocks[1] = bloom->blocks[0] + bloom->nblocks * NGX_HTTP_ERICSTEN_BLOOM_WORDS;
+
+    if (!reused)
+    {
+        bloom->zone->current = NGX_HTTP_ERICSTEN_BLOOM_NONE;
+    }
+
+    //
+    // A reused zone is rebuilt too if the key file changed with the
+    // configuration.
+    //
+
+    ngx_http_ericsten_bloom_update(bloom);
+
+    if (bloom->error)
+    {
+        ngx_log_error(NGX_LOG_ERR, bloom->log, bloom->err,
+            "ngx_http_ericsten: \"%V\": %s", &bloom->path, bloom->error);
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_bloom_start(ngx_http_ericsten_bloom_t *bloom, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    ngx_thread_task_t  *task;
+
+    //
+    // One rebuilder is enough for a shared filter.
+    //
+
+    if (ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    task = ngx_thread_task_alloc(cycle->pool, 0);
+    if (task == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    task->ctx = bloom;
+    task->handler = ngx_http_ericsten_bloom_task;
+    task->event.handler = ngx_http_ericsten_bloom_completion_handler;
+    task->event.data = bloom;
+
+    bloom->thread_pool = tp;
+    bloom->task = task;
+    bloom->log = cycle->log;
+
+    bloom->timer.handler = ngx_http_ericsten_bloom_timer_handler;
+    bloom->timer.data = bloom;
+    bloom->timer.log = cycle->log;
+    bloom->timer.cancelable = 1;
+
+    ngx_add_timer(&bloom->timer, bloom->interval);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_bloom_check(ngx_http_ericsten_bloom_t *bloom, u_char *key, size_t len)
+{
+    uint64_t                             h, *block;
+    ngx_uint_t                           s, seq, found;
+    ngx_http_ericsten_xxh64_t            xxh64;
+    ngx_http_ericsten_bloom_zone_t      *zone = bloom->zone;
+    ngx_http_ericsten_bloom_filter_t    *filter;
+    ngx_http_ericsten_bloom_counters_t  *counters;
+
+    counters = &zone->counters[ngx_worker];
+    (void) ngx_atomic_fetch_add(&counters->checks, 1);
+
+    s = __atomic_load_n(&zone->current, __ATOMIC_ACQUIRE);
+
+    if (s == NGX_HTTP_ERICSTEN_BLOOM_NONE)
+    {
+        return NGX_OK;
+    }
+
+    filter = &zone->filter[s];
+    seq = __atomic_load_n(&filter->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+    {
+        return NGX_OK;
+    }
+
+    ngx_http_ericsten_xxh64_init(&xxh64, 0);
+    ngx_http_ericsten_xxh64_update(&xxh64, key, len);
+    h = ngx_http_ericsten_xxh64_final(&xxh64);
+
+    block = bloom->blocks[s] + ((h >> 32) * bloom->nblocks >> 32) * NGX_HTTP_ERICSTEN_BLOOM_WORDS;
+
+    found = ngx_http_ericsten_bloom_probe(block, (uint32_t) h);
+
+    //
+    // If the filter was rebuilt under us, what we read means nothing.
+    //
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (found || __atomic_load_n(&filter->seq, __ATOMIC_RELAXED) != seq)
+    {
+        return NGX_OK;
+    }
+
+    (void) ngx_atomic_fetch_add(&counters->skips, 1);
+
+    return NGX_DECLINED;
+}
+
+void
+ngx_http_ericsten_bloom_stats(ngx_http_ericsten_bloom_t *bloom, ngx_http_ericsten_bloom_stats_t *stats)
+{
+    ngx_uint_t                       i, s;
+    ngx_http_ericsten_bloom_zone_t  *zone = bloom->zone;
+
+    ngx_memzero(stats, sizeof(ngx_http_ericsten_bloom_stats_t));
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++)
+    {
+        stats->checks += zone->counters[i].checks;
+        stats->skips += zone->counters[i].skips;
+    }
+
+    s = __atomic_load_n(&zone->current, __ATOMIC_ACQUIRE);
+
+    if (s != NGX_HTTP_ERICSTEN_BLOOM_NONE)
+    {
+        stats->keys = zone->filter[s].keys;
+        stats->fp_rate = zone->filter[s].fp_rate;
+    }
+}
+
+//
+// Rebuild the filter not in use from the key file if the file has changed,
+// and swap it in.  Blocking; in the master or on a pool thread.  Does
+// nothing if another process is already at it.
+//
+
+static void
+ngx_http_ericsten_bloom_update(ngx_http_ericsten_bloom_t *bloom)
+{
+    ngx_fd_t                         fd;
+    ngx_pid_t                        pid;
+    ngx_uint_t                       s;
+    ngx_file_info_t                  fi;
+    ngx_http_ericsten_bloom_zone_t  *zone = bloom->zone;
+
+    bloom->error = NULL;
+    bloom->err = 0;
+
+    //
+    // A process that died holding the lock leaves its pid behind.
+    //
+
+    pid = zone->lock;
+
+    if (pid != 0 && (kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH))
+    {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&zone->lock, pid, ngx_pid))
+    {
+        return;
+    }
+
+    fd = ngx_open_file(bloom->path.data, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        bloom->err = ngx_errno;
+        bloom->error = ngx_open_file_n " failed";
+        goto unlock;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    {
+        bloom->err = ngx_errno;
+        bloom->error = ngx_fd_info_n " failed";
+        goto done;
+    }
+
+    s = zone->current;
+
+    if (s != NGX_HTTP_ERICSTEN_BLOOM_NONE
+        && zone->mtime == ngx_file_mtime(&fi)
+        && zone->size == ngx_file_size(&fi)
+        && zone->uniq == ngx_file_uniq(&fi))
+    {
+        goto done;
+    }
+
+    s = (s == 0) ? 1 : 0;
+
+    if (ngx_http_ericsten_bloom_build(bloom, fd, (size_t) ngx_file_size(&fi), s) != NGX_OK)
+    {
+        goto done;
+    }
+
+    __atomic_store_n(&zone->current, s, __ATOMIC_RELEASE);
+
+    zone->mtime = ngx_file_mtime(&fi);
+    zone->size = ngx_file_size(&fi);
+    zone->uniq = ngx_file_uniq(&fi);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, bloom->log, 0,
+        "ngx_http_ericsten_bloom_update: \"%V\", %ui keys", &bloom->path, zone->filter[s].keys);
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, bloom->log, ngx_errno,
+            ngx_close_file_n " \"%V\" failed", &bloom->path);
+    }
+
+unlock:
+
+    __atomic_store_n(&zone->lock, 0, __ATOMIC_RELEASE);
+}
+
+//
+// Fill filter s with the keys of the file: the first word of each line, as
+// in an ericsten_snapshot file, so one file can serve both.
+//
+
+static ngx_int_t
+ngx_http_ericsten_bloom_build(ngx_http_ericsten_bloom_t *bloom, ngx_fd_t fd, size_t size, ngx_uint_t s)
+{
+    u_char                            *text, *p, *q, *last, *end;
+    double                             fp, bits;
+    uint64_t                           h, *blocks, *block;
+    ngx_uint_t                         i, j, seq, keys;
+    ngx_http_ericsten_xxh64_t          xxh64;
+    ngx_http_ericsten_bloom_filter_t  *filter;
+
+    text = NULL;
+
+    if (size)
+    {
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (text == MAP_FAILED)
+        {
+            bloom->err = ngx_errno;
+            bloom->error = "mmap() failed";
+            return NGX_ERROR;
+        }
+
+        (void) madvise(text, size, MADV_SEQUENTIAL);
+    }
+
+    filter = &bloom->zone->filter[s];
+    blocks = bloom->blocks[s];
+
+    //
+    // Readers that still look at this filter see an odd count until it is
+    // done, and an even one that differs from what they started with after.
+    //
+
+    seq = filter->seq;
+
+    __atomic_store_n(&filter->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ngx_memzero(blocks, bloom->nblocks * NGX_HTTP_ERICSTEN_BLOOM_BLOCK);
+
+    keys = 0;
+    end = text + size;
+
+    for (p = text; p < end; p = last + 1)
+    {
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL)
+        {
+            last = end;
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+
+        if (p == last || *p == '#' || *p == CR)
+        {
+            continue;
+        }
+
+        for (q = p; q < last && *q != ' ' && *q != '\t' && *q != CR; q++) { /* void */ }
+
+        ngx_http_ericsten_xxh64_init(&xxh64, 0);
+        ngx_http_ericsten_xxh64_update(&xxh64, p, q - p);
+        h = ngx_http_ericsten_xxh64_final(&xxh64);
+
+        block = blocks + ((h >> 32) * bloom->nblocks >> 32) * NGX_HTTP_ERICSTEN_BLOOM_WORDS;
+
+        ngx_http_ericsten_bloom_add(block, (uint32_t) h);
+        keys++;
+    }
+
+    //
+    // A key that is absent hits a random block, and is a false positive if
+    // all the bits it picks there are set: the product over the words of
+    // the fraction of their bits set.
+    //
+
+    fp = 0;
+
+    for (i = 0; i < bloom->nblocks; i++)
+    {
+        block = blocks + i * NGX_HTTP_ERICSTEN_BLOOM_WORDS;
+        bits = 1;
+
+        for (j = 0; j < NGX_HTTP_ERICSTEN_BLOOM_WORDS; j++)
+        {
+            bits *= __builtin_popcountll(block[j]) / 64.0;
+        }
+
+        fp += bits;
+    }
+
+    filter->keys = keys;
+    filter->fp_rate = fp / bloom->nblocks;
+
+    __atomic_store_n(&filter->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (text)
+    {
+        (void) munmap(text, size);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_bloom_add(uint64_t *block, uint32_t h)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_BLOOM_WORDS; i++)
+    {
+        block[i] |= (uint64_t) 1 << ((h * ngx_http_ericsten_bloom_salt[i]) >> 26);
+    }
+}
+
+static ngx_uint_t
+ngx_http_ericsten_bloom_probe_scalar(uint64_t *block, uint32_t h)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_BLOOM_WORDS; i++)
+    {
+        if (!(block[i] & ((uint64_t) 1 << ((h * ngx_http_ericsten_bloom_salt[i]) >> 26))))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+//
+// The eight bit numbers in one multiply, widened to two vectors of four
+// 64-bit masks, tested against the two halves of the block.
+//
+
+__attribute__((target("avx2")))
+static ngx_uint_t
+ngx_http_ericsten_bloom_probe_avx2(uint64_t *block, uint32_t h)
+{
+    __m256i  bits, one, lo, hi;
+
+    bits = _mm256_mullo_epi32(_mm256_set1_epi32((int) h),
+                              _mm256_load_si256((const __m256i *) ngx_http_ericsten_bloom_salt));
+    bits = _mm256_srli_epi32(bits, 26);
+
+    one = _mm256_set1_epi64x(1);
+    lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits)));
+    hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1)));
+
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *) block), lo)
+           & _mm256_testc_si256(_mm256_load_si256((const __m256i *) (block + 4)), hi);
+}
+
+#endif
+
+static void
+ngx_http_ericsten_bloom_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_bloom_t  *bloom = ev->data;
+
+    if (ngx_exiting)
+    {
+        return;
+    }
+
+    if (ngx_thread_task_post(bloom->thread_pool, bloom->task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "ngx_http_ericsten: failed to post bloom filter task for \"%V\"", &bloom->path);
+
+        ngx_add_timer(&bloom->timer, bloom->interval);
+    }
+}
+
+//
+// Thread Pool Task Function
+//
+
+static void
+ngx_http_ericsten_bloom_task(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_bloom_update(data);
+}
+
+static void
+ngx_http_ericsten_bloom_completion_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_bloom_t  *bloom = ev->data;
+
+    if (bloom->error)
+    {
+        ngx_log_error(NGX_LOG_ERR, bloom->log, bloom->err,
+            "ngx_http_ericsten: \"%V\": %s", &bloom->path, bloom->error);
+    }
+
+    if (!ngx_exiting)
+    {
+        ngx_add_timer(&bloom->timer, bloom->interval);
+    }
+}
@@ -0,0 +1,100 @@
+/*
+
+Module Description:
+    Bloom filter negative cache for ngx_http_ericsten_module.
+
+    Most keys sent to the offloaded lookup are not there.  A Bloom filter
+    of the keys that are lets the event loop turn those away without a
+    task: a key the filter does not have is certainly absent, while a key
+    it has is present or, rarely, a false positive, and goes on to the
+    lookup.
+
+    The filter lives in a shared zone, so all workers use one copy.  It is
+    a blocked filter: a key sets eight bits, one in each 64-bit word of a
+    single cache-line block, so a check costs one cache miss, and with
+    AVX2 all eight bits are tested at once.
+
+    The zone holds two filters.  The master builds the first one from the
+    key file when it maps the zone.  After that, worker 0 checks the file on
+    a timer and, when it has changed, rebuilds the filter not in use on the
+    thread pool and swaps it in.  Each filter has a sequence count, odd
+    while it is written, so that a check racing with a rebuild is noticed
+    and answers "maybe": the filter fails open, never turning away a key
+    that is present.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_BLOOM_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_BLOOM_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_shm.h"
+
+typedef struct ngx_http_ericsten_bloom_zone_s  ngx_http_ericsten_bloom_zone_t;
+
+typedef struct
+{
+    ngx_atomic_uint_t               checks;
+    ngx_atomic_uint_t               skips;      // Checks that found the key absent.
+    ngx_uint_t                      keys;       // In the current filter.
+    double                          fp_rate;    // Estimated false positive rate of the current filter.
+} ngx_http_ericsten_bloom_stats_t;
+
+typedef struct
+{
+    ngx_str_t                       path;
+    ngx_msec_t                      interval;
+    ngx_http_ericsten_shm_t        *shm;
+
+    //
+    // Set when the zone is mapped.
+    //
+
+    ngx_http_ericsten_bloom_zone_t *zone;
+    uint64_t                       *blocks[2];
+    ngx_uint_t                      nblocks;
+    ngx_log_t                      *log;
+
+    //
+    // Worker 0 state.
+    //
+
+    ngx_event_t                     timer;
+    ngx_thread_pool_t              *thread_pool;
+    ngx_thread_task_t              *task;
+    const char                     *error;      // Written by the task.
+    ngx_err_t                       err;
+} ngx_http_ericsten_bloom_t;
+
+//
+// At configuration time: declare the zone, with filters of size bytes.
+//
+ngx_http_ericsten_bloom_t *ngx_http_ericsten_bloom_create(ngx_conf_t *cf, ngx_array_t *zones, ngx_str_t *path,
+    size_t size, ngx_msec_t interval);
+
+//
+// From the module's init_process handler: start rebuilding in worker 0.
+//
+ngx_int_t ngx_http_ericsten_bloom_start(ngx_http_ericsten_bloom_t *bloom, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+//
+// On the event loop.  Returns NGX_DECLINED if key is certainly absent,
+// NGX_OK if it may be present.
+//
+ngx_int_t ngx_http_ericsten_bloom_check(ngx_http_ericsten_bloom_t *bloom, u_char *key, size_t len);
+
+//
+// Counters summed over the workers.
+//
+void ngx_http_ericsten_bloom_stats(ngx_http_ericsten_bloom_t *bloom, ngx_http_ericsten_bloom_stats_t *stats);
+
+//
+// Select the probe for the CPU, once at configuration time.
+//
+void ngx_http_ericsten_bloom_init_kernels(ngx_log_t *log);
+
+#endif /* _NGX_HTTP_ERICSTEN_BLOOM_H_INCLUDED_ */
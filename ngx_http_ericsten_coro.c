@@ -0,0 +1,419 @@
+/*
+
+Module Description:
+    Coroutines on the thread pool for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_coro.h.
+
+    A coroutine is switched to with swapcontext() by the thread task that
+    runs it, and switches back to that thread when it awaits or returns, so
+    the task ends and its completion event goes to the event loop like any
+    other.  That completion handler starts what the coroutine awaits, or
+    reports that it returned.  The coroutine is thus only ever touched by
+    one thread at a time, and the thread pool's queue orders the handoffs.
+
+    glibc's swapcontext() also saves and restores the signal mask, a system
+    call per switch; at two switches per await, that is small next to the
+    thread pool's own handoff.  A body must not keep the address of a
+    thread-local variable across an await, since it may resume on another
+    thread.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include <ucontext.h>
+
+#include "ngx_http_ericsten_coro.h"
+
+#define NGX_HTTP_ERICSTEN_CORO_RETRY    10      // ms before a coroutine the pool refused is posted again.
+
+#ifndef MAP_STACK
+#define MAP_STACK  0
+#endif
+
+struct ngx_http_ericsten_coro_s
+{
+    ngx_http_ericsten_coro_pool_t      *pool;
+    ngx_http_ericsten_coro_t           *next;       // In the pool's free list.
+    u_char                             *stack;      // The mapping, guard page first.
+    size_t                              size;
+
+    ucontext_t                          context;    // The coroutine's, while it is parked.
+    ucontext_t                          caller;     // The thread's, while it runs the coroutine.
+    ngx_thread_task_t                   task;
+    ngx_event_t                         retry;
+
+    ngx_http_ericsten_coro_body_pt      body;
+    ngx_http_ericsten_coro_done_pt      done;
+    void                               *data;
+
+    ngx_http_ericsten_await_t          *awaits;     // What it waits for, while parked.
+    ngx_uint_t                          nawaits;
+    ngx_uint_t                          pending;    // Awaits not completed yet.
+    unsigned                            finished:1;
+};
+
+static ngx_http_ericsten_coro_t *ngx_http_ericsten_coro_get(ngx_http_ericsten_coro_pool_t *pool);
+static void ngx_http_ericsten_coro_put(ngx_http_ericsten_coro_t *co);
+static void ngx_http_ericsten_coro_main(unsigned int hi, unsigned int lo);
+static void ngx_http_ericsten_coro_run(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_coro_event_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_coro_resume(ngx_http_ericsten_coro_t *co);
+static void ngx_http_ericsten_coro_retry_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_ericsten_coro_sleep_start(ngx_http_ericsten_await_t *aw);
+static void ngx_http_ericsten_coro_sleep_handler(ngx_event_t *ev);
+
+ngx_http_ericsten_coro_pool_t *
+ngx_http_ericsten_coro_pool_create(ngx_conf_t *cf, size_t stack_size, ngx_uint_t stacks)
+{
+    ngx_http_ericsten_coro_pool_t  *pool;
+
+    pool = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_coro_pool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->stack_size = stack_size;
+    pool->stacks = stacks;
+
+    return pool;
+}
+
+ngx_int_t
+ngx_http_ericsten_coro_pool_start(ngx_http_ericsten_coro_pool_t *pool, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    pool->tp = tp;
+    pool->log = cycle->log;
+    pool->page_size = ngx_pagesize;
+    pool->stack_size = ngx_align(pool->stack_size, pool->page_size);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_coro_spawn(ngx_http_ericsten_coro_pool_t *pool, ngx_http_ericsten_coro_body_pt body,
+    ngx_http_ericsten_coro_done_pt done, void *data)
+{
+    uint64_t                   p;
+    ngx_http_ericsten_coro_t  *co;
+
+    co = ngx_http_ericsten_coro_get(pool);
+    if (co == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    co->body = body;
+    co->done = done;
+    co->data = data;
+    co->awaits = NULL;
+    co->nawaits = 0;
+    co->finished = 0;
+
+    if (getcontext(&co->context) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+            "ericsten coroutine: getcontext() failed");
+        ngx_http_ericsten_coro_put(co);
+        return NGX_ERROR;
+    }
+
+    //
+    // getcontext() ran on the event loop and saved its signal mask, which
+    // blocks nothing; the first switch would install it on a pool thread.
+    // Block everything as ngx_thread_pool_cycle() does, but for the
+    // signals that a fault raises.
+    //
+
+    (void) sigfillset(&co->context.uc_sigmask);
+
+    (void) sigdelset(&co->context.uc_sigmask, SIGILL);
+    (void) sigdelset(&co->context.uc_sigmask, SIGFPE);
+    (void) sigdelset(&co->context.uc_sigmask, SIGSEGV);
+    (void) sigdelset(&co->context.uc_sigmask, SIGBUS);
+
+    co->context.uc_stack.ss_sp = co->stack + pool->page_size;
+    co->context.uc_stack.ss_size = co->size - pool->page_size;
+    co->context.uc_link = NULL;
+
+    //
+    // makecontext() passes ints.
+    //
+
+    p = (uint64_t) (uintptr_t) co;
+
+    makecontext(&co->context, (void (*)(void)) ngx_http_ericsten_coro_main, 2,
+                (unsigned int) (p >> 32), (unsigned int) p);
+
+    if (ngx_thread_task_post(pool->tp, &co->task) != NGX_OK)
+    {
+        ngx_http_ericsten_coro_put(co);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_coro_await(ngx_http_ericsten_coro_t *co, ngx_http_ericsten_await_t *aw, ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    if (n == 0)
+    {
+        return NGX_OK;
+    }
+
+    co->awaits = aw;
+    co->nawaits = n;
+
+    //
+    // Park: back to the thread task, which returns.
+    //
+
+    if (swapcontext(&co->context, &co->caller) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, co->pool->log, ngx_errno,
+            "ericsten coroutine: swapcontext() failed");
+        return NGX_ERROR;
+    }
+
+    co->awaits = NULL;
+    co->nawaits = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (aw[i].rc != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+void
+ngx_http_ericsten_coro_wake(ngx_http_ericsten_await_t *aw, ngx_int_t rc)
+{
+    ngx_http_ericsten_coro_t  *co = aw->co;
+
+    aw->rc = rc;
+
+    if (--co->pending == 0)
+    {
+        ngx_http_ericsten_coro_resume(co);
+    }
+}
+
+ngx_int_t
+ngx_http_ericsten_coro_sleep(ngx_http_ericsten_coro_t *co, ngx_msec_t msec)
+{
+    ngx_http_ericsten_await_t  aw;
+
+    ngx_memzero(&aw, sizeof(ngx_http_ericsten_await_t));
+
+    aw.start = ngx_http_ericsten_coro_sleep_start;
+    aw.msec = msec;
+
+    return ngx_http_ericsten_coro_await(co, &aw, 1);
+}
+
+static ngx_http_ericsten_coro_t *
+ngx_http_ericsten_coro_get(ngx_http_ericsten_coro_pool_t *pool)
+{
+    u_char                    *stack;
+    size_t                     size;
+    ngx_http_ericsten_coro_t  *co;
+
+    if (pool->free)
+    {
+        co = pool->free;
+        pool->free = co->next;
+        pool->nfree--;
+
+        return co;
+    }
+
+    size = pool->page_size + pool->stack_size;
+
+    stack = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+
+    if (stack == MAP_FAILED)
+    {
+        ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+            "ericsten coroutine: mmap(%uz) failed", size);
+        return NULL;
+    }
+
+    if (mprotect(stack, pool->page_size, PROT_NONE) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+            "ericsten coroutine: mprotect() failed");
+        (void) munmap(stack, size);
+        return NULL;
+    }
+
+    co = ngx_calloc(sizeof(ngx_http_ericsten_coro_t), pool->log);
+    if (co == NULL)
+    {
+        (void) munmap(stack, size);
+        return NULL;
+    }
+
+    co->pool = pool;
+    co->stack = stack;
+    co->size = size;
+
+    co->task.ctx = co;
+    co->task.handler = ngx_http_ericsten_coro_run;
+    co->task.event.handler = ngx_http_ericsten_coro_event_handler;
+    co->task.event.data = co;
+
+    co->retry.handler = ngx_http_ericsten_coro_retry_handler;
+    co->retry.data = co;
+    co->retry.log = pool->log;
+
+    return co;
+}
+
+static void
+ngx_http_ericsten_coro_put(ngx_http_ericsten_coro_t *co)
+{
+    ngx_http_ericsten_coro_pool_t  *pool = co->pool;
+
+    if (pool->nfree < pool->stacks)
+    {
+        co->next = pool->free;
+        pool->free = co;
+        pool->nfree++;
+
+        return;
+    }
+
+    if (munmap(co->stack, co->size) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+            "ericsten coroutine: munmap() failed");
+    }
+
+    ngx_free(co);
+}
+
+//
+// In a pool thread: the bottom of the coroutine's stack.
+//
+
+static void
+ngx_http_ericsten_coro_main(unsigned int hi, unsigned int lo)
+{
+    ngx_http_ericsten_coro_t  *co;
+
+    co = (ngx_http_ericsten_coro_t *) (uintptr_t) ((uint64_t) hi << 32 | lo);
+
+    co->body(co, co->data);
+
+    co->finished = 1;
+
+    (void) setcontext(&co->caller);
+}
+
+//
+// Thread Pool Task Function: run the coroutine until it awaits or returns.
+//
+
+static void
+ngx_http_ericsten_coro_run(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_coro_t  *co = data;
+
+    if (swapcontext(&co->caller, &co->context) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            "ericsten coroutine: swapcontext() failed");
+    }
+}
+
+//
+// On the event loop: the coroutine returned, or is parked on its awaits.
+// pending counts one more than the awaits not completed, so that those that
+// complete while others are being started do not resume it early.
+//
+
+static void
+ngx_http_ericsten_coro_event_handler(ngx_event_t *ev)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  i;
+    ngx_http_ericsten_coro_t   *co = ev->data;
+    ngx_http_ericsten_await_t  *aw;
+
+    if (co->finished)
+    {
+        co->done(co->data);
+        ngx_http_ericsten_coro_put(co);
+        return;
+    }
+
+    co->pending = co->nawaits + 1;
+
+    for (i = 0; i < co->nawaits; i++)
+    {
+        aw = &co->awaits[i];
+
+        aw->co = co;
+        aw->rc = NGX_AGAIN;
+
+        rc = aw->start(aw);
+
+        if (rc != NGX_OK)
+        {
+            ngx_http_ericsten_coro_wake(aw, rc);
+        }
+    }
+
+    if (--co->pending == 0)
+    {
+        ngx_http_ericsten_coro_resume(co);
+    }
+}
+
+//
+// A coroutine cannot be failed once it has started, so one the pool
+// refuses, because its queue is full, is posted again a little later.
+//
+
+static void
+ngx_http_ericsten_coro_resume(ngx_http_ericsten_coro_t *co)
+{
+    if (ngx_thread_task_post(co->pool->tp, &co->task) != NGX_OK)
+    {
+        ngx_add_timer(&co->retry, NGX_HTTP_ERICSTEN_CORO_RETRY);
+    }
+}
+
+static void
+ngx_http_ericsten_coro_retry_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_coro_resume(ev->data);
+}
+
+static ngx_int_t
+ngx_http_ericsten_coro_sleep_start(ngx_http_ericsten_await_t *aw)
+{
+    aw->event.handler = ngx_http_ericsten_coro_sleep_handler;
+    aw->event.data = aw;
+    aw->event.log = aw->co->pool->log;
+
+    ngx_add_timer(&aw->event, aw->msec);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_coro_sleep_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_coro_wake(ev->data, NGX_OK);
+}
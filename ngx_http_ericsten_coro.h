@@ -0,0 +1,119 @@
+/*
+
+Module Description:
+    Coroutines on the thread pool for ngx_http_ericsten_module.
+
+    A task that waits on several operations in a row is otherwise written
+    as a state machine: one thread task per step, and a completion handler
+    that looks at the request's state to decide what comes next.  A
+    coroutine is written as straight-line code instead.  Its body runs on a
+    pool thread, on a stack of its own, and awaits operations: the
+    coroutine parks, the thread goes back to the pool, and the event loop
+    starts the operations.  Once they have all completed, the coroutine is
+    posted to the pool again and resumes on whichever thread takes it.  A
+    thread is thus busy only while a body computes or blocks, not while it
+    waits, and a pool of a few threads can have many coroutines waiting.
+
+    An operation is anything the event loop can start and be told about
+    the end of: a timer, a sidecar call, a helper job.  Operations are
+    started on the event loop, never on the pool thread, so that they may
+    use nginx's event and connection APIs.
+
+    Stacks come from a per-worker pool, and are kept for reuse up to a
+    limit.  Each has a guard page below it, so that a body that overflows
+    its stack crashes instead of corrupting memory.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_CORO_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_CORO_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+typedef struct ngx_http_ericsten_coro_s   ngx_http_ericsten_coro_t;
+typedef struct ngx_http_ericsten_await_s  ngx_http_ericsten_await_t;
+
+//
+// In a pool thread: the body of a coroutine.  It may block, and may await.
+//
+typedef void (*ngx_http_ericsten_coro_body_pt)(ngx_http_ericsten_coro_t *co, void *data);
+
+//
+// On the event loop: the body has returned.
+//
+typedef void (*ngx_http_ericsten_coro_done_pt)(void *data);
+
+//
+// On the event loop: start the operation of aw.  Returns NGX_OK, and calls
+// ngx_http_ericsten_coro_wake() once the operation completes, which may be
+// before returning; or returns the operation's result, such as NGX_ERROR,
+// if it completes without starting.
+//
+typedef ngx_int_t (*ngx_http_ericsten_await_start_pt)(ngx_http_ericsten_await_t *aw);
+
+struct ngx_http_ericsten_await_s
+{
+    ngx_http_ericsten_await_start_pt    start;
+    void                               *arg;        // For start.
+    ngx_msec_t                          msec;       // For ngx_http_ericsten_coro_sleep().
+    ngx_int_t                           rc;         // The result, once awaited.
+
+    ngx_http_ericsten_coro_t           *co;
+    ngx_event_t                         event;      // For start's use.
+};
+
+typedef struct
+{
+    size_t                              stack_size;
+    ngx_uint_t                          stacks;     // Idle stacks kept per worker.
+
+    //
+    // Worker state.
+    //
+
+    ngx_thread_pool_t                  *tp;
+    ngx_log_t                          *log;
+    ngx_http_ericsten_coro_t           *free;       // Idle coroutines, with their stacks.
+    ngx_uint_t                          nfree;
+    ngx_uint_t                          page_size;
+} ngx_http_ericsten_coro_pool_t;
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_coro_pool_t *ngx_http_ericsten_coro_pool_create(ngx_conf_t *cf, size_t stack_size,
+    ngx_uint_t stacks);
+
+//
+// From the module's init_process handler.
+//
+ngx_int_t ngx_http_ericsten_coro_pool_start(ngx_http_ericsten_coro_pool_t *pool, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+//
+// On the event loop: run body(co, data) as a coroutine on the pool, and
+// done(data) on the event loop once it returns.
+//
+ngx_int_t ngx_http_ericsten_coro_spawn(ngx_http_ericsten_coro_pool_t *pool, ngx_http_ericsten_coro_body_pt body,
+    ngx_http_ericsten_coro_done_pt done, void *data);
+
+//
+// In the body: start the n operations of aw together, and return once all
+// have completed, with NGX_OK if all their results are NGX_OK.  aw may be
+// on the coroutine's stack, and must be zeroed but for start and arg.
+//
+ngx_int_t ngx_http_ericsten_coro_await(ngx_http_ericsten_coro_t *co, ngx_http_ericsten_await_t *aw, ngx_uint_t n);
+
+//
+// On the event loop: the operation of aw completed with rc.
+//
+void ngx_http_ericsten_coro_wake(ngx_http_ericsten_await_t *aw, ngx_int_t rc);
+
+//
+// In the body: sleep for msec without holding the thread.
+//
+ngx_int_t ngx_http_ericsten_coro_sleep(ngx_http_ericsten_coro_t *co, ngx_msec_t msec);
+
+#endif /* _NGX_HTTP_ERICSTEN_CORO_H_INCLUDED_ */
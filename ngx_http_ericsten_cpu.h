@@ -0,0 +1,75 @@
+/*
+
+Module Description:
+    CPU helpers shared by the ngx_http_ericsten_module sources: cache line
+    alignment of data shared between threads or processes, and detection of
+    the instruction set extensions the kernels are selected by.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_CPU_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_CPU_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NGX_HTTP_ERICSTEN_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+//
+// Data written by one side is kept on cache lines the other side does not
+// write.
+//
+
+#define NGX_HTTP_ERICSTEN_CACHE_ALIGNED  __attribute__((aligned(NGX_CPU_CACHE_LINE)))
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+//
+// SSE2 is part of x86-64; 32-bit CPUs are asked.
+//
+
+static ngx_inline ngx_uint_t
+ngx_http_ericsten_cpu_sse2(void)
+{
+#if defined(__x86_64__)
+    return 1;
+#else
+    unsigned  eax, ebx, ecx, edx;
+
+    return (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) ? 1 : 0;
+#endif
+}
+
+//
+// Whether AVX2 can be used: the CPU has it, and the OS saves the YMM
+// registers (OSXSAVE + XCR0).
+//
+
+static ngx_inline ngx_uint_t
+ngx_http_ericsten_cpu_avx2(void)
+{
+    unsigned  eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+        || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+    {
+        return 0;
+    }
+
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+
+    if ((eax & 6) != 6 || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        return 0;
+    }
+
+    return (ebx & bit_AVX2) ? 1 : 0;
+}
+
+#endif
+
+#endif /* _NGX_HTTP_ERICSTEN_CPU_H_INCLUDED_ */
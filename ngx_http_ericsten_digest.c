@@ -0,0 +1,619 @@
+/*
+
+Module Description:
+    Checksum and digest kernels for ngx_http_ericsten_module.
+
+    CRC32C: slice-by-8 tables, or the SSE4.2 crc32 instruction.
+    xxHash64: scalar; it is bound by the multiply latency of its four lanes,
+        which a SIMD version does not improve on.
+    SHA-256: FIPS 180-4 reference rounds, or the SHA-NI instructions.
+
+    The kernels are chosen once by ngx_http_ericsten_digest_init(); after
+    that everything here is read-only and safe to use from any thread.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_digest.h"
+
+typedef void (*ngx_http_ericsten_crc32c_pt)(uint32_t *crc, u_char *p, size_t len);
+typedef void (*ngx_http_ericsten_sha256_pt)(uint32_t *state, u_char *p, size_t blocks);
+
+static void ngx_http_ericsten_crc32c_scalar(uint32_t *crc, u_char *p, size_t len);
+static void ngx_http_ericsten_sha256_scalar(uint32_t *state, u_char *p, size_t blocks);
+
+#if (NGX_HTTP_ERICSTEN_X86)
+static void ngx_http_ericsten_crc32c_sse42(uint32_t *crc, u_char *p, size_t len);
+static void ngx_http_ericsten_sha256_shani(uint32_t *state, u_char *p, size_t blocks);
+#endif
+
+static ngx_http_ericsten_crc32c_pt  ngx_http_ericsten_crc32c_kernel = ngx_http_ericsten_crc32c_scalar;
+static ngx_http_ericsten_sha256_pt  ngx_http_ericsten_sha256_kernel = ngx_http_ericsten_sha256_scalar;
+
+static uint32_t  ngx_http_ericsten_crc32c_table[8][256];
+
+static const uint32_t  ngx_http_ericsten_sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define XXH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3  0x165667B19E3779F9ULL
+#define XXH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5  0x27D4EB2F165667C5ULL
+
+#define ngx_http_ericsten_rotl64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+#define ngx_http_ericsten_rotr32(x, r)  (((x) >> (r)) | ((x) << (32 - (r))))
+
+//
+// Unaligned little-endian and big-endian loads, independent of the host.
+//
+
+static ngx_inline uint64_t
+ngx_http_ericsten_le64(u_char *p)
+{
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16)
+           | ((uint64_t) p[3] << 24) | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+           | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static ngx_inline uint32_t
+ngx_http_ericsten_le32(u_char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+           | ((uint32_t) p[3] << 24);
+}
+
+static ngx_inline uint32_t
+ngx_http_ericsten_be32(u_char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8)
+           | (uint32_t) p[3];
+}
+
+void
+ngx_http_ericsten_digest_init(ngx_log_t *log)
+{
+    uint32_t    c, n, k;
+#if (NGX_HTTP_ERICSTEN_X86)
+    unsigned    eax, ebx, ecx, edx;
+    ngx_uint_t  sse42, shani;
+#endif
+
+    //
+    // CRC32C (Castagnoli, reflected polynomial 0x82f63b78) slice-by-8 tables.
+    //
+
+    for (n = 0; n < 256; n++)
+    {
+        c = n;
+
+        for (k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+        }
+
+        ngx_http_ericsten_crc32c_table[0][n] = c;
+    }
+
+    for (n = 0; n < 256; n++)
+    {
+        c = ngx_http_ericsten_crc32c_table[0][n];
+
+        for (k = 1; k < 8; k++)
+        {
+            c = ngx_http_ericsten_crc32c_table[0][c & 0xff] ^ (c >> 8);
+            ngx_http_ericsten_crc32c_table[k][n] = c;
+        }
+    }
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+    sse42 = 0;
+    shani = 0;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        sse42 = (ecx & bit_SSE4_2) ? 1 : 0;
+
+        //
+        // SHA-NI needs SSSE3 and SSE4.1 for the shuffles and blends
+        // around it.
+        //
+
+        if ((ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+            && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        {
+            shani = (ebx & (1 << 29)) ? 1 : 0;
+        }
+    }
+
+    if (sse42)
+    {
+        ngx_http_ericsten_crc32c_kernel = ngx_http_ericsten_crc32c_sse42;
+    }
+
+    if (shani)
+    {
+        ngx_http_ericsten_sha256_kernel = ngx_http_ericsten_sha256_shani;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+        "ngx_http_ericsten_digest_init: sse4.2:%ui sha-ni:%ui", sse42, shani);
+
+#endif
+}
+
+//
+// CRC32C
+//
+
+void
+ngx_http_ericsten_crc32c_init(uint32_t *crc)
+{
+    *crc = 0xffffffff;
+}
+
+void
+ngx_http_ericsten_crc32c_update(uint32_t *crc, u_char *p, size_t len)
+{
+    ngx_http_ericsten_crc32c_kernel(crc, p, len);
+}
+
+void
+ngx_http_ericsten_crc32c_final(uint32_t *crc)
+{
+    *crc ^= 0xffffffff;
+}
+
+static void
+ngx_http_ericsten_crc32c_scalar(uint32_t *crc, u_char *p, size_t len)
+{
+    uint32_t   c, lo, hi;
+    uint32_t (*t)[256] = ngx_http_ericsten_crc32c_table;
+
+    c = *crc;
+
+    while (len >= 8)
+    {
+        lo = c ^ ngx_http_ericsten_le32(p);
+        hi = ngx_http_ericsten_le32(p + 4);
+
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+    {
+        c = t[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+
+    *crc = c;
+}
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+__attribute__((target("sse4.2")))
+static void
+ngx_http_ericsten_crc32c_sse42(uint32_t *crc, u_char *p, size_t len)
+{
+    uint32_t  c;
+#if defined(__x86_64__)
+    uint64_t  c64, v;
+#endif
+
+    c = *crc;
+
+#if defined(__x86_64__)
+
+    while (len && ((uintptr_t) p & 7))
+    {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+
+    c64 = c;
+
+    while (len >= 8)
+    {
+        ngx_memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8;
+        len -= 8;
+    }
+
+    c = (uint32_t) c64;
+
+#endif
+
+    while (len--)
+    {
+        c = _mm_crc32_u8(c, *p++);
+    }
+
+    *crc = c;
+}
+
+#endif
+
+//
+// xxHash64
+//
+
+static ngx_inline uint64_t
+ngx_http_ericsten_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = ngx_http_ericsten_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static ngx_inline uint64_t
+ngx_http_ericsten_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= ngx_http_ericsten_xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void
+ngx_http_ericsten_xxh64_init(ngx_http_ericsten_xxh64_t *s, uint64_t seed)
+{
+    ngx_memzero(s, sizeof(ngx_http_ericsten_xxh64_t));
+
+    s->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    s->v[1] = seed + XXH_PRIME64_2;
+    s->v[2] = seed;
+    s->v[3] = seed - XXH_PRIME64_1;
+}
+
+void
+ngx_http_ericsten_xxh64_update(ngx_http_ericsten_xxh64_t *s, u_char *p, size_t len)
+{
+    size_t    n;
+    uint64_t  v0, v1, v2, v3;
+
+    s->total += len;
+
+    if (s->buf_len)
+    {
+        n = ngx_min(len, 32 - s->buf_len);
+        ngx_memcpy(s->buf + s->buf_len, p, n);
+        s->buf_len += n;
+        p += n;
+        len -= n;
+
+        if (s->buf_len < 32)
+        {
+            return;
+        }
+
+        s->v[0] = ngx_http_ericsten_xxh64_round(s->v[0], ngx_http_ericsten_le64(s->buf));
+        s->v[1] = ngx_http_ericsten_xxh64_round(s->v[1], ngx_http_ericsten_le64(s->buf + 8));
+        s->v[2] = ngx_http_ericsten_xxh64_round(s->v[2], ngx_http_ericsten_le64(s->buf + 16));
+        s->v[3] = ngx_http_ericsten_xxh64_round(s->v[3], ngx_http_ericsten_le64(s->buf + 24));
+        s->buf_len = 0;
+    }
+
+    v0 = s->v[0];
+    v1 = s->v[1];
+    v2 = s->v[2];
+    v3 = s->v[3];
+
+    while (len >= 32)
+    {
+        v0 = ngx_http_ericsten_xxh64_round(v0, ngx_http_ericsten_le64(p));
+        v1 = ngx_http_ericsten_xxh64_round(v1, ngx_http_ericsten_le64(p + 8));
+        v2 = ngx_http_ericsten_xxh64_round(v2, ngx_http_ericsten_le64(p + 16));
+        v3 = ngx_http_ericsten_xxh64_round(v3, ngx_http_ericsten_le64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+
+    s->v[0] = v0;
+    s->v[1] = v1;
+    s->v[2] = v2;
+    s->v[3] = v3;
+
+    if (len)
+    {
+        ngx_memcpy(s->buf, p, len);
+        s->buf_len = len;
+    }
+}
+
+uint64_t
+ngx_http_ericsten_xxh64_final(ngx_http_ericsten_xxh64_t *s)
+{
+    u_char    *p, *last;
+    uint64_t   h;
+
+    if (s->total >= 32)
+    {
+        h = ngx_http_ericsten_rotl64(s->v[0], 1) + ngx_http_ericsten_rotl64(s->v[1], 7)
+            + ngx_http_ericsten_rotl64(s->v[2], 12) + ngx_http_ericsten_rotl64(s->v[3], 18);
+
+        h = ngx_http_ericsten_xxh64_merge(h, s->v[0]);
+        h = ngx_http_ericsten_xxh64_merge(h, s->v[1]);
+        h = ngx_http_ericsten_xxh64_merge(h, s->v[2]);
+        h = ngx_http_ericsten_xxh64_merge(h, s->v[3]);
+    }
+    else
+    {
+        //
+        // v[2] still holds the seed.
+        //
+
+        h = s->v[2] + XXH_PRIME64_5;
+    }
+
+    h += s->total;
+
+    p = s->buf;
+    last = s->buf + s->buf_len;
+
+    while (p + 8 <= last)
+    {
+        h ^= ngx_http_ericsten_xxh64_round(0, ngx_http_ericsten_le64(p));
+        h = ngx_http_ericsten_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= last)
+    {
+        h ^= (uint64_t) ngx_http_ericsten_le32(p) * XXH_PRIME64_1;
+        h = ngx_http_ericsten_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < last)
+    {
+        h ^= (uint64_t) *p * XXH_PRIME64_5;
+        h = ngx_http_ericsten_rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+//
+// SHA-256
+//
+
+void
+ngx_http_ericsten_sha256_init(ngx_http_ericsten_sha256_t *s)
+{
+    s->state[0] = 0x6a09e667;
+    s->state[1] = 0xbb67ae85;
+    s->state[2] = 0x3c6ef372;
+    s->state[3] = 0xa54ff53a;
+    s->state[4] = 0x510e527f;
+    s->state[5] = 0x9b05688c;
+    s->state[6] = 0x1f83d9ab;
+    s->state[7] = 0x5be0cd19;
+
+    s->total = 0;
+    s->buf_len = 0;
+}
+
+void
+ngx_http_ericsten_sha256_update(ngx_http_ericsten_sha256_t *s, u_char *p, size_t len)
+{
+    size_t  n;
+
+    s->total += len;
+
+    if (s->buf_len)
+    {
+        n = ngx_min(len, 64 - s->buf_len);
+        ngx_memcpy(s->buf + s->buf_len, p, n);
+        s->buf_len += n;
+        p += n;
+        len -= n;
+
+        if (s->buf_len < 64)
+        {
+            return;
+        }
+
+        ngx_http_ericsten_sha256_kernel(s->state, s->buf, 1);
+        s->buf_len = 0;
+    }
+
+    if (len >= 64)
+    {
+        n = len / 64;
+        ngx_http_ericsten_sha256_kernel(s->state, p, n);
+        p += n * 64;
+        len -= n * 64;
+    }
+
+    if (len)
+    {
+        ngx_memcpy(s->buf, p, len);
+        s->buf_len = len;
+    }
+}
+
+void
+ngx_http_ericsten_sha256_final(ngx_http_ericsten_sha256_t *s, u_char *digest)
+{
+    uint64_t    bits;
+    ngx_uint_t  i;
+
+    bits = s->total * 8;
+
+    s->buf[s->buf_len++] = 0x80;
+
+    if (s->buf_len > 56)
+    {
+        ngx_memzero(s->buf + s->buf_len, 64 - s->buf_len);
+        ngx_http_ericsten_sha256_kernel(s->state, s->buf, 1);
+        s->buf_len = 0;
+    }
+
+    ngx_memzero(s->buf + s->buf_len, 56 - s->buf_len);
+
+    for (i = 0; i < 8; i++)
+    {
+        s->buf[63 - i] = (u_char) (bits >> (i * 8));
+    }
+
+    ngx_http_ericsten_sha256_kernel(s->state, s->buf, 1);
+
+    for (i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (u_char) (s->state[i] >> 24);
+        digest[i * 4 + 1] = (u_char) (s->state[i] >> 16);
+        digest[i * 4 + 2] = (u_char) (s->state[i] >> 8);
+        digest[i * 4 + 3] = (u_char) s->state[i];
+    }
+}
+
+static void
+ngx_http_ericsten_sha256_scalar(uint32_t *state, u_char *p, size_t blocks)
+{
+    uint32_t    a, b, c, d, e, f, g, h, t1, t2, s0, s1, w[64];
+    ngx_uint_t  i;
+
+    while (blocks--)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            w[i] = ngx_http_ericsten_be32(p + i * 4);
+        }
+
+        for (i = 16; i < 64; i++)
+        {
+            s0 = ngx_http_ericsten_rotr32(w[i - 15], 7) ^ ngx_http_ericsten_rotr32(w[i - 15], 18)
+                 ^ (w[i - 15] >> 3);
+            s1 = ngx_http_ericsten_rotr32(w[i - 2], 17) ^ ngx_http_ericsten_rotr32(w[i - 2], 19)
+                 ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; i++)
+        {
+            s1 = ngx_http_ericsten_rotr32(e, 6) ^ ngx_http_ericsten_rotr32(e, 11)
+                 ^ ngx_http_ericsten_rotr32(e, 25);
+            t1 = h + s1 + ((e & f) ^ (~e & g)) + ngx_http_ericsten_sha256_k[i] + w[i];
+            s0 = ngx_http_ericsten_rotr32(a, 2) ^ ngx_http_ericsten_rotr32(a, 13)
+                 ^ ngx_http_ericsten_rotr32(a, 22);
+            t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        p += 64;
+    }
+}
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+//
+// SHA-NI keeps the state as two vectors, ABEF and CDGH.  Each group of four
+// rounds takes one vector of four message words; words 16..63 are expanded
+// with sha256msg1/sha256msg2 from the previous four vectors.
+//
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+ngx_http_ericsten_sha256_shani(uint32_t *state, u_char *p, size_t blocks)
+{
+    __m128i     state0, state1, abef, cdgh, msg, tmp, w[4];
+    ngx_uint_t  i;
+    const __m128i  mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+    state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--)
+    {
+        abef = state0;
+        cdgh = state1;
+
+        for (i = 0; i < 16; i++)
+        {
+            if (i < 4)
+            {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + i * 16)), mask);
+            }
+            else
+            {
+                tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(w[i & 3],
+                                _mm_loadu_si128((const __m128i *) &ngx_http_ericsten_sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+
+        p += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#endif
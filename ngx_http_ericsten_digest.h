@@ -0,0 +1,55 @@
+/*
+
+Module Description:
+    Checksum and digest kernels used by ngx_http_ericsten_module tasks:
+    CRC32C, xxHash64 and SHA-256.
+
+    All functions are plain computations with no nginx state, so they are
+    safe to call from thread pool tasks.  Hardware kernels (SSE4.2 CRC32C,
+    SHA-NI SHA-256) are selected at runtime by
+    ngx_http_ericsten_digest_init(), with scalar fallbacks.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_DIGEST_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_DIGEST_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#define NGX_HTTP_ERICSTEN_SHA256_LEN  32
+
+typedef struct
+{
+    uint64_t  v[4];
+    uint64_t  total;
+    u_char    buf[32];
+    size_t    buf_len;
+} ngx_http_ericsten_xxh64_t;
+
+typedef struct
+{
+    uint32_t  state[8];
+    uint64_t  total;
+    u_char    buf[64];
+    size_t    buf_len;
+} ngx_http_ericsten_sha256_t;
+
+//
+// Detect CPU features and pick kernels.  Call once, before any task runs.
+//
+void ngx_http_ericsten_digest_init(ngx_log_t *log);
+
+void ngx_http_ericsten_crc32c_init(uint32_t *crc);
+void ngx_http_ericsten_crc32c_update(uint32_t *crc, u_char *p, size_t len);
+void ngx_http_ericsten_crc32c_final(uint32_t *crc);
+
+void ngx_http_ericsten_xxh64_init(ngx_http_ericsten_xxh64_t *s, uint64_t seed);
+void ngx_http_ericsten_xxh64_update(ngx_http_ericsten_xxh64_t *s, u_char *p, size_t len);
+uint64_t ngx_http_ericsten_xxh64_final(ngx_http_ericsten_xxh64_t *s);
+
+void ngx_http_ericsten_sha256_init(ngx_http_ericsten_sha256_t *s);
+void ngx_http_ericsten_sha256_update(ngx_http_ericsten_sha256_t *s, u_char *p, size_t len);
+void ngx_http_ericsten_sha256_final(ngx_http_ericsten_sha256_t *s, u_char *digest);
+
+#endif /* _NGX_HTTP_ERICSTEN_DIGEST_H_INCLUDED_ */
@@ -0,0 +1,764 @@
+/*
+
+Module Description:
+    Helper processes for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_helper.h.
+
+    Mapping layout, per worker:
+
+        header      whether the worker has been rung since it last looked
+        rings       per helper, the jobs to run and the jobs done
+        slots       NGX_HTTP_ERICSTEN_HELPER_DATA bytes and a length each
+
+    A slot is on at most one ring at a time, and every ring has a cell for
+    every slot, so pushing never fails.
+
+    Sleeping and ringing follow the same pattern both ways: the sleeper
+    announces itself and checks the ring again, the producer pushes and then
+    looks for the announcement, each with a full fence in between, so that
+    at least one of them sees the other.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include <poll.h>
+
+#if (NGX_LINUX)
+#include <sys/prctl.h>
+#endif
+
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_helper.h"
+
+#define NGX_HTTP_ERICSTEN_HELPER_WAIT       1000    // ms an idle helper sleeps before checking that its worker is alive.
+#define NGX_HTTP_ERICSTEN_HELPER_RESPAWN    1000    // ms before a helper that did not last that long is forked again.
+
+struct ngx_http_ericsten_helper_zone_s
+{
+    uint32_t            notified;       // The worker has been rung.
+};
+
+typedef struct
+{
+    uint32_t            head NGX_HTTP_ERICSTEN_CACHE_ALIGNED;       // Consumer.
+    uint32_t            tail NGX_HTTP_ERICSTEN_CACHE_ALIGNED;       // Producer; the cells follow.
+    uint32_t            waiting NGX_HTTP_ERICSTEN_CACHE_ALIGNED;    // The consumer is going to sleep.
+} ngx_http_ericsten_helper_ring_t;
+
+struct ngx_http_ericsten_helper_slot_s
+{
+    uint32_t            len;
+    uint32_t            reserved;
+    u_char              data[NGX_HTTP_ERICSTEN_HELPER_DATA];
+};
+
+struct ngx_http_ericsten_helper_proc_s
+{
+    ngx_http_ericsten_helper_t         *helper;
+    ngx_http_ericsten_helper_ring_t    *todo;       // Worker to helper.
+    ngx_http_ericsten_helper_ring_t    *done;       // Helper to worker.
+    ngx_pid_t                           pid;        // NGX_INVALID_PID while not running.
+    ngx_fd_t                            wake[2];    // The worker rings the helper: read end, write end.
+    ngx_connection_t                   *lifeline;   // Read end of a pipe the helper holds the other end of.
+    ngx_uint_t                          active;     // Jobs on it.
+    ngx_msec_t                          started;
+    ngx_event_t                         respawn;
+};
+
+static ngx_int_t ngx_http_ericsten_helper_spawn(ngx_http_ericsten_helper_proc_t *proc);
+static void ngx_http_ericsten_helper_process(ngx_http_ericsten_helper_proc_t *proc, ngx_fd_t lifeline);
+static void ngx_http_ericsten_helper_close_fds(ngx_fd_t *keep, ngx_uint_t n);
+static void ngx_http_ericsten_helper_notify_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_helper_lifeline_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_helper_respawn_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_helper_exited(ngx_http_ericsten_helper_proc_t *proc);
+static void ngx_http_ericsten_helper_collect(ngx_http_ericsten_helper_proc_t *proc);
+static void ngx_http_ericsten_helper_finish(ngx_http_ericsten_helper_proc_t *proc, ngx_uint_t i, ngx_int_t rc);
+static void ngx_http_ericsten_helper_close_wake(ngx_http_ericsten_helper_proc_t *proc);
+static void ngx_http_ericsten_helper_push(ngx_http_ericsten_helper_ring_t *ring, ngx_uint_t mask, uint32_t value);
+static ngx_int_t ngx_http_ericsten_helper_pop(ngx_http_ericsten_helper_ring_t *ring, ngx_uint_t mask,
+    uint32_t *value);
+
+//
+// nginx's handlers would only set flags that a helper never looks at.
+//
+static int  ngx_http_ericsten_helper_signals[] =
+{
+    SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, SIGWINCH, SIGALRM, SIGIO, SIGCHLD, 0
+};
+
+ngx_http_ericsten_helper_t *
+ngx_http_ericsten_helper_create(ngx_conf_t *cf, ngx_uint_t helpers, ngx_uint_t slots,
+    ngx_http_ericsten_helper_run_pt run, ngx_http_ericsten_helper_done_pt done)
+{
+    ngx_http_ericsten_helper_t  *helper;
+
+    helper = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_helper_t));
+    if (helper == NULL)
+    {
+        return NULL;
+    }
+
+    helper->helpers = helpers;
+    helper->slots = slots;
+    helper->run = run;
+    helper->done = done;
+
+    return helper;
+}
+
+ngx_int_t
+ngx_http_ericsten_helper_start(ngx_http_ericsten_helper_t *helper, ngx_cycle_t *cycle)
+{
+    u_char                           *p;
+    size_t                            ring;
+    ngx_uint_t                        i, cells;
+    ngx_shm_t                         shm;
+    ngx_connection_t                 *c;
+    ngx_http_ericsten_helper_proc_t  *proc;
+
+    helper->log = cycle->log;
+
+    //
+    // At least a cache line of cells, so that every ring stays aligned.
+    //
+
+    for (cells = NGX_CPU_CACHE_LINE / sizeof(uint32_t); cells < helper->slots; cells *= 2) { /* void */ }
+
+    helper->mask = cells - 1;
+    ring = sizeof(ngx_http_ericsten_helper_ring_t) + cells * sizeof(uint32_t);
+
+    shm.size = NGX_CPU_CACHE_LINE + 2 * helper->helpers * ring
+               + helper->slots * sizeof(ngx_http_ericsten_helper_slot_t);
+    shm.name.len = sizeof("ericsten_helpers") - 1;
+    shm.name.data = (u_char *) "ericsten_helpers";
+    shm.log = cycle->log;
+
+    if (ngx_shm_alloc(&shm) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    helper->zone = (ngx_http_ericsten_helper_zone_t *) shm.addr;
+    helper->jobs = (ngx_http_ericsten_helper_slot_t *) (shm.addr + NGX_CPU_CACHE_LINE + 2 * helper->helpers * ring);
+
+    helper->procs = ngx_pcalloc(cycle->pool, helper->helpers * sizeof(ngx_http_ericsten_helper_proc_t));
+    helper->owners = ngx_pcalloc(cycle->pool, helper->slots * sizeof(void *));
+    helper->assigned = ngx_palloc(cycle->pool, helper->slots * sizeof(ngx_uint_t));
+    helper->free = ngx_palloc(cycle->pool, helper->slots * sizeof(ngx_uint_t));
+
+    if (helper->procs == NULL || helper->owners == NULL || helper->assigned == NULL || helper->free == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = helper->slots; i-- > 0; /* void */)
+    {
+        helper->free[helper->nfree++] = i;
+    }
+
+    //
+    // The helpers ring the worker through one channel.  Both ends are
+    // nonblocking: a full pipe or counter has a wakeup pending anyway.
+    //
+
+#if (NGX_HAVE_EVENTFD)
+    helper->notify[0] = eventfd(0, 0);
+
+    if (helper->notify[0] == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            "ericsten helper: eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    helper->notify[1] = helper->notify[0];
+#else
+    if (pipe(helper->notify) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            "ericsten helper: pipe() failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(helper->notify[1]) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+            "ericsten helper: " ngx_nonblocking_n " failed");
+        return NGX_ERROR;
+    }
+#endif
+
+    if (ngx_nonblocking(helper->notify[0]) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+            "ericsten helper: " ngx_nonblocking_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(helper->notify[0], cycle->log);
+    if (c == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    c->data = helper;
+    c->read->handler = ngx_http_ericsten_helper_notify_handler;
+    c->read->log = cycle->log;
+    c->read->channel = 1;       // Not reported as leaked when the worker exits.
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    p = shm.addr + NGX_CPU_CACHE_LINE;
+
+    for (i = 0; i < helper->helpers; i++)
+    {
+        proc = &helper->procs[i];
+
+        proc->helper = helper;
+        proc->todo = (ngx_http_ericsten_helper_ring_t *) p;
+        proc->done = (ngx_http_ericsten_helper_ring_t *) (p + ring);
+        proc->pid = NGX_INVALID_PID;
+        proc->wake[0] = -1;
+        proc->wake[1] = -1;
+
+        proc->respawn.handler = ngx_http_ericsten_helper_respawn_handler;
+        proc->respawn.data = proc;
+        proc->respawn.log = cycle->log;
+        proc->respawn.cancelable = 1;
+
+        p += 2 * ring;
+
+        if (ngx_http_ericsten_helper_spawn(proc) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_helper_post(ngx_http_ericsten_helper_t *helper, u_char *job, size_t len, void *data)
+{
+    uint64_t                          value = 1;
+    ngx_uint_t                        i, k;
+    ngx_http_ericsten_helper_proc_t  *proc, *p;
+    ngx_http_ericsten_helper_slot_t  *s;
+
+    if (helper->nfree == 0 || len > NGX_HTTP_ERICSTEN_HELPER_DATA)
+    {
+        return NGX_DECLINED;
+    }
+
+    proc = NULL;
+
+    for (k = 0; k < helper->helpers; k++)
+    {
+        p = &helper->procs[k];
+
+        if (p->pid != NGX_INVALID_PID && (proc == NULL || p->active < proc->active))
+        {
+            proc = p;
+        }
+    }
+
+    if (proc == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    i = helper->free[--helper->nfree];
+    s = &helper->jobs[i];
+
+    s->len = (uint32_t) len;
+    ngx_memcpy(s->data, job, len);
+
+    helper->owners[i] = data;
+    helper->assigned[i] = proc - helper->procs;
+    proc->active++;
+
+    ngx_http_ericsten_helper_push(proc->todo, helper->mask, (uint32_t) i);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&proc->todo->waiting, __ATOMIC_RELAXED)
+        && write(proc->wake[1], &value, sizeof(uint64_t)) == -1 && ngx_errno != NGX_EAGAIN)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "ericsten helper: wake write() failed");
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_helper_spawn(ngx_http_ericsten_helper_proc_t *proc)
+{
+    ngx_fd_t                     lifeline[2];
+    ngx_pid_t                    pid;
+    ngx_connection_t            *c;
+    ngx_http_ericsten_helper_t  *helper = proc->helper;
+
+#if (NGX_HAVE_EVENTFD)
+    proc->wake[0] = eventfd(0, 0);
+
+    if (proc->wake[0] == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "ericsten helper: eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    proc->wake[1] = proc->wake[0];
+#else
+    if (pipe(proc->wake) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "ericsten helper: pipe() failed");
+        return NGX_ERROR;
+    }
+#endif
+
+    if (ngx_nonblocking(proc->wake[0]) == -1 || ngx_nonblocking(proc->wake[1]) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_socket_errno,
+            "ericsten helper: " ngx_nonblocking_n " failed");
+        ngx_http_ericsten_helper_close_wake(proc);
+        return NGX_ERROR;
+    }
+
+    if (pipe(lifeline) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "ericsten helper: pipe() failed");
+        ngx_http_ericsten_helper_close_wake(proc);
+        return NGX_ERROR;
+    }
+
+    pid = fork();
+
+    switch (pid)
+    {
+    case -1:
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "fork() failed while spawning ericsten helper");
+        (void) close(lifeline[0]);
+        (void) close(lifeline[1]);
+        ngx_http_ericsten_helper_close_wake(proc);
+        return NGX_ERROR;
+
+    case 0:
+        ngx_http_ericsten_helper_process(proc, lifeline[1]);
+        break;
+
+    default:
+        break;
+    }
+
+    (void) close(lifeline[1]);
+
+    proc->pid = pid;
+    proc->started = ngx_current_msec;
+
+    ngx_log_error(NGX_LOG_NOTICE, helper->log, 0,
+        "start ericsten helper %P", pid);
+
+    if (ngx_nonblocking(lifeline[0]) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_socket_errno,
+            "ericsten helper: " ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(lifeline[0], helper->log);
+    if (c == NULL)
+    {
+        goto failed;
+    }
+
+    c->data = proc;
+    c->read->handler = ngx_http_ericsten_helper_lifeline_handler;
+    c->read->log = helper->log;
+    c->read->channel = 1;
+
+    proc->lifeline = c;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        ngx_close_connection(c);
+        proc->lifeline = NULL;
+        lifeline[0] = -1;
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    //
+    // A helper the worker cannot watch is of no use.
+    //
+
+    if (kill(pid, SIGKILL) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "kill(%P, SIGKILL) failed", pid);
+    }
+
+    if (lifeline[0] != -1)
+    {
+        (void) close(lifeline[0]);
+    }
+
+    ngx_http_ericsten_helper_close_wake(proc);
+    proc->pid = NGX_INVALID_PID;
+
+    return NGX_ERROR;
+}
+
+//
+// The helper process: run the jobs on its ring until the worker exits.
+//
+
+static void
+ngx_http_ericsten_helper_process(ngx_http_ericsten_helper_proc_t *proc, ngx_fd_t lifeline)
+{
+    u_char                            buf[64];
+    size_t                            len;
+    uint32_t                          i;
+    uint64_t                          value = 1;
+    ngx_fd_t                          keep[8];
+    ngx_pid_t                         parent;
+    ngx_uint_t                        n;
+    ngx_log_t                        *log;
+    sigset_t                          set;
+    struct pollfd                     pfd;
+    ngx_http_ericsten_helper_t       *helper = proc->helper;
+    ngx_http_ericsten_helper_slot_t  *s;
+
+    parent = ngx_pid;
+
+    ngx_pid = ngx_getpid();
+    ngx_process = NGX_PROCESS_HELPER;
+
+    for (n = 0; ngx_http_ericsten_helper_signals[n]; n++)
+    {
+        (void) signal(ngx_http_ericsten_helper_signals[n], SIG_DFL);
+    }
+
+    sigemptyset(&set);
+    (void) sigprocmask(SIG_SETMASK, &set, NULL);
+
+#if (NGX_LINUX)
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, helper->log, ngx_errno,
+            "ericsten helper: prctl(PR_SET_PDEATHSIG) failed");
+    }
+#endif
+
+    if (getppid() != parent)
+    {
+        _exit(0);
+    }
+
+    //
+    // Keep the channels and the error logs; the rest belongs to the worker.
+    //
+
+    n = 0;
+
+    keep[n++] = proc->wake[0];
+    keep[n++] = helper->notify[1];
+    keep[n++] = lifeline;
+
+    for (log = helper->log; log && n < sizeof(keep) / sizeof(ngx_fd_t); log = log->next)
+    {
+        if (log->file && log->file->fd != NGX_INVALID_FILE)
+        {
+            keep[n++] = log->file->fd;
+        }
+    }
+
+    ngx_http_ericsten_helper_close_fds(keep, n);
+
+    ngx_setproctitle("ericsten helper process");
+
+    log = helper->log;
+
+    for ( ;; )
+    {
+        if (ngx_http_ericsten_helper_pop(proc->todo, helper->mask, &i) != NGX_OK)
+        {
+            __atomic_store_n(&proc->todo->waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            if (ngx_http_ericsten_helper_pop(proc->todo, helper->mask, &i) != NGX_OK)
+            {
+                pfd.fd = proc->wake[0];
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+
+                if (poll(&pfd, 1, NGX_HTTP_ERICSTEN_HELPER_WAIT) == 0 && getppid() != parent)
+                {
+                    _exit(0);
+                }
+
+                while (read(proc->wake[0], buf, sizeof(buf)) > 0) { /* void */ }
+
+                __atomic_store_n(&proc->todo->waiting, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            __atomic_store_n(&proc->todo->waiting, 0, __ATOMIC_RELAXED);
+        }
+
+        s = &helper->jobs[i];
+        len = s->len;
+
+        helper->run(s->data, &len, log);
+
+        s->len = (uint32_t) len;
+
+        ngx_http_ericsten_helper_push(proc->done, helper->mask, i);
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&helper->zone->notified, 1, __ATOMIC_RELAXED) == 0
+            && write(helper->notify[1], &value, sizeof(uint64_t)) == -1 && ngx_errno != NGX_EAGAIN)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                "ericsten helper: notify write() failed");
+        }
+    }
+}
+
+static void
+ngx_http_ericsten_helper_close_fds(ngx_fd_t *keep, ngx_uint_t n)
+{
+    long        max;
+    ngx_fd_t    fd;
+    ngx_uint_t  i;
+
+    max = sysconf(_SC_OPEN_MAX);
+
+    if (max == -1)
+    {
+        max = 1024;
+    }
+
+    for (fd = 3; fd < max; fd++)
+    {
+        for (i = 0; i < n && keep[i] != fd; i++) { /* void */ }
+
+        if (i == n)
+        {
+            (void) close(fd);
+        }
+    }
+}
+
+//
+// On the event loop: finish the jobs the helpers have done.
+//
+
+static void
+ngx_http_ericsten_helper_notify_handler(ngx_event_t *ev)
+{
+    u_char                       buf[64];
+    ngx_uint_t                   i;
+    ngx_connection_t            *c = ev->data;
+    ngx_http_ericsten_helper_t  *helper = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "ericsten helper: notified");
+
+    __atomic_store_n(&helper->zone->notified, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (read(c->fd, buf, sizeof(buf)) > 0) { /* void */ }
+
+    for (i = 0; i < helper->helpers; i++)
+    {
+        if (helper->procs[i].pid != NGX_INVALID_PID)
+        {
+            ngx_http_ericsten_helper_collect(&helper->procs[i]);
+        }
+    }
+}
+
+static void
+ngx_http_ericsten_helper_lifeline_handler(ngx_event_t *ev)
+{
+    u_char                            buf[16];
+    ssize_t                           n;
+    ngx_connection_t                 *c = ev->data;
+    ngx_http_ericsten_helper_proc_t  *proc = c->data;
+
+    n = read(c->fd, buf, sizeof(buf));
+
+    if (n > 0 || (n == -1 && ngx_errno == NGX_EAGAIN))
+    {
+        if (ngx_handle_read_event(ev, 0) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                "ericsten helper: failed to watch helper %P", proc->pid);
+        }
+
+        return;
+    }
+
+    ngx_http_ericsten_helper_exited(proc);
+}
+
+static void
+ngx_http_ericsten_helper_respawn_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_helper_proc_t  *proc = ev->data;
+
+    if (ngx_http_ericsten_helper_spawn(proc) != NGX_OK)
+    {
+        ngx_add_timer(&proc->respawn, NGX_HTTP_ERICSTEN_HELPER_RESPAWN);
+    }
+}
+
+//
+// The helper is gone, and so is its end of the lifeline.  The jobs it had
+// finished are done; the others are lost with it.  nginx's SIGCHLD handler
+// reaps it.
+//
+
+static void
+ngx_http_ericsten_helper_exited(ngx_http_ericsten_helper_proc_t *proc)
+{
+    ngx_uint_t                   i, index;
+    ngx_http_ericsten_helper_t  *helper = proc->helper;
+
+    ngx_close_connection(proc->lifeline);
+    proc->lifeline = NULL;
+
+    ngx_http_ericsten_helper_collect(proc);
+
+    ngx_log_error(NGX_LOG_ALERT, helper->log, 0,
+        "ericsten helper %P exited, %ui jobs lost", proc->pid, proc->active);
+
+    proc->pid = NGX_INVALID_PID;
+    ngx_http_ericsten_helper_close_wake(proc);
+
+    index = proc - helper->procs;
+
+    for (i = 0; i < helper->slots; i++)
+    {
+        if (helper->owners[i] != NULL && helper->assigned[i] == index)
+        {
+            ngx_http_ericsten_helper_finish(proc, i, NGX_ERROR);
+        }
+    }
+
+    ngx_memzero(proc->todo, sizeof(ngx_http_ericsten_helper_ring_t));
+    ngx_memzero(proc->done, sizeof(ngx_http_ericsten_helper_ring_t));
+
+    if (ngx_exiting || ngx_quit || ngx_terminate)
+    {
+        return;
+    }
+
+    ngx_add_timer(&proc->respawn,
+                  (ngx_current_msec - proc->started < NGX_HTTP_ERICSTEN_HELPER_RESPAWN)
+                  ? NGX_HTTP_ERICSTEN_HELPER_RESPAWN : 1);
+}
+
+static void
+ngx_http_ericsten_helper_collect(ngx_http_ericsten_helper_proc_t *proc)
+{
+    uint32_t  i;
+
+    while (ngx_http_ericsten_helper_pop(proc->done, proc->helper->mask, &i) == NGX_OK)
+    {
+        ngx_http_ericsten_helper_finish(proc, i, NGX_OK);
+    }
+}
+
+//
+// The slot goes back on the free list once the handler is done with the
+// result, since the handler may post another job.
+//
+
+static void
+ngx_http_ericsten_helper_finish(ngx_http_ericsten_helper_proc_t *proc, ngx_uint_t i, ngx_int_t rc)
+{
+    void                             *data;
+    ngx_http_ericsten_helper_t       *helper = proc->helper;
+    ngx_http_ericsten_helper_slot_t  *s = &helper->jobs[i];
+
+    data = helper->owners[i];
+    helper->owners[i] = NULL;
+    proc->active--;
+
+    if (rc == NGX_OK)
+    {
+        helper->done(data, NGX_OK, s->data, s->len);
+    }
+    else
+    {
+        helper->done(data, NGX_ERROR, NULL, 0);
+    }
+
+    helper->free[helper->nfree++] = i;
+}
+
+static void
+ngx_http_ericsten_helper_close_wake(ngx_http_ericsten_helper_proc_t *proc)
+{
+    if (proc->wake[1] != -1 && proc->wake[1] != proc->wake[0])
+    {
+        (void) close(proc->wake[1]);
+    }
+
+    if (proc->wake[0] != -1)
+    {
+        (void) close(proc->wake[0]);
+    }
+
+    proc->wake[0] = -1;
+    proc->wake[1] = -1;
+}
+
+static void
+ngx_http_ericsten_helper_push(ngx_http_ericsten_helper_ring_t *ring, ngx_uint_t mask, uint32_t value)
+{
+    uint32_t   tail;
+    uint32_t  *cells = (uint32_t *) (ring + 1);
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    cells[tail & mask] = value;
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static ngx_int_t
+ngx_http_ericsten_helper_pop(ngx_http_ericsten_helper_ring_t *ring, ngx_uint_t mask, uint32_t *value)
+{
+    uint32_t   head;
+    uint32_t  *cells = (uint32_t *) (ring + 1);
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    {
+        return NGX_DECLINED;
+    }
+
+    *value = cells[head & mask];
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return NGX_OK;
+}
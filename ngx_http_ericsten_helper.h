@@ -0,0 +1,107 @@
+/*
+
+Module Description:
+    Helper processes for ngx_http_ericsten_module.
+
+    A blocking library that is not thread-safe, or that crashes or leaks,
+    is better kept out of the worker.  Each worker forks a few helper
+    processes when it starts, and runs such jobs on them instead of on its
+    thread pool: a crash then costs the jobs the helper held, not the
+    worker, and a helper that leaks can be killed.
+
+    A job is a small block of bytes, copied into a slot of a shared mapping
+    that the worker creates before forking.  Every helper has a pair of
+    single-producer single-consumer rings in it, one for the jobs it is to
+    run and one for the jobs it has done.  The worker puts a job on the ring
+    of the helper with the fewest, and rings the helper's eventfd (or pipe)
+    only if the helper is asleep; the helper runs the job, puts it on its
+    done ring, and rings the worker's eventfd only if the worker has not
+    been rung since it last looked.  In steady state that is one wakeup
+    each way per job, as on the thread pool.
+
+    The worker supervises its helpers: each holds the write end of a pipe
+    that the worker watches, so the worker sees it exit.  The jobs it held
+    then fail, and it is forked again, after a second if it did not last a
+    second.  Helpers exit when their worker does.
+
+    The worker forks the helpers, not the master.  The master does run
+    module code, in init_module at startup, at every reload and under
+    nginx -t, but it has no event loop and no hook after that: it could not
+    watch its helpers or fork them again, and it reaps as unknown any child
+    it did not start itself.  A pool per worker also gives each ring a
+    single producer and a single consumer.  The helpers close every
+    descriptor of the worker they do not need, so that they do not keep
+    client connections or listening sockets open.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_HELPER_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_HELPER_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+//
+// Largest job, input or result.
+//
+#define NGX_HTTP_ERICSTEN_HELPER_DATA   56
+
+typedef struct ngx_http_ericsten_helper_zone_s  ngx_http_ericsten_helper_zone_t;
+typedef struct ngx_http_ericsten_helper_slot_s  ngx_http_ericsten_helper_slot_t;
+typedef struct ngx_http_ericsten_helper_proc_s  ngx_http_ericsten_helper_proc_t;
+
+//
+// In a helper process: run the job in data, of *len bytes, and leave the
+// result there, setting *len.
+//
+typedef void (*ngx_http_ericsten_helper_run_pt)(u_char *data, size_t *len, ngx_log_t *log);
+
+//
+// On the event loop: the job posted with data is done.  rc is NGX_OK and
+// result valid until the handler returns, or NGX_ERROR if the helper running
+// the job exited.
+//
+typedef void (*ngx_http_ericsten_helper_done_pt)(void *data, ngx_int_t rc, u_char *result, size_t len);
+
+typedef struct
+{
+    ngx_uint_t                          helpers;    // Helper processes per worker.
+    ngx_uint_t                          slots;      // Jobs in flight per worker.
+    ngx_http_ericsten_helper_run_pt     run;
+    ngx_http_ericsten_helper_done_pt    done;
+
+    //
+    // Worker state.
+    //
+
+    ngx_log_t                          *log;
+    ngx_http_ericsten_helper_zone_t    *zone;
+    ngx_http_ericsten_helper_slot_t    *jobs;
+    ngx_http_ericsten_helper_proc_t    *procs;
+    ngx_fd_t                            notify[2];  // Helpers ring the worker: read end, write end.
+    void                              **owners;     // Per slot: the done handler's data.
+    ngx_uint_t                         *assigned;   // Per slot: the helper running it.
+    ngx_uint_t                         *free;       // Stack of free slots.
+    ngx_uint_t                          nfree;
+    ngx_uint_t                          mask;       // Ring cells - 1.
+} ngx_http_ericsten_helper_t;
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_helper_t *ngx_http_ericsten_helper_create(ngx_conf_t *cf, ngx_uint_t helpers, ngx_uint_t slots,
+    ngx_http_ericsten_helper_run_pt run, ngx_http_ericsten_helper_done_pt done);
+
+//
+// From the module's init_process handler: fork the helpers.
+//
+ngx_int_t ngx_http_ericsten_helper_start(ngx_http_ericsten_helper_t *helper, ngx_cycle_t *cycle);
+
+//
+// On the event loop: post a job of len bytes.  Returns NGX_DECLINED if no
+// slot is free or no helper is running.
+//
+ngx_int_t ngx_http_ericsten_helper_post(ngx_http_ericsten_helper_t *helper, u_char *job, size_t len, void *data);
+
+#endif /* _NGX_HTTP_ERICSTEN_HELPER_H_INCLUDED_ */
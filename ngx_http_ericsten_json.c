@@ -0,0 +1,698 @@
+/*
+
+Module Description:
+    Streaming JSON validator for ngx_http_ericsten_module.
+
+    A byte-at-a-time state machine for the grammar, with the string
+    contents skipped by a vector kernel.  See ngx_http_ericsten_json.h.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_json.h"
+
+typedef u_char *(*ngx_http_ericsten_json_scan_pt)(u_char *p, u_char *last);
+
+static u_char *ngx_http_ericsten_json_scan_scalar(u_char *p, u_char *last);
+
+#if (NGX_HTTP_ERICSTEN_X86)
+static u_char *ngx_http_ericsten_json_scan_sse2(u_char *p, u_char *last);
+static u_char *ngx_http_ericsten_json_scan_avx2(u_char *p, u_char *last);
+#endif
+
+static ngx_http_ericsten_json_scan_pt  ngx_http_ericsten_json_scan = ngx_http_ericsten_json_scan_scalar;
+
+enum
+{
+    sw_value = 0,           // A value is expected.
+    sw_array_first,         // After '[': a value or ']'.
+    sw_object_first,        // After '{': a key or '}'.
+    sw_key,                 // After ',' in an object: a key.
+    sw_colon,               // After a key.
+    sw_after_value,         // After a value: ',' or a closing bracket, or the end.
+    sw_string,
+    sw_key_string,
+    sw_escape,
+    sw_key_escape,
+    sw_unicode,
+    sw_key_unicode,
+    sw_utf8,
+    sw_key_utf8,
+    sw_literal,
+    sw_minus,
+    sw_zero,
+    sw_int,
+    sw_frac_first,
+    sw_frac,
+    sw_exp_first,
+    sw_exp_sign,
+    sw_exp
+};
+
+//
+// String states come in pairs: the key variant is always the value
+// variant + 1, so the pair can share code.
+//
+
+#define ngx_http_ericsten_json_is_key(state)  (((state) - sw_string) & 1)
+
+//
+// Bytes that need no attention inside a string.
+//
+
+static u_char  ngx_http_ericsten_json_plain[256];
+
+void
+ngx_http_ericsten_json_init_kernels(ngx_log_t *log)
+{
+    ngx_uint_t  c;
+#if (NGX_HTTP_ERICSTEN_X86)
+    ngx_uint_t  avx2;
+#endif
+
+    for (c = 0; c < 256; c++)
+    {
+        ngx_http_ericsten_json_plain[c] = (c >= 0x20 && c < 0x80 && c != '"' && c != '\\');
+    }
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+    if (ngx_http_ericsten_cpu_sse2())
+    {
+        ngx_http_ericsten_json_scan = ngx_http_ericsten_json_scan_sse2;
+    }
+
+    avx2 = ngx_http_ericsten_cpu_avx2();
+
+    if (avx2)
+    {
+        ngx_http_ericsten_json_scan = ngx_http_ericsten_json_scan_avx2;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+        "ngx_http_ericsten_json_init_kernels: avx2:%ui", avx2);
+
+#endif
+}
+
+void
+ngx_http_ericsten_json_init(ngx_http_ericsten_json_t *j)
+{
+    ngx_memzero(j, sizeof(ngx_http_ericsten_json_t));
+
+    j->state = sw_value;
+}
+
+ngx_int_t
+ngx_http_ericsten_json_feed(ngx_http_ericsten_json_t *j, u_char *p, size_t len)
+{
+    u_char      c, *start, *last;
+    ngx_uint_t  state, key, top;
+
+    if (j->error)
+    {
+        return NGX_ERROR;
+    }
+
+    start = p;
+    last = p + len;
+    state = j->state;
+
+    while (p < last)
+    {
+        c = *p;
+
+        switch (state)
+        {
+
+        case sw_string:
+        case sw_key_string:
+
+            p = ngx_http_ericsten_json_scan(p, last);
+
+            if (p == last)
+            {
+                goto done;
+            }
+
+            c = *p++;
+            key = ngx_http_ericsten_json_is_key(state);
+
+            if (c == '"')
+            {
+                state = key ? sw_colon : sw_after_value;
+                break;
+            }
+
+            if (c == '\\')
+            {
+                state = sw_escape + key;
+                break;
+            }
+
+            if (c < 0x20)
+            {
+                p--;
+                j->error = "control character in string";
+                goto failed;
+            }
+
+            //
+            // Non-ASCII: the lead byte decides the length of the sequence
+            // and the range of its first continuation byte, which rules out
+            // overlong forms, surrogates and code points past U+10FFFF.
+            //
+
+            j->utf8_lo = 0x80;
+            j->utf8_hi = 0xbf;
+
+            if (c >= 0xc2 && c <= 0xdf)
+            {
+                j->utf8_need = 1;
+            }
+            else if (c >= 0xe0 && c <= 0xef)
+            {
+                j->utf8_need = 2;
+                j->utf8_lo = (c == 0xe0) ? 0xa0 : 0x80;
+                j->utf8_hi = (c == 0xed) ? 0x9f : 0xbf;
+            }
+            else if (c >= 0xf0 && c <= 0xf4)
+            {
+                j->utf8_need = 3;
+                j->utf8_lo = (c == 0xf0) ? 0x90 : 0x80;
+                j->utf8_hi = (c == 0xf4) ? 0x8f : 0xbf;
+            }
+            else
+            {
+                p--;
+                j->error = "invalid UTF-8";
+                goto failed;
+            }
+
+            state = sw_utf8 + key;
+            break;
+
+        case sw_utf8:
+        case sw_key_utf8:
+
+            if (c < j->utf8_lo || c > j->utf8_hi)
+            {
+                j->error = "invalid UTF-8";
+                goto failed;
+            }
+
+            p++;
+            j->utf8_lo = 0x80;
+            j->utf8_hi = 0xbf;
+
+            if (--j->utf8_need == 0)
+            {
+                state = sw_string + ngx_http_ericsten_json_is_key(state);
+            }
+
+            break;
+
+        case sw_escape:
+        case sw_key_escape:
+
+            key = ngx_http_ericsten_json_is_key(state);
+
+            switch (c)
+            {
+            case '"': case '\\': case '/':
+            case 'b': case 'f': case 'n': case 'r': case 't':
+                state = sw_string + key;
+                break;
+
+            case 'u':
+                j->hex = 4;
+                state = sw_unicode + key;
+                break;
+
+            default:
+                j->error = "invalid escape";
+                goto failed;
+            }
+
+            p++;
+            break;
+
+        case sw_unicode:
+        case sw_key_unicode:
+
+            if (!((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')))
+            {
+                j->error = "invalid \\u escape";
+                goto failed;
+            }
+
+            p++;
+
+            if (--j->hex == 0)
+            {
+                state = sw_string + ngx_http_ericsten_json_is_key(state);
+            }
+
+            break;
+
+        case sw_value:
+        case sw_array_first:
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                p++;
+                break;
+            }
+
+            if (state == sw_array_first && c == ']')
+            {
+                j->depth--;
+                state = sw_after_value;
+                p++;
+                break;
+            }
+
+            switch (c)
+            {
+            case '{':
+            case '[':
+
+                if (j->depth == NGX_HTTP_ERICSTEN_JSON_MAX_DEPTH)
+                {
+                    j->error = "nesting too deep";
+                    goto failed;
+                }
+
+                if (c == '{')
+                {
+                    j->stack[j->depth / 64] |= (uint64_t) 1 << (j->depth % 64);
+                    state = sw_object_first;
+                }
+                else
+                {
+                    j->stack[j->depth / 64] &= ~((uint64_t) 1 << (j->depth % 64));
+                    state = sw_array_first;
+                }
+
+                j->depth++;
+                break;
+
+            case '"':
+                state = sw_string;
+                break;
+
+            case '-':
+                state = sw_minus;
+                break;
+
+            case '0':
+                state = sw_zero;
+                break;
+
+            case 't':
+                j->literal_text = (u_char *) "true";
+                j->literal = 1;
+                state = sw_literal;
+                break;
+
+            case 'f':
+                j->literal_text = (u_char *) "false";
+                j->literal = 1;
+                state = sw_literal;
+                break;
+
+            case 'n':
+                j->literal_text = (u_char *) "null";
+                j->literal = 1;
+                state = sw_literal;
+                break;
+
+            default:
+
+                if (c >= '1' && c <= '9')
+                {
+                    state = sw_int;
+                    break;
+                }
+
+                j->error = "value expected";
+                goto failed;
+            }
+
+            p++;
+            break;
+
+        case sw_object_first:
+        case sw_key:
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                p++;
+                break;
+            }
+
+            if (c == '"')
+            {
+                state = sw_key_string;
+                p++;
+                break;
+            }
+
+            if (state == sw_object_first && c == '}')
+            {
+                j->depth--;
+                state = sw_after_value;
+                p++;
+                break;
+            }
+
+            j->error = "object key expected";
+            goto failed;
+
+        case sw_colon:
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                p++;
+                break;
+            }
+
+            if (c != ':')
+            {
+                j->error = "\":\" expected";
+                goto failed;
+            }
+
+            state = sw_value;
+            p++;
+            break;
+
+        case sw_after_value:
+
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+            {
+                p++;
+                break;
+            }
+
+            if (j->depth == 0)
+            {
+                j->error = "trailing data after the document";
+                goto failed;
+            }
+
+            top = (j->stack[(j->depth - 1) / 64] >> ((j->depth - 1) % 64)) & 1;
+
+            if (c == ',')
+            {
+                state = top ? sw_key : sw_value;
+                p++;
+                break;
+            }
+
+            if ((top && c == '}') || (!top && c == ']'))
+            {
+                j->depth--;
+                p++;
+                break;
+            }
+
+            j->error = top ? "\",\" or \"}\" expected" : "\",\" or \"]\" expected";
+            goto failed;
+
+        case sw_literal:
+
+            if (c != j->literal_text[j->literal])
+            {
+                j->error = "invalid literal";
+                goto failed;
+            }
+
+            p++;
+
+            if (j->literal_text[++j->literal] == '\0')
+            {
+                state = sw_after_value;
+            }
+
+            break;
+
+        case sw_minus:
+
+            if (c == '0')
+            {
+                state = sw_zero;
+            }
+            else if (c >= '1' && c <= '9')
+            {
+                state = sw_int;
+            }
+            else
+            {
+                j->error = "digit expected";
+                goto failed;
+            }
+
+            p++;
+            break;
+
+        case sw_int:
+
+            while (p < last && *p >= '0' && *p <= '9')
+            {
+                p++;
+            }
+
+            if (p == last)
+            {
+                goto done;
+            }
+
+            c = *p;
+
+            /* fall through */
+
+        case sw_zero:
+
+            if (c == '.')
+            {
+                state = sw_frac_first;
+                p++;
+                break;
+            }
+
+            /* fall through */
+
+        case sw_frac:
+
+            if (state == sw_frac)
+            {
+                while (p < last && *p >= '0' && *p <= '9')
+                {
+                    p++;
+                }
+
+                if (p == last)
+                {
+                    goto done;
+                }
+
+                c = *p;
+            }
+
+            if (c == 'e' || c == 'E')
+            {
+                state = sw_exp_first;
+                p++;
+                break;
+            }
+
+            //
+            // The number ends here; this byte belongs to what follows it.
+            //
+
+            state = sw_after_value;
+            break;
+
+        case sw_frac_first:
+
+            if (c < '0' || c > '9')
+            {
+                j->error = "digit expected";
+                goto failed;
+            }
+
+            state = sw_frac;
+            p++;
+            break;
+
+        case sw_exp_first:
+
+            if (c == '+' || c == '-')
+            {
+                state = sw_exp_sign;
+                p++;
+                break;
+            }
+
+            /* fall through */
+
+        case sw_exp_sign:
+
+            if (c < '0' || c > '9')
+            {
+                j->error = "digit expected";
+                goto failed;
+            }
+
+            state = sw_exp;
+            p++;
+            break;
+
+        case sw_exp:
+
+            while (p < last && *p >= '0' && *p <= '9')
+            {
+                p++;
+            }
+
+            if (p == last)
+            {
+                goto done;
+            }
+
+            state = sw_after_value;
+            break;
+        }
+    }
+
+done:
+
+    j->state = state;
+    j->offset += p - start;
+
+    return NGX_OK;
+
+failed:
+
+    j->state = state;
+    j->offset += p - start;
+
+    return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_http_ericsten_json_finish(ngx_http_ericsten_json_t *j)
+{
+    if (j->error)
+    {
+        return NGX_ERROR;
+    }
+
+    if (j->depth == 0)
+    {
+        switch (j->state)
+        {
+        case sw_after_value:
+        case sw_zero:
+        case sw_int:
+        case sw_frac:
+        case sw_exp:
+            return NGX_OK;
+
+        default:
+            break;
+        }
+    }
+
+    j->error = "unexpected end of document";
+
+    return NGX_ERROR;
+}
+
+//
+// String scanning kernels: return the first byte in [p, last) that is not
+// plain string contents, or last.
+//
+
+static u_char *
+ngx_http_ericsten_json_scan_scalar(u_char *p, u_char *last)
+{
+    while (p < last && ngx_http_ericsten_json_plain[*p])
+    {
+        p++;
+    }
+
+    return p;
+}
+
+#if (NGX_HTTP_ERICSTEN_X86)
+
+//
+// A signed compare with 0x20 catches both control characters (0x00-0x1f)
+// and non-ASCII bytes (0x80-0xff, negative when signed).
+//
+
+__attribute__((target("sse2")))
+static u_char *
+ngx_http_ericsten_json_scan_sse2(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, quote, bslash, space;
+
+    quote = _mm_set1_epi8('"');
+    bslash = _mm_set1_epi8('\\');
+    space = _mm_set1_epi8(0x20);
+
+    while (last - p >= 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                           _mm_cmpeq_epi8(v, bslash)),
+                                              _mm_cmplt_epi8(v, space)));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return ngx_http_ericsten_json_scan_scalar(p, last);
+}
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_ericsten_json_scan_avx2(u_char *p, u_char *last)
+{
+    unsigned  mask;
+    __m256i   v, quote, bslash, space;
+
+    quote = _mm256_set1_epi8('"');
+    bslash = _mm256_set1_epi8('\\');
+    space = _mm256_set1_epi8(0x20);
+
+    while (last - p >= 32)
+    {
+        v = _mm256_loadu_si256((const __m256i *) p);
+
+        mask = (unsigned) _mm256_movemask_epi8(
+                   _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                   _mm256_cmpeq_epi8(v, bslash)),
+                                   _mm256_cmpgt_epi8(space, v)));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_http_ericsten_json_scan_sse2(p, last);
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+
+Module Description:
+    Streaming JSON validator used by ngx_http_ericsten_module tasks.
+
+    The document may be fed in any number of pieces; the validator keeps
+    enough state to resume in the middle of a token or of a UTF-8 sequence.
+    It checks the RFC 8259 grammar and that strings are well-formed UTF-8,
+    and builds nothing.
+
+    Most of a typical payload is string contents.  Those are skipped 16 or
+    32 bytes at a time with SSE2/AVX2 compares (chosen at runtime by
+    ngx_http_ericsten_json_init_kernels()), stopping only at quotes,
+    backslashes, control characters and non-ASCII bytes.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_JSON_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_JSON_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#define NGX_HTTP_ERICSTEN_JSON_MAX_DEPTH  1024
+
+typedef struct
+{
+    ngx_uint_t   state;
+    ngx_uint_t   depth;
+    uint64_t     stack[NGX_HTTP_ERICSTEN_JSON_MAX_DEPTH / 64];     // 1 bit per level: object or array.
+
+    ngx_uint_t   literal;       // Index into the literal being matched (true, false, null).
+    u_char      *literal_text;
+    ngx_uint_t   hex;           // \u escape: hex digits still expected.
+    ngx_uint_t   utf8_need;     // UTF-8 continuation bytes still expected.
+    u_char       utf8_lo;       // Range of the next continuation byte.
+    u_char       utf8_hi;
+
+    off_t        offset;        // Bytes consumed so far; the error position on failure.
+    const char  *error;         // NULL while the document is valid so far.
+} ngx_http_ericsten_json_t;
+
+//
+// Pick the string scanning kernel for this CPU.  Call once, before any task
+// runs.
+//
+void ngx_http_ericsten_json_init_kernels(ngx_log_t *log);
+
+void ngx_http_ericsten_json_init(ngx_http_ericsten_json_t *j);
+ngx_int_t ngx_http_ericsten_json_feed(ngx_http_ericsten_json_t *j, u_char *p, size_t len);
+ngx_int_t ngx_http_ericsten_json_finish(ngx_http_ericsten_json_t *j);
+
+#endif /* _NGX_HTTP_ERICSTEN_JSON_H_INCLUDED_ */
@@ -0,0 +1,337 @@
+/*
+
+Module Description:
+    Memory-mapped lookup tables for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_lookup.h.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <sys/mman.h>
+
+#include "ngx_http_ericsten_digest.h"
+#include "ngx_http_ericsten_lookup.h"
+
+#define NGX_HTTP_ERICSTEN_LOOKUP_MAGIC      "ESLOOKUP"
+#define NGX_HTTP_ERICSTEN_LOOKUP_VERSION    1
+
+//
+// Average entries per bucket of the index.  Four hashes are half a cache
+// line.
+//
+#define NGX_HTTP_ERICSTEN_LOOKUP_BUCKET     4
+
+typedef struct
+{
+    u_char              magic[8];
+    uint32_t            version;
+    uint32_t            reserved;
+    uint64_t            count;
+    uint64_t            hashes;         // Offset of uint64_t[count].
+    uint64_t            records;        // Offset of uint64_t[count].
+    uint64_t            size;           // Of the whole file.
+    uint64_t            checksum;       // XXH64 of the file after the header.
+} ngx_http_ericsten_lookup_header_t;
+
+typedef struct
+{
+    ngx_http_ericsten_snapshot_t    snapshot;
+    u_char                         *addr;
+    size_t                          size;
+    uint64_t                        count;
+    uint64_t                       *hashes;
+    uint64_t                       *records;
+
+    //
+    // Index built when the table is loaded: the entries whose hashes start
+    // with the top bits b are hashes[buckets[b]] to hashes[buckets[b + 1]].
+    //
+
+    uint32_t                       *buckets;
+    ngx_uint_t                      shift;      // 64 - bits.
+} ngx_http_ericsten_lookup_t;
+
+static uint64_t ngx_http_ericsten_lookup_hash(u_char *p, size_t len);
+static ngx_int_t ngx_http_ericsten_lookup_validate(ngx_http_ericsten_lookup_t *lookup, const char **error);
+static ngx_int_t ngx_http_ericsten_lookup_index(ngx_http_ericsten_lookup_t *lookup, ngx_log_t *log);
+static void ngx_http_ericsten_lookup_free(ngx_http_ericsten_snapshot_t *snapshot);
+
+//
+// Thread Pool Task Function, called through ngx_http_ericsten_refresh_task().
+//
+
+ngx_http_ericsten_snapshot_t *
+ngx_http_ericsten_lookup_build(ngx_http_ericsten_refresh_t *refresh, ngx_fd_t fd, ngx_file_info_t *fi)
+{
+    u_char                             *addr;
+    size_t                              size;
+    ngx_http_ericsten_lookup_t         *lookup;
+    ngx_http_ericsten_lookup_header_t  *header;
+
+    size = (size_t) ngx_file_size(fi);
+
+    if (size < sizeof(ngx_http_ericsten_lookup_header_t))
+    {
+        refresh->error = "not a lookup table: file too small";
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        refresh->err = ngx_errno;
+        refresh->error = "mmap() failed";
+        return NULL;
+    }
+
+    lookup = ngx_alloc(sizeof(ngx_http_ericsten_lookup_t), refresh->log);
+    if (lookup == NULL)
+    {
+        refresh->error = "out of memory";
+        (void) munmap(addr, size);
+        return NULL;
+    }
+
+    header = (ngx_http_ericsten_lookup_header_t *) addr;
+
+    lookup->addr = addr;
+    lookup->size = size;
+    lookup->count = header->count;
+    lookup->hashes = (uint64_t *) (addr + header->hashes);
+    lookup->records = (uint64_t *) (addr + header->records);
+    lookup->buckets = NULL;
+
+    //
+    // Read ahead while we walk the whole table.
+    //
+
+    (void) madvise(addr, size, MADV_WILLNEED);
+
+    if (ngx_http_ericsten_lookup_validate(lookup, &refresh->error) != NGX_OK)
+    {
+        ngx_http_ericsten_lookup_free(&lookup->snapshot);
+        return NULL;
+    }
+
+    if (ngx_http_ericsten_lookup_index(lookup, refresh->log) != NGX_OK)
+    {
+        refresh->error = "out of memory";
+        ngx_http_ericsten_lookup_free(&lookup->snapshot);
+        return NULL;
+    }
+
+    lookup->snapshot.data = lookup;
+    lookup->snapshot.free = ngx_http_ericsten_lookup_free;
+
+    return &lookup->snapshot;
+}
+
+ngx_int_t
+ngx_http_ericsten_lookup_find(ngx_http_ericsten_snapshot_t *snapshot, u_char *key, size_t len, ngx_str_t *value)
+{
+    u_char                      *p;
+    uint32_t                     klen, vlen;
+    uint64_t                     h;
+    ngx_uint_t                   i, b;
+    ngx_http_ericsten_lookup_t  *lookup = snapshot->data;
+
+    h = ngx_http_ericsten_lookup_hash(key, len);
+    b = h >> lookup->shift;
+
+    for (i = lookup->buckets[b]; i < lookup->buckets[b + 1]; i++)
+    {
+        if (lookup->hashes[i] < h)
+        {
+            continue;
+        }
+
+        if (lookup->hashes[i] > h)
+        {
+            break;
+        }
+
+        p = lookup->addr + lookup->records[i];
+
+        ngx_memcpy(&klen, p, sizeof(uint32_t));
+        ngx_memcpy(&vlen, p + sizeof(uint32_t), sizeof(uint32_t));
+
+        p += 2 * sizeof(uint32_t);
+
+        if (klen == len && ngx_memcmp(p, key, len) == 0)
+        {
+            value->data = p + klen;
+            value->len = vlen;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+static uint64_t
+ngx_http_ericsten_lookup_hash(u_char *p, size_t len)
+{
+    ngx_http_ericsten_xxh64_t  xxh64;
+
+    ngx_http_ericsten_xxh64_init(&xxh64, 0);
+    ngx_http_ericsten_xxh64_update(&xxh64, p, len);
+
+    return ngx_http_ericsten_xxh64_final(&xxh64);
+}
+
+//
+// Check everything a lookup relies on, so that a corrupt or truncated file
+// is rejected here rather than read out of bounds later.
+//
+
+static ngx_int_t
+ngx_http_ericsten_lookup_validate(ngx_http_ericsten_lookup_t *lookup, const char **error)
+{
+    u_char                             *p;
+    uint32_t                            klen, vlen;
+    uint64_t                            i, off, count;
+    ngx_http_ericsten_xxh64_t           xxh64;
+    ngx_http_ericsten_lookup_header_t  *header;
+
+    header = (ngx_http_ericsten_lookup_header_t *) lookup->addr;
+    count = header->count;
+
+    if (ngx_memcmp(header->magic, NGX_HTTP_ERICSTEN_LOOKUP_MAGIC, 8) != 0)
+    {
+        *error = "not a lookup table: bad magic";
+        return NGX_ERROR;
+    }
+
+    if (header->version != NGX_HTTP_ERICSTEN_LOOKUP_VERSION)
+    {
+        *error = "unsupported lookup table version";
+        return NGX_ERROR;
+    }
+
+    if (header->size != lookup->size)
+    {
+        *error = "lookup table size mismatch, truncated or still being written";
+        return NGX_ERROR;
+    }
+
+    if (count > lookup->size / (2 * sizeof(uint64_t)) || count >= 0xffffffff
+        || header->hashes % sizeof(uint64_t) || header->records % sizeof(uint64_t)
+        || header->hashes < sizeof(ngx_http_ericsten_lookup_header_t)
+        || header->records < sizeof(ngx_http_ericsten_lookup_header_t)
+        || header->hashes > lookup->size - count * sizeof(uint64_t)
+        || header->records > lookup->size - count * sizeof(uint64_t))
+    {
+        *error = "lookup table arrays out of bounds";
+        return NGX_ERROR;
+    }
+
+    ngx_http_ericsten_xxh64_init(&xxh64, 0);
+    ngx_http_ericsten_xxh64_update(&xxh64, lookup->addr + sizeof(ngx_http_ericsten_lookup_header_t),
+                                   lookup->size - sizeof(ngx_http_ericsten_lookup_header_t));
+
+    if (ngx_http_ericsten_xxh64_final(&xxh64) != header->checksum)
+    {
+        *error = "lookup table checksum mismatch";
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (i > 0 && lookup->hashes[i] < lookup->hashes[i - 1])
+        {
+            *error = "lookup table hashes not sorted";
+            return NGX_ERROR;
+        }
+
+        off = lookup->records[i];
+
+        if (off > lookup->size - 2 * sizeof(uint32_t))
+        {
+            *error = "lookup table record out of bounds";
+            return NGX_ERROR;
+        }
+
+        p = lookup->addr + off;
+
+        ngx_memcpy(&klen, p, sizeof(uint32_t));
+        ngx_memcpy(&vlen, p + sizeof(uint32_t), sizeof(uint32_t));
+
+        if ((uint64_t) klen + vlen > lookup->size - 2 * sizeof(uint32_t) - off)
+        {
+            *error = "lookup table record out of bounds";
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_ericsten_lookup_hash(p + 2 * sizeof(uint32_t), klen) != lookup->hashes[i])
+        {
+            *error = "lookup table record does not match its hash";
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+//
+// Bucket the sorted hashes by their top bits.  They are uniform, so a
+// bucket holds a few entries, and a lookup costs an index entry, the cache
+// line of its hashes, one record offset and the record.
+//
+
+static ngx_int_t
+ngx_http_ericsten_lookup_index(ngx_http_ericsten_lookup_t *lookup, ngx_log_t *log)
+{
+    uint64_t    i;
+    ngx_uint_t  bits, b, next;
+
+    for (bits = 1;
+         bits < 32 && ((uint64_t) 1 << bits) * NGX_HTTP_ERICSTEN_LOOKUP_BUCKET < lookup->count;
+         bits++)
+    {
+        /* void */
+    }
+
+    lookup->buckets = ngx_alloc((((size_t) 1 << bits) + 1) * sizeof(uint32_t), log);
+    if (lookup->buckets == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    lookup->shift = 64 - bits;
+    next = 0;
+
+    for (i = 0; i < lookup->count; i++)
+    {
+        b = lookup->hashes[i] >> lookup->shift;
+
+        while (next <= b)
+        {
+            lookup->buckets[next++] = (uint32_t) i;
+        }
+    }
+
+    while (next <= ((ngx_uint_t) 1 << bits))
+    {
+        lookup->buckets[next++] = (uint32_t) lookup->count;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_lookup_free(ngx_http_ericsten_snapshot_t *snapshot)
+{
+    ngx_http_ericsten_lookup_t  *lookup = (ngx_http_ericsten_lookup_t *) snapshot;
+
+    (void) munmap(lookup->addr, lookup->size);
+
+    if (lookup->buckets)
+    {
+        ngx_free(lookup->buckets);
+    }
+
+    ngx_free(lookup);
+}
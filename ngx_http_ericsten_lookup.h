@@ -0,0 +1,54 @@
+/*
+
+Module Description:
+    Memory-mapped key-value lookup tables for ngx_http_ericsten_module.
+
+    A table is a file in a compact read-only format, built offline by
+    contrib/ericsten_lookup_build.py, and mapped into memory as an
+    ngx_http_ericsten_refresh snapshot.  Looking a key up touches a few
+    cache lines and no system call, so it is done on the event loop.
+
+    File format, little endian:
+
+        header      magic "ESLOOKUP", version 1, entry count, offsets of
+                    the two arrays below, file size, and the XXH64 of
+                    everything after the header
+        hashes      uint64_t[count]: XXH64 (seed 0) of each key, ascending
+        records     uint64_t[count]: offset of the record of each hash
+        data        records: uint32_t key length, uint32_t value length,
+                    key, value
+
+    The hashes are uniformly distributed.  When a table is loaded, the hash
+    array is indexed by the top bits of the hashes, a few entries per
+    bucket, so a lookup reads one index entry and one cache line of hashes,
+    and only then follows one record offset to compare the key itself.
+
+    A new table is validated in full on the thread pool before it is
+    swapped in, which also brings it into the page cache.  Replace the file
+    by renaming a new one over it: a file changed in place would change
+    the mapped table under the readers.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_LOOKUP_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_LOOKUP_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_ericsten_refresh.h"
+
+//
+// ngx_http_ericsten_refresh_build_pt for lookup tables.
+//
+ngx_http_ericsten_snapshot_t *ngx_http_ericsten_lookup_build(ngx_http_ericsten_refresh_t *refresh, ngx_fd_t fd,
+    ngx_file_info_t *fi);
+
+//
+// Find key in the table.  Returns NGX_OK and points value into the table,
+// or NGX_DECLINED.
+//
+ngx_int_t ngx_http_ericsten_lookup_find(ngx_http_ericsten_snapshot_t *snapshot, u_char *key, size_t len,
+    ngx_str_t *value);
+
+#endif /* _NGX_HTTP_ERICSTEN_LOOKUP_H_INCLUDED_ */
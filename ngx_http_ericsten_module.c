@@ -22,27 +22,231 @@ Module Description:
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include <zlib.h>
+
+#include "ngx_http_ericsten_arena.h"
+#include "ngx_http_ericsten_batch.h"
+#include "ngx_http_ericsten_bloom.h"
+#include "ngx_http_ericsten_coro.h"
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_digest.h"
+#include "ngx_http_ericsten_helper.h"
+#include "ngx_http_ericsten_json.h"
+#include "ngx_http_ericsten_lookup.h"
+#include "ngx_http_ericsten_queue.h"
+#include "ngx_http_ericsten_refresh.h"
+#include "ngx_http_ericsten_shm.h"
+#include "ngx_http_ericsten_sidecar.h"
+#include "ngx_http_ericsten_store.h"
+#include "ngx_http_ericsten_uring.h"
+#include "ngx_http_ericsten_warmup.h"
+
 #ifndef NGX_THREADS
 #error ngx_http_ericsten_module.c requires --with-threads
 #endif /* NGX_THREADS */
 
+typedef struct ngx_http_ericsten_ctx_s ngx_http_ericsten_ctx_t;
+typedef struct ngx_http_ericsten_loc_conf_s ngx_http_ericsten_loc_conf_t;
+typedef struct ngx_http_ericsten_filter_entry_s ngx_http_ericsten_filter_entry_t;
+typedef struct ngx_http_ericsten_file_s ngx_http_ericsten_file_t;
+
 static ngx_int_t ngx_http_ericsten_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_ericsten_get_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_ericsten_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_ericsten_ref_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_ericsten_lookup_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data);
+static ngx_int_t ngx_http_ericsten_bloom_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data);
 static ngx_int_t ngx_http_ericsten_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_ericsten_dostuff_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static ngx_http_ericsten_ctx_t *ngx_http_ericsten_ctx_create(ngx_http_request_t *r);
+static void ngx_http_ericsten_ctx_free(void *data);
+static void *ngx_http_ericsten_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_ericsten_init_main_conf(ngx_conf_t *cf, void *conf);
+static void *ngx_http_ericsten_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_ericsten_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 
 static void ngx_http_ericsten_dostuff(void *data, ngx_log_t *log);
+static ngx_uint_t ngx_http_ericsten_sleep(ngx_uint_t value, ngx_log_t *log);
+static ngx_uint_t ngx_http_ericsten_sleep_msec(ngx_uint_t value);
 static void ngx_http_ericsten_dostuff_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_dostuff_finish(ngx_http_ericsten_ctx_t *ctx);
+
+static char *ngx_http_ericsten_content(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ericsten_content_handler(ngx_http_request_t *r);
+static void ngx_http_ericsten_content_head(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_content_generate(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_content_fill(uint64_t *x, u_char *p, u_char *end);
+static void ngx_http_ericsten_content_completion_handler(ngx_event_t *ev);
+
+static char *ngx_http_ericsten_stream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ericsten_stream_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_ericsten_stream_init(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, size_t size);
+static ngx_int_t ngx_http_ericsten_stream_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx,
+    void (*handler)(void *data, ngx_log_t *log));
+static ngx_buf_t *ngx_http_ericsten_stream_get(ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_stream_put(ngx_http_ericsten_ctx_t *ctx, ngx_buf_t *b, ngx_log_t *log);
+static void ngx_http_ericsten_stream_produce(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_stream_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_stream_process(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_stream_write_handler(ngx_http_request_t *r);
+static void ngx_http_ericsten_stream_run_ready(void);
+
+static char *ngx_http_ericsten_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ericsten_file_handler(ngx_http_request_t *r);
+static void ngx_http_ericsten_file_open(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_file_open_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_file_read(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_file_check(ngx_http_ericsten_file_t *file, ngx_uint_t residency, ngx_log_t *log);
+static void ngx_http_ericsten_file_residency(ngx_http_ericsten_file_t *file, ngx_log_t *log);
+static void ngx_http_ericsten_file_respond(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_file_uring_open_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_ericsten_file_uring_start(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_file_uring_process(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_file_uring_read_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_file_uring_write_handler(ngx_http_request_t *r);
+static void ngx_http_ericsten_file_uring_cleanup(void *data);
+
+static ngx_int_t ngx_http_ericsten_init_module(ngx_cycle_t *cycle);
+static char *ngx_http_ericsten_refresh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ericsten_bloom(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ericsten_result_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_ericsten_warmup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_ericsten_warmup_compute(ngx_str_t *key, u_char *value, size_t *len, ngx_log_t *log);
+static char *ngx_http_ericsten_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_ericsten_queue_run(u_char *data, size_t *len, ngx_log_t *log);
+static void ngx_http_ericsten_queue_done(void *data, u_char *result, size_t len);
+static char *ngx_http_ericsten_sidecar(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_ericsten_sidecar_done(void *data, ngx_int_t rc, u_char *body, size_t len);
+static char *ngx_http_ericsten_helpers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_ericsten_helper_done(void *data, ngx_int_t rc, u_char *result, size_t len);
+static char *ngx_http_ericsten_coroutines(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_ericsten_dostuff_coro(ngx_http_ericsten_coro_t *co, void *data);
+static void ngx_http_ericsten_dostuff_coro_done(void *data);
+static char *ngx_http_ericsten_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_ericsten_dostuff_batch(void **items, ngx_uint_t n, ngx_log_t *log);
+static void ngx_http_ericsten_dostuff_batch_done(void *item, ngx_int_t rc);
+static ngx_http_ericsten_snapshot_t *ngx_http_ericsten_kv_build(ngx_http_ericsten_refresh_t *refresh, ngx_fd_t fd,
+    ngx_file_info_t *fi);
+static void ngx_http_ericsten_kv_free(ngx_http_ericsten_snapshot_t *snapshot);
+static int ngx_libc_cdecl ngx_http_ericsten_kv_cmp(const void *one, const void *two);
+static ngx_int_t ngx_http_ericsten_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_ericsten_doorbell_init(ngx_cycle_t *cycle);
+static void ngx_http_ericsten_doorbell_handler(ngx_event_t *ev);
+
+static ngx_int_t ngx_http_ericsten_body_start(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_body_post_read(ngx_http_request_t *r);
+static void ngx_http_ericsten_body_read_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_ericsten_body_read(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static ngx_int_t ngx_http_ericsten_body_next(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static ngx_int_t ngx_http_ericsten_body_last_buf(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static void ngx_http_ericsten_body_chunk(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_body_chunk_completion_handler(ngx_event_t *ev);
+
+static ngx_buf_t *ngx_http_ericsten_buf_get(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, size_t size);
+static void ngx_http_ericsten_buf_put(ngx_buf_t *b);
+static void ngx_http_ericsten_buf_cleanup(void *data);
+
+static ngx_int_t ngx_http_ericsten_header_filter(ngx_http_request_t *r);
+static ngx_int_t ngx_http_ericsten_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_int_t ngx_http_ericsten_filter_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx);
+static ngx_int_t ngx_http_ericsten_filter_flush(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_uint_t always);
+static void ngx_http_ericsten_filter_transform(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_filter_completion_handler(ngx_event_t *ev);
+
+static ngx_uint_t ngx_http_ericsten_gzip_test(ngx_http_request_t *r, ngx_http_ericsten_loc_conf_t *elcf);
+static ngx_int_t ngx_http_ericsten_gzip_body_filter(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_ericsten_gzip_queue_block(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_uint_t last);
+static ngx_int_t ngx_http_ericsten_gzip_prepare(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_http_ericsten_filter_entry_t *entry);
+static ngx_int_t ngx_http_ericsten_gzip_account(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_http_ericsten_filter_entry_t *entry);
+static void ngx_http_ericsten_gzip_deflate(void *data, ngx_log_t *log);
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
 static ngx_str_t ngx_ericsten_thread_pool_name = ngx_string("ericsten");
 
 #define TRUE 1
 #define FALSE 0
 
+//
+// The task state is published with release stores and read with acquire
+// loads, so whatever a task wrote before moving to a state is visible to the
+// side that sees the state.
+//
+
+#define ngx_http_ericsten_set_state(ctx, s)  __atomic_store_n(&(ctx)->state, (s), __ATOMIC_RELEASE)
+#define ngx_http_ericsten_get_state(ctx)     __atomic_load_n(&(ctx)->state, __ATOMIC_ACQUIRE)
+
 #define ngx_http_null_variable  { ngx_null_string, NULL, NULL, 0, 0, 0 }
 
 #define MAX_VARIABLE_SIZE 64
 
+//
+// Connection-level "buffered" bit, set while the body filter holds response
+// buffers that are queued to or being transformed on the thread pool.
+//
+
+#define NGX_HTTP_ERICSTEN_BUFFERED 0x80
+
+//
+// Buffer pool: size classes go 4k, 6k, 8k, 12k, ... 1m, 1.5m.  Larger
+// requests get a block of their own, freed when returned.
+//
+
+#define NGX_HTTP_ERICSTEN_BUF_ALIGN     64
+#define NGX_HTTP_ERICSTEN_BUF_CLASSES   18
+#define NGX_HTTP_ERICSTEN_BUF_IDLE_MAX  (8 * 1024 * 1024)   // Per worker.
+
+//
+// Request contexts are carved from slabs of this size, aligned to it.
+//
+
+#define NGX_HTTP_ERICSTEN_SLAB_SIZE     (64 * 1024)
+
+//
+// Content handler: response body buffer size, and room for the response
+// headers a task can set.
+//
+
+#define NGX_HTTP_ERICSTEN_CONTENT_BUF_SIZE  (256 * 1024)
+#define NGX_HTTP_ERICSTEN_RESPONSE_HEADERS  4
+
+//
+// Streaming content: ring slots (a power of two), and buffers cycling
+// between the task and the event loop.  There are fewer buffers than slots,
+// so a ring can never be full.
+//
+
+#define NGX_HTTP_ERICSTEN_RING_SIZE      8
+#define NGX_HTTP_ERICSTEN_STREAM_BUFS    4
+#define NGX_HTTP_ERICSTEN_STREAM_CHUNK_MAX  (1024 * 1024)
+
+//
+// File task: read size per buffer, and the alignment O_DIRECT needs for
+// buffers, offsets and sizes.
+//
+
+#define NGX_HTTP_ERICSTEN_FILE_BUF_SIZE  (128 * 1024)
+#define NGX_HTTP_ERICSTEN_FILE_ALIGN     4096
+
+//
+// How ericsten_file does its I/O (ericsten_file_io).
+//
+
+#define NGX_HTTP_ERICSTEN_FILE_IO_THREADS  0
+#define NGX_HTTP_ERICSTEN_FILE_IO_URING    1
+
+//
+// Digests computed over the request body (ericsten_digest).
+//
+
+#define NGX_HTTP_ERICSTEN_DIGEST_OFF     0x0002
+#define NGX_HTTP_ERICSTEN_DIGEST_CRC32C  0x0004
+#define NGX_HTTP_ERICSTEN_DIGEST_XXH64   0x0008
+#define NGX_HTTP_ERICSTEN_DIGEST_SHA256  0x0010
+
 typedef enum ERICSTEN_TASK_STATE_tag
 {
     ES_TASK_INIT = 0,
@@ -59,25 +263,593 @@ char * ngx_ericsten_states[] =
 };
 
 //
-// Per-request context.  This is effectively the "out-params" from the thread pool task.
+// Main configuration: the shared zones and how they are mapped.
 //
 typedef struct
 {
-    ERICSTEN_STATE      state;    
-    int                 msSleep;        // Time the task slept while doing background work, in milliseconds.
+    ngx_array_t         zones;          // ngx_http_ericsten_shm_t *: shared zones used by the configuration.
+    ngx_flag_t          zone_huge_pages;    // Back the zones with huge pages.
+    ngx_flag_t          zone_prefault;      // Fault the zones in when they are mapped.
+    ngx_http_ericsten_refresh_t  *snapshot; // ericsten_snapshot: reference data for $ericsten_ref_*.
+    ngx_http_ericsten_refresh_t  *lookup;   // ericsten_lookup: mapped table for $ericsten_lookup.
+    ngx_http_ericsten_bloom_t    *bloom;    // ericsten_bloom: keys the sleep task may find.
+    ngx_http_ericsten_store_t    *store;    // ericsten_result_cache: sleep task results kept across restarts.
+    ngx_http_ericsten_warmup_t   *warmup;   // ericsten_warmup: keys computed into the result cache at worker start.
+    ngx_http_ericsten_queue_t    *queue;    // ericsten_queue: sleep tasks shared between the workers' pools.
+    ngx_http_ericsten_sidecar_t  *sidecar;  // ericsten_sidecar: sleep tasks run out of process.
+    ngx_http_ericsten_helper_t   *helper;   // ericsten_helpers: sleep tasks run on the worker's helper processes.
+    ngx_http_ericsten_coro_pool_t  *coro;   // ericsten_coroutines: sleep tasks run as coroutines on the pool.
+    ngx_http_ericsten_batcher_t  *batch;    // ericsten_batch: sleep tasks run on the pool in batches.
+    ngx_uint_t                    doorbell; // Some location streams task output: workers need the doorbell.
+} ngx_http_ericsten_main_conf_t;
+
+//
+// ericsten_snapshot: the entries of the file, sorted by key.  Keys and values
+// point into a copy of the file's text that follows the entries.
+//
+typedef struct
+{
+    ngx_uint_t          nelts;
+    ngx_keyval_t       *elts;
+} ngx_http_ericsten_kv_t;
+
+//
+// Per-location configuration.
+//
+struct ngx_http_ericsten_loc_conf_s
+{
+    ngx_flag_t          request_body;   // Stream the request body through the thread pool before resuming.
+    ngx_flag_t          filter;         // Transform response body buffers on the thread pool.
+    ngx_uint_t          filter_tasks;   // Max response buffers in flight per request.
+    ngx_flag_t          gzip;           // Compress response bodies on the thread pool.
+    ngx_int_t           gzip_level;     // zlib compression level.
+    size_t              gzip_block_size;    // Uncompressed bytes per independently compressed block.
+    ssize_t             gzip_min_length;    // Responses with a shorter Content-Length are left alone.
+    ngx_hash_t          gzip_types;     // MIME types of the responses to compress.
+    ngx_array_t        *gzip_types_keys;
+    ngx_uint_t          digest;         // NGX_HTTP_ERICSTEN_DIGEST_* computed over the request body.
+    ngx_flag_t          json;           // Reject request bodies that are not valid JSON.
+    ngx_flag_t          content;        // ericsten_content: the response is generated by a task.
+    off_t               content_max_size;   // Largest body a content task may be asked for.
+    ngx_flag_t          stream;         // ericsten_stream: the response is streamed by a task.
+    ngx_flag_t          file;           // ericsten_file: files are read on the thread pool.
+    off_t               file_directio;  // Cold files at least this large are read with O_DIRECT; 0 is off.
+    ngx_flag_t          file_readahead; // Give the kernel readahead hints.
+    ngx_uint_t          file_io;        // NGX_HTTP_ERICSTEN_FILE_IO_*.
+    ngx_http_complex_value_t  *lookup_key;  // ericsten_lookup_key: answered from ericsten_lookup.
+    ngx_http_complex_value_t  *bloom_key;   // ericsten_bloom_key: checked against ericsten_bloom.
+    ngx_http_complex_value_t  *result_cache_key;    // ericsten_result_cache_key: sleep task results are stored under it.
+};
+
+//
+// One io_uring read of ericsten_file into one of the streaming buffers.
+//
+typedef enum
+{
+    ES_FILE_READ_FREE = 0,
+    ES_FILE_READ_READING,               // Submitted; the kernel owns the buffer.
+    ES_FILE_READ_READY,                 // Filled, waiting for its turn to be sent.
+    ES_FILE_READ_SENDING                // Passed to the output filters.
+} ERICSTEN_FILE_READ_STATE;
+
+typedef struct
+{
+    ngx_http_ericsten_uring_op_t   op;
+    ngx_http_ericsten_ctx_t       *ctx;
+    ngx_buf_t                     *buf;
+    off_t                          offset;      // File offset of buf->pos.
+    ERICSTEN_FILE_READ_STATE       state;
+} ngx_http_ericsten_file_read_t;
+
+//
+// File served by ericsten_file.  Filled in by the open task, or by the open
+// completion with io_uring.
+//
+struct ngx_http_ericsten_file_s
+{
+    u_char             *path;           // NUL-terminated.
+    ngx_fd_t            fd;
+    off_t               size;
+    time_t              mtime;
+    off_t               offset;         // Next offset to read.
+    ngx_err_t           err;            // open() or fstat() error.
+    off_t               directio;
+    unsigned            readahead:1;
+    unsigned            regular:1;
+    unsigned            resident:1;     // Entirely in the page cache.
+    unsigned            direct:1;       // Switched to O_DIRECT.
+    unsigned            uring:1;        // Opened and read through the worker's io_uring.
+
+    //
+    // io_uring reads.  The buffers are used in turn, so reads are submitted
+    // in file order; they may complete in any order but are sent in file
+    // order.
+    //
+
+    ngx_http_ericsten_uring_op_t   open_op;
+    ngx_http_ericsten_file_read_t  reads[NGX_HTTP_ERICSTEN_STREAM_BUFS];
+    ngx_uint_t          read_next;      // Next read to submit.
+    ngx_uint_t          send_next;      // Next read to send.
+    ngx_uint_t          inflight;       // Operations the kernel has not completed.
+    off_t               sent;           // Bytes passed to the output filters.
+};
+
+//
+// Single-producer single-consumer ring of buffers.  Each index is written by
+// one side only; the release store on it publishes the slot.  The slots and
+// tail belong to the producer, the head to the consumer, each on its own
+// cache line.
+//
+typedef struct
+{
+    ngx_buf_t          *slot[NGX_HTTP_ERICSTEN_RING_SIZE] NGX_HTTP_ERICSTEN_CACHE_ALIGNED;
+    ngx_uint_t          tail NGX_HTTP_ERICSTEN_CACHE_ALIGNED;  // Next slot to write; written by the producer.
+    ngx_uint_t          head NGX_HTTP_ERICSTEN_CACHE_ALIGNED;  // Next slot to read; written by the consumer.
+} ngx_http_ericsten_ring_t;
+
+//
+// Streaming content: the rings between the task and the event loop.  Each
+// ring is split between the two sides by itself.
+//
+typedef struct
+{
+    ngx_http_ericsten_ring_t   full;
+    ngx_http_ericsten_ring_t   free;
+} ngx_http_ericsten_stream_t;
+
+//
+// Response headers built by a content task.  The task cannot touch the
+// request, so it fills this in and the completion handler applies it.
+// Header names are static strings; header values are allocated by the task
+// from its thread's arena, under lease, and copied into the request pool by
+// the completion handler.
+//
+typedef struct
+{
+    ngx_uint_t          status;
+    ngx_str_t           content_type;
+    off_t               content_length;     // -1 if not known.
+    ngx_keyval_t        headers[NGX_HTTP_ERICSTEN_RESPONSE_HEADERS];
+    ngx_uint_t          nheaders;
+    ngx_http_ericsten_arena_lease_t  lease;
+} ngx_http_ericsten_response_t;
+
+//
+// Request body digests (ericsten_digest).  Updated by the chunk tasks, in
+// order; finalized on the event loop once the last chunk is done.
+//
+typedef struct
+{
+    ngx_uint_t                  mask;       // NGX_HTTP_ERICSTEN_DIGEST_* being computed.
+    uint32_t                    crc32c;
+    ngx_http_ericsten_xxh64_t   xxh64;
+    ngx_http_ericsten_sha256_t  sha256;
+    uint64_t                    xxh64_result;
+    u_char                      sha256_result[NGX_HTTP_ERICSTEN_SHA256_LEN];
+    unsigned                    final:1;
+} ngx_http_ericsten_digest_t;
+
+//
+// Response body filter (ericsten_filter on).  Every buffer passed to the
+// filter gets an entry, kept in arrival order.  Up to filter_tasks entries
+// are transformed on the pool at once; finished entries are passed to the
+// next filter from the head of the queue only, so the output order is
+// preserved.
+//
+// Parallel gzip (ericsten_gzip on) is built on the same queue.  The body is
+// cut into blocks which are deflated independently and concatenated; each
+// block is primed with the tail of the previous one as its dictionary.  The
+// CRC32 of the whole body is combined from the per-block CRCs as blocks are
+// passed on in order.
+//
+typedef struct
+{
+    ngx_queue_t         entries;            // Entries in arrival order.
+    ngx_queue_t         free;               // Recycled entries.
+    ngx_thread_task_t  *tasks;              // Idle tasks, linked through task->next.
+    ngx_uint_t          inflight;           // Entries currently on the pool.
+    ngx_chain_t        *out_free;           // Our output buffers handed back by the next filters.
+    ngx_chain_t        *out_busy;
+
+    ngx_chain_t        *gzip_in;            // Buffers from the previous filter not yet copied into blocks.
+    ngx_buf_t          *gzip_block;         // Block being filled.
+    ngx_buf_t          *gzip_prev;          // Previous block, the dictionary of the next one.
+    ngx_uint_t          gzip_pending;       // Blocks queued but not yet compressed.
+    uint32_t            gzip_crc32;         // CRC32 of the uncompressed data passed on so far.
+    uint32_t            gzip_size;          // Uncompressed size passed on so far, modulo 2^32.
+    unsigned            gzip_on:1;
+    unsigned            gzip_started:1;     // The gzip header has been queued.
+    unsigned            gzip_last:1;        // The last block has been queued.
+} ngx_http_ericsten_filter_t;
+
+//
+// Per-request context.  This is effectively the "out-params" from the thread pool task.
+//
+// The fields are grouped by the side that writes them: the event loop's
+// first, then those written by tasks while they run, starting on a cache
+// line of their own.  The context is allocated cache line aligned by
+// ngx_http_ericsten_ctx_create(), and its size is a whole number of lines,
+// so no other allocation shares its lines either.
+//
+struct ngx_http_ericsten_ctx_s
+{
     ngx_http_request_t *r;              // Http Request pointer, for the thread completion.
-} ngx_http_ericsten_ctx_t;
+
+    //
+    // Request body streaming (ericsten_request_body on).  Chunks are copied
+    // out of the request body buffers as they arrive, so that the next read
+    // can proceed while the pool thread works on the previous chunk.  Chunks
+    // are processed one at a time, in arrival order.
+    //
+
+    ngx_chain_t        *body_pending;       // Chunks read from the client, waiting for the pool.
+    ngx_chain_t       **body_pending_last;
+    ngx_chain_t        *body_done;          // Chunks already processed, in arrival order.
+    ngx_chain_t       **body_done_last;
+    ngx_int_t           body_rc;            // Deferred error while a chunk task is in flight.
+    ngx_http_ericsten_digest_t  *digest;    // NULL unless ericsten_digest is set.
+    ngx_http_ericsten_json_t    *json;      // NULL unless ericsten_json_validate is on.
+
+    ngx_http_ericsten_response_t  *response;    // ericsten_content: filled by the content task.
+
+    //
+    // Streaming content (ericsten_stream).  The task takes empty buffers
+    // from stream->free, fills them and hands them over in stream->full; the
+    // event loop is the other end of both rings.  When it runs out of empty
+    // buffers, because the client reads slower than the task produces, the
+    // task returns, keeping its place, and is posted again once the output
+    // filters give buffers back.
+    //
+
+    ngx_http_ericsten_stream_t  *stream;    // Allocated by ngx_http_ericsten_stream_init().
+    ngx_chain_t               *stream_out_free; // Buffers handed back by the output filters.
+    ngx_chain_t               *stream_out_busy;
+    ngx_int_t                  stream_rc;       // Final status once stopped.
+    ngx_uint_t                 stream_abort;    // Atomic: the task should stop.
+    unsigned                   stream_header_sent:1;
+    unsigned                   stream_last_sent:1;
+    unsigned                   stream_done:1;   // The task has completed.
+    unsigned                   stream_stopped:1;    // Given up on; finalize with stream_rc once done.
+    unsigned                   stream_parked:1;     // The task returned for want of a buffer.
+
+    ngx_http_ericsten_file_t  *file;        // ericsten_file.
+    unsigned            body_last:1;        // The last chunk has been read from the client.
+    unsigned            body_last_buf:1;    // The request body filters marked its end with last_buf.
+    unsigned            body_busy:1;        // A chunk task is in flight.
+    unsigned            task_failed:1;      // The sleep task failed out of process.
+
+    ngx_http_ericsten_filter_t  *filter;    // NULL unless the response is filtered.
+
+    //
+    // Buffer pool blocks handed out to this request and not yet returned.
+    //
+
+    ngx_queue_t         bufs;
+    unsigned            bufs_cleanup:1;     // The pool cleanup returning them is registered.
+
+    //
+    // The request's thread pool task and its in-params, filled in by the
+    // event loop before posting it.  A request has one such task at a time
+    // (the sleep task, a chunk of the request body, the content, stream or
+    // file task), so they all share this one instead of allocating a task
+    // and a task context each; task.ctx is this context.  Filter tasks,
+    // several per request, are allocated separately.
+    //
+
+    ngx_thread_task_t   task;
+    union
+    {
+        int             random_value;       // Sleep task.
+        ngx_chain_t    *chunk;              // Body chunk being processed; moved to body_done on completion.
+
+        struct
+        {
+            off_t       size;               // Body bytes to generate.
+            off_t       done;               // Body bytes generated, kept by the task across its runs.
+            uint64_t    seed;
+            uint64_t    x;                  // Generator state after the bytes done.
+            ngx_uint_t  digest;             // The header task computes the X-Ericsten-Crc32c header.
+        } content;
+
+        struct
+        {
+            ngx_uint_t  steps;              // 100 ms steps, one buffer each.
+            ngx_uint_t  step;               // Steps done, kept by the task across its runs.
+            size_t      chunk;              // Padding bytes added to each step's line.
+        } stream;
+    } task_args;
+
+    //
+    // Written by tasks.  The event loop only reads these once the task is
+    // done, except for stream_ready, which it clears.
+    //
+
+    ERICSTEN_STATE      state NGX_HTTP_ERICSTEN_CACHE_ALIGNED;     // Atomic; see ngx_http_ericsten_set_state().
+    int                 msSleep;        // Time the task slept while doing background work, in milliseconds.
+    off_t               body_bytes;         // Bytes processed so far.
+    uint32_t            body_crc32;         // Running CRC32 of the processed bytes.
+    ngx_uint_t          stream_failed;      // Atomic: the body is incomplete.
+    ngx_uint_t          stream_starved;     // The task returned for want of a buffer.
+    ngx_uint_t          stream_ready;       // Atomic: on the ready list.
+    ngx_http_ericsten_ctx_t   *stream_next;     // Link in the worker's ready list.
+};
+
+//
+// Response body filter entry: one buffer from the previous filter, or one
+// block in gzip mode.
+//
+struct ngx_http_ericsten_filter_entry_s
+{
+    ngx_queue_t          queue;
+    ngx_buf_t           *in;            // Buffer as received from the previous filter.
+    ngx_buf_t           *out;           // Buffer passed to the next filter; same as in when transformed in place.
+    ngx_buf_t           *dict;          // gzip: previous block, for the dictionary.
+    size_t               size;          // gzip: uncompressed block size.
+    uint32_t             crc32;         // gzip: CRC32 of the block, set by the task.
+    unsigned             posted:1;      // Handed to the thread pool.
+    unsigned             done:1;        // Ready to be passed to the next filter.
+    unsigned             block:1;       // gzip: a block to compress (not a header, trailer or flush).
+    unsigned             last:1;        // gzip: final block of the stream.
+    unsigned             failed:1;      // gzip: deflate() failed.
+};
 
 //
-// Per-task context.  This is effectively the "in-params" to the thread pool task.
+// Per-buffer task context for the response body filter.
 //
 typedef struct
 {
-    ngx_http_ericsten_ctx_t *ericsten_ctx;
-    int                      random_value;
-} ngx_http_ericsten_task_ctx_t;
+    ngx_http_ericsten_ctx_t           *ericsten_ctx;
+    ngx_http_ericsten_filter_entry_t  *entry;
+    ngx_thread_task_t                 *task;
+    int                                gzip_level;  // Copied from the location, which the task must not look up.
+} ngx_http_ericsten_filter_task_ctx_t;
+
+static ngx_conf_bitmask_t  ngx_http_ericsten_digest_masks[] = {
+    { ngx_string("off"), NGX_HTTP_ERICSTEN_DIGEST_OFF },
+    { ngx_string("crc32c"), NGX_HTTP_ERICSTEN_DIGEST_CRC32C },
+    { ngx_string("xxhash64"), NGX_HTTP_ERICSTEN_DIGEST_XXH64 },
+    { ngx_string("sha256"), NGX_HTTP_ERICSTEN_DIGEST_SHA256 },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_ericsten_file_io[] = {
+    { ngx_string("threads"), NGX_HTTP_ERICSTEN_FILE_IO_THREADS },
+    { ngx_string("io_uring"), NGX_HTTP_ERICSTEN_FILE_IO_URING },
+    { ngx_null_string, 0 }
+};
+
+//
+// The builders of the snapshots that ngx_http_ericsten_refresh() configures.
+//
+static ngx_http_ericsten_refresh_build_pt  ngx_http_ericsten_kv_builder = ngx_http_ericsten_kv_build;
+static ngx_http_ericsten_refresh_build_pt  ngx_http_ericsten_lookup_builder = ngx_http_ericsten_lookup_build;
 
 static ngx_command_t  ngx_http_ericsten_commands[] = {
+
+    { ngx_string("ericsten_request_body"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, request_body),
+      NULL },
+
+    { ngx_string("ericsten_digest"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, digest),
+      &ngx_http_ericsten_digest_masks },
+
+    { ngx_string("ericsten_json_validate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, json),
+      NULL },
+
+    { ngx_string("ericsten_content"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_ericsten_content,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_stream"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_ericsten_stream,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_file"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_ericsten_file,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_file_directio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, file_directio),
+      NULL },
+
+    { ngx_string("ericsten_file_readahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, file_readahead),
+      NULL },
+
+    { ngx_string("ericsten_file_io"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, file_io),
+      &ngx_http_ericsten_file_io },
+
+    { ngx_string("ericsten_content_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, content_max_size),
+      NULL },
+
+    { ngx_string("ericsten_filter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, filter),
+      NULL },
+
+    { ngx_string("ericsten_filter_tasks"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, filter_tasks),
+      NULL },
+
+    { ngx_string("ericsten_gzip"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, gzip),
+      NULL },
+
+    { ngx_string("ericsten_gzip_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, gzip_level),
+      NULL },
+
+    { ngx_string("ericsten_gzip_block_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, gzip_block_size),
+      NULL },
+
+    { ngx_string("ericsten_gzip_min_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, gzip_min_length),
+      NULL },
+
+    { ngx_string("ericsten_gzip_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, gzip_types_keys),
+      &ngx_http_html_default_types[0] },
+
+    { ngx_string("ericsten_zone_huge_pages"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_main_conf_t, zone_huge_pages),
+      NULL },
+
+    { ngx_string("ericsten_zone_prefault"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_main_conf_t, zone_prefault),
+      NULL },
+
+    { ngx_string("ericsten_snapshot"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_ericsten_refresh,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_main_conf_t, snapshot),
+      &ngx_http_ericsten_kv_builder },
+
+    { ngx_string("ericsten_lookup"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_ericsten_refresh,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_main_conf_t, lookup),
+      &ngx_http_ericsten_lookup_builder },
+
+    { ngx_string("ericsten_lookup_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, lookup_key),
+      NULL },
+
+    { ngx_string("ericsten_bloom"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+      ngx_http_ericsten_bloom,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_bloom_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, bloom_key),
+      NULL },
+
+    { ngx_string("ericsten_result_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_ericsten_result_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_result_cache_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_ericsten_loc_conf_t, result_cache_key),
+      NULL },
+
+    { ngx_string("ericsten_warmup"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_ericsten_warmup,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_queue"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_ericsten_queue,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_sidecar"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_ericsten_sidecar,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_helpers"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_ericsten_helpers,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_coroutines"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_ericsten_coroutines,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ericsten_batch"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_ericsten_batch,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -85,14 +857,14 @@ static ngx_http_module_t  ngx_http_ericsten_module_ctx = {
     ngx_http_ericsten_add_variables,    /* preconfiguration */
     ngx_http_ericsten_init,             /* postconfiguration */
 
-    NULL,                               /* create main configuration */
-    NULL,                               /* init main configuration */
+    ngx_http_ericsten_create_main_conf, /* create main configuration */
+    ngx_http_ericsten_init_main_conf,   /* init main configuration */
 
     NULL,                               /* create server configuration */
     NULL,                               /* merge server configuration */
 
-    NULL,                               /* create location configuration */
-    NULL                                /* merge location configuration */
+    ngx_http_ericsten_create_loc_conf,  /* create location configuration */
+    ngx_http_ericsten_merge_loc_conf    /* merge location configuration */
 };
 
 ngx_module_t  ngx_http_ericsten_module = {
@@ -101,8 +873,8 @@ ngx_module_t  ngx_http_ericsten_module = {
     ngx_http_ericsten_commands,         /* module directives */
     NGX_HTTP_MODULE,                    /* module type */
     NULL,                               /* init master */
-    NULL,                               /* init module */
-    NULL,                               /* init process */
+    ngx_http_ericsten_init_module,      /* init module */
+    ngx_http_ericsten_init_process,     /* init process */
     NULL,                               /* init thread */
     NULL,                               /* exit thread */
     NULL,                               /* exit process */
@@ -113,7 +885,21 @@ ngx_module_t  ngx_http_ericsten_module = {
 enum ERICSTEN_VAR_INDEX
 {
     ES_VAR_SLEEP = 0,
-    ES_VAR_BANANA = 1
+    ES_VAR_BANANA = 1,
+    ES_VAR_BODY_BYTES = 2,
+    ES_VAR_BODY_CRC32 = 3,
+    ES_VAR_RESULT_CRC32C = 4,
+    ES_VAR_RESULT_XXH64 = 5,
+    ES_VAR_RESULT_SHA256 = 6,
+    ES_VAR_JSON_ERROR = 7
+};
+
+enum ERICSTEN_BLOOM_VAR_INDEX
+{
+    ES_BLOOM_VAR_CHECKS = 0,
+    ES_BLOOM_VAR_SKIP_RATE = 1,
+    ES_BLOOM_VAR_FP_RATE = 2,
+    ES_BLOOM_VAR_KEYS = 3
 };
 
 static ngx_http_variable_t  ngx_http_ericsten_vars[] = {
@@ -124,6 +910,42 @@ static ngx_http_variable_t  ngx_http_ericsten_vars[] = {
     { ngx_string("ericsten_banana"), NULL, ngx_http_ericsten_get_variable,
       ES_VAR_BANANA, NGX_HTTP_VAR_NOCACHEABLE, 1 },
 
+    { ngx_string("ericsten_body_bytes"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_BODY_BYTES, NGX_HTTP_VAR_NOCACHEABLE, 2 },
+
+    { ngx_string("ericsten_body_crc32"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_BODY_CRC32, NGX_HTTP_VAR_NOCACHEABLE, 3 },
+
+    { ngx_string("ericsten_result_crc32c"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_RESULT_CRC32C, NGX_HTTP_VAR_NOCACHEABLE, 4 },
+
+    { ngx_string("ericsten_result_xxhash64"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_RESULT_XXH64, NGX_HTTP_VAR_NOCACHEABLE, 5 },
+
+    { ngx_string("ericsten_result_sha256"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_RESULT_SHA256, NGX_HTTP_VAR_NOCACHEABLE, 6 },
+
+    { ngx_string("ericsten_json_error"), NULL, ngx_http_ericsten_get_variable,
+      ES_VAR_JSON_ERROR, NGX_HTTP_VAR_NOCACHEABLE, 7 },
+
+    { ngx_string("ericsten_ref_"), NULL, ngx_http_ericsten_ref_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_PREFIX, 0 },
+
+    { ngx_string("ericsten_lookup"), NULL, ngx_http_ericsten_lookup_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ericsten_bloom_checks"), NULL, ngx_http_ericsten_bloom_variable,
+      ES_BLOOM_VAR_CHECKS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ericsten_bloom_skip_rate"), NULL, ngx_http_ericsten_bloom_variable,
+      ES_BLOOM_VAR_SKIP_RATE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ericsten_bloom_fp_rate"), NULL, ngx_http_ericsten_bloom_variable,
+      ES_BLOOM_VAR_FP_RATE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("ericsten_bloom_keys"), NULL, ngx_http_ericsten_bloom_variable,
+      ES_BLOOM_VAR_KEYS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     ngx_http_null_variable
 };
 
@@ -171,6 +993,74 @@ ngx_http_ericsten_get_variable(ngx_http_request_t *r, ngx_http_variable_value_t
         v->len = ngx_sprintf(p, "banana") - p;
         break;
 
+    case ES_VAR_BODY_BYTES:
+
+        //
+        // Number of request body bytes run through the thread pool.
+        //
+
+        found = TRUE;
+        v->len = ngx_sprintf(p, "%O", ctx->body_bytes) - p;
+        break;
+
+    case ES_VAR_BODY_CRC32:
+
+        //
+        // CRC32 of the request body, computed on the thread pool.
+        //
+
+        found = TRUE;
+        v->len = ngx_sprintf(p, "%08xD", ctx->body_crc32) - p;
+        break;
+
+    case ES_VAR_RESULT_CRC32C:
+
+        //
+        // Request body digests: only there once the whole body is done.
+        //
+
+        if (ctx->digest && ctx->digest->final
+            && (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_CRC32C))
+        {
+            found = TRUE;
+            v->len = ngx_sprintf(p, "%08xD", ctx->digest->crc32c) - p;
+        }
+        break;
+
+    case ES_VAR_RESULT_XXH64:
+
+        if (ctx->digest && ctx->digest->final
+            && (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_XXH64))
+        {
+            found = TRUE;
+            v->len = ngx_sprintf(p, "%016xL", ctx->digest->xxh64_result) - p;
+        }
+        break;
+
+    case ES_VAR_RESULT_SHA256:
+
+        if (ctx->digest && ctx->digest->final
+            && (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_SHA256))
+        {
+            found = TRUE;
+            v->len = ngx_hex_dump(p, ctx->digest->sha256_result, NGX_HTTP_ERICSTEN_SHA256_LEN) - p;
+        }
+        break;
+
+    case ES_VAR_JSON_ERROR:
+
+        //
+        // Why ericsten_json_validate rejected the body, and where.
+        //
+
+        if (ctx->json && ctx->json->error)
+        {
+            found = TRUE;
+            v->len = ngx_snprintf(p, MAX_VARIABLE_SIZE, "%s at %O",
+                                  ctx->json->error, ctx->json->offset) - p;
+        }
+        break;
+
     default:
 
         //
@@ -219,200 +1109,5874 @@ ngx_http_ericsten_add_variables(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+//
+// $ericsten_ref_<key>: the value of key in the current ericsten_snapshot.
+// Read on the event loop straight from the snapshot, with no task.  The
+// value is copied, since the snapshot may be replaced after this event.
+//
+
 static ngx_int_t
-ngx_http_ericsten_init(ngx_conf_t *cf)
+ngx_http_ericsten_ref_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
-    ngx_thread_pool_t          *tp;
+    ngx_str_t                      *name = (ngx_str_t *) data;
+    u_char                         *key;
+    size_t                          len;
+    ngx_int_t                       rc;
+    ngx_uint_t                      lo, hi, mid;
+    ngx_http_ericsten_kv_t         *kv;
+    ngx_http_ericsten_snapshot_t   *snapshot;
+    ngx_http_ericsten_main_conf_t  *emcf;
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
 
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+    if (emcf->snapshot == NULL
+        || (snapshot = ngx_http_ericsten_refresh_get(emcf->snapshot)) == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    *h = ngx_http_ericsten_handler;
+    key = name->data + sizeof("ericsten_ref_") - 1;
+    len = name->len - (sizeof("ericsten_ref_") - 1);
 
-    //
-    // Set up our thread pool.
-    //
+    kv = snapshot->data;
+    lo = 0;
+    hi = kv->nelts;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+
+        rc = ngx_memn2cmp(key, kv->elts[mid].key.data, len, kv->elts[mid].key.len);
+
+        if (rc == 0)
+        {
+            v->data = ngx_pnalloc(r->pool, kv->elts[mid].value.len);
+            if (v->data == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(v->data, kv->elts[mid].value.data, kv->elts[mid].value.len);
+
+            v->len = kv->elts[mid].value.len;
+            v->valid = 1;
+            v->no_cacheable = 1;
+            v->not_found = 0;
+
+            return NGX_OK;
+        }
+
+        if (rc < 0)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    v->not_found = 1;
+
+    return NGX_OK;
+}
+
+//
+// $ericsten_lookup: the value of ericsten_lookup_key in the current
+// ericsten_lookup table, found on the event loop.  Copied, like
+// $ericsten_ref_*, since the table may be unmapped after this event.
+//
+
+static ngx_int_t
+ngx_http_ericsten_lookup_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t                       key, value;
+    ngx_http_ericsten_snapshot_t   *snapshot;
+    ngx_http_ericsten_loc_conf_t   *elcf;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    if (emcf->lookup == NULL
+        || elcf->lookup_key == NULL
+        || (snapshot = ngx_http_ericsten_refresh_get(emcf->lookup)) == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (ngx_http_complex_value(r, elcf->lookup_key, &key) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_ericsten_lookup_find(snapshot, key.data, key.len, &value) != NGX_OK)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = ngx_pnalloc(r->pool, value.len);
+    if (v->data == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(v->data, value.data, value.len);
+
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+//
+// $ericsten_bloom_*: the counters of ericsten_bloom, over all workers.  The
+// skip rate is the share of checks that found the key absent and needed no
+// task; the false positive rate is the one expected of the current filter.
+//
+
+static ngx_int_t
+ngx_http_ericsten_bloom_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                           *p;
+    ngx_http_ericsten_main_conf_t    *emcf;
+    ngx_http_ericsten_bloom_stats_t   stats;
+
+    emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+
+    if (emcf->bloom == NULL)
+    {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    ngx_http_ericsten_bloom_stats(emcf->bloom, &stats);
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN + sizeof(".000000") - 1);
+    if (p == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    switch (data)
+    {
+    case ES_BLOOM_VAR_CHECKS:
+        p = ngx_sprintf(p, "%uA", stats.checks);
+        break;
+
+    case ES_BLOOM_VAR_SKIP_RATE:
+        p = ngx_sprintf(p, "%.4f", stats.checks ? (double) stats.skips / stats.checks : 0.0);
+        break;
+
+    case ES_BLOOM_VAR_FP_RATE:
+        p = ngx_sprintf(p, "%.6f", stats.fp_rate);
+        break;
+
+    default: /* ES_BLOOM_VAR_KEYS */
+        p = ngx_sprintf(p, "%ui", stats.keys);
+        break;
+    }
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+    ngx_thread_pool_t          *tp;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_ericsten_handler;
+
+    //
+    // Pick the digest and JSON kernels for this CPU before any task can run.
+    //
+
+    ngx_http_ericsten_digest_init(cf->log);
+    ngx_http_ericsten_json_init_kernels(cf->log);
+    ngx_http_ericsten_bloom_init_kernels(cf->log);
+
+    //
+    // The body filter sits next to the phase handler; it is a no-op unless
+    // ericsten_filter is on for the request's location.
+    //
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_ericsten_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_ericsten_body_filter;
+
+    //
+    // Set up our thread pool.
+    //
 
 #if (NGX_THREADS)
     tp = ngx_thread_pool_add(cf, &ngx_ericsten_thread_pool_name);
 
-    if (tp == NULL) {
-        return NGX_ERROR;
+    if (tp == NULL) {
+        return NGX_ERROR;
+    }
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"aio threads\" "
+                           "is unsupported on this platform");
+        return NGX_ERROR;
+#endif
+
+    return NGX_OK;
+}
+
+static void *
+ngx_http_ericsten_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_ericsten_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_main_conf_t));
+    if (conf == NULL)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->zones, cf->pool, 4, sizeof(ngx_http_ericsten_shm_t *)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    conf->zone_huge_pages = NGX_CONF_UNSET;
+    conf->zone_prefault = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+static char *
+ngx_http_ericsten_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+
+    ngx_conf_init_value(emcf->zone_huge_pages, 0);
+    ngx_conf_init_value(emcf->zone_prefault, 0);
+
+    if (emcf->warmup)
+    {
+        if (emcf->store == NULL)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"ericsten_warmup\" requires \"ericsten_result_cache\"");
+            return NGX_CONF_ERROR;
+        }
+
+        emcf->warmup->store = emcf->store;
+    }
+
+    //
+    // The sleep task runs on one backend.
+    //
+
+    if ((emcf->sidecar != NULL) + (emcf->helper != NULL) + (emcf->queue != NULL)
+        + (emcf->coro != NULL) + (emcf->batch != NULL) > 1)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "only one of \"ericsten_sidecar\", \"ericsten_helpers\", \"ericsten_queue\", "
+            "\"ericsten_coroutines\" and \"ericsten_batch\" may be set");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static void *
+ngx_http_ericsten_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_ericsten_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_loc_conf_t));
+    if (conf == NULL)
+    {
+        return NULL;
+    }
+
+    conf->request_body = NGX_CONF_UNSET;
+    conf->filter = NGX_CONF_UNSET;
+    conf->filter_tasks = NGX_CONF_UNSET_UINT;
+    conf->gzip = NGX_CONF_UNSET;
+    conf->gzip_level = NGX_CONF_UNSET;
+    conf->gzip_block_size = NGX_CONF_UNSET_SIZE;
+    conf->gzip_min_length = NGX_CONF_UNSET;
+    conf->json = NGX_CONF_UNSET;
+    conf->content = NGX_CONF_UNSET;
+    conf->content_max_size = NGX_CONF_UNSET;
+    conf->stream = NGX_CONF_UNSET;
+    conf->file = NGX_CONF_UNSET;
+    conf->file_directio = NGX_CONF_UNSET;
+    conf->file_readahead = NGX_CONF_UNSET;
+    conf->file_io = NGX_CONF_UNSET_UINT;
+
+    //
+    // conf->digest is zeroed by ngx_pcalloc(), i.e. unset for a bitmask, and
+    // conf->lookup_key, conf->bloom_key and conf->result_cache_key are NULL,
+    // i.e. unset for a complex value.
+    //
+
+    return conf;
+}
+
+static char *
+ngx_http_ericsten_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_ericsten_loc_conf_t  *prev = parent;
+    ngx_http_ericsten_loc_conf_t  *conf = child;
+
+    ngx_conf_merge_value(conf->request_body, prev->request_body, 0);
+    ngx_conf_merge_value(conf->filter, prev->filter, 0);
+    ngx_conf_merge_uint_value(conf->filter_tasks, prev->filter_tasks, 4);
+
+    if (conf->filter_tasks == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"ericsten_filter_tasks\" must be at least 1");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_bitmask_value(conf->digest, prev->digest,
+                                 (NGX_CONF_BITMASK_SET|NGX_HTTP_ERICSTEN_DIGEST_OFF));
+
+    if (conf->digest & NGX_HTTP_ERICSTEN_DIGEST_OFF)
+    {
+        conf->digest = NGX_CONF_BITMASK_SET|NGX_HTTP_ERICSTEN_DIGEST_OFF;
+    }
+
+    ngx_conf_merge_value(conf->json, prev->json, 0);
+
+    //
+    // ericsten_content, ericsten_stream and ericsten_file are a location's
+    // content handler; they are not inherited.
+    //
+
+    if (conf->content == NGX_CONF_UNSET)
+    {
+        conf->content = 0;
+    }
+
+    if (conf->stream == NGX_CONF_UNSET)
+    {
+        conf->stream = 0;
+    }
+
+    if (conf->file == NGX_CONF_UNSET)
+    {
+        conf->file = 0;
+    }
+
+    ngx_conf_merge_off_value(conf->file_directio, prev->file_directio, 0);
+    ngx_conf_merge_value(conf->file_readahead, prev->file_readahead, 1);
+    ngx_conf_merge_uint_value(conf->file_io, prev->file_io, NGX_HTTP_ERICSTEN_FILE_IO_THREADS);
+
+    if (conf->lookup_key == NULL)
+    {
+        conf->lookup_key = prev->lookup_key;
+    }
+
+    if (conf->bloom_key == NULL)
+    {
+        conf->bloom_key = prev->bloom_key;
+    }
+
+    if (conf->result_cache_key == NULL)
+    {
+        conf->result_cache_key = prev->result_cache_key;
+    }
+
+#if !(NGX_HTTP_ERICSTEN_IO_URING)
+    if (conf->file_io == NGX_HTTP_ERICSTEN_FILE_IO_URING)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"ericsten_file_io io_uring\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    ngx_conf_merge_off_value(conf->content_max_size, prev->content_max_size, 16 * 1024 * 1024);
+
+    ngx_conf_merge_value(conf->gzip, prev->gzip, 0);
+    ngx_conf_merge_value(conf->gzip_level, prev->gzip_level, 6);
+    ngx_conf_merge_size_value(conf->gzip_block_size, prev->gzip_block_size, 128 * 1024);
+    ngx_conf_merge_value(conf->gzip_min_length, prev->gzip_min_length, 20);
+
+    if (ngx_http_merge_types(cf, &conf->gzip_types_keys, &conf->gzip_types,
+                             &prev->gzip_types_keys, &prev->gzip_types,
+                             ngx_http_html_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->gzip_level < 1 || conf->gzip_level > 9)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"ericsten_gzip_level\" must be between 1 and 9");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->gzip_block_size < 4096)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"ericsten_gzip_block_size\" must be at least 4k");
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_HTTP_GZIP)
+    if (conf->gzip)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"ericsten_gzip\" requires the gzip or gzip_static module");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+//
+// Configuration
+//
+// Directive handlers of the features that have no section of their own,
+// and the module and process initialization that acts on the main
+// configuration.
+//
+
+//
+// ericsten_snapshot path [interval];
+// ericsten_lookup path [interval];
+//
+// cmd->post points to the builder of the snapshots.
+//
+
+static char *
+ngx_http_ericsten_refresh(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                            *value;
+    ngx_int_t                             interval;
+    ngx_http_ericsten_refresh_t         **refresh;
+    ngx_http_ericsten_refresh_build_pt   *build = cmd->post;
+
+    refresh = (ngx_http_ericsten_refresh_t **) ((u_char *) conf + cmd->offset);
+
+    if (*refresh != NULL)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    interval = 30000;
+
+    if (cf->args->nelts == 3)
+    {
+        interval = ngx_parse_time(&value[2], 0);
+
+        if (interval == NGX_ERROR || interval == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid interval \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    *refresh = ngx_http_ericsten_refresh_create(cf, &value[1], (ngx_msec_t) interval, *build, NULL);
+    if (*refresh == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_bloom path size [interval];
+//
+
+static char *
+ngx_http_ericsten_bloom(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value;
+    ssize_t                         size;
+    ngx_int_t                       interval;
+
+    if (emcf->bloom != NULL)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    //
+    // The block of a key is picked with a 32-bit multiply.
+    //
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR || size < 64 || (uint64_t) size / 64 > 0xffffffff)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid bloom filter size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    interval = 30000;
+
+    if (cf->args->nelts == 4)
+    {
+        interval = ngx_parse_time(&value[3], 0);
+
+        if (interval == NGX_ERROR || interval == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid interval \"%V\"", &value[3]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    emcf->bloom = ngx_http_ericsten_bloom_create(cf, &emcf->zones, &value[1], (size_t) size,
+                                                 (ngx_msec_t) interval);
+    if (emcf->bloom == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_result_cache path size;
+//
+
+static char *
+ngx_http_ericsten_result_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value;
+    ssize_t                         size;
+
+    if (emcf->store != NULL)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    //
+    // Record offsets are stored in 40 bits of 8-byte units.
+    //
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR || size < 64 * 1024 || (uint64_t) size >= (uint64_t) 1 << 43)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid result cache size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->store = ngx_http_ericsten_store_create(cf, &value[1], (size_t) size);
+    if (emcf->store == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_warmup [concurrency=number] [file=path] [key ...];
+//
+
+static char *
+ngx_http_ericsten_warmup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value, name, *key;
+    ngx_int_t                       n;
+    ngx_uint_t                      i;
+
+    if (emcf->warmup != NULL)
+    {
+        return "is duplicate";
+    }
+
+    emcf->warmup = ngx_http_ericsten_warmup_create(cf, ngx_http_ericsten_warmup_compute);
+    if (emcf->warmup == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->warmup->concurrency = 2;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "concurrency=", 12) == 0)
+        {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+
+            if (n == NGX_ERROR || n == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid concurrency \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            emcf->warmup->concurrency = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "file=", 5) == 0)
+        {
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+
+            if (ngx_http_ericsten_warmup_add_file(cf, emcf->warmup, &name) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        key = ngx_array_push(&emcf->warmup->keys);
+        if (key == NULL)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        *key = value[i];
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_queue [threads=number] [slots=number];
+//
+
+static char *
+ngx_http_ericsten_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, threads, slots;
+
+    if (emcf->queue != NULL)
+    {
+        return "is duplicate";
+    }
+
+    threads = 8;
+    slots = 256;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0)
+        {
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (n == NGX_ERROR || n == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid threads \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            threads = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slots=", 6) == 0)
+        {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0 || n > 65536)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid slots \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            slots = (ngx_uint_t) n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->queue = ngx_http_ericsten_queue_create(cf, &emcf->zones, threads, slots, ngx_http_ericsten_queue_run,
+                                                 ngx_http_ericsten_queue_done);
+    if (emcf->queue == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_sidecar address [connections=number] [requests=number]
+//     [timeout=time] [keepalive=time];
+//
+
+static char *
+ngx_http_ericsten_sidecar(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value, s;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, connections, requests;
+    ngx_msec_t                      timeout, keepalive;
+
+    if (emcf->sidecar != NULL)
+    {
+        return "is duplicate";
+    }
+
+    connections = 2;
+    requests = 128;
+    timeout = 10000;
+    keepalive = 60000;
+
+    value = cf->args->elts;
+
+    for (i = 2; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "connections=", 12) == 0)
+        {
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+
+            if (n == NGX_ERROR || n == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid connections \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            connections = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0)
+        {
+            n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+
+            if (n == NGX_ERROR || n == 0 || n > 65536)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid requests \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            requests = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0)
+        {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            timeout = ngx_parse_time(&s, 0);
+
+            if (timeout == NGX_ERROR || timeout == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid timeout \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "keepalive=", 10) == 0)
+        {
+            s.data = value[i].data + 10;
+            s.len = value[i].len - 10;
+
+            keepalive = ngx_parse_time(&s, 0);
+
+            if (keepalive == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid keepalive \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->sidecar = ngx_http_ericsten_sidecar_create(cf, &value[1], connections, requests, timeout, keepalive);
+    if (emcf->sidecar == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_helpers number [slots=number];
+//
+
+static char *
+ngx_http_ericsten_helpers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, helpers, slots;
+
+    if (emcf->helper != NULL)
+    {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid number of helpers \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    helpers = (ngx_uint_t) n;
+    slots = 256;
+
+    for (i = 2; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "slots=", 6) == 0)
+        {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0 || n > 65536)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid slots \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            slots = (ngx_uint_t) n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->helper = ngx_http_ericsten_helper_create(cf, helpers, slots, ngx_http_ericsten_queue_run,
+                                                   ngx_http_ericsten_helper_done);
+    if (emcf->helper == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_coroutines [stack=size] [stacks=number];
+//
+
+static char *
+ngx_http_ericsten_coroutines(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value, s;
+    ssize_t                         size;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, stacks;
+
+    if (emcf->coro != NULL)
+    {
+        return "is duplicate";
+    }
+
+    size = 64 * 1024;
+    stacks = 256;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "stack=", 6) == 0)
+        {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size < 16 * 1024)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid stack \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "stacks=", 7) == 0)
+        {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (n == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid stacks \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            stacks = (ngx_uint_t) n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->coro = ngx_http_ericsten_coro_pool_create(cf, (size_t) size, stacks);
+    if (emcf->coro == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// ericsten_batch [size=number] [delay=time];
+//
+
+static char *
+ngx_http_ericsten_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_main_conf_t  *emcf = conf;
+    ngx_str_t                      *value, s;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, size;
+    ngx_msec_t                      delay;
+
+    if (emcf->batch != NULL)
+    {
+        return "is duplicate";
+    }
+
+    size = 16;
+    delay = 0;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++)
+    {
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0)
+        {
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+
+            if (n == NGX_ERROR || n == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            size = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "delay=", 6) == 0)
+        {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+
+            delay = ngx_parse_time(&s, 0);
+
+            if (delay == NGX_ERROR)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid delay \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    emcf->batch = ngx_http_ericsten_batcher_create(cf, size, delay, ngx_http_ericsten_dostuff_batch,
+                                                   ngx_http_ericsten_dostuff_batch_done);
+    if (emcf->batch == NULL)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+//
+// Thread Pool Task Function, called through ngx_http_ericsten_refresh_task():
+// build an ericsten_snapshot from "key value" lines.  Empty lines and lines
+// starting with '#' are skipped; the value is the rest of the line and may
+// be empty.  Keys are lowercased, as nginx lowercases the variable names
+// they are looked up by.  A file with a duplicate key is rejected, keeping
+// the previous snapshot.
+//
+
+static ngx_http_ericsten_snapshot_t *
+ngx_http_ericsten_kv_build(ngx_http_ericsten_refresh_t *refresh, ngx_fd_t fd, ngx_file_info_t *fi)
+{
+    u_char                        *text, *p, *q, *last, *end;
+    size_t                         size;
+    ssize_t                        n;
+    ngx_uint_t                     i, lines;
+    ngx_keyval_t                  *kv;
+    ngx_http_ericsten_kv_t        *table;
+    ngx_http_ericsten_snapshot_t  *snapshot;
+
+    size = (size_t) ngx_file_size(fi);
+
+    snapshot = ngx_alloc(sizeof(ngx_http_ericsten_snapshot_t) + sizeof(ngx_http_ericsten_kv_t) + size,
+                         refresh->log);
+    if (snapshot == NULL)
+    {
+        refresh->error = "out of memory";
+        return NULL;
+    }
+
+    table = (ngx_http_ericsten_kv_t *) (snapshot + 1);
+    text = (u_char *) (table + 1);
+
+    for (p = text; p < text + size; p += n)
+    {
+        n = ngx_read_fd(fd, p, text + size - p);
+
+        if (n == -1)
+        {
+            refresh->err = ngx_errno;
+            refresh->error = ngx_read_fd_n " failed";
+            goto failed;
+        }
+
+        if (n == 0)
+        {
+            refresh->error = "file was truncated while being read";
+            goto failed;
+        }
+    }
+
+    end = text + size;
+    lines = 1;
+
+    for (p = text; p < end; p++)
+    {
+        if (*p == LF)
+        {
+            lines++;
+        }
+    }
+
+    table->elts = ngx_alloc(lines * sizeof(ngx_keyval_t), refresh->log);
+    if (table->elts == NULL)
+    {
+        refresh->error = "out of memory";
+        goto failed;
+    }
+
+    table->nelts = 0;
+
+    for (p = text; p < end; p = last + 1)
+    {
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL)
+        {
+            last = end;
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+
+        if (p == last || *p == '#' || *p == CR)
+        {
+            continue;
+        }
+
+        kv = &table->elts[table->nelts++];
+
+        for (q = p; q < last && *q != ' ' && *q != '\t' && *q != CR; q++) { /* void */ }
+
+        ngx_strlow(p, p, q - p);
+
+        kv->key.data = p;
+        kv->key.len = q - p;
+
+        while (q < last && (*q == ' ' || *q == '\t'))
+        {
+            q++;
+        }
+
+        p = last;
+
+        while (p > q && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == CR))
+        {
+            p--;
+        }
+
+        kv->value.data = q;
+        kv->value.len = p - q;
+    }
+
+    ngx_qsort(table->elts, table->nelts, sizeof(ngx_keyval_t), ngx_http_ericsten_kv_cmp);
+
+    for (i = 1; i < table->nelts; i++)
+    {
+        if (ngx_http_ericsten_kv_cmp(&table->elts[i - 1], &table->elts[i]) == 0)
+        {
+            refresh->error = "duplicate key";
+            ngx_free(table->elts);
+            goto failed;
+        }
+    }
+
+    snapshot->data = table;
+    snapshot->free = ngx_http_ericsten_kv_free;
+
+    return snapshot;
+
+failed:
+
+    ngx_free(snapshot);
+
+    return NULL;
+}
+
+static void
+ngx_http_ericsten_kv_free(ngx_http_ericsten_snapshot_t *snapshot)
+{
+    ngx_http_ericsten_kv_t  *table = snapshot->data;
+
+    ngx_free(table->elts);
+    ngx_free(snapshot);
+}
+
+static int ngx_libc_cdecl
+ngx_http_ericsten_kv_cmp(const void *one, const void *two)
+{
+    ngx_keyval_t  *a = (ngx_keyval_t *) one;
+    ngx_keyval_t  *b = (ngx_keyval_t *) two;
+
+    return (int) ngx_memn2cmp(a->key.data, b->key.data, a->key.len, b->key.len);
+}
+
+//
+// Map the shared zones in the master, once the configuration has been read,
+// so that the workers inherit them.
+//
+
+static ngx_int_t
+ngx_http_ericsten_init_module(ngx_cycle_t *cycle)
+{
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    emcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ericsten_module);
+    if (emcf == NULL)
+    {
+        return NGX_OK;
+    }
+
+    if (emcf->queue && ngx_http_ericsten_queue_init(emcf->queue, cycle) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_ericsten_shm_init(cycle, &emcf->zones, emcf->zone_huge_pages, emcf->zone_prefault) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (emcf->store && ngx_http_ericsten_store_open(emcf->store, cycle) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_init_process(ngx_cycle_t *cycle)
+{
+    ngx_thread_pool_t              *tp;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    emcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_ericsten_module);
+
+    if (emcf == NULL)
+    {
+        return NGX_OK;
+    }
+
+    if (emcf->doorbell && ngx_http_ericsten_doorbell_init(cycle) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    //
+    // The sidecar and the helpers need no thread.
+    //
+
+    if ((emcf->sidecar && ngx_http_ericsten_sidecar_start(emcf->sidecar, cycle) != NGX_OK)
+        || (emcf->helper && ngx_http_ericsten_helper_start(emcf->helper, cycle) != NGX_OK))
+    {
+        return NGX_ERROR;
+    }
+
+    if (emcf->snapshot == NULL && emcf->lookup == NULL && emcf->bloom == NULL && emcf->warmup == NULL
+        && emcf->queue == NULL && emcf->coro == NULL && emcf->batch == NULL)
+    {
+        return NGX_OK;
+    }
+
+    tp = ngx_thread_pool_get(cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_ERROR;
+    }
+
+    if ((emcf->snapshot && ngx_http_ericsten_refresh_start(emcf->snapshot, tp, cycle) != NGX_OK)
+        || (emcf->lookup && ngx_http_ericsten_refresh_start(emcf->lookup, tp, cycle) != NGX_OK)
+        || (emcf->bloom && ngx_http_ericsten_bloom_start(emcf->bloom, tp, cycle) != NGX_OK)
+        || (emcf->warmup && ngx_http_ericsten_warmup_start(emcf->warmup, tp, cycle) != NGX_OK)
+        || (emcf->queue && ngx_http_ericsten_queue_start(emcf->queue, tp, cycle) != NGX_OK)
+        || (emcf->coro && ngx_http_ericsten_coro_pool_start(emcf->coro, tp, cycle) != NGX_OK)
+        || (emcf->batch && ngx_http_ericsten_batcher_start(emcf->batch, tp, cycle) != NGX_OK))
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+//
+// Request Contexts
+//
+// Request contexts come from a per-worker slab rather than from the request
+// pool, where each one would be a separately malloc()ed aligned block plus
+// the pool's record of it.  The contexts are all the same size and aligned
+// to a cache line, so they are packed back to back into slabs, and found
+// back from their address by masking it.  A slab is used up from its start,
+// so a worker only touches as many pages as it has contexts in flight.
+//
+// Slabs with free contexts are kept on a list, the most recently used
+// first.  One empty slab is kept as a spare, the others are freed.  Like the
+// buffer pool, the slab is only used on the event loop and needs no lock.
+//
+
+typedef struct
+{
+    ngx_queue_t     queue;      // In the partial list, unless full.
+    void           *free;       // Returned contexts, linked through their first word.
+    u_char         *last;       // Never used past this point.
+    ngx_uint_t      used;
+    ngx_uint_t      full;
+} ngx_http_ericsten_slab_t;
+
+typedef struct
+{
+    ngx_queue_t                partial;
+    ngx_http_ericsten_slab_t  *spare;
+    ngx_uint_t                 initialized;
+} ngx_http_ericsten_ctxcache_t;
+
+static ngx_http_ericsten_ctxcache_t  ngx_http_ericsten_ctxcache;
+
+#define ngx_http_ericsten_slab_header                                        \
+    ngx_align(sizeof(ngx_http_ericsten_slab_t), NGX_CPU_CACHE_LINE)
+
+#define ngx_http_ericsten_slab_end(slab)                                     \
+    ((u_char *) (slab) + NGX_HTTP_ERICSTEN_SLAB_SIZE)
+
+//
+// Create the request's context.  It is aligned to a cache line, so that the
+// lines a task writes hold nothing but the task's fields; see
+// ngx_http_ericsten_ctx_s.  It goes back to the slab with the request pool.
+//
+
+static ngx_http_ericsten_ctx_t *
+ngx_http_ericsten_ctx_create(ngx_http_request_t *r)
+{
+    ngx_queue_t                   *q;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_ericsten_ctx_t       *ctx;
+    ngx_http_ericsten_slab_t      *slab;
+    ngx_http_ericsten_ctxcache_t  *cache = &ngx_http_ericsten_ctxcache;
+
+    if (!cache->initialized)
+    {
+        ngx_queue_init(&cache->partial);
+        cache->initialized = 1;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL)
+    {
+        return NULL;
+    }
+
+    if (ngx_queue_empty(&cache->partial))
+    {
+        slab = cache->spare;
+        cache->spare = NULL;
+
+        if (slab == NULL)
+        {
+            slab = ngx_memalign(NGX_HTTP_ERICSTEN_SLAB_SIZE, NGX_HTTP_ERICSTEN_SLAB_SIZE,
+                                r->connection->log);
+            if (slab == NULL)
+            {
+                return NULL;
+            }
+        }
+
+        slab->free = NULL;
+        slab->last = (u_char *) slab + ngx_http_ericsten_slab_header;
+        slab->used = 0;
+        slab->full = 0;
+
+        ngx_queue_insert_head(&cache->partial, &slab->queue);
+    }
+
+    q = ngx_queue_head(&cache->partial);
+    slab = ngx_queue_data(q, ngx_http_ericsten_slab_t, queue);
+
+    if (slab->free != NULL)
+    {
+        ctx = slab->free;
+        slab->free = *(void **) ctx;
+    }
+    else
+    {
+        ctx = (ngx_http_ericsten_ctx_t *) slab->last;
+        slab->last += sizeof(ngx_http_ericsten_ctx_t);
+    }
+
+    slab->used++;
+
+    if (slab->free == NULL
+        && slab->last + sizeof(ngx_http_ericsten_ctx_t) > ngx_http_ericsten_slab_end(slab))
+    {
+        ngx_queue_remove(&slab->queue);
+        slab->full = 1;
+    }
+
+    cln->handler = ngx_http_ericsten_ctx_free;
+    cln->data = ctx;
+
+    ngx_memzero(ctx, sizeof(ngx_http_ericsten_ctx_t));
+
+    ngx_http_set_ctx(r, ctx, ngx_http_ericsten_module);
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_INIT);
+    ctx->r = r;
+    ctx->task.ctx = ctx;
+
+    return ctx;
+}
+
+//
+// Pool cleanup: return the context to its slab.  Registered before any other
+// cleanup that uses the context, so it runs after them.
+//
+
+static void
+ngx_http_ericsten_ctx_free(void *data)
+{
+    ngx_http_ericsten_slab_t      *slab;
+    ngx_http_ericsten_ctxcache_t  *cache = &ngx_http_ericsten_ctxcache;
+
+    slab = (ngx_http_ericsten_slab_t *) ((uintptr_t) data & ~((uintptr_t) NGX_HTTP_ERICSTEN_SLAB_SIZE - 1));
+
+    *(void **) data = slab->free;
+    slab->free = data;
+    slab->used--;
+
+    if (slab->full)
+    {
+        ngx_queue_insert_head(&cache->partial, &slab->queue);
+        slab->full = 0;
+    }
+
+    if (slab->used != 0)
+    {
+        return;
+    }
+
+    ngx_queue_remove(&slab->queue);
+
+    if (cache->spare == NULL)
+    {
+        cache->spare = slab;
+        return;
+    }
+
+    ngx_free(slab);
+}
+
+static ngx_int_t
+ngx_http_ericsten_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_str_t                       key, value;
+    ngx_http_ericsten_ctx_t        *ctx = NULL;
+    ngx_http_ericsten_loc_conf_t   *elcf = NULL;
+    ngx_http_ericsten_main_conf_t  *emcf = NULL;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "ngx_http_ericsten_handler: Entering rewrite handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+    if (ctx != NULL)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+           "ngx_http_ericsten_handler: Resuming a previously seen request. "
+           "request_state: %s",
+           ngx_ericsten_states[ngx_http_ericsten_get_state(ctx)]);
+
+        //
+        // If the thread pool task could fail, this would be the correct
+        // point to fail the request and set a final response status.  A
+        // sidecar call or a helper process can.
+        //
+        // Alternately, if there were multiple tasks, this would be the place
+        // to process the state machine on the per-request context and move to
+        // the next task.
+        //
+
+        if (ctx->task_failed)
+        {
+            return NGX_HTTP_BAD_GATEWAY;
+        }
+    }
+    else
+    {
+        //
+        // Create a context for the module.
+        //
+
+        ctx = ngx_http_ericsten_ctx_create(r);
+        if (ctx == NULL) 
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        //
+        // Init the state on the context.
+        //
+
+        ngx_http_ericsten_set_state(ctx, ES_TASK_INIT);
+        ctx->msSleep = 0;
+
+        //
+        // In request body mode the body is streamed through the thread pool
+        // instead of running the sleep task.  JSON validation needs the body
+        // too, so it implies the same mode.
+        //
+
+        elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+        if ((elcf->request_body || elcf->json) && r == r->main)
+        {
+            return ngx_http_ericsten_body_start(r, ctx);
+        }
+
+        //
+        // In content mode the work is done by the content task instead.
+        //
+
+        if (elcf->content || elcf->stream || elcf->file)
+        {
+            return NGX_DECLINED;
+        }
+
+        //
+        // With ericsten_lookup_key, the blocking lookup the sleep task
+        // models is answered by $ericsten_lookup from the mapped table, on
+        // the event loop; there is nothing to wait for.
+        //
+
+        if (elcf->lookup_key)
+        {
+            ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+            return NGX_DECLINED;
+        }
+
+        //
+        // A key that ericsten_bloom rules out would not be found by the
+        // task either, so it is not posted.
+        //
+
+        if (elcf->bloom_key)
+        {
+            emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+
+            if (emcf->bloom)
+            {
+                if (ngx_http_complex_value(r, elcf->bloom_key, &key) != NGX_OK)
+                {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                if (ngx_http_ericsten_bloom_check(emcf->bloom, key.data, key.len) == NGX_DECLINED)
+                {
+                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                        "ngx_http_ericsten_handler: \"%V\" is not in the bloom filter", &key);
+
+                    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+                    return NGX_DECLINED;
+                }
+            }
+        }
+
+        //
+        // A result stored by ericsten_result_cache, possibly by a previous
+        // generation of workers, is used instead of posting the task again.
+        //
+
+        if (elcf->result_cache_key)
+        {
+            emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+
+            if (emcf->store)
+            {
+                if (ngx_http_complex_value(r, elcf->result_cache_key, &key) != NGX_OK)
+                {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                rc = ngx_http_ericsten_store_get(emcf->store, key.data, key.len, r->pool, &value);
+
+                if (rc == NGX_ERROR)
+                {
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                if (rc == NGX_OK && value.len == sizeof(ctx->msSleep))
+                {
+                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                        "ngx_http_ericsten_handler: \"%V\" found in the result cache", &key);
+
+                    ngx_memcpy(&ctx->msSleep, value.data, sizeof(ctx->msSleep));
+                    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+                    return NGX_DECLINED;
+                }
+            }
+        }
+
+        ctx->task_args.random_value = ngx_random();
+
+        rc = ngx_http_ericsten_dostuff_post(r, ctx);
+
+        if (rc != NGX_OK)
+        {
+            return rc;
+        }
+
+        //
+        // Whichever way the task runs, the request waits for it as for aio,
+        // and its completion handler resumes the phases.
+        //
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "ngx_http_ericsten_handler: Finished rewrite handler.");
+
+    return NGX_DECLINED;
+}
+
+//
+// Start the sleep task on the backend the configuration chose.  At most one
+// of ericsten_sidecar, ericsten_helpers, ericsten_queue, ericsten_coroutines
+// and ericsten_batch is set (see ngx_http_ericsten_init_main_conf()); with
+// none, or when the queue is full, the task goes to the thread pool.
+// Returns NGX_OK, or the status to fail the request with.
+//
+
+static ngx_int_t
+ngx_http_ericsten_dostuff_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    u_char                          buf[4];
+    ngx_thread_pool_t              *tp;
+    ngx_thread_task_t              *task;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+
+    //
+    // With ericsten_sidecar, the blocking operation is not run in nginx at
+    // all: it is a call to the sidecar service, and the request resumes
+    // when the response arrives.
+    //
+
+    if (emcf->sidecar)
+    {
+        buf[0] = (u_char) (ctx->task_args.random_value >> 24);
+        buf[1] = (u_char) (ctx->task_args.random_value >> 16);
+        buf[2] = (u_char) (ctx->task_args.random_value >> 8);
+        buf[3] = (u_char) ctx->task_args.random_value;
+
+        if (ngx_http_ericsten_sidecar_call(emcf->sidecar, NGX_HTTP_ERICSTEN_SIDECAR_SLEEP, buf, sizeof(buf),
+                                           ngx_http_ericsten_sidecar_done, ctx)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_ericsten: no sidecar connection available");
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        return NGX_OK;
+    }
+
+    //
+    // With ericsten_helpers, it runs on one of this worker's helper
+    // processes, and the request resumes when the helper is done.
+    //
+
+    if (emcf->helper)
+    {
+        if (ngx_http_ericsten_helper_post(emcf->helper, (u_char *) &ctx->task_args.random_value,
+                                          sizeof(ctx->task_args.random_value), ctx)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_ericsten: no helper process available");
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        return NGX_OK;
+    }
+
+    //
+    // With ericsten_queue, the task goes to the queue shared by the
+    // workers, unless this worker has too many there already.
+    //
+
+    if (emcf->queue
+        && ngx_http_ericsten_queue_post(emcf->queue, (u_char *) &ctx->task_args.random_value,
+                                        sizeof(ctx->task_args.random_value), ctx) == NGX_OK)
+    {
+        return NGX_OK;
+    }
+
+    //
+    // With ericsten_coroutines, the task is a coroutine on the pool, which
+    // gives its thread back while it waits.
+    //
+
+    if (emcf->coro)
+    {
+        if (ngx_http_ericsten_coro_spawn(emcf->coro, ngx_http_ericsten_dostuff_coro,
+                                         ngx_http_ericsten_dostuff_coro_done, ctx)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_ericsten: failed to start coroutine");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    //
+    // With ericsten_batch, the task joins the current batch, which runs as
+    // one pool task.
+    //
+
+    if (emcf->batch)
+    {
+        if (ngx_http_ericsten_batch_add(emcf->batch, ctx) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_ericsten: failed to add task to batch");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    //
+    // Queue work item to a background thread
+    //
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    task = &ctx->task;
+
+    task->handler = ngx_http_ericsten_dostuff;
+    task->event.handler = ngx_http_ericsten_dostuff_completion_handler;
+    task->event.data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: failed to post new task");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+//
+// Thread Pool Task Functions
+//
+
+static void
+ngx_http_ericsten_dostuff(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t       *ctx = data;
+    ngx_uint_t                     msec_sleep;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    //
+    // Run the blocking operation with the input parameter passed via the
+    // task context.
+    //
+
+    msec_sleep = ngx_http_ericsten_sleep(ctx->task_args.random_value, ctx->r->connection->log);
+
+    //
+    // Any product of our processing that we need to pass back to the main
+    // handler should be put on the per-request context.
+    //
+
+    ctx->msSleep = msec_sleep;
+    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+}
+
+//
+// Coroutine body, with ericsten_coroutines: the sleep task, which awaits
+// the sleep on a timer instead of holding the thread for it.  Further steps
+// would simply follow the await.
+//
+
+static void
+ngx_http_ericsten_dostuff_coro(ngx_http_ericsten_coro_t *co, void *data)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+    ngx_uint_t                msec_sleep;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    msec_sleep = ngx_http_ericsten_sleep_msec(ctx->task_args.random_value);
+
+    if (ngx_http_ericsten_coro_sleep(co, msec_sleep) != NGX_OK)
+    {
+        return;
+    }
+
+    ctx->msSleep = msec_sleep;
+    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+}
+
+//
+// Event loop: the coroutine returned.  It only publishes ES_TASK_DONE when
+// the sleep succeeded, so task_failed, which shares a word with the loop's
+// own flags, is set here rather than by the coroutine.
+//
+
+static void
+ngx_http_ericsten_dostuff_coro_done(void *data)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+
+    if (ngx_http_ericsten_get_state(ctx) != ES_TASK_DONE)
+    {
+        ctx->task_failed = 1;
+    }
+
+    ngx_http_ericsten_dostuff_finish(ctx);
+}
+
+//
+// Thread Pool Task Function, with ericsten_batch: the sleep tasks of a
+// batch.  The sleep stands for a backend call that answers a batch as fast
+// as a single item, so the batch sleeps once, for its longest item.
+//
+
+static void
+ngx_http_ericsten_dostuff_batch(void **items, ngx_uint_t n, ngx_log_t *log)
+{
+    ngx_uint_t                i, msec_sleep, longest;
+    ngx_http_ericsten_ctx_t  *ctx;
+
+    longest = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        ctx = items[i];
+
+        ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+        msec_sleep = ngx_http_ericsten_sleep_msec(ctx->task_args.random_value);
+        ctx->msSleep = msec_sleep;
+
+        if (msec_sleep > longest)
+        {
+            longest = msec_sleep;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_dostuff_batch: %ui tasks, sleeping for %ui msec", n, longest);
+    ngx_msleep(longest);
+
+    for (i = 0; i < n; i++)
+    {
+        ctx = items[i];
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+}
+
+static void
+ngx_http_ericsten_dostuff_batch_done(void *item, ngx_int_t rc)
+{
+    ngx_http_ericsten_ctx_t  *ctx = item;
+
+    if (rc != NGX_OK)
+    {
+        ctx->task_failed = 1;
+    }
+
+    ngx_http_ericsten_dostuff_finish(ctx);
+}
+
+static ngx_uint_t
+ngx_http_ericsten_sleep(ngx_uint_t value, ngx_log_t *log)
+{
+    ngx_uint_t  msec_sleep;
+
+    msec_sleep = ngx_http_ericsten_sleep_msec(value);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_sleep: About to sleep for %d msec", msec_sleep);
+    ngx_msleep(msec_sleep);
+
+    return msec_sleep;
+}
+
+static ngx_uint_t
+ngx_http_ericsten_sleep_msec(ngx_uint_t value)
+{
+    //
+    // Our blocking operation is simple:
+    // Sleep from 100 to 1000 milliseconds (in 100ms increments).
+    //
+
+    return ((value % 9) + 1) * 100;
+}
+
+//
+// Thread Pool Task Function, called through ngx_http_ericsten_warmup_task():
+// the blocking operation for an ericsten_warmup key.  A request draws the
+// input at random; here it is derived from the key, and the result is
+// stored as the request's completion handler stores it.
+//
+
+static ngx_int_t
+ngx_http_ericsten_warmup_compute(ngx_str_t *key, u_char *value, size_t *len, ngx_log_t *log)
+{
+    int  msec_sleep;
+
+    msec_sleep = (int) ngx_http_ericsten_sleep(ngx_hash_key(key->data, key->len), log);
+
+    ngx_memcpy(value, &msec_sleep, sizeof(int));
+    *len = sizeof(int);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_dostuff_completion_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_dostuff_finish(ev->data);
+}
+
+//
+// Thread Pool Task Function, called through ngx_http_ericsten_queue_pull()
+// in any worker: the sleep task, posted to ericsten_queue.  Helper processes
+// run it the same way for ericsten_helpers.
+//
+
+static void
+ngx_http_ericsten_queue_run(u_char *data, size_t *len, ngx_log_t *log)
+{
+    int  random_value, msec_sleep;
+
+    ngx_memcpy(&random_value, data, sizeof(int));
+
+    msec_sleep = (int) ngx_http_ericsten_sleep(random_value, log);
+
+    ngx_memcpy(data, &msec_sleep, sizeof(int));
+    *len = sizeof(int);
+}
+
+//
+// Back in the worker that posted it.
+//
+
+static void
+ngx_http_ericsten_queue_done(void *data, u_char *result, size_t len)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+
+    ngx_memcpy(&ctx->msSleep, result, sizeof(int));
+    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+
+    ngx_http_ericsten_dostuff_finish(ctx);
+}
+
+//
+// Event loop: the sidecar answered the sleep task's call, or the call
+// failed, which fails the request.
+//
+
+static void
+ngx_http_ericsten_sidecar_done(void *data, ngx_int_t rc, u_char *body, size_t len)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+
+    if (rc == NGX_OK && len == 4)
+    {
+        ctx->msSleep = (int) ((uint32_t) body[0] << 24 | body[1] << 16 | body[2] << 8 | body[3]);
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+    else
+    {
+        if (rc == NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, ctx->r->connection->log, 0,
+                "ngx_http_ericsten: sidecar sent a sleep result of %uz bytes", len);
+        }
+
+        ctx->task_failed = 1;
+    }
+
+    ngx_http_ericsten_dostuff_finish(ctx);
+}
+
+//
+// Event loop: a helper process ran the sleep task, or exited while it held
+// it, which fails the request.
+//
+
+static void
+ngx_http_ericsten_helper_done(void *data, ngx_int_t rc, u_char *result, size_t len)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+
+    if (rc == NGX_OK)
+    {
+        ngx_memcpy(&ctx->msSleep, result, sizeof(int));
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+    else
+    {
+        ctx->task_failed = 1;
+    }
+
+    ngx_http_ericsten_dostuff_finish(ctx);
+}
+
+static void
+ngx_http_ericsten_dostuff_finish(ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_str_t                       key;
+    ngx_connection_t               *c;
+    ngx_http_request_t             *r;
+    ngx_http_ericsten_loc_conf_t   *elcf;
+    ngx_http_ericsten_main_conf_t  *emcf;
+    
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_dostuff_finish: \"%V?%V\"", &r->uri, &r->args);
+
+    //
+    // The task completion handler executes on the main event loop, and is
+    // pretty straightfoward: Mark the background processing complete, and
+    // call the nginx HTTP function to resume processing of the request.
+    //
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    //
+    // Keep the result for later requests, and later workers.
+    //
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    if (elcf->result_cache_key && !ctx->task_failed)
+    {
+        emcf = ngx_http_get_module_main_conf(r, ngx_http_ericsten_module);
+
+        if (emcf->store && ngx_http_complex_value(r, elcf->result_cache_key, &key) == NGX_OK)
+        {
+            ngx_http_ericsten_store_put(emcf->store, key.data, key.len, (u_char *) &ctx->msSleep,
+                                        sizeof(ctx->msSleep));
+        }
+    }
+
+    ngx_http_handler(r);
+}
+
+//
+// Content Handler
+//
+// With ericsten_content, the location's response is generated on the pool.
+// A first task produces the status and headers, which the completion
+// handler sends.  The body is then produced by a second task, a buffer at a
+// time, through the streaming rings (see Streaming Content below): the
+// buffers are reused as soon as the output filters have sent them, so a
+// response of any size holds NGX_HTTP_ERICSTEN_STREAM_BUFS of them at most,
+// and the task gives its thread back whenever the client falls behind.  No
+// body is generated for a response that has none, as to a HEAD request.
+//
+// The example task generates ?size= bytes (default 4k) of pseudo-random data
+// from ?seed=, and returns their CRC32C in an X-Ericsten-Crc32c header.  The
+// header task gets the CRC by running the generator over the whole body
+// without keeping it; the header is left out of responses to HEAD, for which
+// that pass would be the only work.
+//
+
+static char *
+ngx_http_ericsten_content(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_loc_conf_t   *elcf = conf;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    if (elcf->content != NGX_CONF_UNSET)
+    {
+        return "is duplicate";
+    }
+
+    elcf->content = 1;
+
+    emcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ericsten_module);
+    emcf->doorbell = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_ericsten_content_handler;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_content_handler(ngx_http_request_t *r)
+{
+    off_t                                  size, n;
+    ngx_int_t                              rc;
+    ngx_str_t                              value;
+    ngx_thread_pool_t                     *tp;
+    ngx_thread_task_t                     *task;
+    ngx_http_ericsten_ctx_t               *ctx;
+    ngx_http_ericsten_loc_conf_t          *elcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    size = 4096;
+
+    if (ngx_http_arg(r, (u_char *) "size", 4, &value) == NGX_OK)
+    {
+        size = ngx_parse_offset(&value);
+
+        if (size == NGX_ERROR || size > elcf->content_max_size)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+    if (ctx == NULL)
+    {
+        ctx = ngx_http_ericsten_ctx_create(r);
+        if (ctx == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_INIT);
+
+    ctx->response = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_response_t));
+    if (ctx->response == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    task = &ctx->task;
+    ctx->task_args.content.size = size;
+    ctx->task_args.content.done = 0;
+    ctx->task_args.content.seed = ngx_random();
+    ctx->task_args.content.digest = (r->method != NGX_HTTP_HEAD);
+
+    if (ngx_http_arg(r, (u_char *) "seed", 4, &value) == NGX_OK)
+    {
+        n = ngx_atoof(value.data, value.len);
+
+        if (n == NGX_ERROR)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ctx->task_args.content.seed = (uint64_t) n;
+    }
+
+    //
+    // xorshift64*; the state must not be zero.
+    //
+
+    ctx->task_args.content.x = ctx->task_args.content.seed ? ctx->task_args.content.seed
+                                                           : 0x9e3779b97f4a7c15ULL;
+
+    task->handler = ngx_http_ericsten_content_head;
+    task->event.handler = ngx_http_ericsten_content_completion_handler;
+    task->event.data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: failed to post new task");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    //
+    // The request is finalized by the completion handler, or by the stream
+    // that produces the body.
+    //
+
+    r->main->count++;
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_DONE;
+}
+
+//
+// The example generator: fill p to end from the state x.  Each state step
+// gives 8 bytes, so a body cut into pieces whose sizes are multiples of 8
+// comes out the same as in one piece.
+//
+
+static void
+ngx_http_ericsten_content_fill(uint64_t *x, u_char *p, u_char *end)
+{
+    uint64_t  v = *x;
+
+    while (p < end)
+    {
+        v ^= v >> 12;
+        v ^= v << 25;
+        v ^= v >> 27;
+
+        v *= 0x2545f4914f6cdd1dULL;
+
+        if (end - p >= 8)
+        {
+            ngx_memcpy(p, &v, 8);
+            p += 8;
+        }
+        else
+        {
+            ngx_memcpy(p, &v, end - p);
+            p = end;
+        }
+    }
+
+    *x = v;
+}
+
+//
+// Thread Pool Task Functions
+//
+
+static void
+ngx_http_ericsten_content_head(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t               *ctx = data;
+    ngx_http_ericsten_response_t          *resp = ctx->response;
+    off_t                                  rest;
+    size_t                                 n;
+    uint64_t                               x;
+    uint32_t                               crc;
+    u_char                                *p, buf[4096];
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    ngx_http_ericsten_arena_begin(&resp->lease, log);
+
+    resp->status = NGX_HTTP_OK;
+    ngx_str_set(&resp->content_type, "application/octet-stream");
+    resp->content_length = ctx->task_args.content.size;
+
+    if (!ctx->task_args.content.digest)
+    {
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+        return;
+    }
+
+    //
+    // The body, generated into a scratch buffer and thrown away: only its
+    // CRC is kept.  The body task generates it again from the same state.
+    //
+
+    x = ctx->task_args.content.x;
+    rest = ctx->task_args.content.size;
+
+    ngx_http_ericsten_crc32c_init(&crc);
+
+    while (rest)
+    {
+        n = (size_t) ngx_min(rest, (off_t) sizeof(buf));
+
+        ngx_http_ericsten_content_fill(&x, buf, buf + n);
+        ngx_http_ericsten_crc32c_update(&crc, buf, n);
+
+        rest -= n;
+    }
+
+    ngx_http_ericsten_crc32c_final(&crc);
+
+    p = ngx_http_ericsten_arena_alloc(&resp->lease, 8);
+
+    if (p == NULL)
+    {
+        resp->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+        return;
+    }
+
+    ngx_str_set(&resp->headers[0].key, "X-Ericsten-Crc32c");
+    resp->headers[0].value.data = p;
+    resp->headers[0].value.len = ngx_sprintf(p, "%08xD", crc) - p;
+    resp->nheaders = 1;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+}
+
+static void
+ngx_http_ericsten_content_generate(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t               *ctx = data;
+    ngx_buf_t                             *b;
+    off_t                                  n;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    ctx->stream_starved = 0;
+
+    while (ctx->task_args.content.done < ctx->task_args.content.size)
+    {
+        if (__atomic_load_n(&ctx->stream_abort, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        b = ngx_http_ericsten_stream_get(ctx);
+
+        if (b == NULL)
+        {
+            break;
+        }
+
+        n = ngx_min(ctx->task_args.content.size - ctx->task_args.content.done,
+                    NGX_HTTP_ERICSTEN_CONTENT_BUF_SIZE);
+
+        b->pos = b->start;
+        b->last = b->pos + n;
+
+        ngx_http_ericsten_content_fill(&ctx->task_args.content.x, b->pos, b->last);
+
+        ctx->task_args.content.done += n;
+
+        ngx_http_ericsten_stream_put(ctx, b, log);
+    }
+
+    if (!ctx->stream_starved)
+    {
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_content_generate: %O of %O bytes",
+        ctx->task_args.content.done, ctx->task_args.content.size);
+}
+
+static void
+ngx_http_ericsten_content_completion_handler(ngx_event_t *ev)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_str_t                     *value;
+    ngx_table_elt_t               *h;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_ericsten_ctx_t       *ctx = ev->data;
+    ngx_http_ericsten_response_t  *resp = ctx->response;
+
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_content_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    //
+    // Copy the header values out of the task's arena and give it the
+    // memory back right away, while it is still warm in the thread's cache.
+    //
+
+    for (i = 0; i < resp->nheaders; i++)
+    {
+        value = &resp->headers[i].value;
+        value->data = ngx_pstrdup(r->pool, value);
+
+        if (value->data == NULL)
+        {
+            resp->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ngx_http_ericsten_arena_release(&resp->lease);
+
+    if (resp->status >= NGX_HTTP_SPECIAL_RESPONSE)
+    {
+        rc = resp->status;
+        goto done;
+    }
+
+    r->headers_out.status = resp->status;
+    r->headers_out.content_length_n = resp->content_length;
+    r->headers_out.content_type = resp->content_type;
+    r->headers_out.content_type_len = resp->content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    for (i = 0; i < resp->nheaders; i++)
+    {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL)
+        {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        h->hash = 1;
+        h->key = resp->headers[i].key;
+        h->value = resp->headers[i].value;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    {
+        goto done;
+    }
+
+    if (ctx->task_args.content.size == 0)
+    {
+        rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+        goto done;
+    }
+
+    //
+    // Produce the body.  The request reference passes to the stream, which
+    // sends the buffers as they fill and ends the response.
+    //
+
+    ctx->stream_header_sent = 1;
+
+    if (ngx_http_ericsten_stream_init(r, ctx, NGX_HTTP_ERICSTEN_CONTENT_BUF_SIZE) != NGX_OK
+        || ngx_http_ericsten_stream_post(r, ctx, ngx_http_ericsten_content_generate) != NGX_OK)
+    {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    ngx_http_run_posted_requests(c);
+
+    return;
+
+done:
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// Streaming Content
+//
+// With ericsten_stream, a pool task produces the response body a piece at a
+// time, and each piece is sent as soon as it is ready rather than when the
+// task completes.  The response has no Content-Length, so it goes out with
+// chunked encoding.
+//
+// A fixed set of buffers cycles between the task and the event loop through
+// two single-producer single-consumer rings.  After handing over a buffer
+// the task puts the request on the worker's ready list (a lock-free stack)
+// and, if the list was empty, rings the worker's doorbell: an eventfd (or a
+// pipe) watched by the event loop.  The doorbell handler flushes every
+// request on the list.  Buffers come back to the task once the output
+// filters have sent them.  A task that finds none free returns, and is
+// posted again when some come back, so a slow client holds neither the
+// worker nor a pool thread.
+//
+// The example task works like the sleep task, 100 to 1000 ms in 100 ms
+// steps, but emits a line after each step, padded with ?chunk= bytes.
+//
+
+static ngx_fd_t                  ngx_http_ericsten_doorbell_fd[2] = { -1, -1 };
+static ngx_http_ericsten_ctx_t  *ngx_http_ericsten_stream_ready_list;      // Atomic.
+
+static ngx_uint_t  ngx_http_ericsten_stream_tag;
+
+static ngx_uint_t
+ngx_http_ericsten_ring_push(ngx_http_ericsten_ring_t *ring, ngx_buf_t *b)
+{
+    ngx_uint_t  head, tail;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == NGX_HTTP_ERICSTEN_RING_SIZE)
+    {
+        return FALSE;
+    }
+
+    ring->slot[tail & (NGX_HTTP_ERICSTEN_RING_SIZE - 1)] = b;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+static ngx_buf_t *
+ngx_http_ericsten_ring_pop(ngx_http_ericsten_ring_t *ring)
+{
+    ngx_buf_t   *b;
+    ngx_uint_t   head, tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        return NULL;
+    }
+
+    b = ring->slot[head & (NGX_HTTP_ERICSTEN_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return b;
+}
+
+//
+// The doorbell of streaming tasks: an eventfd, or a pipe, that wakes the
+// event loop up.  It is marked as a channel, so that a worker exiting with
+// it open does not report it as a leaked connection.
+//
+
+static ngx_int_t
+ngx_http_ericsten_doorbell_init(ngx_cycle_t *cycle)
+{
+    ngx_connection_t  *c;
+
+#if (NGX_HAVE_EVENTFD)
+    ngx_http_ericsten_doorbell_fd[0] = eventfd(0, 0);
+
+    if (ngx_http_ericsten_doorbell_fd[0] == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            "ngx_http_ericsten: eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_http_ericsten_doorbell_fd[1] = ngx_http_ericsten_doorbell_fd[0];
+#else
+    if (pipe(ngx_http_ericsten_doorbell_fd) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            "ngx_http_ericsten: pipe() failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(ngx_http_ericsten_doorbell_fd[1]) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+            "ngx_http_ericsten: " ngx_nonblocking_n " failed");
+        return NGX_ERROR;
+    }
+#endif
+
+    if (ngx_nonblocking(ngx_http_ericsten_doorbell_fd[0]) == -1)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+            "ngx_http_ericsten: " ngx_nonblocking_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(ngx_http_ericsten_doorbell_fd[0], cycle->log);
+    if (c == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_http_ericsten_doorbell_handler;
+    c->read->log = cycle->log;
+    c->read->channel = 1;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_doorbell_ring(ngx_log_t *log)
+{
+    uint64_t  value = 1;
+
+    //
+    // Called on pool threads.  A full pipe or counter means the event loop
+    // has a wakeup pending anyway.
+    //
+
+    if (write(ngx_http_ericsten_doorbell_fd[1], &value, sizeof(uint64_t)) == -1
+        && ngx_errno != NGX_EAGAIN)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            "ngx_http_ericsten: doorbell write() failed");
+    }
+}
+
+static void
+ngx_http_ericsten_doorbell_handler(ngx_event_t *ev)
+{
+    u_char             buf[64];
+    ngx_connection_t  *c = ev->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "ngx_http_ericsten_doorbell_handler");
+
+    while (read(c->fd, buf, sizeof(buf)) > 0) { /* void */ }
+
+    ngx_http_ericsten_stream_run_ready();
+}
+
+//
+// Pool thread side: the request has buffers to send.
+//
+
+static void
+ngx_http_ericsten_stream_notify(ngx_http_ericsten_ctx_t *ctx, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t  *head;
+
+    if (__atomic_exchange_n(&ctx->stream_ready, 1, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+
+    head = __atomic_load_n(&ngx_http_ericsten_stream_ready_list, __ATOMIC_RELAXED);
+
+    do
+    {
+        ctx->stream_next = head;
+    }
+    while (!__atomic_compare_exchange_n(&ngx_http_ericsten_stream_ready_list, &head, ctx,
+                                        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL)
+    {
+        ngx_http_ericsten_doorbell_ring(log);
+    }
+}
+
+//
+// Event loop side: flush every request on the ready list.  The ready flag
+// is cleared before the rings are looked at, so that anything handed over
+// from then on gets the request back on the list.
+//
+
+static void
+ngx_http_ericsten_stream_run_ready(void)
+{
+    ngx_connection_t         *c;
+    ngx_http_ericsten_ctx_t  *ctx, *next;
+
+    ctx = __atomic_exchange_n(&ngx_http_ericsten_stream_ready_list, NULL, __ATOMIC_ACQUIRE);
+
+    for ( /* void */ ; ctx; ctx = next)
+    {
+        next = ctx->stream_next;
+
+        __atomic_store_n(&ctx->stream_ready, 0, __ATOMIC_SEQ_CST);
+
+        c = ctx->r->connection;
+
+        ngx_http_set_log_request(c->log, ctx->r);
+
+        ngx_http_ericsten_stream_process(ctx->r, ctx);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+static char *
+ngx_http_ericsten_stream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_loc_conf_t   *elcf = conf;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    if (elcf->stream != NGX_CONF_UNSET)
+    {
+        return "is duplicate";
+    }
+
+    elcf->stream = 1;
+
+    emcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ericsten_module);
+    emcf->doorbell = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_ericsten_stream_handler;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_stream_handler(ngx_http_request_t *r)
+{
+    off_t                                 chunk;
+    ngx_int_t                             rc;
+    ngx_str_t                             value;
+    ngx_http_ericsten_ctx_t              *ctx;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
+
+    chunk = 0;
+
+    if (ngx_http_arg(r, (u_char *) "chunk", 5, &value) == NGX_OK)
+    {
+        chunk = ngx_parse_offset(&value);
+
+        if (chunk == NGX_ERROR || chunk > NGX_HTTP_ERICSTEN_STREAM_CHUNK_MAX)
+        {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+    if (ctx == NULL)
+    {
+        ctx = ngx_http_ericsten_ctx_create(r);
+        if (ctx == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_INIT);
+
+    if (ngx_http_ericsten_stream_init(r, ctx, 128 + (size_t) chunk) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->task_args.stream.steps = (ngx_random() % 9) + 1;
+    ctx->task_args.stream.chunk = (size_t) chunk;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (ngx_http_ericsten_stream_post(r, ctx, ngx_http_ericsten_stream_produce) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+//
+// Set up the rings and the buffers cycling through them, each with room for
+// size bytes.
+//
+
+static ngx_int_t
+ngx_http_ericsten_stream_init(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, size_t size)
+{
+    ngx_buf_t   *b;
+    ngx_uint_t   i;
+
+    //
+    // Only streaming requests pay for the rings, which take a cache line
+    // per index.
+    //
+
+    ctx->stream = ngx_pmemalign(r->pool, sizeof(ngx_http_ericsten_stream_t), NGX_CPU_CACHE_LINE);
+    if (ctx->stream == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ctx->stream, sizeof(ngx_http_ericsten_stream_t));
+
+    //
+    // The buffers are not tagged as buffer pool buffers, so that none of our
+    // filters returns them to the pool: they belong to the rings until the
+    // request ends.
+    //
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_STREAM_BUFS; i++)
+    {
+        b = ngx_http_ericsten_buf_get(r, ctx, size);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_ericsten_stream_tag;
+
+        (void) ngx_http_ericsten_ring_push(&ctx->stream->free, b);
+    }
+
+    return NGX_OK;
+}
+
+//
+// Post a producer task, or post it again once it has returned for want of
+// buffers.  The response headers must be set by now; they are sent with the
+// first buffer.  The caller holds a reference on the request
+// (r->main->count) that the stream finalizes.
+//
+
+static ngx_int_t
+ngx_http_ericsten_stream_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx,
+    void (*handler)(void *data, ngx_log_t *log))
+{
+    ngx_thread_pool_t  *tp;
+    ngx_thread_task_t  *task = &ctx->task;
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_ERROR;
+    }
+
+    task->handler = handler;
+    task->event.handler = ngx_http_ericsten_stream_completion_handler;
+    task->event.data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: failed to post new task");
+        return NGX_ERROR;
+    }
+
+    //
+    // r->aio is left alone: the response is written while the task runs.
+    //
+
+    r->main->blocked++;
+
+    r->write_event_handler = ngx_http_ericsten_stream_write_handler;
+
+    return NGX_OK;
+}
+
+//
+// Pool thread side: take an empty buffer.  If there is none, because the
+// client reads slower than the task produces, NULL is returned with
+// stream_starved set: the task is to return, keeping its place, and carry
+// on from there when it is posted again.
+//
+
+static ngx_buf_t *
+ngx_http_ericsten_stream_get(ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_buf_t  *b;
+
+    b = ngx_http_ericsten_ring_pop(&ctx->stream->free);
+
+    if (b == NULL)
+    {
+        ctx->stream_starved = 1;
+    }
+
+    return b;
+}
+
+//
+// Pool thread side: hand a filled buffer to the event loop.
+//
+
+static void
+ngx_http_ericsten_stream_put(ngx_http_ericsten_ctx_t *ctx, ngx_buf_t *b, ngx_log_t *log)
+{
+    (void) ngx_http_ericsten_ring_push(&ctx->stream->full, b);
+
+    ngx_http_ericsten_stream_notify(ctx, log);
+}
+
+//
+// Thread Pool Task Function
+//
+
+static void
+ngx_http_ericsten_stream_produce(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t              *ctx = data;
+    ngx_buf_t                            *b;
+    ngx_uint_t                            i;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    ctx->stream_starved = 0;
+
+    for (i = ctx->task_args.stream.step; i < ctx->task_args.stream.steps; i++)
+    {
+        if (__atomic_load_n(&ctx->stream_abort, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        b = ngx_http_ericsten_stream_get(ctx);
+
+        if (b == NULL)
+        {
+            break;
+        }
+
+        ngx_msleep(100);
+
+        b->pos = b->start;
+        b->last = ngx_sprintf(b->pos, "step %ui of %ui, %ui ms\n",
+                              i + 1, ctx->task_args.stream.steps, (i + 1) * 100);
+
+        if (ctx->task_args.stream.chunk)
+        {
+            ngx_memset(b->last, '.', ctx->task_args.stream.chunk - 1);
+            b->last += ctx->task_args.stream.chunk - 1;
+            *b->last++ = '\n';
+        }
+
+        b->flush = 1;
+
+        ngx_http_ericsten_stream_put(ctx, b, log);
+    }
+
+    ctx->task_args.stream.step = i;
+    ctx->msSleep = i * 100;
+
+    if (!ctx->stream_starved)
+    {
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+}
+
+//
+// Event loop side: send whatever the task has handed over, give sent buffers
+// back to it, and finish the request once the task is done.
+//
+
+static ngx_int_t
+ngx_http_ericsten_stream_flush(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *out, **ll, *cl;
+
+    out = NULL;
+    ll = &out;
+
+    while ((b = ngx_http_ericsten_ring_pop(&ctx->stream->full)) != NULL)
+    {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    if (ctx->stream_done && !ctx->stream_last_sent)
+    {
+        b = ngx_calloc_buf(r->pool);
+        cl = ngx_alloc_chain_link(r->pool);
+        if (b == NULL || cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (r == r->main)
+        {
+            b->last_buf = 1;
+        }
+        else
+        {
+            b->last_in_chain = 1;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+
+        ctx->stream_last_sent = 1;
+    }
+
+    *ll = NULL;
+
+    if (!ctx->stream_header_sent)
+    {
+        if (out == NULL)
+        {
+            return NGX_OK;
+        }
+
+        ctx->stream_header_sent = 1;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        {
+            return rc;
+        }
+    }
+
+    if (out == NULL && ctx->stream_out_busy == NULL)
+    {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    //
+    // Sent buffers go back to the task.
+    //
+
+    ngx_chain_update_chains(r->pool, &ctx->stream_out_free, &ctx->stream_out_busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_ericsten_stream_tag);
+
+    for (cl = ctx->stream_out_free; cl; cl = cl->next)
+    {
+        (void) ngx_http_ericsten_ring_push(&ctx->stream->free, cl->buf);
+    }
+
+    ctx->stream_out_free = NULL;
+
+    return rc;
+}
+
+static void
+ngx_http_ericsten_stream_stop(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_int_t rc)
+{
+    ctx->stream_stopped = 1;
+    ctx->stream_rc = rc;
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (ctx->stream_done || ctx->stream_parked)
+    {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    //
+    // The task is running: have it stop early; the completion handler
+    // finalizes the request.
+    //
+
+    __atomic_store_n(&ctx->stream_abort, 1, __ATOMIC_RELEASE);
+}
+
+//
+// After a flush: wait for the client if the output filters could not send
+// everything.
+//
+
+static ngx_int_t
+ngx_http_ericsten_stream_wait(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_event_t               *wev;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    wev = r->connection->write;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (rc == NGX_AGAIN)
+    {
+        if (!wev->delayed)
+        {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        return ngx_handle_write_event(wev, clcf->send_lowat);
+    }
+
+    if (wev->timer_set)
+    {
+        ngx_del_timer(wev);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_stream_process(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t  rc;
+
+    if (ctx->stream_stopped)
+    {
+        return;
+    }
+
+    rc = ngx_http_ericsten_stream_flush(r, ctx);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    {
+        ngx_http_ericsten_stream_stop(r, ctx, rc);
+        return;
+    }
+
+    //
+    // A parked task goes back to the pool as soon as it has a buffer to
+    // fill.  The task is not running, so both ends of the ring can be read.
+    //
+
+    if (ctx->stream_parked && ctx->stream->free.head != ctx->stream->free.tail)
+    {
+        ctx->stream_parked = 0;
+
+        if (ngx_http_ericsten_stream_post(r, ctx, ctx->task.handler) != NGX_OK)
+        {
+            ctx->stream_parked = 1;
+            ngx_http_ericsten_stream_stop(r, ctx, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (ctx->stream_last_sent)
+    {
+        //
+        // Everything has been passed on; ngx_http_writer() sends the rest.
+        //
+
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    if (ngx_http_ericsten_stream_wait(r, rc) != NGX_OK)
+    {
+        ngx_http_ericsten_stream_stop(r, ctx, NGX_ERROR);
+    }
+}
+
+static void
+ngx_http_ericsten_stream_write_handler(ngx_http_request_t *r)
+{
+    ngx_http_ericsten_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+
+    if (r->connection->write->timedout)
+    {
+        r->connection->timedout = 1;
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+            "client timed out");
+        ngx_http_ericsten_stream_stop(r, ctx, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_ericsten_stream_process(r, ctx);
+}
+
+static void
+ngx_http_ericsten_stream_completion_handler(ngx_event_t *ev)
+{
+    ngx_connection_t         *c;
+    ngx_http_request_t       *r;
+    ngx_http_ericsten_ctx_t  *ctx = ev->data;
+
+    r = ctx->r;
+    c = r->connection;
+
+    //
+    // The task may have put the request on the ready list after the last
+    // doorbell was handled; take it off before the request can go away.
+    //
+
+    ngx_http_ericsten_stream_run_ready();
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_stream_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+
+    if (ctx->stream_starved && !ctx->stream_stopped)
+    {
+        //
+        // Out of buffers: the task is posted again once some are sent.
+        //
+
+        ctx->stream_parked = 1;
+
+        ngx_http_ericsten_stream_process(r, ctx);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    ctx->stream_done = 1;
+
+    if (ctx->stream_stopped)
+    {
+        ngx_http_finalize_request(r, ctx->stream_rc);
+    }
+    else if (__atomic_load_n(&ctx->stream_failed, __ATOMIC_ACQUIRE))
+    {
+        //
+        // The response cannot be completed; the connection is closed so the
+        // client sees a truncated response rather than a short one.
+        //
+
+        ngx_http_ericsten_stream_stop(r, ctx, NGX_ERROR);
+    }
+    else
+    {
+        ngx_http_ericsten_stream_process(r, ctx);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// File Content
+//
+// With ericsten_file, files are served from the location's root without the
+// event loop ever touching the disk.  A first task opens the file and checks
+// with mincore() whether it is entirely in the page cache:
+//
+//  - If it is, the response is a regular file buffer, sent with sendfile()
+//    from the event loop: it cannot fault on a cold page.
+//
+//  - If it is not, a second task reads it with preadv(), filling as many of
+//    the streaming buffers as are free in one call, and hands them over as
+//    in ericsten_stream.  Sequential readahead hints are given unless
+//    ericsten_file_readahead is off, and files of at least
+//    ericsten_file_directio bytes bypass the page cache with O_DIRECT, which
+//    is why the buffers are page aligned.
+//
+// With ericsten_file_io io_uring, there are no tasks: the open and the reads
+// go through the worker's io_uring, and their completions resume the request
+// on the event loop like task completions do.  The streaming buffers are
+// read into directly, one read each, and sent in file order as they fill.
+// A request that finds the ring unavailable or full uses the tasks.
+//
+
+static char *
+ngx_http_ericsten_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_ericsten_loc_conf_t   *elcf = conf;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_ericsten_main_conf_t  *emcf;
+
+    if (elcf->file != NGX_CONF_UNSET)
+    {
+        return "is duplicate";
+    }
+
+    elcf->file = 1;
+
+    //
+    // Files not in the page cache are read through the streaming rings.
+    //
+
+    emcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_ericsten_module);
+    emcf->doorbell = 1;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_ericsten_file_handler;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_file_handler(ngx_http_request_t *r)
+{
+    size_t                         root;
+    ngx_int_t                      rc;
+    ngx_str_t                      path;
+    ngx_thread_pool_t             *tp;
+    ngx_thread_task_t             *task;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_ericsten_ctx_t       *ctx;
+    ngx_http_ericsten_file_t      *file;
+    ngx_http_ericsten_loc_conf_t  *elcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/')
+    {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK)
+    {
+        return rc;
+    }
+
+    if (ngx_http_map_uri_to_path(r, &path, &root, 0) == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "ngx_http_ericsten_file_handler: \"%s\"", path.data);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+    if (ctx == NULL)
+    {
+        ctx = ngx_http_ericsten_ctx_create(r);
+        if (ctx == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_INIT);
+
+    file = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_file_t));
+    if (file == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    file->path = path.data;
+    file->fd = NGX_INVALID_FILE;
+    file->directio = elcf->file_directio;
+    file->readahead = elcf->file_readahead;
+
+    ctx->file = file;
+
+    if (elcf->file_io == NGX_HTTP_ERICSTEN_FILE_IO_URING
+        && ngx_http_ericsten_uring_reserve(NGX_HTTP_ERICSTEN_STREAM_BUFS, r->connection->log) == NGX_OK)
+    {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL)
+        {
+            ngx_http_ericsten_uring_release(NGX_HTTP_ERICSTEN_STREAM_BUFS);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cln->handler = ngx_http_ericsten_file_uring_cleanup;
+        cln->data = file;
+
+        file->uring = 1;
+
+        file->open_op.event.handler = ngx_http_ericsten_file_uring_open_handler;
+        file->open_op.event.data = ctx;
+        file->open_op.event.log = r->connection->log;
+
+        ngx_http_ericsten_uring_openat(&file->open_op, file->path, O_RDONLY|O_CLOEXEC);
+
+        file->inflight++;
+
+        r->main->count++;
+        r->main->blocked++;
+        r->aio = 1;
+
+        ngx_http_ericsten_uring_submit(r->connection->log);
+
+        return NGX_DONE;
+    }
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    task = &ctx->task;
+
+    task->handler = ngx_http_ericsten_file_open;
+    task->event.handler = ngx_http_ericsten_file_open_completion_handler;
+    task->event.data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: failed to post new task");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->main->count++;
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_DONE;
+}
+
+//
+// Thread Pool Task Functions
+//
+
+static void
+ngx_http_ericsten_file_open(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t       *ctx = data;
+    ngx_http_ericsten_file_t      *file = ctx->file;
+
+    file->fd = ngx_open_file(file->path, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK, NGX_FILE_OPEN, 0);
+
+    if (file->fd == NGX_INVALID_FILE)
+    {
+        file->err = ngx_errno;
+        return;
+    }
+
+    ngx_http_ericsten_file_check(file, 1, log);
+}
+
+//
+// Look at an open file: its type and size, with residency set whether it is
+// in the page cache, and the O_DIRECT and readahead settings for reading it.
+// The residency check maps the file and allocates a byte per page, which is
+// too much for the event loop; without it, a file is taken as not cached.
+//
+
+static void
+ngx_http_ericsten_file_check(ngx_http_ericsten_file_t *file, ngx_uint_t residency, ngx_log_t *log)
+{
+    ngx_file_info_t   fi;
+
+    if (ngx_fd_info(file->fd, &fi) == NGX_FILE_ERROR)
+    {
+        file->err = ngx_errno;
+        return;
+    }
+
+    file->regular = ngx_is_file(&fi) ? 1 : 0;
+    file->size = ngx_file_size(&fi);
+    file->mtime = ngx_file_mtime(&fi);
+
+    if (!file->regular)
+    {
+        return;
+    }
+
+    if (file->size == 0)
+    {
+        file->resident = 1;
+        return;
+    }
+
+    if (residency)
+    {
+        ngx_http_ericsten_file_residency(file, log);
+
+        if (file->resident)
+        {
+            return;
+        }
+    }
+
+#if (NGX_HAVE_O_DIRECT)
+    if (file->directio && file->size >= file->directio)
+    {
+        if (ngx_directio_on(file->fd) != NGX_FILE_ERROR)
+        {
+            file->direct = 1;
+        }
+        else
+        {
+            ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                ngx_directio_on_n " \"%s\" failed", file->path);
+        }
+    }
+#endif
+
+#if (NGX_HAVE_POSIX_FADVISE)
+    if (file->readahead && !file->direct)
+    {
+        (void) posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#endif
+}
+
+//
+// Residency check.  Mapping the file does not read it; mincore() only
+// reports which of its pages are cached.  The vector it fills, a byte per
+// page, is scratch memory for the duration of the task: it comes from the
+// thread's arena, which hands the same warm block to the next open, and is
+// given back before returning.
+//
+
+static void
+ngx_http_ericsten_file_residency(ngx_http_ericsten_file_t *file, ngx_log_t *log)
+{
+    u_char                           *vec;
+    void                             *addr;
+    size_t                            pages, i;
+    long                              page_size;
+    ngx_http_ericsten_arena_lease_t   lease;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    pages = (size_t) ((file->size + page_size - 1) / page_size);
+
+    addr = mmap(NULL, (size_t) file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        return;
+    }
+
+    ngx_http_ericsten_arena_begin(&lease, log);
+
+    vec = ngx_http_ericsten_arena_alloc(&lease, pages);
+
+    if (vec != NULL && mincore(addr, (size_t) file->size, vec) == 0)
+    {
+        for (i = 0; i < pages && (vec[i] & 1); i++) { /* void */ }
+
+        file->resident = (i == pages);
+    }
+
+    ngx_http_ericsten_arena_release(&lease);
+
+    (void) munmap(addr, (size_t) file->size);
+}
+
+static void
+ngx_http_ericsten_file_read(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t       *ctx = data;
+    ngx_http_ericsten_file_t      *file = ctx->file;
+    ngx_buf_t                     *b, *bufs[NGX_HTTP_ERICSTEN_STREAM_BUFS];
+    struct iovec                   iov[NGX_HTTP_ERICSTEN_STREAM_BUFS];
+    ngx_uint_t                     n, i;
+    ssize_t                        rd;
+    size_t                         len;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    ctx->stream_starved = 0;
+
+    n = 0;
+
+    while (file->offset < file->size)
+    {
+        if (__atomic_load_n(&ctx->stream_abort, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        //
+        // At least one empty buffer, then whatever else is free: one
+        // preadv() fills them all.  Buffers left over from a short read are
+        // kept for the next round.
+        //
+
+        if (n == 0)
+        {
+            b = ngx_http_ericsten_stream_get(ctx);
+
+            if (b == NULL)
+            {
+                break;
+            }
+
+            bufs[n++] = b;
+        }
+
+        while (n < NGX_HTTP_ERICSTEN_STREAM_BUFS
+               && (b = ngx_http_ericsten_ring_pop(&ctx->stream->free)) != NULL)
+        {
+            bufs[n++] = b;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            bufs[i]->pos = ngx_align_ptr(bufs[i]->start, NGX_HTTP_ERICSTEN_FILE_ALIGN);
+            bufs[i]->last = bufs[i]->pos;
+
+            iov[i].iov_base = bufs[i]->pos;
+            iov[i].iov_len = NGX_HTTP_ERICSTEN_FILE_BUF_SIZE;
+        }
+
+#if (NGX_HAVE_POSIX_FADVISE)
+        if (file->readahead && !file->direct)
+        {
+            //
+            // Ask for the next batch while this one is being read.
+            //
+
+            (void) posix_fadvise(file->fd, file->offset + n * NGX_HTTP_ERICSTEN_FILE_BUF_SIZE,
+                                 n * NGX_HTTP_ERICSTEN_FILE_BUF_SIZE, POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        rd = preadv(file->fd, iov, (int) n, file->offset);
+
+        if (rd == -1)
+        {
+            if (ngx_errno == NGX_EINTR)
+            {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                "preadv() \"%s\" failed", file->path);
+            __atomic_store_n(&ctx->stream_failed, 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        if (rd == 0)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, 0,
+                "file \"%s\" was truncated while read", file->path);
+            __atomic_store_n(&ctx->stream_failed, 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        //
+        // Never send more than the Content-Length promised, even if the
+        // file has grown since.
+        //
+
+        if (rd > file->size - file->offset)
+        {
+            rd = (ssize_t) (file->size - file->offset);
+        }
+
+        file->offset += rd;
+
+        for (i = 0; i < n && rd > 0; i++)
+        {
+            len = ngx_min((size_t) rd, NGX_HTTP_ERICSTEN_FILE_BUF_SIZE);
+
+            bufs[i]->last = bufs[i]->pos + len;
+            rd -= len;
+
+            ngx_http_ericsten_stream_put(ctx, bufs[i], log);
+        }
+
+        ngx_memmove(bufs, &bufs[i], (n - i) * sizeof(ngx_buf_t *));
+        n -= i;
+
+#if (NGX_HAVE_O_DIRECT)
+        if (file->direct
+            && file->offset < file->size
+            && (file->offset & (NGX_HTTP_ERICSTEN_FILE_ALIGN - 1)))
+        {
+            //
+            // A short read left the offset unaligned, which O_DIRECT
+            // rejects; the rest of the file goes through the page cache.
+            //
+
+            if (ngx_directio_off(file->fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                    ngx_directio_off_n " \"%s\" failed", file->path);
+                __atomic_store_n(&ctx->stream_failed, 1, __ATOMIC_RELEASE);
+                break;
+            }
+
+            file->direct = 0;
+        }
+#endif
+    }
+
+    //
+    // A task that runs out of buffers has none in hand.  Spare buffers left
+    // once the file is read are not handed back; the ring they came from
+    // only runs the other way, and the stream is over.
+    //
+
+    if (!ctx->stream_starved)
+    {
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_file_read: %O of %O bytes", file->offset, file->size);
+}
+
+static void
+ngx_http_ericsten_file_open_completion_handler(ngx_event_t *ev)
+{
+    ngx_connection_t         *c;
+    ngx_http_request_t       *r;
+    ngx_http_ericsten_ctx_t  *ctx = ev->data;
+
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_file_open_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ngx_http_ericsten_file_respond(r, ctx);
+
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// The file has been opened (or not): send the response.  The request
+// reference taken by the handler is released here, or passes to the read
+// stream.
+//
+
+static void
+ngx_http_ericsten_file_respond(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     level;
+    ngx_buf_t                     *b;
+    ngx_chain_t                    out;
+    ngx_connection_t              *c;
+    ngx_pool_cleanup_t            *cln;
+    ngx_pool_cleanup_file_t       *clnf;
+    ngx_http_ericsten_file_t      *file = ctx->file;
+
+    c = r->connection;
+
+    //
+    // Close the file with the request.
+    //
+
+    if (file->fd != NGX_INVALID_FILE)
+    {
+        cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+        if (cln == NULL)
+        {
+            (void) ngx_close_file(file->fd);
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        cln->handler = ngx_pool_cleanup_file;
+        clnf = cln->data;
+        clnf->fd = file->fd;
+        clnf->name = file->path;
+        clnf->log = c->log;
+    }
+
+    if (file->err)
+    {
+        switch (file->err)
+        {
+        case NGX_ENOENT:
+        case NGX_ENOTDIR:
+        case NGX_ENAMETOOLONG:
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_NOT_FOUND;
+            break;
+
+        case NGX_EACCES:
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_FORBIDDEN;
+            break;
+
+        default:
+            level = NGX_LOG_CRIT;
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        }
+
+        ngx_log_error(level, c->log, file->err,
+            "ngx_http_ericsten: \"%s\" failed", file->path);
+
+        goto done;
+    }
+
+    if (!file->regular)
+    {
+        rc = NGX_HTTP_NOT_FOUND;
+        goto done;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = file->size;
+    r->headers_out.last_modified_time = file->mtime;
+
+    if (ngx_http_set_etag(r) != NGX_OK || ngx_http_set_content_type(r) != NGX_OK)
+    {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+
+    if (file->resident || r->header_only)
+    {
+        //
+        // Hand the file to sendfile() as it is.
+        //
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        {
+            goto done;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        if (file->size)
+        {
+            b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+            if (b->file == NULL)
+            {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                goto done;
+            }
+
+            b->file_pos = 0;
+            b->file_last = file->size;
+            b->in_file = 1;
+
+            b->file->fd = file->fd;
+            b->file->name.data = file->path;
+            b->file->name.len = ngx_strlen(file->path);
+            b->file->log = c->log;
+        }
+
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        rc = ngx_http_output_filter(r, &out);
+
+        goto done;
+    }
+
+    //
+    // Not (all) in the page cache: read it through the ring, or on the pool.
+    //
+
+    if (file->uring)
+    {
+        rc = ngx_http_ericsten_file_uring_start(r, ctx);
+
+        if (rc != NGX_OK || r->header_only)
+        {
+            goto done;
+        }
+
+        return;
+    }
+
+    if (ngx_http_ericsten_stream_init(r, ctx, NGX_HTTP_ERICSTEN_FILE_BUF_SIZE + NGX_HTTP_ERICSTEN_FILE_ALIGN)
+        != NGX_OK)
+    {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+
+    if (ngx_http_ericsten_stream_post(r, ctx, ngx_http_ericsten_file_read) != NGX_OK)
+    {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+
+    return;
+
+done:
+
+    ngx_http_finalize_request(r, rc);
+}
+
+//
+// io_uring: the open has completed.
+//
+
+static void
+ngx_http_ericsten_file_uring_open_handler(ngx_event_t *ev)
+{
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_ericsten_ctx_t   *ctx = ev->data;
+    ngx_http_ericsten_file_t  *file = ctx->file;
+
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_file_uring_open_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    file->inflight--;
+
+    if (file->open_op.res < 0)
+    {
+        file->err = -file->open_op.res;
+    }
+    else
+    {
+        file->fd = file->open_op.res;
+
+        //
+        // On the event loop: the file is read through the ring whether it
+        // is cached or not, and cached pages come back on the first poll.
+        //
+
+        ngx_http_ericsten_file_check(file, 0, c->log);
+    }
+
+    ngx_http_ericsten_file_respond(r, ctx);
+
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// io_uring: the file is not (all) in the page cache.  Send the header and
+// start reading.
+//
+
+static ngx_int_t
+ngx_http_ericsten_file_uring_start(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i;
+    ngx_http_ericsten_file_t       *file = ctx->file;
+    ngx_http_ericsten_file_read_t  *rd;
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_STREAM_BUFS; i++)
+    {
+        b = ngx_http_ericsten_buf_get(r, ctx, NGX_HTTP_ERICSTEN_FILE_BUF_SIZE + NGX_HTTP_ERICSTEN_FILE_ALIGN);
+        if (b == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        //
+        // As in ericsten_stream, the buffers stay with the request.
+        //
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_ericsten_stream_tag;
+
+        rd = &file->reads[i];
+        rd->ctx = ctx;
+        rd->buf = b;
+        rd->state = ES_FILE_READ_FREE;
+
+        rd->op.event.handler = ngx_http_ericsten_file_uring_read_handler;
+        rd->op.event.data = rd;
+        rd->op.event.log = r->connection->log;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    {
+        return rc;
+    }
+
+    r->write_event_handler = ngx_http_ericsten_file_uring_write_handler;
+
+    ngx_http_ericsten_file_uring_process(r, ctx);
+
+    return NGX_OK;
+}
+
+//
+// io_uring: pass on the reads that are done, in file order, and take back
+// the buffers the output filters have sent.
+//
+
+static ngx_int_t
+ngx_http_ericsten_file_uring_flush(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i;
+    ngx_chain_t                    *out, **ll, *cl;
+    ngx_http_ericsten_file_t       *file = ctx->file;
+    ngx_http_ericsten_file_read_t  *rd;
+
+    out = NULL;
+    ll = &out;
+
+    for ( ;; )
+    {
+        rd = &file->reads[file->send_next];
+
+        if (rd->state != ES_FILE_READ_READY)
+        {
+            break;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = rd->buf;
+        *ll = cl;
+        ll = &cl->next;
+
+        rd->state = ES_FILE_READ_SENDING;
+
+        file->sent += rd->buf->last - rd->buf->pos;
+        file->send_next = (file->send_next + 1) % NGX_HTTP_ERICSTEN_STREAM_BUFS;
+    }
+
+    if (file->sent == file->size && !ctx->stream_last_sent)
+    {
+        b = ngx_calloc_buf(r->pool);
+        cl = ngx_alloc_chain_link(r->pool);
+        if (b == NULL || cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        if (r == r->main)
+        {
+            b->last_buf = 1;
+        }
+        else
+        {
+            b->last_in_chain = 1;
+        }
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+
+        ctx->stream_last_sent = 1;
+    }
+
+    *ll = NULL;
+
+    if (out == NULL && ctx->stream_out_busy == NULL)
+    {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    ngx_chain_update_chains(r->pool, &ctx->stream_out_free, &ctx->stream_out_busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_ericsten_stream_tag);
+
+    for (cl = ctx->stream_out_free; cl; cl = cl->next)
+    {
+        for (i = 0; i < NGX_HTTP_ERICSTEN_STREAM_BUFS; i++)
+        {
+            if (file->reads[i].buf == cl->buf)
+            {
+                file->reads[i].state = ES_FILE_READ_FREE;
+            }
+        }
+    }
+
+    ctx->stream_out_free = NULL;
+
+    return rc;
+}
+
+//
+// io_uring: submit a read for every free buffer, in turn, up to the end of
+// the file.  Reads are always of a whole buffer, as O_DIRECT needs aligned
+// sizes; what lies past the size found at open is dropped.
+//
+
+static void
+ngx_http_ericsten_file_uring_queue(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_uint_t                      n;
+    ngx_http_ericsten_file_t       *file = ctx->file;
+    ngx_http_ericsten_file_read_t  *rd;
+
+    n = 0;
+
+    while (file->offset < file->size)
+    {
+        rd = &file->reads[file->read_next];
+
+        if (rd->state != ES_FILE_READ_FREE)
+        {
+            break;
+        }
+
+        rd->offset = file->offset;
+        rd->buf->pos = ngx_align_ptr(rd->buf->start, NGX_HTTP_ERICSTEN_FILE_ALIGN);
+        rd->buf->last = rd->buf->pos;
+        rd->state = ES_FILE_READ_READING;
+
+        ngx_http_ericsten_uring_read(&rd->op, file->fd, rd->buf->pos,
+                                     NGX_HTTP_ERICSTEN_FILE_BUF_SIZE, rd->offset);
+
+        file->offset += NGX_HTTP_ERICSTEN_FILE_BUF_SIZE;
+        file->read_next = (file->read_next + 1) % NGX_HTTP_ERICSTEN_STREAM_BUFS;
+        file->inflight++;
+
+        r->main->blocked++;
+        n++;
+    }
+
+    if (n)
+    {
+        ngx_http_ericsten_uring_submit(r->connection->log);
+    }
+}
+
+static void
+ngx_http_ericsten_file_uring_stop(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_int_t rc)
+{
+    ctx->stream_stopped = 1;
+    ctx->stream_rc = rc;
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    //
+    // The kernel may still be writing into the buffers; if so, the last
+    // read completion finalizes the request.
+    //
+
+    if (ctx->file->inflight == 0)
+    {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+static void
+ngx_http_ericsten_file_uring_process(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t  rc;
+
+    if (ctx->stream_stopped)
+    {
+        return;
+    }
+
+    rc = ngx_http_ericsten_file_uring_flush(r, ctx);
+
+    if (rc == NGX_ERROR || rc > NGX_OK)
+    {
+        ngx_http_ericsten_file_uring_stop(r, ctx, rc);
+        return;
+    }
+
+    if (ctx->stream_last_sent)
+    {
+        //
+        // The whole file has been read and passed on.
+        //
+
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    ngx_http_ericsten_file_uring_queue(r, ctx);
+
+    if (ngx_http_ericsten_stream_wait(r, rc) != NGX_OK)
+    {
+        ngx_http_ericsten_file_uring_stop(r, ctx, NGX_ERROR);
+    }
+}
+
+static void
+ngx_http_ericsten_file_uring_write_handler(ngx_http_request_t *r)
+{
+    ngx_http_ericsten_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+
+    if (r->connection->write->timedout)
+    {
+        r->connection->timedout = 1;
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+            "client timed out");
+        ngx_http_ericsten_file_uring_stop(r, ctx, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_ericsten_file_uring_process(r, ctx);
+}
+
+//
+// io_uring: a read has completed.
+//
+
+static void
+ngx_http_ericsten_file_uring_read_handler(ngx_event_t *ev)
+{
+    off_t                           want, got;
+    ngx_connection_t               *c;
+    ngx_http_request_t             *r;
+    ngx_http_ericsten_ctx_t        *ctx;
+    ngx_http_ericsten_file_t       *file;
+    ngx_http_ericsten_file_read_t  *rd = ev->data;
+
+    ctx = rd->ctx;
+    file = ctx->file;
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_file_uring_read_handler: %O at %O, res %D",
+        (off_t) (rd->buf->last - rd->buf->pos), rd->offset, rd->op.res);
+
+    r->main->blocked--;
+    file->inflight--;
+
+    if (ctx->stream_stopped)
+    {
+        if (file->inflight == 0)
+        {
+            ngx_http_finalize_request(r, ctx->stream_rc);
+        }
+
+        goto done;
+    }
+
+    if (rd->op.res < 0)
+    {
+        ngx_log_error(NGX_LOG_CRIT, c->log, -rd->op.res,
+            "read() \"%s\" failed", file->path);
+        ngx_http_ericsten_file_uring_stop(r, ctx, NGX_ERROR);
+        goto done;
+    }
+
+    if (rd->op.res == 0)
+    {
+        ngx_log_error(NGX_LOG_CRIT, c->log, 0,
+            "file \"%s\" was truncated while read", file->path);
+        ngx_http_ericsten_file_uring_stop(r, ctx, NGX_ERROR);
+        goto done;
+    }
+
+    //
+    // Never send more than the Content-Length promised, even if the file
+    // has grown since.
+    //
+
+    want = ngx_min(file->size - rd->offset, NGX_HTTP_ERICSTEN_FILE_BUF_SIZE);
+    got = ngx_min(rd->buf->last - rd->buf->pos + rd->op.res, want);
+
+    rd->buf->last = rd->buf->pos + got;
+
+    if (got < want)
+    {
+        //
+        // Short read: read the rest into the same buffer.  Neither the
+        // buffer nor the offset is aligned now, which O_DIRECT rejects, so
+        // the rest of the file goes through the page cache.
+        //
+
+#if (NGX_HAVE_O_DIRECT)
+        if (file->direct)
+        {
+            if (ngx_directio_off(file->fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_CRIT, c->log, ngx_errno,
+                    ngx_directio_off_n " \"%s\" failed", file->path);
+                ngx_http_ericsten_file_uring_stop(r, ctx, NGX_ERROR);
+                goto done;
+            }
+
+            file->direct = 0;
+        }
+#endif
+
+        ngx_http_ericsten_uring_read(&rd->op, file->fd, rd->buf->last,
+                                     NGX_HTTP_ERICSTEN_FILE_BUF_SIZE - (size_t) got, rd->offset + got);
+
+        file->inflight++;
+        r->main->blocked++;
+
+        ngx_http_ericsten_uring_submit(c->log);
+
+        goto done;
+    }
+
+    rd->state = ES_FILE_READ_READY;
+
+    ngx_http_ericsten_file_uring_process(r, ctx);
+
+done:
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_ericsten_file_uring_cleanup(void *data)
+{
+    ngx_http_ericsten_uring_release(NGX_HTTP_ERICSTEN_STREAM_BUFS);
+}
+
+//
+// Request Body Streaming
+//
+// The body is read with r->request_body_no_buffering set, so that each chunk
+// is handed to us as soon as it arrives.  Each chunk is copied out of the
+// request body buffer (which frees that buffer for the next read) and queued
+// to the thread pool.  Only one chunk task is in flight at a time, so the
+// processing sees the bytes in order, but it overlaps with the network reads
+// of the following chunks.
+//
+// Once the last chunk is processed, the copies are put back on
+// r->request_body as a fully buffered in-memory body, so that later phases
+// (e.g. proxy_pass) see the same body they would have without this module.
+//
+
+static ngx_int_t
+ngx_http_ericsten_body_start(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_int_t                      rc;
+    ngx_http_ericsten_loc_conf_t  *elcf;
+
+    ctx->body_pending_last = &ctx->body_pending;
+    ctx->body_done_last = &ctx->body_done;
+    ngx_crc32_init(ctx->body_crc32);
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    if (!(elcf->digest & NGX_HTTP_ERICSTEN_DIGEST_OFF))
+    {
+        ctx->digest = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_digest_t));
+        if (ctx->digest == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->digest->mask = elcf->digest;
+        ngx_http_ericsten_crc32c_init(&ctx->digest->crc32c);
+        ngx_http_ericsten_xxh64_init(&ctx->digest->xxh64, 0);
+        ngx_http_ericsten_sha256_init(&ctx->digest->sha256);
+    }
+
+    if (elcf->json)
+    {
+        ctx->json = ngx_palloc(r->pool, sizeof(ngx_http_ericsten_json_t));
+        if (ctx->json == NULL)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_ericsten_json_init(ctx->json);
+    }
+
+    r->request_body_no_buffering = 1;
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_ericsten_body_post_read);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+    {
+        return rc;
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+
+    return NGX_DONE;
+}
+
+static void
+ngx_http_ericsten_body_post_read(ngx_http_request_t *r)
+{
+    ngx_int_t                 rc;
+    ngx_http_ericsten_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+
+    //
+    // Called once, with whatever part of the body has been read so far.  If
+    // there is more to come, the rest is pulled by our read event handler.
+    // Until the whole body is processed, write events must not re-enter the
+    // phase engine.
+    //
+
+    if (r->reading_body)
+    {
+        r->read_event_handler = ngx_http_ericsten_body_read_handler;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    rc = ngx_http_ericsten_body_read(r, ctx);
+
+    if (rc == NGX_OK)
+    {
+        rc = ngx_http_ericsten_body_next(r, ctx);
+    }
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+    {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+static void
+ngx_http_ericsten_body_read_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                 rc;
+    ngx_http_ericsten_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+
+    rc = ngx_http_ericsten_body_read(r, ctx);
+
+    if (rc == NGX_OK || rc == NGX_AGAIN)
+    {
+        rc = ngx_http_ericsten_body_next(r, ctx);
+
+        if (rc == NGX_OK || rc == NGX_AGAIN)
+        {
+            return;
+        }
+    }
+
+    if (ctx->body_busy)
+    {
+        //
+        // The pool thread still references this request; the chunk
+        // completion handler finalizes it.
+        //
+
+        ctx->body_rc = rc;
+        r->read_event_handler = ngx_http_block_reading;
+        return;
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+static ngx_int_t
+ngx_http_ericsten_body_read(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    size_t                    size;
+    ngx_int_t                 rc;
+    ngx_buf_t                *b;
+    ngx_chain_t              *cl, *ln;
+    ngx_http_request_body_t  *rb = r->request_body;
+
+    if (rb == NULL)
+    {
+        //
+        // The body is being discarded: there is nothing to process.
+        //
+
+        ctx->body_last = 1;
+        return NGX_OK;
+    }
+
+    for ( ;; )
+    {
+        //
+        // Copy out everything the request body filters have produced, and
+        // mark the original buffers consumed so they can be reused.
+        //
+
+        for (cl = rb->bufs; cl; cl = cl->next)
+        {
+            //
+            // The end of the body is flagged on its last buffer, which may
+            // be an empty one; the flag goes on the copies' last buffer once
+            // they are all processed.
+            //
+
+            if (cl->buf->last_buf)
+            {
+                ctx->body_last_buf = 1;
+            }
+
+            size = ngx_buf_size(cl->buf);
+
+            if (size == 0)
+            {
+                continue;
+            }
+
+            if (!ngx_buf_in_memory(cl->buf))
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "ngx_http_ericsten: request body buffered to file");
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b = ngx_create_temp_buf(r->pool, size);
+            if (b == NULL)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b->last = ngx_cpymem(b->pos, cl->buf->pos, size);
+            cl->buf->pos = cl->buf->last;
+
+            ln = ngx_alloc_chain_link(r->pool);
+            if (ln == NULL)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ln->buf = b;
+            ln->next = NULL;
+
+            *ctx->body_pending_last = ln;
+            ctx->body_pending_last = &ln->next;
+        }
+
+        rb->bufs = NULL;
+
+        if (!r->reading_body)
+        {
+            ctx->body_last = 1;
+            return NGX_OK;
+        }
+
+        rc = ngx_http_read_unbuffered_request_body(r);
+
+        if (rc != NGX_OK && rc != NGX_AGAIN)
+        {
+            return (rc >= NGX_HTTP_SPECIAL_RESPONSE) ? rc : NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc == NGX_AGAIN && rb->bufs == NULL)
+        {
+            return NGX_AGAIN;
+        }
+    }
+}
+
+static ngx_int_t
+ngx_http_ericsten_body_next(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_chain_t                        *cl;
+    ngx_thread_pool_t                  *tp;
+    ngx_thread_task_t                  *task = &ctx->task;
+
+    if (ctx->body_busy)
+    {
+        return NGX_AGAIN;
+    }
+
+    //
+    // An invalid JSON body is rejected as soon as the chunk that breaks it
+    // has been seen, without waiting for (or processing) the rest.  The
+    // finalization takes care of the unread part.
+    //
+
+    if (ctx->json && ctx->json->error)
+    {
+        goto invalid_json;
+    }
+
+    if (ctx->body_pending == NULL)
+    {
+        if (!ctx->body_last)
+        {
+            return NGX_AGAIN;
+        }
+
+        //
+        // An empty body is left alone: there is no document to validate.
+        //
+
+        if (ctx->json && ctx->json->offset
+            && ngx_http_ericsten_json_finish(ctx->json) != NGX_OK)
+        {
+            goto invalid_json;
+        }
+
+        //
+        // Everything has been read and processed: hand the body back as a
+        // regular in-memory request body and resume the request.
+        //
+
+        ngx_crc32_final(ctx->body_crc32);
+
+        if (ctx->digest)
+        {
+            ngx_http_ericsten_crc32c_final(&ctx->digest->crc32c);
+            ctx->digest->xxh64_result = ngx_http_ericsten_xxh64_final(&ctx->digest->xxh64);
+            ngx_http_ericsten_sha256_final(&ctx->digest->sha256, ctx->digest->sha256_result);
+            ctx->digest->final = 1;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "ngx_http_ericsten: request body done, %O bytes, crc32 %08xD",
+            ctx->body_bytes, ctx->body_crc32);
+
+        if (ctx->body_last_buf)
+        {
+            if (ngx_http_ericsten_body_last_buf(r, ctx) != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+
+        if (r->request_body)
+        {
+            r->request_body->bufs = ctx->body_done;
+        }
+
+        r->request_body_no_buffering = 0;
+        r->read_event_handler = ngx_http_block_reading;
+
+        ngx_http_ericsten_set_state(ctx, ES_TASK_DONE);
+
+        ngx_http_handler(r);
+
+        return NGX_OK;
+    }
+
+    tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+    if (tp == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+          "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cl = ctx->body_pending;
+    ctx->body_pending = cl->next;
+    if (ctx->body_pending == NULL)
+    {
+        ctx->body_pending_last = &ctx->body_pending;
+    }
+    cl->next = NULL;
+
+    ctx->task_args.chunk = cl;
+
+    task->handler = ngx_http_ericsten_body_chunk;
+    task->event.handler = ngx_http_ericsten_body_chunk_completion_handler;
+    task->event.data = ctx;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: failed to post new task");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    //
+    // Keep the request alive while the pool thread uses it.  r->aio is left
+    // alone: the client connection keeps being read while the task runs.
+    //
+
+    ctx->body_busy = 1;
+    r->main->blocked++;
+
+    return NGX_AGAIN;
+
+invalid_json:
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+        "ngx_http_ericsten: client sent invalid JSON body: %s at offset %O",
+        ctx->json->error, ctx->json->offset);
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+//
+// Put last_buf on the last of the processed copies, or, for an empty body,
+// on an empty buffer of its own.
+//
+
+static ngx_int_t
+ngx_http_ericsten_body_last_buf(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (ctx->body_done == NULL)
+    {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        ctx->body_done = cl;
+        ctx->body_done_last = &cl->next;
+    }
+
+    for (cl = ctx->body_done; cl->next; cl = cl->next) { /* void */ }
+
+    cl->buf->last_buf = 1;
+    cl->buf->last_in_chain = 1;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_body_chunk(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_ctx_t            *ctx = data;
+    ngx_buf_t                          *b = ctx->task_args.chunk->buf;
+
+    ngx_http_ericsten_set_state(ctx, ES_TASK_PROCESSING);
+
+    //
+    // Our per-chunk processing is simple: count the bytes and fold them
+    // into a running CRC32.
+    //
+
+    ngx_crc32_update(&ctx->body_crc32, b->pos, b->last - b->pos);
+    ctx->body_bytes += b->last - b->pos;
+
+    //
+    // Integrity digests, when configured.
+    //
+
+    if (ctx->digest)
+    {
+        if (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_CRC32C)
+        {
+            ngx_http_ericsten_crc32c_update(&ctx->digest->crc32c, b->pos, b->last - b->pos);
+        }
+
+        if (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_XXH64)
+        {
+            ngx_http_ericsten_xxh64_update(&ctx->digest->xxh64, b->pos, b->last - b->pos);
+        }
+
+        if (ctx->digest->mask & NGX_HTTP_ERICSTEN_DIGEST_SHA256)
+        {
+            ngx_http_ericsten_sha256_update(&ctx->digest->sha256, b->pos, b->last - b->pos);
+        }
+    }
+
+    //
+    // JSON validation.  A failure is left in ctx->json->error for the
+    // completion handler to act on.
+    //
+
+    if (ctx->json)
+    {
+        (void) ngx_http_ericsten_json_feed(ctx->json, b->pos, b->last - b->pos);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_body_chunk: processed %uz bytes, %O total",
+        (size_t) (b->last - b->pos), ctx->body_bytes);
+}
+
+static void
+ngx_http_ericsten_body_chunk_completion_handler(ngx_event_t *ev)
+{
+    ngx_int_t                           rc;
+    ngx_connection_t                   *c;
+    ngx_http_request_t                 *r;
+    ngx_http_ericsten_ctx_t            *ctx = ev->data;
+
+    r = ctx->r;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_body_chunk_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    ctx->body_busy = 0;
+
+    *ctx->body_done_last = ctx->task_args.chunk;
+    ctx->body_done_last = &ctx->task_args.chunk->next;
+
+    if (ctx->body_rc)
+    {
+        ngx_http_finalize_request(r, ctx->body_rc);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    rc = ngx_http_ericsten_body_next(r, ctx);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+    {
+        ngx_http_finalize_request(r, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// Buffer Pool
+//
+// Buffers that tasks write their output into come from a per-worker cache of
+// recycled blocks rather than from the request pool.  Such a buffer is passed
+// to the next filter as it is, with no copy, and goes back to the cache as
+// soon as the filters below have sent it instead of living as long as the
+// request.  Buffers still out when the request ends are returned by a pool
+// cleanup.
+//
+// The cache is only used on the event loop: a buffer is taken before its task
+// is posted and returned after the completion handler has passed it on, so
+// no lock is needed.  Pool buffers carry our module tag.
+//
+
+typedef struct
+{
+    ngx_queue_t     queue;      // In the cache, or in the owning request's list.
+    size_t          size;       // Usable bytes following the header.
+    ngx_uint_t      cls;        // Size class; NGX_HTTP_ERICSTEN_BUF_CLASSES if oversized.
+} ngx_http_ericsten_block_t;
+
+typedef struct
+{
+    ngx_queue_t     free[NGX_HTTP_ERICSTEN_BUF_CLASSES];
+    size_t          idle;       // Bytes sitting in the cache.
+    ngx_uint_t      initialized;
+} ngx_http_ericsten_bufcache_t;
+
+static ngx_http_ericsten_bufcache_t  ngx_http_ericsten_bufcache;
+
+#define ngx_http_ericsten_block_header                                       \
+    ngx_align(sizeof(ngx_http_ericsten_block_t), NGX_HTTP_ERICSTEN_BUF_ALIGN)
+
+#define ngx_http_ericsten_buf_class_size(cls)                                \
+    ((size_t) (((cls) & 1) ? 3 : 2) << (11 + (cls) / 2))
+
+static ngx_buf_t *
+ngx_http_ericsten_buf_get(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, size_t size)
+{
+    size_t                         n;
+    ngx_uint_t                     cls;
+    ngx_buf_t                     *b;
+    ngx_queue_t                   *q;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_ericsten_block_t     *blk;
+    ngx_http_ericsten_bufcache_t  *cache = &ngx_http_ericsten_bufcache;
+
+    if (!cache->initialized)
+    {
+        for (cls = 0; cls < NGX_HTTP_ERICSTEN_BUF_CLASSES; cls++)
+        {
+            ngx_queue_init(&cache->free[cls]);
+        }
+
+        cache->initialized = 1;
+    }
+
+    if (!ctx->bufs_cleanup)
+    {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL)
+        {
+            return NULL;
+        }
+
+        cln->handler = ngx_http_ericsten_buf_cleanup;
+        cln->data = ctx;
+
+        ngx_queue_init(&ctx->bufs);
+        ctx->bufs_cleanup = 1;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL)
+    {
+        return NULL;
+    }
+
+    for (cls = 0; cls < NGX_HTTP_ERICSTEN_BUF_CLASSES; cls++)
+    {
+        if (ngx_http_ericsten_buf_class_size(cls) >= size)
+        {
+            break;
+        }
+    }
+
+    if (cls < NGX_HTTP_ERICSTEN_BUF_CLASSES && !ngx_queue_empty(&cache->free[cls]))
+    {
+        q = ngx_queue_head(&cache->free[cls]);
+        ngx_queue_remove(q);
+
+        blk = ngx_queue_data(q, ngx_http_ericsten_block_t, queue);
+        cache->idle -= blk->size;
+    }
+    else
+    {
+        n = (cls < NGX_HTTP_ERICSTEN_BUF_CLASSES) ? ngx_http_ericsten_buf_class_size(cls) : size;
+
+        blk = ngx_memalign(NGX_HTTP_ERICSTEN_BUF_ALIGN, ngx_http_ericsten_block_header + n,
+                           r->connection->log);
+        if (blk == NULL)
+        {
+            return NULL;
+        }
+
+        blk->size = n;
+        blk->cls = cls;
+    }
+
+    ngx_queue_insert_tail(&ctx->bufs, &blk->queue);
+
+    b->start = (u_char *) blk + ngx_http_ericsten_block_header;
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_http_ericsten_module;
+
+    return b;
+}
+
+static void
+ngx_http_ericsten_buf_release(ngx_http_ericsten_block_t *blk)
+{
+    ngx_http_ericsten_bufcache_t  *cache = &ngx_http_ericsten_bufcache;
+
+    if (blk->cls == NGX_HTTP_ERICSTEN_BUF_CLASSES
+        || cache->idle + blk->size > NGX_HTTP_ERICSTEN_BUF_IDLE_MAX)
+    {
+        ngx_free(blk);
+        return;
+    }
+
+    //
+    // Most recently used first: its memory is the most likely to be cached.
+    //
+
+    ngx_queue_insert_head(&cache->free[blk->cls], &blk->queue);
+    cache->idle += blk->size;
+}
+
+//
+// Return a buffer to the pool.  Buffers that do not come from the pool are
+// left alone, as are buffers already returned.
+//
+
+static void
+ngx_http_ericsten_buf_put(ngx_buf_t *b)
+{
+    ngx_http_ericsten_block_t  *blk;
+
+    if (b->tag != (ngx_buf_tag_t) &ngx_http_ericsten_module || b->start == NULL)
+    {
+        return;
+    }
+
+    blk = (ngx_http_ericsten_block_t *) (b->start - ngx_http_ericsten_block_header);
+
+    ngx_queue_remove(&blk->queue);
+    ngx_http_ericsten_buf_release(blk);
+
+    b->start = NULL;
+    b->pos = NULL;
+    b->last = NULL;
+    b->end = NULL;
+}
+
+static void
+ngx_http_ericsten_buf_cleanup(void *data)
+{
+    ngx_http_ericsten_ctx_t  *ctx = data;
+    ngx_queue_t              *q;
+
+    while (!ngx_queue_empty(&ctx->bufs))
+    {
+        q = ngx_queue_head(&ctx->bufs);
+        ngx_queue_remove(q);
+
+        ngx_http_ericsten_buf_release(ngx_queue_data(q, ngx_http_ericsten_block_t, queue));
+    }
+}
+
+//
+// Response Body Filter
+//
+// Buffers are transformed on the thread pool, up to filter_tasks at a time.
+// Writable (temporary) buffers are transformed in place; read-only memory
+// buffers get an output buffer from the buffer pool, filled by the task in
+// the same pass.
+// Special and file-backed buffers are passed through as they are, but still
+// wait their turn in the queue.
+//
+// Input buffers are marked consumed only once their task is done, so the
+// producer (e.g. the upstream) does not get them back for reuse while a
+// task may still read them.  That also throttles the producer when the
+// pool falls behind.
+//
+
+static ngx_int_t
+ngx_http_ericsten_header_filter(ngx_http_request_t *r)
+{
+    ngx_uint_t                     gzip;
+    ngx_table_elt_t               *h;
+    ngx_http_ericsten_ctx_t       *ctx;
+    ngx_http_ericsten_loc_conf_t  *elcf;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    if (!(elcf->filter || elcf->gzip)
+        || r != r->main
+        || r->header_only
+        || r->headers_out.status != NGX_HTTP_OK)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    //
+    // ericsten_gzip takes precedence over ericsten_filter when the response
+    // can be compressed.
+    //
+
+    gzip = elcf->gzip && ngx_http_ericsten_gzip_test(r, elcf);
+
+    if (!elcf->filter && !gzip)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+    if (ctx == NULL)
+    {
+        ctx = ngx_http_ericsten_ctx_create(r);
+        if (ctx == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->filter = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_t));
+    if (ctx->filter == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&ctx->filter->entries);
+    ngx_queue_init(&ctx->filter->free);
+
+    if (gzip)
+    {
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        h->hash = 1;
+        ngx_str_set(&h->key, "Content-Encoding");
+        ngx_str_set(&h->value, "gzip");
+        r->headers_out.content_encoding = h;
+
+        ngx_http_clear_content_length(r);
+        ngx_http_clear_accept_ranges(r);
+
+        ctx->filter->gzip_on = 1;
+        ctx->filter->gzip_crc32 = crc32(0L, Z_NULL, 0);
+    }
+
+    //
+    // The tasks need the data in memory; the representation changes, so the
+    // entity tag can only be weak from here on.
+    //
+
+    r->filter_need_in_memory = 1;
+    ngx_http_weak_etag(r);
+
+    return ngx_http_next_header_filter(r);
+}
+
+static ngx_int_t
+ngx_http_ericsten_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_queue_t                       *q;
+    ngx_chain_t                       *cl;
+    ngx_http_ericsten_ctx_t           *ctx;
+    ngx_http_ericsten_filter_entry_t  *entry;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
+
+    if (ctx == NULL || ctx->filter == NULL)
+    {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (ctx->filter->gzip_on)
+    {
+        return ngx_http_ericsten_gzip_body_filter(r, ctx, in);
+    }
+
+    //
+    // Queue the incoming buffers.
+    //
+
+    for (cl = in; cl; cl = cl->next)
+    {
+        if (!ngx_queue_empty(&ctx->filter->free))
+        {
+            q = ngx_queue_head(&ctx->filter->free);
+            ngx_queue_remove(q);
+            entry = ngx_queue_data(q, ngx_http_ericsten_filter_entry_t, queue);
+            ngx_memzero(entry, sizeof(ngx_http_ericsten_filter_entry_t));
+        }
+        else
+        {
+            entry = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_entry_t));
+            if (entry == NULL)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        entry->in = cl->buf;
+        entry->out = cl->buf;
+
+        if (!ngx_buf_in_memory(cl->buf) || cl->buf->pos == cl->buf->last)
+        {
+            //
+            // Nothing for the pool to do.
+            //
+
+            entry->done = 1;
+        }
+
+        ngx_queue_insert_tail(&ctx->filter->entries, &entry->queue);
+    }
+
+    if (ngx_http_ericsten_filter_post(r, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_ericsten_filter_flush(r, ctx, TRUE);
+}
+
+static ngx_int_t
+ngx_http_ericsten_filter_post(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx)
+{
+    size_t                                size;
+    ngx_buf_t                            *b;
+    ngx_queue_t                          *q;
+    ngx_thread_pool_t                    *tp;
+    ngx_thread_task_t                    *task;
+    ngx_http_ericsten_loc_conf_t         *elcf;
+    ngx_http_ericsten_filter_entry_t     *entry;
+    ngx_http_ericsten_filter_task_ctx_t  *task_ctx;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    tp = NULL;
+
+    for (q = ngx_queue_head(&ctx->filter->entries);
+         q != ngx_queue_sentinel(&ctx->filter->entries)
+         && ctx->filter->inflight < elcf->filter_tasks;
+         q = ngx_queue_next(q))
+    {
+        entry = ngx_queue_data(q, ngx_http_ericsten_filter_entry_t, queue);
+
+        if (entry->done || entry->posted)
+        {
+            continue;
+        }
+
+        if (tp == NULL)
+        {
+            tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
+            if (tp == NULL)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
+                return NGX_ERROR;
+            }
+        }
+
+        if (ctx->filter->gzip_on)
+        {
+            if (ngx_http_ericsten_gzip_prepare(r, ctx, entry) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+        else if (!entry->in->temporary)
+        {
+            //
+            // Read-only memory: the task writes into a buffer of our own.
+            //
+
+            size = entry->in->last - entry->in->pos;
+
+            b = ngx_http_ericsten_buf_get(r, ctx, size);
+            if (b == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            b->last = b->pos + size;
+            b->flush = entry->in->flush;
+            b->sync = entry->in->sync;
+            b->last_buf = entry->in->last_buf;
+            b->last_in_chain = entry->in->last_in_chain;
+
+            entry->out = b;
+        }
+
+        task = ctx->filter->tasks;
+
+        if (task != NULL)
+        {
+            ctx->filter->tasks = task->next;
+            task->next = NULL;
+        }
+        else
+        {
+            task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_ericsten_filter_task_ctx_t));
+            if (task == NULL)
+            {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "ngx_http_ericsten: failed to alloc new task");
+                return NGX_ERROR;
+            }
+
+            task_ctx = task->ctx;
+            task_ctx->ericsten_ctx = ctx;
+            task_ctx->task = task;
+
+            task->event.handler = ngx_http_ericsten_filter_completion_handler;
+            task->event.data = task_ctx;
+        }
+
+        task->handler = ctx->filter->gzip_on ? ngx_http_ericsten_gzip_deflate
+                                     : ngx_http_ericsten_filter_transform;
+
+        task_ctx = task->ctx;
+        task_ctx->entry = entry;
+        task_ctx->gzip_level = (int) elcf->gzip_level;
+
+        if (ngx_thread_task_post(tp, task) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_ericsten: failed to post new task");
+            return NGX_ERROR;
+        }
+
+        entry->posted = 1;
+        ctx->filter->inflight++;
+        r->main->blocked++;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_filter_flush(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_uint_t always)
+{
+    ngx_int_t                          rc;
+    ngx_queue_t                       *q;
+    ngx_chain_t                       *out, **ll, *cl, *next;
+    ngx_http_ericsten_filter_entry_t  *entry;
+
+    out = NULL;
+    ll = &out;
+
+    //
+    // Pass on everything that is done, up to the first entry that is not.
+    //
+
+    while (!ngx_queue_empty(&ctx->filter->entries))
+    {
+        q = ngx_queue_head(&ctx->filter->entries);
+        entry = ngx_queue_data(q, ngx_http_ericsten_filter_entry_t, queue);
+
+        if (!entry->done)
+        {
+            break;
+        }
+
+        if (ctx->filter->gzip_on && ngx_http_ericsten_gzip_account(r, ctx, entry) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        cl->buf = entry->out;
+        *ll = cl;
+        ll = &cl->next;
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&ctx->filter->free, q);
+    }
+
+    *ll = NULL;
+
+    if (ngx_queue_empty(&ctx->filter->entries))
+    {
+        r->connection->buffered &= ~NGX_HTTP_ERICSTEN_BUFFERED;
+    }
+    else
+    {
+        r->connection->buffered |= NGX_HTTP_ERICSTEN_BUFFERED;
+    }
+
+    if (out == NULL && !always)
+    {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_next_body_filter(r, out);
+
+    //
+    // Our own output buffers go back to the buffer pool once the next
+    // filters are done with them.
+    //
+
+    ngx_chain_update_chains(r->pool, &ctx->filter->out_free, &ctx->filter->out_busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_ericsten_module);
+
+    for (cl = ctx->filter->out_free; cl; cl = next)
+    {
+        next = cl->next;
+        ngx_http_ericsten_buf_put(cl->buf);
+        ngx_free_chain(r->pool, cl);
+    }
+
+    ctx->filter->out_free = NULL;
+
+    if (rc == NGX_OK && !ngx_queue_empty(&ctx->filter->entries))
+    {
+        return NGX_AGAIN;
+    }
+
+    return rc;
+}
+
+//
+// Thread Pool Task Function
+//
+
+static void
+ngx_http_ericsten_filter_transform(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_filter_task_ctx_t  *task_ctx = data;
+    ngx_http_ericsten_filter_entry_t     *entry = task_ctx->entry;
+    u_char                               *src, *dst, *last;
+
+    //
+    // Our transformation is simple: upper-case ASCII letters.  The task only
+    // touches the entry's buffers, never the request.
+    //
+
+    src = entry->in->pos;
+    last = entry->in->last;
+    dst = entry->out->pos;
+
+    while (src < last)
+    {
+        *dst++ = ngx_toupper(*src);
+        src++;
     }
-#else
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "\"aio threads\" "
-                           "is unsupported on this platform");
-        return NGX_ERROR;
-#endif
 
-    return NGX_OK;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_filter_transform: %uz bytes",
+        (size_t) (last - entry->in->pos));
 }
 
-static ngx_int_t
-ngx_http_ericsten_handler(ngx_http_request_t *r)
+static void
+ngx_http_ericsten_filter_completion_handler(ngx_event_t *ev)
 {
-    ngx_http_ericsten_ctx_t       *ctx = NULL;
-    ngx_thread_pool_t             *tp = NULL;
-    ngx_thread_task_t             *task = NULL;
-    ngx_http_ericsten_task_ctx_t  *task_ctx = NULL;
+    ngx_int_t                             rc;
+    ngx_connection_t                     *c;
+    ngx_http_request_t                   *r;
+    ngx_http_ericsten_ctx_t              *ctx;
+    ngx_http_ericsten_filter_entry_t     *entry;
+    ngx_http_ericsten_filter_task_ctx_t  *task_ctx = ev->data;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-        "ngx_http_ericsten_handler: Entering rewrite handler");
+    ctx = task_ctx->ericsten_ctx;
+    entry = task_ctx->entry;
+    r = ctx->r;
+    c = r->connection;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_ericsten_module);
-    if (ctx != NULL)
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+        "ngx_http_ericsten_filter_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+
+    r->main->blocked--;
+    ctx->filter->inflight--;
+
+    entry->done = 1;
+
+    if (ctx->filter->gzip_on)
     {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-           "ngx_http_ericsten_handler: Resuming a previously seen request. "
-           "request_state: %s",
-           ngx_ericsten_states[ctx->state]);
+        ctx->filter->gzip_pending--;
+    }
+    else if (entry->out != entry->in)
+    {
+        entry->in->pos = entry->in->last;
+    }
 
-        //
-        // If the thread pool task could fail, this would be the correct
-        // point to fail the request and set a final response status.
-        //
-        // Alternately, if there were multiple tasks, this would be the place
-        // to process the state machine on the per-request context and move to
-        // the next task.
-        //
+    task_ctx->task->next = ctx->filter->tasks;
+    ctx->filter->tasks = task_ctx->task;
+
+    //
+    // Keep the pool busy, pass on whatever is now in order, then let the
+    // owner of the output (upstream, ngx_http_writer, ...) carry on.  In
+    // gzip mode that includes cutting blocks from input held back so far.
+    //
+
+    if (ctx->filter->gzip_on)
+    {
+        rc = ngx_http_ericsten_gzip_body_filter(r, ctx, NULL);
+    }
+    else if (ngx_http_ericsten_filter_post(r, ctx) != NGX_OK)
+    {
+        rc = NGX_ERROR;
     }
     else
     {
-        //
-        // Create a context for the module.
-        //
+        rc = ngx_http_ericsten_filter_flush(r, ctx, FALSE);
+    }
 
-        ctx = (ngx_http_ericsten_ctx_t*) ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_ctx_t));
-        if (ctx == NULL) 
+    if (rc == NGX_ERROR)
+    {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    r->write_event_handler(r);
+    ngx_http_run_posted_requests(c);
+}
+
+//
+// Parallel gzip
+//
+// The stream is a 10 byte gzip header, then one raw deflate block sequence
+// per block, each ended with a sync flush (so they can be concatenated)
+// except the last one, then the 8 byte trailer.  This is the layout pigz
+// produces.
+//
+
+static ngx_uint_t
+ngx_http_ericsten_gzip_test(ngx_http_request_t *r, ngx_http_ericsten_loc_conf_t *elcf)
+{
+#if (NGX_HTTP_GZIP)
+    if (r->headers_out.content_encoding
+        && r->headers_out.content_encoding->value.len)
+    {
+        return FALSE;
+    }
+
+    if (ngx_http_test_content_type(r, &elcf->gzip_types) == NULL)
+    {
+        return FALSE;
+    }
+
+    if (r->headers_out.content_length_n != -1
+        && r->headers_out.content_length_n < elcf->gzip_min_length)
+    {
+        return FALSE;
+    }
+
+    //
+    // Accept-Encoding, gzip_http_version, gzip_proxied, gzip_disable and
+    // gzip_vary are honoured the same way as for the stock gzip filter.
+    //
+
+    if (ngx_http_gzip_ok(r) != NGX_OK)
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+static ngx_int_t
+ngx_http_ericsten_gzip_body_filter(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_chain_t *in)
+{
+    size_t                             n;
+    ngx_buf_t                         *b;
+    ngx_chain_t                       *cl;
+    ngx_http_ericsten_loc_conf_t      *elcf;
+    ngx_http_ericsten_filter_entry_t  *entry;
+
+    elcf = ngx_http_get_module_loc_conf(r, ngx_http_ericsten_module);
+
+    if (in)
+    {
+        if (ngx_chain_add_copy(r->pool, &ctx->filter->gzip_in, in) != NGX_OK)
         {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return NGX_ERROR;
         }
+    }
 
+    if (!ctx->filter->gzip_started)
+    {
         //
-        // Set the context.
+        // First call: queue the gzip header.
         //
 
-        ngx_http_set_ctx(r, ctx, ngx_http_ericsten_module);
+        b = ngx_calloc_buf(r->pool);
+        entry = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_entry_t));
+        if (b == NULL || entry == NULL)
+        {
+            return NGX_ERROR;
+        }
 
-        //
-        // Init the state on the context.
-        //
+        b->memory = 1;
+        b->pos = (u_char *) "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03";
+        b->last = b->pos + 10;
 
-        ctx->state = ES_TASK_INIT;
-        ctx->msSleep = 0;
-        ctx->r = r;
+        entry->in = b;
+        entry->out = b;
+        entry->done = 1;
 
-        //
-        // Queue work item to a background thread & return NGX_AGAIN
-        //
+        ngx_queue_insert_tail(&ctx->filter->entries, &entry->queue);
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &ngx_ericsten_thread_pool_name);
-        if (tp == NULL)
+        ctx->filter->gzip_started = 1;
+    }
+
+    //
+    // Cut the input into blocks.  Stop taking input once filter_tasks blocks
+    // are waiting for the pool; the buffers we have not consumed yet hold
+    // back the producer.
+    //
+
+    while (ctx->filter->gzip_in && ctx->filter->gzip_pending < elcf->filter_tasks)
+    {
+        b = ctx->filter->gzip_in->buf;
+
+        if (ngx_buf_size(b) && !ngx_buf_in_memory(b))
         {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-              "ngx_http_ericsten: thread pool \"%V\" not found", &ngx_ericsten_thread_pool_name);
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+                "ngx_http_ericsten: gzip input buffer not in memory");
+            return NGX_ERROR;
         }
 
-        task = ngx_thread_task_alloc(r->connection->pool, sizeof(ngx_http_ericsten_task_ctx_t));
-        if (task == NULL)
+        if (b->pos < b->last)
         {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-              "ngx_http_ericsten: failed to alloc new task");
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+            if (ctx->filter->gzip_block == NULL)
+            {
+                ctx->filter->gzip_block = ngx_http_ericsten_buf_get(r, ctx, elcf->gzip_block_size);
+                if (ctx->filter->gzip_block == NULL)
+                {
+                    return NGX_ERROR;
+                }
+            }
 
-        task_ctx = task->ctx;
-        task_ctx->ericsten_ctx = ctx;
-        task_ctx->random_value = ngx_random();
+            n = ngx_min((size_t) (b->last - b->pos),
+                        (size_t) (ctx->filter->gzip_block->end - ctx->filter->gzip_block->last));
 
-        task->handler = ngx_http_ericsten_dostuff;
-        task->event.handler = ngx_http_ericsten_dostuff_completion_handler;
-        task->event.data = ctx;
+            ctx->filter->gzip_block->last = ngx_cpymem(ctx->filter->gzip_block->last, b->pos, n);
+            b->pos += n;
 
-        if (ngx_thread_task_post(tp, task) != NGX_OK)
+            if (ctx->filter->gzip_block->last == ctx->filter->gzip_block->end)
+            {
+                if (ngx_http_ericsten_gzip_queue_block(r, ctx, FALSE) != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                //
+                // Check the limit again before the next block, even the
+                // final one of this buffer.
+                //
+
+                continue;
+            }
+        }
+
+        if (b->last_buf)
         {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "ngx_http_ericsten: failed to post new task");
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            if (ngx_http_ericsten_gzip_queue_block(r, ctx, TRUE) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
         }
+        else if (b->flush)
+        {
+            //
+            // Cut the block short so the client gets everything so far, and
+            // pass the flush on behind it.
+            //
 
-        r->main->blocked++;
-        r->aio = 1;
+            if (ctx->filter->gzip_block && ngx_http_ericsten_gzip_queue_block(r, ctx, FALSE) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
 
-        return NGX_AGAIN;
+            cl = ngx_alloc_chain_link(r->pool);
+            entry = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_entry_t));
+            if (cl == NULL || entry == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            entry->in = ngx_calloc_buf(r->pool);
+            if (entry->in == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            entry->in->flush = 1;
+            entry->out = entry->in;
+            entry->done = 1;
+
+            ngx_queue_insert_tail(&ctx->filter->entries, &entry->queue);
+        }
+
+        ctx->filter->gzip_in = ctx->filter->gzip_in->next;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-        "ngx_http_ericsten_handler: Finished rewrite handler.");
+    if (ngx_http_ericsten_filter_post(r, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    return NGX_DECLINED;
+    return ngx_http_ericsten_filter_flush(r, ctx, TRUE);
 }
 
-//
-// Thread Pool Task Functions
-//
+static ngx_int_t
+ngx_http_ericsten_gzip_queue_block(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_uint_t last)
+{
+    ngx_http_ericsten_filter_entry_t  *entry;
 
-static void
-ngx_http_ericsten_dostuff(void *data, ngx_log_t *log)
+    if (ctx->filter->gzip_last)
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->filter->gzip_block == NULL)
+    {
+        //
+        // A final block is needed even with no data left, to end the
+        // deflate stream.
+        //
+
+        ctx->filter->gzip_block = ngx_create_temp_buf(r->pool, 0);
+        if (ctx->filter->gzip_block == NULL)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    entry = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_entry_t));
+    if (entry == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    entry->in = ctx->filter->gzip_block;
+    entry->out = NULL;
+    entry->dict = ctx->filter->gzip_prev;
+    entry->size = ctx->filter->gzip_block->last - ctx->filter->gzip_block->pos;
+    entry->block = 1;
+    entry->last = last;
+
+    ngx_queue_insert_tail(&ctx->filter->entries, &entry->queue);
+
+    ctx->filter->gzip_prev = ctx->filter->gzip_block;
+    ctx->filter->gzip_block = NULL;
+    ctx->filter->gzip_pending++;
+    ctx->filter->gzip_last = last;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_gzip_prepare(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_http_ericsten_filter_entry_t *entry)
 {
-    ngx_http_ericsten_task_ctx_t  *task_ctx = data;
-    ngx_http_ericsten_ctx_t       *ctx = task_ctx->ericsten_ctx;
-    ngx_uint_t                     msec_sleep;
+    size_t     size;
+    ngx_buf_t  *b;
+
+    //
+    // deflateBound() covers the compressed data; a sync flush or the end of
+    // stream adds a few bytes more.
+    //
+
+    size = deflateBound(Z_NULL, entry->size) + 16;
+
+    b = ngx_http_ericsten_buf_get(r, ctx, size);
+    if (b == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    b->flush = entry->last ? 0 : 1;
+
+    entry->out = b;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_gzip_account(ngx_http_request_t *r, ngx_http_ericsten_ctx_t *ctx, ngx_http_ericsten_filter_entry_t *entry)
+{
+    ngx_buf_t                         *b;
+    ngx_http_ericsten_filter_entry_t  *trailer;
 
-    ctx->state = ES_TASK_PROCESSING;
+    if (!entry->block)
+    {
+        return NGX_OK;
+    }
+
+    if (entry->failed)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "ngx_http_ericsten: deflate() failed");
+        return NGX_ERROR;
+    }
 
     //
-    // Our blocking operation is simple: 
-    // Sleep from 100 to 1000 milliseconds (in 100ms increments).
-    // This uses the input parameter passed via the task context.
+    // Blocks are accounted for in stream order, so the CRC can be combined.
+    // The previous block is not needed as a dictionary any more.
     //
 
-    msec_sleep = (((task_ctx->random_value % 9) + 1) * 100);
+    ctx->filter->gzip_crc32 = crc32_combine(ctx->filter->gzip_crc32, entry->crc32, entry->size);
+    ctx->filter->gzip_size += (uint32_t) entry->size;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->r->connection->log, 0,
-        "ngx_http_ericsten_dostuff: About to sleep for %d msec", msec_sleep);
-    ngx_msleep(msec_sleep);
+    if (entry->dict)
+    {
+        ngx_http_ericsten_buf_put(entry->dict);
+        entry->dict = NULL;
+    }
+
+    if (!entry->last)
+    {
+        return NGX_OK;
+    }
+
+    ngx_http_ericsten_buf_put(entry->in);
 
     //
-    // Any product of our processing that we need to pass back to the main
-    // handler should be put on the per-request context.
+    // Append the trailer: CRC32 and size, little-endian.
     //
 
-    ctx->msSleep = msec_sleep;
-    ctx->state = ES_TASK_DONE;
+    b = ngx_create_temp_buf(r->pool, 8);
+    trailer = ngx_pcalloc(r->pool, sizeof(ngx_http_ericsten_filter_entry_t));
+    if (b == NULL || trailer == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    b->last[0] = (u_char) (ctx->filter->gzip_crc32 & 0xff);
+    b->last[1] = (u_char) ((ctx->filter->gzip_crc32 >> 8) & 0xff);
+    b->last[2] = (u_char) ((ctx->filter->gzip_crc32 >> 16) & 0xff);
+    b->last[3] = (u_char) ((ctx->filter->gzip_crc32 >> 24) & 0xff);
+    b->last[4] = (u_char) (ctx->filter->gzip_size & 0xff);
+    b->last[5] = (u_char) ((ctx->filter->gzip_size >> 8) & 0xff);
+    b->last[6] = (u_char) ((ctx->filter->gzip_size >> 16) & 0xff);
+    b->last[7] = (u_char) ((ctx->filter->gzip_size >> 24) & 0xff);
+    b->last += 8;
+    b->last_buf = 1;
+
+    trailer->in = b;
+    trailer->out = b;
+    trailer->done = 1;
+
+    //
+    // The entry is being flushed from the head of the queue, so right behind
+    // it is the right place.
+    //
+
+    ngx_queue_insert_after(&entry->queue, &trailer->queue);
+
+    return NGX_OK;
 }
 
+//
+// Thread Pool Task Function
+//
+
 static void
-ngx_http_ericsten_dostuff_completion_handler(ngx_event_t *ev)
+ngx_http_ericsten_gzip_deflate(void *data, ngx_log_t *log)
 {
-    ngx_connection_t         *c;
-    ngx_http_request_t       *r;
-    ngx_http_ericsten_ctx_t  *ctx = ev->data;
-    
-    r = ctx->r;
-    c = r->connection;
-
-    ngx_http_set_log_request(c->log, r);
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-        "ngx_http_ericsten_dostuff_completion_handler: \"%V?%V\"", &r->uri, &r->args);
+    int                                   rc;
+    size_t                                dict_len;
+    z_stream                              zs;
+    ngx_http_ericsten_filter_task_ctx_t  *task_ctx = data;
+    ngx_http_ericsten_filter_entry_t     *entry = task_ctx->entry;
 
     //
-    // The task completion handler executes on the main event loop, and is
-    // pretty straightfoward: Mark the background processing complete, and
-    // call the nginx HTTP function to resume processing of the request.
+    // zlib allocates with malloc(), which is safe on a pool thread.
     //
 
-    r->main->blocked--;
-    r->aio = 0;
+    ngx_memzero(&zs, sizeof(z_stream));
 
-    ngx_http_handler(r);
+    if (deflateInit2(&zs, task_ctx->gzip_level, Z_DEFLATED, -MAX_WBITS,
+                     MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        entry->failed = 1;
+        return;
+    }
+
+    if (entry->dict)
+    {
+        dict_len = ngx_min((size_t) (entry->dict->last - entry->dict->pos), 32768);
+
+        if (dict_len
+            && deflateSetDictionary(&zs, entry->dict->last - dict_len, (uInt) dict_len) != Z_OK)
+        {
+            entry->failed = 1;
+            (void) deflateEnd(&zs);
+            return;
+        }
+    }
+
+    zs.next_in = entry->in->pos;
+    zs.avail_in = (uInt) entry->size;
+    zs.next_out = entry->out->last;
+    zs.avail_out = (uInt) (entry->out->end - entry->out->last);
+
+    rc = deflate(&zs, entry->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    if ((entry->last && rc != Z_STREAM_END)
+        || (!entry->last && (rc != Z_OK || zs.avail_in != 0)))
+    {
+        entry->failed = 1;
+    }
+
+    entry->out->last = zs.next_out;
+    entry->crc32 = (uint32_t) crc32(0L, entry->in->pos, (uInt) entry->size);
+
+    (void) deflateEnd(&zs);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_gzip_deflate: %uz -> %uz bytes, last:%d",
+        entry->size, (size_t) (entry->out->last - entry->out->pos), entry->last);
 }
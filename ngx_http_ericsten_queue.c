@@ -0,0 +1,645 @@
+/*
+
+Module Description:
+    Work queue shared by the workers of ngx_http_ericsten_module.  See
+    ngx_http_ericsten_queue.h.
+
+    Zone layout:
+
+        header      the futex pulling threads sleep on
+        queue       ring of slot numbers waiting to run
+        rings       per worker, ring of slot numbers done
+        slots       per worker, NGX_HTTP_ERICSTEN_QUEUE_DATA bytes and a
+                    length each
+
+    The rings are Vyukov's bounded MPMC queue: every cell has a sequence
+    number that says whether it is ready to be written or to be read at a
+    given position, so producers and consumers only contend on their own
+    position counter.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#if (NGX_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ngx_http_ericsten_cpu.h"
+#include "ngx_http_ericsten_queue.h"
+
+#define NGX_HTTP_ERICSTEN_QUEUE_WAIT    100     // ms an idle thread waits for a job before returning to its pool.
+
+#define NGX_HTTP_ERICSTEN_QUEUE_FREE    0
+#define NGX_HTTP_ERICSTEN_QUEUE_BUSY    1
+
+struct ngx_http_ericsten_queue_zone_s
+{
+    uint32_t            signal;         // Futex: bumped for every job posted.
+    uint32_t            sleepers;       // Threads waiting on it.
+};
+
+typedef struct
+{
+    uint64_t            seq;
+    uint64_t            value;
+} ngx_http_ericsten_queue_cell_t;
+
+struct ngx_http_ericsten_queue_ring_s
+{
+    uint64_t            enqueue NGX_HTTP_ERICSTEN_CACHE_ALIGNED;
+    uint64_t            dequeue NGX_HTTP_ERICSTEN_CACHE_ALIGNED;
+    uint64_t            mask NGX_HTTP_ERICSTEN_CACHE_ALIGNED;   // Cells - 1; the cells follow.
+};
+
+struct ngx_http_ericsten_queue_slot_s
+{
+    uint32_t            state;          // NGX_HTTP_ERICSTEN_QUEUE_FREE or _BUSY, owner only.
+    uint32_t            len;
+    u_char              data[NGX_HTTP_ERICSTEN_QUEUE_DATA];
+};
+
+static ngx_uint_t ngx_http_ericsten_queue_cells(ngx_uint_t n);
+static ngx_http_ericsten_queue_ring_t *ngx_http_ericsten_queue_ring_init(u_char *p, ngx_uint_t cells);
+static ngx_int_t ngx_http_ericsten_queue_push(ngx_http_ericsten_queue_ring_t *ring, uint64_t value);
+static ngx_int_t ngx_http_ericsten_queue_pop(ngx_http_ericsten_queue_ring_t *ring, uint64_t *value);
+static ngx_int_t ngx_http_ericsten_queue_init_zone(ngx_http_ericsten_shm_t *shm, ngx_uint_t reused);
+static void ngx_http_ericsten_queue_cleanup(void *data);
+static void ngx_http_ericsten_queue_pull(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_queue_pull_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_queue_notify_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_queue_wait(uint32_t *futex, uint32_t value);
+static void ngx_http_ericsten_queue_wake(uint32_t *futex);
+
+//
+// Configurations are told apart by zone name: the workers of the previous
+// configuration may still be finishing their jobs in its zone.
+//
+static ngx_uint_t  ngx_http_ericsten_queue_generation;
+
+ngx_http_ericsten_queue_t *
+ngx_http_ericsten_queue_create(ngx_conf_t *cf, ngx_array_t *zones, ngx_uint_t threads, ngx_uint_t slots,
+    ngx_http_ericsten_queue_run_pt run, ngx_http_ericsten_queue_done_pt done)
+{
+    ngx_str_t                   name;
+    ngx_http_ericsten_queue_t  *queue;
+
+    queue = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_queue_t));
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->threads = threads;
+    queue->slots = slots;
+    queue->run = run;
+    queue->done = done;
+
+    name.data = ngx_pnalloc(cf->pool, sizeof("ericsten_queue:") - 1 + NGX_INT_T_LEN);
+    if (name.data == NULL)
+    {
+        return NULL;
+    }
+
+    name.len = ngx_sprintf(name.data, "ericsten_queue:%ui", ngx_http_ericsten_queue_generation++) - name.data;
+
+    queue->shm = ngx_http_ericsten_shm_add(cf, zones, &name, 0);
+    if (queue->shm == NULL)
+    {
+        return NULL;
+    }
+
+    queue->shm->init = ngx_http_ericsten_queue_init_zone;
+    queue->shm->data = queue;
+
+    return queue;
+}
+
+ngx_int_t
+ngx_http_ericsten_queue_init(ngx_http_ericsten_queue_t *queue, ngx_cycle_t *cycle)
+{
+    ngx_fd_t            *fd;
+    ngx_uint_t           i;
+    ngx_core_conf_t     *ccf;
+    ngx_pool_cleanup_t  *cln;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    queue->workers = (ngx_uint_t) ccf->worker_processes;
+
+    queue->shm->size = sizeof(ngx_http_ericsten_queue_zone_t) + NGX_CPU_CACHE_LINE
+                       + sizeof(ngx_http_ericsten_queue_ring_t)
+                       + ngx_http_ericsten_queue_cells(queue->workers * queue->slots)
+                         * sizeof(ngx_http_ericsten_queue_cell_t)
+                       + queue->workers * (sizeof(ngx_http_ericsten_queue_ring_t)
+                                           + ngx_http_ericsten_queue_cells(queue->slots)
+                                             * sizeof(ngx_http_ericsten_queue_cell_t))
+                       + queue->workers * queue->slots * sizeof(ngx_http_ericsten_queue_slot_t);
+
+    queue->rings = ngx_palloc(cycle->pool, queue->workers * sizeof(ngx_http_ericsten_queue_ring_t *));
+    if (queue->rings == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    queue->notify = ngx_palloc(cycle->pool, 2 * queue->workers * sizeof(ngx_fd_t));
+    if (queue->notify == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 2 * queue->workers; i++)
+    {
+        queue->notify[i] = -1;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_ericsten_queue_cleanup;
+    cln->data = queue;
+
+    //
+    // A channel per worker, created before forking so that every worker
+    // has them all.  Both ends are nonblocking: the writers need not wait,
+    // since a full pipe or counter has a wakeup pending anyway.
+    //
+
+    for (i = 0; i < queue->workers; i++)
+    {
+        fd = &queue->notify[2 * i];
+
+#if (NGX_HAVE_EVENTFD)
+        fd[0] = eventfd(0, 0);
+
+        if (fd[0] == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                "ericsten queue: eventfd() failed");
+            return NGX_ERROR;
+        }
+
+        fd[1] = fd[0];
+#else
+        if (pipe(fd) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                "ericsten queue: pipe() failed");
+            return NGX_ERROR;
+        }
+
+        if (ngx_nonblocking(fd[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                "ericsten queue: " ngx_nonblocking_n " failed");
+            return NGX_ERROR;
+        }
+#endif
+
+        if (ngx_nonblocking(fd[0]) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                "ericsten queue: " ngx_nonblocking_n " failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_uint_t
+ngx_http_ericsten_queue_cells(ngx_uint_t n)
+{
+    ngx_uint_t  cells;
+
+    //
+    // At least a cache line of cells, so that every ring and the slots
+    // stay aligned.
+    //
+
+    for (cells = 4; cells < n; cells *= 2) { /* void */ }
+
+    return cells;
+}
+
+//
+// In the master, once the zone is mapped.  The zone is never carried over
+// from another configuration, so it always starts empty.
+//
+
+static ngx_int_t
+ngx_http_ericsten_queue_init_zone(ngx_http_ericsten_shm_t *shm, ngx_uint_t reused)
+{
+    u_char                     *p;
+    ngx_uint_t                  i, cells;
+    ngx_http_ericsten_queue_t  *queue = shm->data;
+
+    ngx_memzero(shm->addr, shm->size);
+
+    queue->zone = (ngx_http_ericsten_queue_zone_t *) shm->addr;
+
+    p = ngx_align_ptr(shm->addr + sizeof(ngx_http_ericsten_queue_zone_t), NGX_CPU_CACHE_LINE);
+
+    cells = ngx_http_ericsten_queue_cells(queue->workers * queue->slots);
+    queue->queue = ngx_http_ericsten_queue_ring_init(p, cells);
+    p += sizeof(ngx_http_ericsten_queue_ring_t) + cells * sizeof(ngx_http_ericsten_queue_cell_t);
+
+    cells = ngx_http_ericsten_queue_cells(queue->slots);
+
+    for (i = 0; i < queue->workers; i++)
+    {
+        queue->rings[i] = ngx_http_ericsten_queue_ring_init(p, cells);
+        p += sizeof(ngx_http_ericsten_queue_ring_t) + cells * sizeof(ngx_http_ericsten_queue_cell_t);
+    }
+
+    queue->jobs = (ngx_http_ericsten_queue_slot_t *) p;
+
+    return NGX_OK;
+}
+
+static ngx_http_ericsten_queue_ring_t *
+ngx_http_ericsten_queue_ring_init(u_char *p, ngx_uint_t cells)
+{
+    ngx_uint_t                       i;
+    ngx_http_ericsten_queue_ring_t  *ring = (ngx_http_ericsten_queue_ring_t *) p;
+    ngx_http_ericsten_queue_cell_t  *cell = (ngx_http_ericsten_queue_cell_t *) (ring + 1);
+
+    ring->mask = cells - 1;
+
+    for (i = 0; i < cells; i++)
+    {
+        cell[i].seq = i;
+    }
+
+    return ring;
+}
+
+static void
+ngx_http_ericsten_queue_cleanup(void *data)
+{
+    ngx_uint_t                  i;
+    ngx_http_ericsten_queue_t  *queue = data;
+
+    for (i = 0; i < 2 * queue->workers; i++)
+    {
+        if (queue->notify[i] == -1 || (i % 2 && queue->notify[i] == queue->notify[i - 1]))
+        {
+            continue;
+        }
+
+        if (close(queue->notify[i]) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                "ericsten queue: close() failed");
+        }
+    }
+}
+
+ngx_int_t
+ngx_http_ericsten_queue_start(ngx_http_ericsten_queue_t *queue, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_connection_t                *c;
+    ngx_thread_task_t               *task;
+    ngx_http_ericsten_queue_slot_t  *jobs;
+
+    queue->thread_pool = tp;
+    queue->log = cycle->log;
+
+    queue->owners = ngx_pcalloc(cycle->pool, queue->slots * sizeof(void *));
+    if (queue->owners == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    queue->free = ngx_palloc(cycle->pool, queue->slots * sizeof(ngx_uint_t));
+    if (queue->free == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    //
+    // A worker that replaces one that crashed leaves the slots that were in
+    // flight alone until they come back.
+    //
+
+    jobs = queue->jobs + ngx_worker * queue->slots;
+
+    for (i = queue->slots; i-- > 0; /* void */)
+    {
+        if (jobs[i].state == NGX_HTTP_ERICSTEN_QUEUE_FREE)
+        {
+            queue->free[queue->nfree++] = i;
+        }
+    }
+
+    c = ngx_get_connection(queue->notify[2 * ngx_worker], cycle->log);
+    if (c == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    c->data = queue;
+    c->read->handler = ngx_http_ericsten_queue_notify_handler;
+    c->read->log = cycle->log;
+    c->read->channel = 1;       // Not reported as leaked when the worker exits.
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < queue->threads; i++)
+    {
+        task = ngx_thread_task_alloc(cycle->pool, 0);
+        if (task == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        task->ctx = queue;
+        task->handler = ngx_http_ericsten_queue_pull;
+        task->event.handler = ngx_http_ericsten_queue_pull_completion_handler;
+        task->event.data = task;
+
+        if (ngx_thread_task_post(tp, task) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_queue_post(ngx_http_ericsten_queue_t *queue, u_char *job, size_t len, void *data)
+{
+    ngx_uint_t                       i, slot;
+    ngx_http_ericsten_queue_slot_t  *s;
+
+    //
+    // The threads of a worker that is shutting down stop pulling once its
+    // jobs are done; it runs any new ones itself.
+    //
+
+    if (queue->nfree == 0 || len > NGX_HTTP_ERICSTEN_QUEUE_DATA || ngx_exiting || ngx_quit || ngx_terminate)
+    {
+        return NGX_DECLINED;
+    }
+
+    i = queue->free[--queue->nfree];
+    slot = ngx_worker * queue->slots + i;
+    s = &queue->jobs[slot];
+
+    s->state = NGX_HTTP_ERICSTEN_QUEUE_BUSY;
+    s->len = (uint32_t) len;
+    ngx_memcpy(s->data, job, len);
+
+    queue->owners[i] = data;
+    queue->active++;
+
+    (void) ngx_http_ericsten_queue_push(queue->queue, slot);
+
+    //
+    // Bump the futex before looking for sleepers, and they register before
+    // checking it, so one of the two sees the other.
+    //
+
+    __atomic_add_fetch(&queue->zone->signal, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->zone->sleepers, __ATOMIC_SEQ_CST))
+    {
+        ngx_http_ericsten_queue_wake(&queue->zone->signal);
+    }
+
+    return NGX_OK;
+}
+
+//
+// Thread Pool Task Function: run one job, from any worker, or return after
+// waiting for one for NGX_HTTP_ERICSTEN_QUEUE_WAIT.
+//
+
+static void
+ngx_http_ericsten_queue_pull(void *data, ngx_log_t *log)
+{
+    size_t                           len;
+    uint32_t                         signal;
+    uint64_t                         slot;
+    uint64_t                         value = 1;
+    ngx_uint_t                       owner, waited;
+    ngx_http_ericsten_queue_t       *queue = data;
+    ngx_http_ericsten_queue_slot_t  *s;
+
+    for (waited = 0; /* void */; waited = 1)
+    {
+        signal = __atomic_load_n(&queue->zone->signal, __ATOMIC_SEQ_CST);
+
+        if (ngx_http_ericsten_queue_pop(queue->queue, &slot) == NGX_OK)
+        {
+            break;
+        }
+
+        if (waited)
+        {
+            return;
+        }
+
+        __atomic_add_fetch(&queue->zone->sleepers, 1, __ATOMIC_SEQ_CST);
+        ngx_http_ericsten_queue_wait(&queue->zone->signal, signal);
+        __atomic_sub_fetch(&queue->zone->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+
+    s = &queue->jobs[slot];
+    len = s->len;
+
+    queue->run(s->data, &len, log);
+
+    s->len = (uint32_t) len;
+
+    owner = slot / queue->slots;
+
+    (void) ngx_http_ericsten_queue_push(queue->rings[owner], slot);
+
+    if (write(queue->notify[2 * owner + 1], &value, sizeof(uint64_t)) == -1 && ngx_errno != NGX_EAGAIN)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            "ericsten queue: notify write() failed");
+    }
+}
+
+static void
+ngx_http_ericsten_queue_pull_completion_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t          *task = ev->data;
+    ngx_http_ericsten_queue_t  *queue = task->ctx;
+
+    if (ngx_terminate || ((ngx_exiting || ngx_quit) && queue->active == 0))
+    {
+        return;
+    }
+
+    if (ngx_thread_task_post(queue->thread_pool, task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ALERT, queue->log, 0,
+            "ericsten queue: failed to post task");
+    }
+}
+
+//
+// On the owner's event loop: finish the jobs on this worker's ring.
+//
+
+static void
+ngx_http_ericsten_queue_notify_handler(ngx_event_t *ev)
+{
+    u_char                           buf[64];
+    void                            *data;
+    uint64_t                         slot;
+    ngx_uint_t                       i;
+    ngx_connection_t                *c = ev->data;
+    ngx_http_ericsten_queue_t       *queue = c->data;
+    ngx_http_ericsten_queue_slot_t  *s;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "ericsten queue: notified");
+
+    while (read(c->fd, buf, sizeof(buf)) > 0) { /* void */ }
+
+    while (ngx_http_ericsten_queue_pop(queue->rings[ngx_worker], &slot) == NGX_OK)
+    {
+        i = slot - ngx_worker * queue->slots;
+        s = &queue->jobs[slot];
+
+        data = queue->owners[i];
+        queue->owners[i] = NULL;
+
+        //
+        // A job without an owner was posted by a worker that crashed.
+        //
+
+        if (data)
+        {
+            queue->active--;
+            queue->done(data, s->data, s->len);
+        }
+
+        s->state = NGX_HTTP_ERICSTEN_QUEUE_FREE;
+        queue->free[queue->nfree++] = i;
+    }
+}
+
+static ngx_int_t
+ngx_http_ericsten_queue_push(ngx_http_ericsten_queue_ring_t *ring, uint64_t value)
+{
+    int64_t                          dif;
+    uint64_t                         pos, seq;
+    ngx_http_ericsten_queue_cell_t  *cell, *cells = (ngx_http_ericsten_queue_cell_t *) (ring + 1);
+
+    pos = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+
+    for ( ;; )
+    {
+        cell = &cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) (seq - pos);
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NGX_DECLINED;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_queue_pop(ngx_http_ericsten_queue_ring_t *ring, uint64_t *value)
+{
+    int64_t                          dif;
+    uint64_t                         pos, seq;
+    ngx_http_ericsten_queue_cell_t  *cell, *cells = (ngx_http_ericsten_queue_cell_t *) (ring + 1);
+
+    pos = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED);
+
+    for ( ;; )
+    {
+        cell = &cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) (seq - (pos + 1));
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->dequeue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NGX_DECLINED;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->dequeue, __ATOMIC_RELAXED);
+        }
+    }
+
+    *value = cell->value;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+    return NGX_OK;
+}
+
+//
+// Wait up to NGX_HTTP_ERICSTEN_QUEUE_WAIT for the futex to change from
+// value.  The zone is shared between processes, so the futex is not
+// private.  Elsewhere, poll.
+//
+
+static void
+ngx_http_ericsten_queue_wait(uint32_t *futex, uint32_t value)
+{
+#if (NGX_LINUX)
+    struct timespec  ts;
+
+    ts.tv_sec = NGX_HTTP_ERICSTEN_QUEUE_WAIT / 1000;
+    ts.tv_nsec = (NGX_HTTP_ERICSTEN_QUEUE_WAIT % 1000) * 1000000;
+
+    (void) syscall(SYS_futex, futex, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_HTTP_ERICSTEN_QUEUE_WAIT && __atomic_load_n(futex, __ATOMIC_SEQ_CST) == value; n++)
+    {
+        ngx_msleep(1);
+    }
+#endif
+}
+
+static void
+ngx_http_ericsten_queue_wake(uint32_t *futex)
+{
+#if (NGX_LINUX)
+    (void) syscall(SYS_futex, futex, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
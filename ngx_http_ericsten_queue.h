@@ -0,0 +1,124 @@
+/*
+
+Module Description:
+    Work queue shared by the workers of ngx_http_ericsten_module.
+
+    Each worker has a thread pool of its own, so a worker that accepted a
+    burst of slow requests can have all its threads busy while the threads
+    of the other workers sit idle.  With the shared queue, a worker posts
+    jobs to a queue in shared memory instead of its own pool, and a few
+    threads of every worker's pool take them from there: whichever worker
+    has an idle thread runs the next job.
+
+    A job is a small block of bytes, copied into a slot of the zone, and
+    the same function runs it in every worker.  The worker that ran it
+    puts the slot on the owner's completion ring and signals the owner's
+    eventfd (or pipe), which the master created before forking so that any
+    worker can signal any other.  The owner's event loop takes the result
+    from the slot and finishes the job.
+
+    The queue and the rings are bounded multi-producer multi-consumer
+    queues, each with room for every slot, so posting never fails for lack
+    of room, only for lack of a free slot; the caller then runs the job on
+    its own pool.  Threads waiting for jobs sleep on a futex in the zone.
+
+    A pulling thread runs one job at a time and then returns to its pool,
+    to be posted again from the event loop, so that a worker shutting down
+    waits for one job at most.  A worker that is shutting down keeps
+    pulling until its own jobs are done, since the workers of the new
+    configuration use a new zone.
+
+    A worker that crashes while holding a job loses it, and the request
+    that posted it waits until the client gives up.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_QUEUE_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_QUEUE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_shm.h"
+
+//
+// Largest job, input or result.
+//
+#define NGX_HTTP_ERICSTEN_QUEUE_DATA    56
+
+typedef struct ngx_http_ericsten_queue_zone_s  ngx_http_ericsten_queue_zone_t;
+typedef struct ngx_http_ericsten_queue_slot_s  ngx_http_ericsten_queue_slot_t;
+typedef struct ngx_http_ericsten_queue_ring_s  ngx_http_ericsten_queue_ring_t;
+
+//
+// On a pool thread of any worker: run the job in data, of *len bytes, and
+// leave the result there, setting *len.
+//
+typedef void (*ngx_http_ericsten_queue_run_pt)(u_char *data, size_t *len, ngx_log_t *log);
+
+//
+// On the owner's event loop: the job posted with data is done.  The result
+// is valid until the handler returns.
+//
+typedef void (*ngx_http_ericsten_queue_done_pt)(void *data, u_char *result, size_t len);
+
+typedef struct
+{
+    ngx_uint_t                          threads;    // Pool threads per worker that pull jobs.
+    ngx_uint_t                          slots;      // Jobs in flight per worker.
+    ngx_http_ericsten_queue_run_pt      run;
+    ngx_http_ericsten_queue_done_pt     done;
+    ngx_http_ericsten_shm_t            *shm;
+
+    //
+    // Set in the master before forking.
+    //
+
+    ngx_uint_t                          workers;
+    ngx_fd_t                           *notify;     // Per worker: read end, write end.
+    ngx_http_ericsten_queue_zone_t     *zone;
+    ngx_http_ericsten_queue_ring_t     *queue;
+    ngx_http_ericsten_queue_ring_t    **rings;      // Per worker completion rings.
+    ngx_http_ericsten_queue_slot_t     *jobs;
+
+    //
+    // Worker state.
+    //
+
+    ngx_thread_pool_t                  *thread_pool;
+    ngx_log_t                          *log;
+    void                              **owners;     // Per slot of this worker: the done handler's data.
+    ngx_uint_t                         *free;       // Stack of free slots of this worker.
+    ngx_uint_t                          nfree;
+    ngx_uint_t                          active;     // Jobs of this worker in flight.
+} ngx_http_ericsten_queue_t;
+
+//
+// At configuration time: declare the zone.  Its size depends on
+// worker_processes, and is set by ngx_http_ericsten_queue_init().
+//
+ngx_http_ericsten_queue_t *ngx_http_ericsten_queue_create(ngx_conf_t *cf, ngx_array_t *zones,
+    ngx_uint_t threads, ngx_uint_t slots, ngx_http_ericsten_queue_run_pt run,
+    ngx_http_ericsten_queue_done_pt done);
+
+//
+// In the master, from the module's init_module handler, before the zones
+// are mapped: size the zone and create the notification channels.
+//
+ngx_int_t ngx_http_ericsten_queue_init(ngx_http_ericsten_queue_t *queue, ngx_cycle_t *cycle);
+
+//
+// From the module's init_process handler: watch this worker's channel and
+// post the pulling threads.
+//
+ngx_int_t ngx_http_ericsten_queue_start(ngx_http_ericsten_queue_t *queue, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+//
+// On the event loop: post a job of len bytes.  Returns NGX_DECLINED if this
+// worker has no free slot.
+//
+ngx_int_t ngx_http_ericsten_queue_post(ngx_http_ericsten_queue_t *queue, u_char *job, size_t len, void *data);
+
+#endif /* _NGX_HTTP_ERICSTEN_QUEUE_H_INCLUDED_ */
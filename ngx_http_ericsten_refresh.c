@@ -0,0 +1,252 @@
+/*
+
+Module Description:
+    Periodically refreshed snapshots for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_refresh.h.
+
+    Each worker has one task per refresh, posted from its timer; the timer
+    is only re-armed by the task's completion handler, so there is never
+    more than one build in flight.  The task is the only writer of
+    refresh->current once the worker runs.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_refresh.h"
+
+static void ngx_http_ericsten_refresh_timer_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_refresh_task(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_refresh_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_refresh_done(ngx_http_ericsten_refresh_t *refresh);
+
+ngx_http_ericsten_refresh_t *
+ngx_http_ericsten_refresh_create(ngx_conf_t *cf, ngx_str_t *path, ngx_msec_t interval,
+    ngx_http_ericsten_refresh_build_pt build, void *data)
+{
+    ngx_http_ericsten_refresh_t  *refresh;
+
+    refresh = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_refresh_t));
+    if (refresh == NULL)
+    {
+        return NULL;
+    }
+
+    refresh->path = *path;
+
+    if (ngx_conf_full_name(cf->cycle, &refresh->path, 1) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    refresh->interval = interval;
+    refresh->build = build;
+    refresh->data = data;
+
+    return refresh;
+}
+
+ngx_int_t
+ngx_http_ericsten_refresh_start(ngx_http_ericsten_refresh_t *refresh, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    ngx_thread_task_t  *task;
+
+    task = ngx_thread_task_alloc(cycle->pool, 0);
+    if (task == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    task->ctx = refresh;
+    task->handler = ngx_http_ericsten_refresh_task;
+    task->event.handler = ngx_http_ericsten_refresh_completion_handler;
+    task->event.data = refresh;
+
+    refresh->thread_pool = tp;
+    refresh->task = task;
+    refresh->log = cycle->log;
+
+    //
+    // The worker does not accept connections yet, so the first snapshot is
+    // built right here rather than on the pool.  If that fails, requests
+    // find no snapshot until the file has been fixed.
+    //
+
+    ngx_http_ericsten_refresh_task(refresh, cycle->log);
+    ngx_http_ericsten_refresh_done(refresh);
+
+    refresh->timer.handler = ngx_http_ericsten_refresh_timer_handler;
+    refresh->timer.data = refresh;
+    refresh->timer.log = cycle->log;
+    refresh->timer.cancelable = 1;
+
+    ngx_add_timer(&refresh->timer, refresh->interval);
+
+    return NGX_OK;
+}
+
+ngx_http_ericsten_snapshot_t *
+ngx_http_ericsten_snapshot_acquire(ngx_http_ericsten_refresh_t *refresh)
+{
+    ngx_http_ericsten_snapshot_t  *snapshot;
+
+    snapshot = ngx_http_ericsten_refresh_get(refresh);
+
+    if (snapshot != NULL)
+    {
+        snapshot->refs++;
+    }
+
+    return snapshot;
+}
+
+void
+ngx_http_ericsten_snapshot_release(ngx_http_ericsten_snapshot_t *snapshot)
+{
+    if (--snapshot->refs == 0 && snapshot->retired)
+    {
+        snapshot->free(snapshot);
+    }
+}
+
+static void
+ngx_http_ericsten_refresh_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_refresh_t  *refresh = ev->data;
+
+    if (ngx_exiting)
+    {
+        return;
+    }
+
+    if (ngx_thread_task_post(refresh->thread_pool, refresh->task) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+            "ngx_http_ericsten: failed to post refresh task for \"%V\"", &refresh->path);
+
+        ngx_add_timer(&refresh->timer, refresh->interval);
+    }
+}
+
+//
+// Thread Pool Task Function
+//
+
+static void
+ngx_http_ericsten_refresh_task(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_refresh_t   *refresh = data;
+    ngx_fd_t                       fd;
+    ngx_file_info_t                fi;
+    ngx_http_ericsten_snapshot_t  *current, *snapshot;
+
+    refresh->old = NULL;
+    refresh->error = NULL;
+    refresh->err = 0;
+
+    fd = ngx_open_file(refresh->path.data, NGX_FILE_RDONLY|NGX_FILE_NONBLOCK, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        refresh->err = ngx_errno;
+        refresh->error = ngx_open_file_n " failed";
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    {
+        refresh->err = ngx_errno;
+        refresh->error = ngx_fd_info_n " failed";
+        goto done;
+    }
+
+    //
+    // Nothing to do if the file has not changed.
+    //
+
+    current = __atomic_load_n(&refresh->current, __ATOMIC_RELAXED);
+
+    if (current != NULL
+        && current->mtime == ngx_file_mtime(&fi)
+        && current->size == ngx_file_size(&fi)
+        && current->uniq == ngx_file_uniq(&fi))
+    {
+        goto done;
+    }
+
+    snapshot = refresh->build(refresh, fd, &fi);
+    if (snapshot == NULL)
+    {
+        goto done;
+    }
+
+    snapshot->refs = 0;
+    snapshot->retired = 0;
+    snapshot->mtime = ngx_file_mtime(&fi);
+    snapshot->size = ngx_file_size(&fi);
+    snapshot->uniq = ngx_file_uniq(&fi);
+
+    //
+    // Publish.  The release half of the exchange makes the snapshot's
+    // contents visible before the pointer to it.
+    //
+
+    refresh->old = __atomic_exchange_n(&refresh->current, snapshot, __ATOMIC_ACQ_REL);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+        "ngx_http_ericsten_refresh_task: published \"%V\"", &refresh->path);
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            ngx_close_file_n " \"%V\" failed", &refresh->path);
+    }
+}
+
+static void
+ngx_http_ericsten_refresh_completion_handler(ngx_event_t *ev)
+{
+    ngx_http_ericsten_refresh_t  *refresh = ev->data;
+
+    ngx_http_ericsten_refresh_done(refresh);
+
+    if (!ngx_exiting)
+    {
+        ngx_add_timer(&refresh->timer, refresh->interval);
+    }
+}
+
+//
+// On the event loop, after the task: report errors and retire the snapshot
+// it replaced.  Any event that loaded the old pointer before the swap has
+// been handled by now.
+//
+
+static void
+ngx_http_ericsten_refresh_done(ngx_http_ericsten_refresh_t *refresh)
+{
+    ngx_http_ericsten_snapshot_t  *old = refresh->old;
+
+    if (refresh->error)
+    {
+        ngx_log_error(NGX_LOG_ERR, refresh->log, refresh->err,
+            "ngx_http_ericsten: \"%V\": %s", &refresh->path, refresh->error);
+    }
+
+    if (old == NULL)
+    {
+        return;
+    }
+
+    refresh->old = NULL;
+    old->retired = 1;
+
+    if (old->refs == 0)
+    {
+        old->free(old);
+    }
+}
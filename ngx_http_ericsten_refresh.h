@@ -0,0 +1,117 @@
+/*
+
+Module Description:
+    Periodically refreshed snapshots of reference data for
+    ngx_http_ericsten_module.
+
+    A snapshot is an immutable object built from a file: an allowlist, a
+    routing table, a set of feature flags.  Every worker checks the file on
+    a timer.  When it has changed, a task on the thread pool builds a new
+    snapshot and publishes it with an atomic pointer swap, so requests read
+    the current snapshot directly, with no lock and no task of their own.
+
+    The snapshot being replaced is reclaimed RCU style.  The only readers
+    that do not hold a reference are on the event loop, and they never keep
+    the pointer past the event they are handling.  The swap completion
+    handler runs on the event loop too, after any event that could have
+    loaded the old pointer, so it is past the grace period.  It frees the
+    old snapshot unless a reference is still held.  Code that keeps a
+    snapshot across events, for example to hand it to a task, takes a
+    reference with ngx_http_ericsten_snapshot_acquire().
+
+    The first snapshot is built synchronously when the worker starts, so
+    requests never see the data missing.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_REFRESH_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_REFRESH_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+typedef struct ngx_http_ericsten_snapshot_s  ngx_http_ericsten_snapshot_t;
+typedef struct ngx_http_ericsten_refresh_s   ngx_http_ericsten_refresh_t;
+
+//
+// On a pool thread: build a snapshot from the open file.  Returns NULL and
+// sets refresh->error on failure.
+//
+typedef ngx_http_ericsten_snapshot_t *(*ngx_http_ericsten_refresh_build_pt)(ngx_http_ericsten_refresh_t *refresh,
+    ngx_fd_t fd, ngx_file_info_t *fi);
+
+//
+// Header of a snapshot, followed by whatever its builder put there.  The
+// builder fills in data and free; the rest is ours.
+//
+struct ngx_http_ericsten_snapshot_s
+{
+    void                          *data;
+    void                         (*free)(ngx_http_ericsten_snapshot_t *snapshot);
+
+    ngx_uint_t                     refs;        // Event loop only.
+    unsigned                       retired:1;   // Replaced; freed with its last reference.
+
+    time_t                         mtime;       // Of the file it was built from.
+    off_t                          size;
+    ngx_file_uniq_t                uniq;
+};
+
+struct ngx_http_ericsten_refresh_s
+{
+    ngx_str_t                           path;
+    ngx_msec_t                          interval;
+    ngx_http_ericsten_refresh_build_pt  build;
+    void                               *data;       // For the builder.
+
+    ngx_http_ericsten_snapshot_t       *current;    // Atomic; see ngx_http_ericsten_refresh_get().
+
+    //
+    // Worker state.
+    //
+
+    ngx_event_t                         timer;
+    ngx_thread_pool_t                  *thread_pool;
+    ngx_thread_task_t                  *task;
+    ngx_log_t                          *log;
+
+    //
+    // Written by the task, read by its completion handler.
+    //
+
+    ngx_http_ericsten_snapshot_t       *old;        // Replaced by the task.
+    const char                         *error;
+    ngx_err_t                           err;
+};
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_refresh_t *ngx_http_ericsten_refresh_create(ngx_conf_t *cf, ngx_str_t *path,
+    ngx_msec_t interval, ngx_http_ericsten_refresh_build_pt build, void *data);
+
+//
+// From the module's init_process handler: build the first snapshot and
+// start the timer.
+//
+ngx_int_t ngx_http_ericsten_refresh_start(ngx_http_ericsten_refresh_t *refresh, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+//
+// On the event loop.  The snapshot returned is valid until the current
+// event has been handled; NULL if the first build failed.
+//
+static ngx_inline ngx_http_ericsten_snapshot_t *
+ngx_http_ericsten_refresh_get(ngx_http_ericsten_refresh_t *refresh)
+{
+    return __atomic_load_n(&refresh->current, __ATOMIC_ACQUIRE);
+}
+
+//
+// On the event loop: keep the current snapshot valid until released.
+//
+ngx_http_ericsten_snapshot_t *ngx_http_ericsten_snapshot_acquire(ngx_http_ericsten_refresh_t *refresh);
+void ngx_http_ericsten_snapshot_release(ngx_http_ericsten_snapshot_t *snapshot);
+
+#endif /* _NGX_HTTP_ERICSTEN_REFRESH_H_INCLUDED_ */
@@ -0,0 +1,368 @@
+/*
+
+Module Description:
+    Shared memory zones of ngx_http_ericsten_module.  See
+    ngx_http_ericsten_shm.h.
+
+    Mappings are recorded in a list private to the process, outside any
+    cycle, and counted by the cycles using them: a reload that keeps a zone
+    takes another reference on its mapping, and the old cycle's pool cleanup
+    drops its own.  A failed reload simply drops the references the new
+    cycle took.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <sys/mman.h>
+
+#include "ngx_http_ericsten_shm.h"
+
+#define NGX_HTTP_ERICSTEN_SHM_HUGE_SIZE  (2 * 1024 * 1024)
+
+struct ngx_http_ericsten_shm_map_s
+{
+    ngx_http_ericsten_shm_map_t  *next;
+    ngx_str_t                     name;     // Allocated with the record.
+    size_t                        size;     // As declared.
+    ngx_flag_t                    huge;     // ericsten_zone_huge_pages when it was mapped.
+    u_char                       *addr;
+    size_t                        len;      // Mapped length.
+    ngx_uint_t                    pages;    // NGX_HTTP_ERICSTEN_SHM_*.
+    ngx_uint_t                    refs;     // Cycles using it.
+};
+
+static ngx_http_ericsten_shm_map_t  *ngx_http_ericsten_shm_maps;
+
+static ngx_http_ericsten_shm_map_t *ngx_http_ericsten_shm_map(ngx_http_ericsten_shm_t *shm, ngx_flag_t huge,
+    ngx_flag_t prefault, ngx_log_t *log);
+static u_char *ngx_http_ericsten_shm_mmap(size_t len, int flags, ngx_log_t *log);
+static void ngx_http_ericsten_shm_prefault(u_char *addr, size_t len);
+static void ngx_http_ericsten_shm_cleanup(void *data);
+
+static char *ngx_http_ericsten_shm_pages[] = {
+    "small pages",
+    "transparent huge pages",
+    "huge pages"
+};
+
+ngx_http_ericsten_shm_t *
+ngx_http_ericsten_shm_add(ngx_conf_t *cf, ngx_array_t *zones, ngx_str_t *name, size_t size)
+{
+    ngx_uint_t                 i;
+    ngx_http_ericsten_shm_t   *shm, **zone;
+
+    zone = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++)
+    {
+        if (zone[i]->name.len != name->len
+            || ngx_strncmp(zone[i]->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (zone[i]->size != size)
+        {
+            return NULL;
+        }
+
+        return zone[i];
+    }
+
+    shm = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_shm_t));
+    if (shm == NULL)
+    {
+        return NULL;
+    }
+
+    zone = ngx_array_push(zones);
+    if (zone == NULL)
+    {
+        return NULL;
+    }
+
+    shm->name = *name;
+    shm->size = size;
+
+    *zone = shm;
+
+    return shm;
+}
+
+ngx_int_t
+ngx_http_ericsten_shm_init(ngx_cycle_t *cycle, ngx_array_t *zones, ngx_flag_t huge_pages,
+    ngx_flag_t prefault)
+{
+    ngx_uint_t                     i, reused;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_ericsten_shm_t      **zone;
+    ngx_http_ericsten_shm_map_t   *map;
+
+    if (zones->nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    //
+    // Registered first, so that the references already taken are dropped
+    // if a later zone fails.
+    //
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_ericsten_shm_cleanup;
+    cln->data = zones;
+
+    zone = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++)
+    {
+        for (map = ngx_http_ericsten_shm_maps; map; map = map->next)
+        {
+            if (map->name.len == zone[i]->name.len
+                && ngx_strncmp(map->name.data, zone[i]->name.data, map->name.len) == 0
+                && map->size == zone[i]->size
+                && map->huge == huge_pages)
+            {
+                break;
+            }
+        }
+
+        if (map != NULL)
+        {
+            map->refs++;
+            reused = 1;
+        }
+        else
+        {
+            map = ngx_http_ericsten_shm_map(zone[i], huge_pages, prefault, cycle->log);
+            if (map == NULL)
+            {
+                return NGX_ERROR;
+            }
+
+            reused = 0;
+        }
+
+        zone[i]->addr = map->addr;
+        zone[i]->pages = map->pages;
+        zone[i]->map = map;
+
+        if (zone[i]->init && zone[i]->init(zone[i], reused) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_http_ericsten_shm_map_t *
+ngx_http_ericsten_shm_map(ngx_http_ericsten_shm_t *shm, ngx_flag_t huge, ngx_flag_t prefault, ngx_log_t *log)
+{
+    u_char                       *p, *addr;
+    size_t                        len;
+    ngx_uint_t                    pages;
+    ngx_http_ericsten_shm_map_t  *map;
+
+    addr = NULL;
+    pages = NGX_HTTP_ERICSTEN_SHM_SMALL;
+    len = ngx_align(shm->size, ngx_pagesize);
+
+    if (huge)
+    {
+        len = ngx_align(shm->size, NGX_HTTP_ERICSTEN_SHM_HUGE_SIZE);
+
+#ifdef MAP_HUGETLB
+
+        //
+        // Explicit huge pages are reserved when mapped, so this fails
+        // right away if vm.nr_hugepages is too low, rather than on first
+        // touch.
+        //
+
+        addr = ngx_http_ericsten_shm_mmap(len, MAP_HUGETLB|(prefault ? MAP_POPULATE : 0), NULL);
+
+        if (addr != NULL)
+        {
+            pages = NGX_HTTP_ERICSTEN_SHM_HUGETLB;
+        }
+        else
+        {
+            ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+                "ericsten zone \"%V\": mmap(MAP_HUGETLB, %uz) failed, "
+                "trying transparent huge pages", &shm->name, len);
+        }
+
+#endif
+
+        if (addr == NULL)
+        {
+            //
+            // Map a huge page more and trim it to a huge page boundary, so
+            // that the whole zone can be backed by huge pages.
+            //
+
+            p = ngx_http_ericsten_shm_mmap(len + NGX_HTTP_ERICSTEN_SHM_HUGE_SIZE, 0, log);
+            if (p == NULL)
+            {
+                return NULL;
+            }
+
+            addr = ngx_align_ptr(p, NGX_HTTP_ERICSTEN_SHM_HUGE_SIZE);
+
+            if (addr != p)
+            {
+                (void) munmap(p, addr - p);
+            }
+
+            (void) munmap(addr + len, NGX_HTTP_ERICSTEN_SHM_HUGE_SIZE - (addr - p));
+
+#ifdef MADV_HUGEPAGE
+
+            //
+            // Shared memory only gets transparent huge pages if
+            // /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it.
+            //
+
+            if (madvise(addr, len, MADV_HUGEPAGE) == 0)
+            {
+                pages = NGX_HTTP_ERICSTEN_SHM_THP;
+            }
+            else
+            {
+                ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+                    "ericsten zone \"%V\": madvise(MADV_HUGEPAGE) failed", &shm->name);
+            }
+
+#endif
+        }
+    }
+    else
+    {
+        addr = ngx_http_ericsten_shm_mmap(len, 0, log);
+        if (addr == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if (prefault && pages != NGX_HTTP_ERICSTEN_SHM_HUGETLB)
+    {
+        ngx_http_ericsten_shm_prefault(addr, len);
+    }
+
+    map = ngx_alloc(sizeof(ngx_http_ericsten_shm_map_t) + shm->name.len, log);
+    if (map == NULL)
+    {
+        (void) munmap(addr, len);
+        return NULL;
+    }
+
+    map->name.len = shm->name.len;
+    map->name.data = (u_char *) (map + 1);
+    ngx_memcpy(map->name.data, shm->name.data, shm->name.len);
+
+    map->size = shm->size;
+    map->huge = huge;
+    map->addr = addr;
+    map->len = len;
+    map->pages = pages;
+    map->refs = 1;
+
+    map->next = ngx_http_ericsten_shm_maps;
+    ngx_http_ericsten_shm_maps = map;
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+        "ericsten zone \"%V\": %uz bytes in %s%s", &shm->name, len,
+        ngx_http_ericsten_shm_pages[pages], prefault ? ", prefaulted" : "");
+
+    return map;
+}
+
+//
+// Returns NULL on failure, logged if log is set.
+//
+
+static u_char *
+ngx_http_ericsten_shm_mmap(size_t len, int flags, ngx_log_t *log)
+{
+    u_char  *addr;
+
+    addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED|flags, -1, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        if (log)
+        {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                "mmap(MAP_ANON|MAP_SHARED, %uz) failed", len);
+        }
+
+        return NULL;
+    }
+
+    return addr;
+}
+
+//
+// Fault the zone in now, in the master, so that the workers inherit it
+// populated.  The memory is fresh, so writing zeros to it changes nothing.
+//
+
+static void
+ngx_http_ericsten_shm_prefault(u_char *addr, size_t len)
+{
+    u_char  *p;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+
+    for (p = addr; p < addr + len; p += ngx_pagesize)
+    {
+        *(volatile u_char *) p = 0;
+    }
+}
+
+static void
+ngx_http_ericsten_shm_cleanup(void *data)
+{
+    ngx_array_t                   *zones = data;
+    ngx_uint_t                     i;
+    ngx_http_ericsten_shm_t      **zone;
+    ngx_http_ericsten_shm_map_t   *map, **prev;
+
+    zone = zones->elts;
+
+    for (i = 0; i < zones->nelts; i++)
+    {
+        map = zone[i]->map;
+
+        if (map == NULL || --map->refs != 0)
+        {
+            continue;
+        }
+
+        for (prev = &ngx_http_ericsten_shm_maps; *prev != map; prev = &(*prev)->next) { /* void */ }
+
+        *prev = map->next;
+
+        if (munmap(map->addr, map->len) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                "munmap(%p, %uz) failed", map->addr, map->len);
+        }
+
+        ngx_free(map);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+
+Module Description:
+    Shared memory zones of ngx_http_ericsten_module.
+
+    The zones are mapped by the master process once the configuration has
+    been read, before the workers are forked, so every worker sees them at
+    the same address.  Unlike nginx's own shared zones they can be backed
+    by huge pages: explicit ones (MAP_HUGETLB) when the system has reserved
+    enough, or else transparent huge pages, asked for with madvise().
+    Either way, a large randomly accessed zone needs far fewer TLB entries.
+
+    A zone can also be prefaulted when it is mapped, so that the first
+    requests after a start or reload do not each take page faults on memory
+    that is certain to be used.
+
+    A zone that keeps its name, size and page settings across a reload keeps
+    its memory and contents; its init handler is told so.  The memory is
+    unmapped once no configuration uses it any more.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_SHM_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_SHM_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#define NGX_HTTP_ERICSTEN_SHM_SMALL     0   // Regular pages.
+#define NGX_HTTP_ERICSTEN_SHM_THP       1   // Transparent huge pages were asked for.
+#define NGX_HTTP_ERICSTEN_SHM_HUGETLB   2   // Explicit huge pages.
+
+typedef struct ngx_http_ericsten_shm_s      ngx_http_ericsten_shm_t;
+typedef struct ngx_http_ericsten_shm_map_s  ngx_http_ericsten_shm_map_t;
+
+//
+// Called in the master once the zone is mapped.  reused is set if the zone
+// is carried over from the previous configuration with its contents.
+//
+typedef ngx_int_t (*ngx_http_ericsten_shm_init_pt)(ngx_http_ericsten_shm_t *shm, ngx_uint_t reused);
+
+struct ngx_http_ericsten_shm_s
+{
+    ngx_str_t                       name;
+    size_t                          size;
+    ngx_http_ericsten_shm_init_pt   init;
+    void                           *data;       // For the init handler and the zone's users.
+
+    u_char                         *addr;       // Set once mapped.
+    ngx_uint_t                      pages;      // NGX_HTTP_ERICSTEN_SHM_*: what the zone got.
+    ngx_http_ericsten_shm_map_t    *map;
+};
+
+//
+// At configuration time: declare a zone.  Returns NULL if a zone of the
+// same name was declared with another size.
+//
+ngx_http_ericsten_shm_t *ngx_http_ericsten_shm_add(ngx_conf_t *cf, ngx_array_t *zones, ngx_str_t *name,
+    size_t size);
+
+//
+// In the master, from the module's init_module handler: map the declared
+// zones, reusing those of the previous configuration when possible, and
+// call their init handlers.
+//
+ngx_int_t ngx_http_ericsten_shm_init(ngx_cycle_t *cycle, ngx_array_t *zones, ngx_flag_t huge_pages,
+    ngx_flag_t prefault);
+
+#endif /* _NGX_HTTP_ERICSTEN_SHM_H_INCLUDED_ */
@@ -0,0 +1,687 @@
+/*
+
+Module Description:
+    Out-of-process executor for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_sidecar.h.
+
+    A connection has room for sidecar->requests calls.  A call's id is its
+    index in the connection's call table in the low 16 bits, and a counter
+    of the uses of that entry in the high 16 bits, so that a response is
+    matched to its call without a search.
+
+    Calls are appended to the connection's output buffer, and the write
+    event is posted; it runs once the current handlers are done, so calls
+    made in one event loop iteration share a send().  Responses are parsed
+    out of the input buffer as they arrive, and the buffer is compacted
+    after every read.
+
+    The connections are a pool: a call goes to an open connection with
+    room, and only if there is none is a closed one opened.  The read timer
+    is the call timeout while calls are in flight, and the keepalive timeout
+    while there are none.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#include "ngx_http_ericsten_sidecar.h"
+
+#define NGX_HTTP_ERICSTEN_SIDECAR_BUFFER    65536   // Per connection, each way.
+#define NGX_HTTP_ERICSTEN_SIDECAR_RETRY     1000    // ms before a connection that broke is opened again.
+
+#define ngx_http_ericsten_sidecar_parse_uint16(p)  ((p)[0] << 8 | (p)[1])
+#define ngx_http_ericsten_sidecar_parse_uint32(p)  ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+typedef struct
+{
+    uint32_t                            id;
+    uint16_t                            uses;
+    ngx_http_ericsten_sidecar_done_pt   handler;        // NULL while free.
+    void                               *data;
+} ngx_http_ericsten_sidecar_call_t;
+
+struct ngx_http_ericsten_sidecar_conn_s
+{
+    ngx_http_ericsten_sidecar_t        *sidecar;
+    ngx_peer_connection_t               peer;           // peer.connection is NULL while closed.
+    ngx_buf_t                          *in;
+    ngx_buf_t                          *out;
+    ngx_http_ericsten_sidecar_call_t   *calls;
+    ngx_uint_t                         *free;           // Stack of free calls.
+    ngx_uint_t                          nfree;
+    ngx_msec_t                          failed;         // When the connection last broke.
+    unsigned                            broken:1;       // It did, less than a retry period ago.
+    unsigned                            connecting:1;
+};
+
+static ngx_int_t ngx_http_ericsten_sidecar_connect(ngx_http_ericsten_sidecar_conn_t *conn);
+static ngx_int_t ngx_http_ericsten_sidecar_test_connect(ngx_http_ericsten_sidecar_conn_t *conn);
+static void ngx_http_ericsten_sidecar_write_handler(ngx_event_t *wev);
+static void ngx_http_ericsten_sidecar_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_ericsten_sidecar_process(ngx_http_ericsten_sidecar_conn_t *conn);
+static void ngx_http_ericsten_sidecar_close(ngx_http_ericsten_sidecar_conn_t *conn, ngx_uint_t broken);
+static u_char *ngx_http_ericsten_sidecar_write_uint32(u_char *p, uint32_t value);
+
+ngx_http_ericsten_sidecar_t *
+ngx_http_ericsten_sidecar_create(ngx_conf_t *cf, ngx_str_t *url, ngx_uint_t connections, ngx_uint_t requests,
+    ngx_msec_t timeout, ngx_msec_t keepalive)
+{
+    ngx_url_t                     u;
+    ngx_http_ericsten_sidecar_t  *sidecar;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = *url;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK)
+    {
+        if (u.err)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "%s in sidecar \"%V\"", u.err, &u.url);
+        }
+
+        return NULL;
+    }
+
+    if (u.no_port && u.family != AF_UNIX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "no port in sidecar \"%V\"", &u.url);
+        return NULL;
+    }
+
+    if (u.naddrs == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "no addresses for sidecar \"%V\"", &u.url);
+        return NULL;
+    }
+
+    sidecar = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_sidecar_t));
+    if (sidecar == NULL)
+    {
+        return NULL;
+    }
+
+    sidecar->addr = u.addrs;
+    sidecar->connections = connections;
+    sidecar->requests = requests;
+    sidecar->timeout = timeout;
+    sidecar->keepalive = keepalive;
+
+    return sidecar;
+}
+
+ngx_int_t
+ngx_http_ericsten_sidecar_start(ngx_http_ericsten_sidecar_t *sidecar, ngx_cycle_t *cycle)
+{
+    ngx_uint_t                         i, j;
+    ngx_http_ericsten_sidecar_conn_t  *conn;
+
+    sidecar->log = cycle->log;
+
+    sidecar->conns = ngx_pcalloc(cycle->pool, sidecar->connections * sizeof(ngx_http_ericsten_sidecar_conn_t));
+    if (sidecar->conns == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < sidecar->connections; i++)
+    {
+        conn = &sidecar->conns[i];
+        conn->sidecar = sidecar;
+
+        conn->in = ngx_create_temp_buf(cycle->pool, NGX_HTTP_ERICSTEN_SIDECAR_BUFFER);
+        conn->out = ngx_create_temp_buf(cycle->pool, NGX_HTTP_ERICSTEN_SIDECAR_BUFFER);
+        conn->calls = ngx_pcalloc(cycle->pool, sidecar->requests * sizeof(ngx_http_ericsten_sidecar_call_t));
+        conn->free = ngx_palloc(cycle->pool, sidecar->requests * sizeof(ngx_uint_t));
+
+        if (conn->in == NULL || conn->out == NULL || conn->calls == NULL || conn->free == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < sidecar->requests; j++)
+        {
+            conn->free[j] = sidecar->requests - 1 - j;
+        }
+
+        conn->nfree = sidecar->requests;
+    }
+
+    //
+    // Open one connection up front, so that the first requests do not wait
+    // for it, and so that a sidecar that is not running shows in the log.
+    //
+
+    (void) ngx_http_ericsten_sidecar_connect(&sidecar->conns[0]);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_sidecar_call(ngx_http_ericsten_sidecar_t *sidecar, ngx_uint_t op, u_char *body, size_t len,
+    ngx_http_ericsten_sidecar_done_pt handler, void *data)
+{
+    u_char                            *p;
+    size_t                             size;
+    ngx_uint_t                         i, n;
+    ngx_buf_t                         *out;
+    ngx_connection_t                  *c;
+    ngx_http_ericsten_sidecar_conn_t  *conn;
+    ngx_http_ericsten_sidecar_call_t  *call;
+
+    if (len > NGX_HTTP_ERICSTEN_SIDECAR_BODY)
+    {
+        return NGX_DECLINED;
+    }
+
+    size = NGX_HTTP_ERICSTEN_SIDECAR_HEADER + len;
+    conn = NULL;
+
+    for (n = 0; n < sidecar->connections; n++)
+    {
+        conn = &sidecar->conns[(sidecar->next + n) % sidecar->connections];
+
+        if (conn->peer.connection == NULL || conn->nfree == 0)
+        {
+            continue;
+        }
+
+        out = conn->out;
+
+        if ((size_t) (out->end - out->last) < size && out->pos != out->start)
+        {
+            out->last = ngx_movemem(out->start, out->pos, out->last - out->pos);
+            out->pos = out->start;
+        }
+
+        if ((size_t) (out->end - out->last) >= size)
+        {
+            break;
+        }
+    }
+
+    //
+    // None of the open connections has room: open another.
+    //
+
+    if (n == sidecar->connections)
+    {
+        for (n = 0; n < sidecar->connections; n++)
+        {
+            conn = &sidecar->conns[(sidecar->next + n) % sidecar->connections];
+
+            if (conn->peer.connection == NULL && ngx_http_ericsten_sidecar_connect(conn) == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (n == sidecar->connections)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    sidecar->next = (sidecar->next + n + 1) % sidecar->connections;
+
+    i = conn->free[--conn->nfree];
+    call = &conn->calls[i];
+
+    call->uses++;
+    call->id = (uint32_t) call->uses << 16 | (uint32_t) i;
+    call->handler = handler;
+    call->data = data;
+
+    out = conn->out;
+    p = out->last;
+
+    p = ngx_http_ericsten_sidecar_write_uint32(p, (uint32_t) len);
+    p = ngx_http_ericsten_sidecar_write_uint32(p, call->id);
+    *p++ = (u_char) (op >> 8);
+    *p++ = (u_char) op;
+    *p++ = 0;
+    *p++ = 0;
+
+    out->last = ngx_cpymem(p, body, len);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, sidecar->log, 0,
+        "ericsten sidecar: call %08xD, op %ui, %uz bytes", call->id, op, len);
+
+    c = conn->peer.connection;
+
+    //
+    // The first call on an idle connection replaces its keepalive timer.
+    //
+
+    if (c->idle || !c->read->timer_set)
+    {
+        ngx_add_timer(c->read, sidecar->timeout);
+    }
+
+    c->idle = 0;
+
+    //
+    // A connection still being opened is written to once it is.
+    //
+
+    if (!conn->connecting && !c->write->posted)
+    {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+//
+// Returns NGX_DECLINED without trying if the connection broke less than a
+// retry period ago, or if the worker is shutting down.
+//
+
+static ngx_int_t
+ngx_http_ericsten_sidecar_connect(ngx_http_ericsten_sidecar_conn_t *conn)
+{
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_peer_connection_t        *pc = &conn->peer;
+    ngx_http_ericsten_sidecar_t  *sidecar = conn->sidecar;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (conn->broken)
+    {
+        if (ngx_current_msec - conn->failed < NGX_HTTP_ERICSTEN_SIDECAR_RETRY)
+        {
+            return NGX_DECLINED;
+        }
+
+        conn->broken = 0;
+    }
+
+    ngx_memzero(pc, sizeof(ngx_peer_connection_t));
+
+    pc->sockaddr = sidecar->addr->sockaddr;
+    pc->socklen = sidecar->addr->socklen;
+    pc->name = &sidecar->addr->name;
+    pc->get = ngx_event_get_peer;
+    pc->log = sidecar->log;
+    pc->log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED)
+    {
+        pc->connection = NULL;
+        conn->broken = 1;
+        conn->failed = ngx_current_msec;
+        return NGX_DECLINED;
+    }
+
+    c = pc->connection;
+    c->data = conn;
+    c->idle = 1;
+
+    c->read->handler = ngx_http_ericsten_sidecar_read_handler;
+    c->write->handler = ngx_http_ericsten_sidecar_write_handler;
+
+    if (pc->sockaddr->sa_family != AF_UNIX && ngx_tcp_nodelay(c) != NGX_OK)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 1);
+        return NGX_DECLINED;
+    }
+
+    conn->connecting = (rc == NGX_AGAIN);
+
+    //
+    // Until a call is made, the connection is idle like any other.
+    //
+
+    ngx_add_timer(c->read, sidecar->keepalive);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, sidecar->log, 0,
+        "ericsten sidecar: connecting to %V: %i", pc->name, rc);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_ericsten_sidecar_test_connect(ngx_http_ericsten_sidecar_conn_t *conn)
+{
+    int                err;
+    socklen_t          len;
+    ngx_connection_t  *c = conn->peer.connection;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1)
+    {
+        err = ngx_socket_errno;
+    }
+
+    if (err)
+    {
+        ngx_log_error(NGX_LOG_ERR, c->log, err,
+            "ericsten sidecar: connect() to %V failed", conn->peer.name);
+        return NGX_ERROR;
+    }
+
+    conn->connecting = 0;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_ericsten_sidecar_write_handler(ngx_event_t *wev)
+{
+    ssize_t                            n;
+    ngx_buf_t                         *out;
+    ngx_connection_t                  *c = wev->data;
+    ngx_http_ericsten_sidecar_conn_t  *conn = c->data;
+
+    if (conn->connecting && ngx_http_ericsten_sidecar_test_connect(conn) != NGX_OK)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 1);
+        return;
+    }
+
+    out = conn->out;
+
+    while (out->pos < out->last)
+    {
+        n = c->send(c, out->pos, out->last - out->pos);
+
+        if (n == NGX_AGAIN)
+        {
+            break;
+        }
+
+        if (n == NGX_ERROR)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 1);
+            return;
+        }
+
+        out->pos += n;
+    }
+
+    if (out->pos == out->last)
+    {
+        out->pos = out->start;
+        out->last = out->start;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 1);
+    }
+}
+
+static void
+ngx_http_ericsten_sidecar_read_handler(ngx_event_t *rev)
+{
+    ssize_t                            n;
+    ngx_uint_t                         active;
+    ngx_buf_t                         *in;
+    ngx_connection_t                  *c = rev->data;
+    ngx_http_ericsten_sidecar_conn_t  *conn = c->data;
+    ngx_http_ericsten_sidecar_t       *sidecar = conn->sidecar;
+
+    //
+    // Closed by ngx_close_idle_connections() when the worker shuts down.
+    //
+
+    if (c->close)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 0);
+        return;
+    }
+
+    if (rev->timedout)
+    {
+        if (c->idle)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 0);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+            "ericsten sidecar: %V timed out", conn->peer.name);
+        ngx_http_ericsten_sidecar_close(conn, 1);
+        return;
+    }
+
+    if (conn->connecting && ngx_http_ericsten_sidecar_test_connect(conn) != NGX_OK)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 1);
+        return;
+    }
+
+    in = conn->in;
+
+    for ( ;; )
+    {
+        n = c->recv(c, in->last, in->end - in->last);
+
+        if (n == NGX_AGAIN)
+        {
+            break;
+        }
+
+        //
+        // A sidecar may close an idle connection, as an idle one may be
+        // closed by it.
+        //
+
+        if (n == 0 && c->idle)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 0);
+            return;
+        }
+
+        if (n == 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                "ericsten sidecar: %V closed the connection", conn->peer.name);
+        }
+
+        if (n == 0 || n == NGX_ERROR)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 1);
+            return;
+        }
+
+        in->last += n;
+
+        if (ngx_http_ericsten_sidecar_process(conn) != NGX_OK)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 1);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK)
+    {
+        ngx_http_ericsten_sidecar_close(conn, 1);
+        return;
+    }
+
+    //
+    // The timeout runs from the last response while calls are in flight,
+    // and the keepalive timeout from the last one once there are none.
+    //
+
+    active = sidecar->requests - conn->nfree;
+
+    if (active)
+    {
+        ngx_add_timer(rev, sidecar->timeout);
+    }
+    else
+    {
+        if (ngx_exiting || sidecar->keepalive == 0)
+        {
+            ngx_http_ericsten_sidecar_close(conn, 0);
+            return;
+        }
+
+        if (!c->idle)
+        {
+            ngx_add_timer(rev, sidecar->keepalive);
+        }
+    }
+
+    c->idle = (active == 0);
+}
+
+//
+// Complete the calls whose responses are in the input buffer, and keep the
+// partial response that may follow them.
+//
+
+static ngx_int_t
+ngx_http_ericsten_sidecar_process(ngx_http_ericsten_sidecar_conn_t *conn)
+{
+    u_char                            *p, *body;
+    void                              *data;
+    size_t                             len;
+    uint32_t                           id;
+    ngx_uint_t                         i, status;
+    ngx_buf_t                         *in = conn->in;
+    ngx_http_ericsten_sidecar_t       *sidecar = conn->sidecar;
+    ngx_http_ericsten_sidecar_call_t  *call;
+    ngx_http_ericsten_sidecar_done_pt  handler;
+
+    p = in->start;
+
+    while (in->last - p >= NGX_HTTP_ERICSTEN_SIDECAR_HEADER)
+    {
+        len = ngx_http_ericsten_sidecar_parse_uint32(p);
+
+        if (len > NGX_HTTP_ERICSTEN_SIDECAR_BODY)
+        {
+            ngx_log_error(NGX_LOG_ERR, sidecar->log, 0,
+                "ericsten sidecar: %V sent a response of %uz bytes", conn->peer.name, len);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (in->last - p) < NGX_HTTP_ERICSTEN_SIDECAR_HEADER + len)
+        {
+            break;
+        }
+
+        id = ngx_http_ericsten_sidecar_parse_uint32(p + 4);
+        status = ngx_http_ericsten_sidecar_parse_uint16(p + 8);
+        body = p + NGX_HTTP_ERICSTEN_SIDECAR_HEADER;
+
+        p = body + len;
+
+        i = id & 0xffff;
+        call = (i < sidecar->requests) ? &conn->calls[i] : NULL;
+
+        if (call == NULL || call->handler == NULL || call->id != id)
+        {
+            ngx_log_error(NGX_LOG_ERR, sidecar->log, 0,
+                "ericsten sidecar: %V sent a response to unknown call %08xD", conn->peer.name, id);
+            return NGX_ERROR;
+        }
+
+        handler = call->handler;
+        data = call->data;
+
+        call->handler = NULL;
+        conn->free[conn->nfree++] = i;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, sidecar->log, 0,
+            "ericsten sidecar: response %08xD, status %ui, %uz bytes", id, status, len);
+
+        if (status != 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, sidecar->log, 0,
+                "ericsten sidecar: call failed with status %ui: \"%*s\"", status, len, body);
+
+            handler(data, NGX_ERROR, NULL, 0);
+            continue;
+        }
+
+        handler(data, NGX_OK, body, len);
+    }
+
+    in->last = ngx_movemem(in->start, p, in->last - p);
+
+    return NGX_OK;
+}
+
+//
+// Close the connection and fail its calls.  A connection that broke is not
+// opened again for a retry period.  The connection is marked closed first,
+// so that the handlers of the failed calls do not make new ones on it.
+//
+
+static void
+ngx_http_ericsten_sidecar_close(ngx_http_ericsten_sidecar_conn_t *conn, ngx_uint_t broken)
+{
+    void                              *data;
+    ngx_uint_t                         i;
+    ngx_http_ericsten_sidecar_t       *sidecar = conn->sidecar;
+    ngx_http_ericsten_sidecar_call_t  *call;
+    ngx_http_ericsten_sidecar_done_pt  handler;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, sidecar->log, 0,
+        "ericsten sidecar: closing connection to %V", conn->peer.name);
+
+    if (conn->peer.connection)
+    {
+        ngx_close_connection(conn->peer.connection);
+        conn->peer.connection = NULL;
+    }
+
+    conn->connecting = 0;
+
+    if (broken)
+    {
+        conn->broken = 1;
+        conn->failed = ngx_current_msec;
+    }
+
+    conn->in->last = conn->in->start;
+    conn->out->pos = conn->out->start;
+    conn->out->last = conn->out->start;
+
+    for (i = 0; i < sidecar->requests; i++)
+    {
+        call = &conn->calls[i];
+
+        if (call->handler == NULL)
+        {
+            continue;
+        }
+
+        handler = call->handler;
+        data = call->data;
+
+        call->handler = NULL;
+        conn->free[conn->nfree++] = i;
+
+        handler(data, NGX_ERROR, NULL, 0);
+    }
+}
+
+static u_char *
+ngx_http_ericsten_sidecar_write_uint32(u_char *p, uint32_t value)
+{
+    *p++ = (u_char) (value >> 24);
+    *p++ = (u_char) (value >> 16);
+    *p++ = (u_char) (value >> 8);
+    *p++ = (u_char) value;
+
+    return p;
+}
@@ -0,0 +1,113 @@
+/*
+
+Module Description:
+    Out-of-process executor for ngx_http_ericsten_module.
+
+    Some blocking operations wrap libraries that are not thread-safe, and
+    cannot run on the thread pool; many are calls to a local service, and
+    need no thread at all.  The sidecar backend sends them to such a
+    service, the sidecar, over a Unix domain or TCP socket: the request is
+    suspended while the call is out, and resumed by the event loop when the
+    response arrives.  No nginx thread is involved.
+
+    Each worker keeps a pool of non-blocking connections to the sidecar and
+    spreads calls over them, opening connections as they are needed and
+    closing those left idle for the keepalive timeout.  A connection carries
+    many calls at a time: requests are written back to back, and the sidecar
+    may answer them in any order, so a slow call does not hold up the ones
+    behind it.  Calls made in the same event loop iteration go out in one
+    send().  A sidecar that answers calls one at a time in order works too,
+    and with one call per connection, the pool is a plain keepalive pool.
+
+    Protocol.  Every message is a 12-byte header followed by a body of at
+    most NGX_HTTP_ERICSTEN_SIDECAR_BODY bytes.  Integers are in network
+    byte order.
+
+        uint32  length      Body length.
+        uint32  id          Chosen by nginx, unique among the calls in
+                            flight on the connection; the response carries
+                            the id of its request.
+        uint16  op          Request: the operation.
+                status      Response: 0 on success, else an error code; the
+                            body is then an optional message.
+        uint16  reserved    0.
+
+    Operations:
+
+        0   echo    The response body is the request body.
+        1   sleep   Body: uint32 input.  The blocking operation of the sleep
+                    task; the response body is the uint32 number of
+                    milliseconds slept.
+
+    A connection that sends a malformed response, or that has calls in
+    flight and sends nothing for the timeout, is closed and its calls fail.
+    Either side may close an idle connection.  A connection that broke is
+    not opened again for a second.
+
+    contrib/ericsten_sidecar.py is a reference sidecar.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_SIDECAR_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_SIDECAR_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#define NGX_HTTP_ERICSTEN_SIDECAR_HEADER    12
+#define NGX_HTTP_ERICSTEN_SIDECAR_BODY      4096
+
+#define NGX_HTTP_ERICSTEN_SIDECAR_ECHO      0
+#define NGX_HTTP_ERICSTEN_SIDECAR_SLEEP     1
+
+typedef struct ngx_http_ericsten_sidecar_conn_s  ngx_http_ericsten_sidecar_conn_t;
+
+//
+// On the event loop: the call made with data is done.  rc is NGX_OK and
+// body the response body, valid until the handler returns, or NGX_ERROR if
+// the call failed, which has been logged.  The handler may make new calls.
+//
+typedef void (*ngx_http_ericsten_sidecar_done_pt)(void *data, ngx_int_t rc, u_char *body, size_t len);
+
+typedef struct
+{
+    ngx_addr_t                         *addr;
+    ngx_uint_t                          connections;    // Per worker.
+    ngx_uint_t                          requests;       // Calls in flight per connection.
+    ngx_msec_t                          timeout;
+    ngx_msec_t                          keepalive;      // Before an idle connection is closed.
+
+    //
+    // Worker state.
+    //
+
+    ngx_http_ericsten_sidecar_conn_t   *conns;
+    ngx_uint_t                          next;           // Connection the next call tries first.
+    ngx_log_t                          *log;
+} ngx_http_ericsten_sidecar_t;
+
+//
+// At configuration time: url is "unix:path" or "host:port"; a host name is
+// resolved now, and its first address used.  Returns NULL and logs the
+// error if it is not valid.
+//
+ngx_http_ericsten_sidecar_t *ngx_http_ericsten_sidecar_create(ngx_conf_t *cf, ngx_str_t *url,
+    ngx_uint_t connections, ngx_uint_t requests, ngx_msec_t timeout, ngx_msec_t keepalive);
+
+//
+// From the module's init_process handler: open the first connection.  A
+// sidecar that is not running yet is not an error.
+//
+ngx_int_t ngx_http_ericsten_sidecar_start(ngx_http_ericsten_sidecar_t *sidecar, ngx_cycle_t *cycle);
+
+//
+// On the event loop: make a call.  Returns NGX_DECLINED if no connection has
+// room for it and none can be opened, or if the body is too large; handler
+// is then not called.
+//
+ngx_int_t ngx_http_ericsten_sidecar_call(ngx_http_ericsten_sidecar_t *sidecar, ngx_uint_t op, u_char *body,
+    size_t len, ngx_http_ericsten_sidecar_done_pt handler, void *data);
+
+#endif /* _NGX_HTTP_ERICSTEN_SIDECAR_H_INCLUDED_ */
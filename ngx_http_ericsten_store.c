@@ -0,0 +1,526 @@
+/*
+
+Module Description:
+    Persistent result store for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_store.h.
+
+    File layout:
+
+        header      one page: magic "ESRESULT", version, file size, index
+                    entries, and the log tail
+        index       uint64_t[entries]
+        log         records, each 8-byte aligned: uint32_t CRC32C,
+                    generation, key length and value length, then the key
+                    and the value
+
+    The log tail packs the generation in its top 16 bits and the bytes used
+    in the rest, so that reserving space and starting a new generation is a
+    single compare-and-swap.
+
+    An index entry packs a used bit, 15 bits of the key's hash, the low 8
+    bits of the generation it was written in, and the record's offset in
+    8-byte units.  Entries of an older generation count as free.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <sys/mman.h>
+
+#include "ngx_http_ericsten_digest.h"
+#include "ngx_http_ericsten_store.h"
+
+#define NGX_HTTP_ERICSTEN_STORE_MAGIC       "ESRESULT"
+#define NGX_HTTP_ERICSTEN_STORE_VERSION     1
+#define NGX_HTTP_ERICSTEN_STORE_HEADER      4096
+#define NGX_HTTP_ERICSTEN_STORE_PROBES      16      // Index entries tried per key.
+
+//
+// File bytes per index entry: a result is a small record, and the index is
+// an eighth of the file.
+//
+#define NGX_HTTP_ERICSTEN_STORE_RATIO       64
+
+#define NGX_HTTP_ERICSTEN_STORE_USED        ((uint64_t) 1 << 63)
+#define NGX_HTTP_ERICSTEN_STORE_USED_MASK   ((uint64_t) 0xffffff << 40)     // Used bit, tag and generation.
+#define NGX_HTTP_ERICSTEN_STORE_OFFSET_MASK (((uint64_t) 1 << 40) - 1)
+#define NGX_HTTP_ERICSTEN_STORE_TAIL_MASK   (((uint64_t) 1 << 48) - 1)
+
+struct ngx_http_ericsten_store_header_s
+{
+    u_char              magic[8];
+    uint32_t            version;
+    uint32_t            reserved;
+    uint64_t            size;
+    uint64_t            entries;
+    uint64_t            tail;           // Atomic: generation << 48 | log bytes used.
+};
+
+typedef struct
+{
+    uint32_t            crc;            // Of the rest of the record; written last.
+    uint32_t            generation;
+    uint32_t            key_len;
+    uint32_t            value_len;
+} ngx_http_ericsten_store_record_t;
+
+static ngx_int_t ngx_http_ericsten_store_check(ngx_http_ericsten_store_t *store, ngx_fd_t fd, ngx_log_t *log);
+static ngx_fd_t ngx_http_ericsten_store_create_file(ngx_http_ericsten_store_t *store, ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_ericsten_store_map(ngx_http_ericsten_store_t *store, ngx_fd_t fd, ngx_log_t *log);
+static uint32_t ngx_http_ericsten_store_crc(ngx_http_ericsten_store_record_t *record);
+static uint64_t ngx_http_ericsten_store_entry(uint64_t hash, uint32_t generation, size_t offset);
+static void ngx_http_ericsten_store_cleanup(void *data);
+
+ngx_http_ericsten_store_t *
+ngx_http_ericsten_store_create(ngx_conf_t *cf, ngx_str_t *path, size_t size)
+{
+    ngx_http_ericsten_store_t  *store;
+
+    store = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_store_t));
+    if (store == NULL)
+    {
+        return NULL;
+    }
+
+    store->path = *path;
+
+    if (ngx_conf_full_name(cf->cycle, &store->path, 1) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    store->size = ngx_align(size, ngx_pagesize);
+
+    //
+    // A power of two entries, at most one per NGX_HTTP_ERICSTEN_STORE_RATIO
+    // bytes.
+    //
+
+    for (store->mask = 63;
+         (store->mask + 1) * 2 * NGX_HTTP_ERICSTEN_STORE_RATIO <= store->size;
+         store->mask = store->mask * 2 + 1)
+    {
+        /* void */
+    }
+
+    store->log_size = store->size - NGX_HTTP_ERICSTEN_STORE_HEADER - (store->mask + 1) * sizeof(uint64_t);
+
+    return store;
+}
+
+//
+// Called from init_module, which runs in the master at every reload while
+// the old workers still have the file mapped, and under nginx -t.  The file
+// is therefore never changed in place: a file that does not fit is
+// replaced by a new one renamed over it, which only the new workers map.
+//
+
+ngx_int_t
+ngx_http_ericsten_store_open(ngx_http_ericsten_store_t *store, ngx_cycle_t *cycle)
+{
+    ngx_fd_t             fd;
+    ngx_int_t            rc;
+    ngx_pool_cleanup_t  *cln;
+
+    if (ngx_test_config)
+    {
+        return NGX_OK;
+    }
+
+    fd = ngx_open_file(store->path.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        if (ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                ngx_open_file_n " \"%V\" failed", &store->path);
+            return NGX_ERROR;
+        }
+    }
+    else
+    {
+        rc = ngx_http_ericsten_store_check(store, fd, cycle->log);
+
+        if (rc != NGX_OK)
+        {
+            if (ngx_close_file(fd) == NGX_FILE_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                    ngx_close_file_n " \"%V\" failed", &store->path);
+            }
+
+            if (rc == NGX_ERROR)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                "ericsten result cache \"%V\" is not valid for this configuration, replaced", &store->path);
+
+            fd = NGX_INVALID_FILE;
+        }
+    }
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        fd = ngx_http_ericsten_store_create_file(store, cycle);
+
+        if (fd == NGX_INVALID_FILE)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    rc = NGX_ERROR;
+
+    if (ngx_http_ericsten_store_map(store, fd, cycle->log) != NGX_OK)
+    {
+        goto done;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL)
+    {
+        ngx_http_ericsten_store_cleanup(store);
+        goto done;
+    }
+
+    cln->handler = ngx_http_ericsten_store_cleanup;
+    cln->data = store;
+
+    rc = NGX_OK;
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+            ngx_close_file_n " \"%V\" failed", &store->path);
+    }
+
+    return rc;
+}
+
+//
+// Only the header is checked here; the records are checked as lookups reach
+// them.  NGX_DECLINED: the file is not ours, or not ours at this size.
+//
+
+static ngx_int_t
+ngx_http_ericsten_store_check(ngx_http_ericsten_store_t *store, ngx_fd_t fd, ngx_log_t *log)
+{
+    ngx_file_info_t                    fi;
+    ngx_http_ericsten_store_header_t   header;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+            ngx_fd_info_n " \"%V\" failed", &store->path);
+        return NGX_ERROR;
+    }
+
+    if (ngx_file_size(&fi) != (off_t) store->size
+        || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+        || ngx_memcmp(header.magic, NGX_HTTP_ERICSTEN_STORE_MAGIC, 8) != 0
+        || header.version != NGX_HTTP_ERICSTEN_STORE_VERSION
+        || header.size != store->size
+        || header.entries != store->mask + 1)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+//
+// Build an empty file under a temporary name and rename it into place.
+// Returns it open, or NGX_INVALID_FILE.
+//
+
+static ngx_fd_t
+ngx_http_ericsten_store_create_file(ngx_http_ericsten_store_t *store, ngx_cycle_t *cycle)
+{
+    u_char                            *temp;
+    ngx_fd_t                           fd;
+    ngx_http_ericsten_store_header_t   header;
+
+    temp = ngx_pnalloc(cycle->pool, store->path.len + sizeof(".tmp"));
+    if (temp == NULL)
+    {
+        return NGX_INVALID_FILE;
+    }
+
+    (void) ngx_sprintf(temp, "%V.tmp%Z", &store->path);
+
+    fd = ngx_open_file(temp, NGX_FILE_RDWR, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            ngx_open_file_n " \"%s\" failed", temp);
+        return NGX_INVALID_FILE;
+    }
+
+    ngx_memzero(&header, sizeof(header));
+    ngx_memcpy(header.magic, NGX_HTTP_ERICSTEN_STORE_MAGIC, 8);
+    header.version = NGX_HTTP_ERICSTEN_STORE_VERSION;
+    header.size = store->size;
+    header.entries = store->mask + 1;
+    header.tail = (uint64_t) 1 << 48;
+
+    if (ftruncate(fd, store->size) == -1
+        || pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+        || ngx_rename_file(temp, store->path.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+            "ericsten result cache \"%V\" could not be created", &store->path);
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                ngx_close_file_n " \"%s\" failed", temp);
+        }
+
+        if (ngx_delete_file(temp) == NGX_FILE_ERROR)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                ngx_delete_file_n " \"%s\" failed", temp);
+        }
+
+        return NGX_INVALID_FILE;
+    }
+
+    return fd;
+}
+
+static ngx_int_t
+ngx_http_ericsten_store_map(ngx_http_ericsten_store_t *store, ngx_fd_t fd, ngx_log_t *log)
+{
+    u_char  *addr;
+
+    addr = mmap(NULL, store->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED)
+    {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+            "mmap(\"%V\", %uz) failed", &store->path, store->size);
+        return NGX_ERROR;
+    }
+
+    store->addr = addr;
+    store->header = (ngx_http_ericsten_store_header_t *) addr;
+    store->index = (uint64_t *) (addr + NGX_HTTP_ERICSTEN_STORE_HEADER);
+    store->log = (u_char *) (store->index + store->mask + 1);
+
+    //
+    // Start reading the index in the background; the first lookups will
+    // not have to wait for all of it.
+    //
+
+    (void) madvise(store->index, (store->mask + 1) * sizeof(uint64_t), MADV_WILLNEED);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_ericsten_store_get(ngx_http_ericsten_store_t *store, u_char *key, size_t len, ngx_pool_t *pool,
+    ngx_str_t *value)
+{
+    u_char                            *copy;
+    size_t                             offset, n;
+    uint32_t                           crc, generation;
+    uint64_t                           hash, entry, mask;
+    ngx_uint_t                         i;
+    ngx_http_ericsten_xxh64_t          xxh64;
+    ngx_http_ericsten_store_record_t  *record, header;
+
+    ngx_http_ericsten_xxh64_init(&xxh64, 0);
+    ngx_http_ericsten_xxh64_update(&xxh64, key, len);
+    hash = ngx_http_ericsten_xxh64_final(&xxh64);
+
+    generation = __atomic_load_n(&store->header->tail, __ATOMIC_ACQUIRE) >> 48;
+    mask = ngx_http_ericsten_store_entry(hash, generation, 0) & NGX_HTTP_ERICSTEN_STORE_USED_MASK;
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_STORE_PROBES; i++)
+    {
+        entry = __atomic_load_n(&store->index[(hash + i) & store->mask], __ATOMIC_ACQUIRE);
+
+        if (entry == 0)
+        {
+            break;
+        }
+
+        if ((entry & NGX_HTTP_ERICSTEN_STORE_USED_MASK) != mask)
+        {
+            continue;
+        }
+
+        offset = (size_t) (entry & NGX_HTTP_ERICSTEN_STORE_OFFSET_MASK) << 3;
+
+        if (offset > store->log_size - sizeof(ngx_http_ericsten_store_record_t))
+        {
+            continue;
+        }
+
+        record = (ngx_http_ericsten_store_record_t *) (store->log + offset);
+        crc = __atomic_load_n(&record->crc, __ATOMIC_ACQUIRE);
+
+        ngx_memcpy(&header, record, sizeof(ngx_http_ericsten_store_record_t));
+
+        n = sizeof(ngx_http_ericsten_store_record_t) + (size_t) header.key_len + header.value_len;
+
+        if (header.key_len != len || n > store->log_size - offset)
+        {
+            continue;
+        }
+
+        //
+        // Check the copy, not the record: another worker may be writing
+        // over it in a new generation.
+        //
+
+        copy = ngx_pnalloc(pool, n);
+        if (copy == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(copy, record, n);
+
+        record = (ngx_http_ericsten_store_record_t *) copy;
+
+        if (record->key_len != header.key_len
+            || record->value_len != header.value_len
+            || ngx_http_ericsten_store_crc(record) != crc
+            || record->generation != generation
+            || ngx_memcmp(copy + sizeof(ngx_http_ericsten_store_record_t), key, len) != 0)
+        {
+            continue;
+        }
+
+        value->data = copy + sizeof(ngx_http_ericsten_store_record_t) + len;
+        value->len = record->value_len;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+void
+ngx_http_ericsten_store_put(ngx_http_ericsten_store_t *store, u_char *key, size_t len, u_char *value,
+    size_t value_len)
+{
+    u_char                            *p;
+    size_t                             n, used;
+    uint32_t                           generation;
+    uint64_t                           hash, entry, old, tail, *slot;
+    ngx_uint_t                         i;
+    ngx_http_ericsten_xxh64_t          xxh64;
+    ngx_http_ericsten_store_record_t  *record;
+
+    n = ngx_align(sizeof(ngx_http_ericsten_store_record_t) + len + value_len, 8);
+
+    if (n > store->log_size || len > 0xffffffff || value_len > 0xffffffff)
+    {
+        return;
+    }
+
+    //
+    // Reserve the space, starting a new generation at the beginning of the
+    // log if it is full.
+    //
+
+    tail = __atomic_load_n(&store->header->tail, __ATOMIC_RELAXED);
+
+    do
+    {
+        generation = tail >> 48;
+        used = (size_t) (tail & NGX_HTTP_ERICSTEN_STORE_TAIL_MASK);
+
+        if (used > store->log_size - n)
+        {
+            generation = (generation + 1) & 0xffff;
+            generation += (generation == 0);
+            used = 0;
+        }
+    }
+    while (!__atomic_compare_exchange_n(&store->header->tail, &tail, ((uint64_t) generation << 48) | (used + n),
+                                        1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    record = (ngx_http_ericsten_store_record_t *) (store->log + used);
+
+    record->generation = generation;
+    record->key_len = (uint32_t) len;
+    record->value_len = (uint32_t) value_len;
+
+    p = ngx_cpymem((u_char *) (record + 1), key, len);
+    ngx_memcpy(p, value, value_len);
+
+    __atomic_store_n(&record->crc, ngx_http_ericsten_store_crc(record), __ATOMIC_RELEASE);
+
+    //
+    // Then index it: in the first entry that is free, of an older
+    // generation, or probably for the same key, or else in place of the
+    // first one.
+    //
+
+    ngx_http_ericsten_xxh64_init(&xxh64, 0);
+    ngx_http_ericsten_xxh64_update(&xxh64, key, len);
+    hash = ngx_http_ericsten_xxh64_final(&xxh64);
+
+    entry = ngx_http_ericsten_store_entry(hash, generation, used);
+    slot = &store->index[hash & store->mask];
+
+    for (i = 0; i < NGX_HTTP_ERICSTEN_STORE_PROBES; i++)
+    {
+        old = __atomic_load_n(&store->index[(hash + i) & store->mask], __ATOMIC_RELAXED);
+
+        if (old == 0
+            || ((old ^ entry) & NGX_HTTP_ERICSTEN_STORE_USED_MASK) == 0
+            || ((old >> 40) & 0xff) != (generation & 0xff))
+        {
+            slot = &store->index[(hash + i) & store->mask];
+            break;
+        }
+    }
+
+    __atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+}
+
+static uint32_t
+ngx_http_ericsten_store_crc(ngx_http_ericsten_store_record_t *record)
+{
+    uint32_t  crc;
+
+    ngx_http_ericsten_crc32c_init(&crc);
+    ngx_http_ericsten_crc32c_update(&crc, (u_char *) &record->generation,
+                                    sizeof(ngx_http_ericsten_store_record_t) - sizeof(uint32_t)
+                                    + record->key_len + record->value_len);
+    ngx_http_ericsten_crc32c_final(&crc);
+
+    return crc;
+}
+
+static uint64_t
+ngx_http_ericsten_store_entry(uint64_t hash, uint32_t generation, size_t offset)
+{
+    return NGX_HTTP_ERICSTEN_STORE_USED
+           | ((hash >> 49) << 48)
+           | ((uint64_t) (generation & 0xff) << 40)
+           | (offset >> 3);
+}
+
+static void
+ngx_http_ericsten_store_cleanup(void *data)
+{
+    ngx_http_ericsten_store_t  *store = data;
+
+    if (munmap(store->addr, store->size) == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+            "munmap(\"%V\", %uz) failed", &store->path, store->size);
+    }
+}
@@ -0,0 +1,73 @@
+/*
+
+Module Description:
+    Persistent result store for ngx_http_ericsten_module.
+
+    Results of the offloaded lookups are kept in a file mapped into every
+    worker, so that they outlive a reload, a restart and a binary upgrade:
+    the new processes map the same file and serve from it at once, instead
+    of sending every key to the thread pool while an in-memory cache fills.
+
+    The file is an append log of records with an index in front of it.
+    Workers append concurrently: a record's space is reserved with one
+    atomic operation on the log tail, and the record is committed by
+    writing its CRC32C last.  The index is an open-addressing table of
+    64-bit entries, each stored with a single write, that point into the
+    log.  Nothing is read in when the file is opened; a record is validated
+    when a lookup reaches it, by its checksum, its generation and its key.
+    A record torn by a crash, or by a system crash before the kernel wrote
+    it back, is therefore only a miss.
+
+    When the log is full it starts over in a new generation, which drops
+    everything stored so far: this is a cache.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_STORE_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_STORE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+typedef struct ngx_http_ericsten_store_header_s  ngx_http_ericsten_store_header_t;
+
+typedef struct
+{
+    ngx_str_t                           path;
+    size_t                              size;
+
+    //
+    // Set when the file is mapped.
+    //
+
+    u_char                             *addr;
+    ngx_http_ericsten_store_header_t   *header;
+    uint64_t                           *index;
+    ngx_uint_t                          mask;       // Index entries - 1.
+    u_char                             *log;
+    size_t                              log_size;
+} ngx_http_ericsten_store_t;
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_store_t *ngx_http_ericsten_store_create(ngx_conf_t *cf, ngx_str_t *path, size_t size);
+
+//
+// In the master, from the module's init_module handler: open the file,
+// creating or resetting it if it is missing or was made for another size,
+// and map it.  Unmapped with the cycle.
+//
+ngx_int_t ngx_http_ericsten_store_open(ngx_http_ericsten_store_t *store, ngx_cycle_t *cycle);
+
+//
+// On the event loop.  Other workers may be overwriting the record, so
+// ngx_http_ericsten_store_get() copies it into pool and checks the copy.
+// Returns NGX_OK, NGX_DECLINED if the key is not stored, or NGX_ERROR.
+//
+ngx_int_t ngx_http_ericsten_store_get(ngx_http_ericsten_store_t *store, u_char *key, size_t len,
+    ngx_pool_t *pool, ngx_str_t *value);
+void ngx_http_ericsten_store_put(ngx_http_ericsten_store_t *store, u_char *key, size_t len, u_char *value,
+    size_t value_len);
+
+#endif /* _NGX_HTTP_ERICSTEN_STORE_H_INCLUDED_ */
@@ -0,0 +1,482 @@
+/*
+
+Module Description:
+    Per-worker io_uring for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_uring.h.
+
+    The rings are driven with the raw system calls, so there is no liburing
+    dependency.  There is one ring per worker process and only the event
+    loop touches it: it is the sole producer of submissions and the sole
+    consumer of completions.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_uring.h"
+
+#if (NGX_HTTP_ERICSTEN_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define NGX_HTTP_ERICSTEN_URING_ENTRIES  1024
+
+typedef struct
+{
+    int                   fd;
+    unsigned             *sq_head;
+    unsigned             *sq_tail;
+    unsigned             *sq_array;
+    unsigned              sq_mask;
+    struct io_uring_sqe  *sqes;
+    unsigned             *cq_head;
+    unsigned             *cq_tail;
+    unsigned              cq_mask;
+    struct io_uring_cqe  *cqes;
+    unsigned              entries;
+
+    unsigned              queued;       // Our submission tail: entries filled in.
+    unsigned              submitted;    // Entries the kernel has taken.
+    ngx_uint_t            reserved;     // Operations callers may have in flight; at most entries.
+    ngx_connection_t     *notify;       // The eventfd the kernel signals completions on.
+
+    unsigned              ready:1;
+    unsigned              failed:1;     // Setup failed; not retried.
+    unsigned              reaping:1;    // Submissions are deferred to the end of the batch.
+} ngx_http_ericsten_uring_t;
+
+static ngx_http_ericsten_uring_t  ngx_http_ericsten_uring;
+
+static ngx_int_t ngx_http_ericsten_uring_init(ngx_log_t *log);
+static ngx_int_t ngx_http_ericsten_uring_probe(int fd, ngx_log_t *log);
+static void ngx_http_ericsten_uring_handler(ngx_event_t *ev);
+static struct io_uring_sqe *ngx_http_ericsten_uring_sqe(ngx_http_ericsten_uring_op_t *op);
+
+ngx_int_t
+ngx_http_ericsten_uring_reserve(ngx_uint_t n, ngx_log_t *log)
+{
+    ngx_http_ericsten_uring_t  *ring = &ngx_http_ericsten_uring;
+
+    if (!ring->ready)
+    {
+        if (ring->failed)
+        {
+            return NGX_DECLINED;
+        }
+
+        if (ngx_http_ericsten_uring_init(log) != NGX_OK)
+        {
+            ring->failed = 1;
+            return NGX_DECLINED;
+        }
+
+        ring->ready = 1;
+    }
+
+    //
+    // Reservations keep the operations in flight below the ring size, so
+    // neither the submission ring nor the completion ring can fill up.
+    //
+
+    if (ring->reserved + n > ring->entries)
+    {
+        return NGX_DECLINED;
+    }
+
+    ring->reserved += n;
+
+    return NGX_OK;
+}
+
+void
+ngx_http_ericsten_uring_release(ngx_uint_t n)
+{
+    ngx_http_ericsten_uring.reserved -= n;
+}
+
+void
+ngx_http_ericsten_uring_openat(ngx_http_ericsten_uring_op_t *op, u_char *path, int flags)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_http_ericsten_uring_sqe(op);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = (uint32_t) flags;
+}
+
+void
+ngx_http_ericsten_uring_read(ngx_http_ericsten_uring_op_t *op, ngx_fd_t fd, u_char *buf,
+    size_t len, off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_http_ericsten_uring_sqe(op);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (uint32_t) len;
+    sqe->off = (uint64_t) offset;
+}
+
+void
+ngx_http_ericsten_uring_submit(ngx_log_t *log)
+{
+    int                            n;
+    unsigned                       i;
+    ngx_err_t                      err;
+    ngx_http_ericsten_uring_op_t  *op;
+    ngx_http_ericsten_uring_t     *ring = &ngx_http_ericsten_uring;
+
+    if (ring->reaping || ring->queued == ring->submitted)
+    {
+        return;
+    }
+
+    __atomic_store_n(ring->sq_tail, ring->queued, __ATOMIC_RELEASE);
+
+    n = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued - ring->submitted, 0, 0, NULL, 0);
+
+    if (n >= 0)
+    {
+        ring->submitted += n;
+        return;
+    }
+
+    err = ngx_errno;
+
+    if (err == NGX_EINTR || err == NGX_EAGAIN || err == EBUSY)
+    {
+        //
+        // Left queued; they go with the next submission.
+        //
+
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, log, err, "io_uring_enter() failed");
+
+    //
+    // Take back what the kernel did not take and fail it, so that nobody
+    // waits for it.  The completions are posted events, as the callers may
+    // not expect their handlers to run from here.
+    //
+
+    for (i = ring->submitted; i != ring->queued; i++)
+    {
+        op = (ngx_http_ericsten_uring_op_t *) (uintptr_t) ring->sqes[i & ring->sq_mask].user_data;
+        op->res = -err;
+
+        ngx_post_event(&op->event, &ngx_posted_events);
+    }
+
+    ring->queued = ring->submitted;
+
+    __atomic_store_n(ring->sq_tail, ring->queued, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+ngx_http_ericsten_uring_sqe(ngx_http_ericsten_uring_op_t *op)
+{
+    unsigned                    index;
+    struct io_uring_sqe        *sqe;
+    ngx_http_ericsten_uring_t  *ring = &ngx_http_ericsten_uring;
+
+    //
+    // The reservation guarantees a free entry.  The tail is published by
+    // the next submit.
+    //
+
+    index = ring->queued & ring->sq_mask;
+    ring->queued++;
+
+    sqe = &ring->sqes[index];
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+    sqe->user_data = (uintptr_t) op;
+
+    ring->sq_array[index] = index;
+
+    return sqe;
+}
+
+//
+// Reap completions.  The eventfd is drained first, so a completion posted
+// after the ring has been looked at signals it again.
+//
+
+static void
+ngx_http_ericsten_uring_handler(ngx_event_t *ev)
+{
+    uint64_t                       value;
+    unsigned                       head;
+    struct io_uring_cqe           *cqe;
+    ngx_connection_t              *c = ev->data;
+    ngx_http_ericsten_uring_op_t  *op;
+    ngx_http_ericsten_uring_t     *ring = &ngx_http_ericsten_uring;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0, "ngx_http_ericsten_uring_handler");
+
+    (void) read(c->fd, &value, sizeof(uint64_t));
+
+    ring->reaping = 1;
+
+    head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &ring->cqes[head & ring->cq_mask];
+
+        op = (ngx_http_ericsten_uring_op_t *) (uintptr_t) cqe->user_data;
+        op->res = cqe->res;
+
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        op->event.handler(&op->event);
+    }
+
+    ring->reaping = 0;
+
+    //
+    // Whatever the handlers queued goes in one io_uring_enter().
+    //
+
+    ngx_http_ericsten_uring_submit(ev->log);
+}
+
+static ngx_int_t
+ngx_http_ericsten_uring_init(ngx_log_t *log)
+{
+    int                         fd, efd;
+    u_char                     *sq, *cq;
+    size_t                      sq_size, cq_size, sqes_size;
+    ngx_connection_t           *c;
+    struct io_uring_sqe        *sqes;
+    struct io_uring_params      p;
+    ngx_http_ericsten_uring_t  *ring = &ngx_http_ericsten_uring;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    fd = (int) syscall(__NR_io_uring_setup, NGX_HTTP_ERICSTEN_URING_ENTRIES, &p);
+
+    if (fd == -1)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+            "io_uring_setup() failed, using the thread pool instead");
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_ericsten_uring_probe(fd, log) != NGX_OK)
+    {
+        (void) close(fd);
+        return NGX_ERROR;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size = ngx_max(sq_size, cq_size);
+        cq_size = sq_size;
+    }
+
+    sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq = MAP_FAILED;
+    sqes = MAP_FAILED;
+    efd = -1;
+
+    if (sq == MAP_FAILED)
+    {
+        goto failed;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cq = sq;
+    }
+    else
+    {
+        cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED)
+        {
+            goto failed;
+        }
+    }
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED)
+    {
+        goto failed;
+    }
+
+    efd = eventfd(0, 0);
+
+    if (efd == -1)
+    {
+        goto failed;
+    }
+
+    if (ngx_nonblocking(efd) == -1)
+    {
+        goto failed;
+    }
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) == -1)
+    {
+        goto failed;
+    }
+
+    //
+    // The connection outlives any request; it logs to the cycle, and is
+    // marked as a channel so that a worker exiting with it open does not
+    // report it as a leaked connection.
+    //
+
+    c = ngx_get_connection(efd, ngx_cycle->log);
+    if (c == NULL)
+    {
+        (void) close(efd);
+        efd = -1;
+        goto failed;
+    }
+
+    c->read->handler = ngx_http_ericsten_uring_handler;
+    c->read->log = ngx_cycle->log;
+    c->read->channel = 1;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        ngx_close_connection(c);
+        efd = -1;
+        goto failed;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sqes = sqes;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->entries = p.sq_entries;
+    ring->queued = *ring->sq_tail;
+    ring->submitted = ring->queued;
+    ring->notify = c;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+        "ngx_http_ericsten_uring_init: %ud entries, features %xd", p.sq_entries, p.features);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+        "io_uring setup failed, using the thread pool instead");
+
+    if (efd != -1)
+    {
+        (void) close(efd);
+    }
+
+    if (sqes != MAP_FAILED)
+    {
+        (void) munmap(sqes, sqes_size);
+    }
+
+    if (cq != MAP_FAILED && cq != sq)
+    {
+        (void) munmap(cq, cq_size);
+    }
+
+    if (sq != MAP_FAILED)
+    {
+        (void) munmap(sq, sq_size);
+    }
+
+    (void) close(fd);
+
+    return NGX_ERROR;
+}
+
+//
+// IORING_OP_OPENAT and IORING_OP_READ came with Linux 5.6, as did probing;
+// a kernel that cannot be probed is too old.
+//
+
+static ngx_int_t
+ngx_http_ericsten_uring_probe(int fd, ngx_log_t *log)
+{
+    ngx_int_t               rc;
+    struct io_uring_probe  *probe;
+
+    probe = ngx_calloc(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), log);
+    if (probe == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && probe->last_op >= IORING_OP_READ
+        && (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+    {
+        rc = NGX_OK;
+    }
+    else
+    {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+            "io_uring lacks IORING_OP_OPENAT or IORING_OP_READ, using the thread pool instead");
+    }
+
+    ngx_free(probe);
+
+    return rc;
+}
+
+#else
+
+ngx_int_t
+ngx_http_ericsten_uring_reserve(ngx_uint_t n, ngx_log_t *log)
+{
+    return NGX_DECLINED;
+}
+
+void
+ngx_http_ericsten_uring_release(ngx_uint_t n)
+{
+}
+
+void
+ngx_http_ericsten_uring_openat(ngx_http_ericsten_uring_op_t *op, u_char *path, int flags)
+{
+}
+
+void
+ngx_http_ericsten_uring_read(ngx_http_ericsten_uring_op_t *op, ngx_fd_t fd, u_char *buf,
+    size_t len, off_t offset)
+{
+}
+
+void
+ngx_http_ericsten_uring_submit(ngx_log_t *log)
+{
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+
+Module Description:
+    Per-worker io_uring used by ngx_http_ericsten_module for I/O-bound work.
+
+    Operations are queued to a submission ring shared with the kernel and
+    submitted in batches with io_uring_enter().  Completions are signalled on
+    an eventfd watched by the event loop; its handler reaps them and calls
+    each operation's event handler, the same way a thread pool task's
+    completion handler is called.  Nothing runs on a thread.
+
+    The ring is set up on first use.  When io_uring is not available (built
+    without it, an old kernel, or a seccomp policy that forbids it),
+    ngx_http_ericsten_uring_reserve() declines and callers use the thread
+    pool instead.  Needs Linux 5.6 for IORING_OP_OPENAT and IORING_OP_READ.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_URING_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_URING_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+typedef struct
+{
+    ngx_event_t     event;      // Handler, data and log are set by the caller; run on the event loop.
+    int32_t         res;        // As returned by the system call, or -errno.
+} ngx_http_ericsten_uring_op_t;
+
+//
+// Reserve room for n operations in flight, setting the ring up if needed.
+// Returns NGX_DECLINED if there is no ring or it is fully reserved; the
+// caller should use the thread pool then.  Every operation must have
+// completed before the reservation is released.
+//
+ngx_int_t ngx_http_ericsten_uring_reserve(ngx_uint_t n, ngx_log_t *log);
+void ngx_http_ericsten_uring_release(ngx_uint_t n);
+
+//
+// Queue an operation.  It is submitted by ngx_http_ericsten_uring_submit(),
+// or after the current batch of completions has been handled when called
+// from a completion handler.
+//
+void ngx_http_ericsten_uring_openat(ngx_http_ericsten_uring_op_t *op, u_char *path, int flags);
+void ngx_http_ericsten_uring_read(ngx_http_ericsten_uring_op_t *op, ngx_fd_t fd, u_char *buf,
+    size_t len, off_t offset);
+
+void ngx_http_ericsten_uring_submit(ngx_log_t *log);
+
+#endif /* _NGX_HTTP_ERICSTEN_URING_H_INCLUDED_ */
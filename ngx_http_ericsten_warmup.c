@@ -0,0 +1,306 @@
+/*
+
+Module Description:
+    Cache warm-up for ngx_http_ericsten_module.  See
+    ngx_http_ericsten_warmup.h.
+
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_http_ericsten_warmup.h"
+
+typedef struct
+{
+    ngx_http_ericsten_warmup_t     *warmup;
+    ngx_str_t                      *key;
+    ngx_int_t                       rc;
+    size_t                          len;
+    u_char                          value[NGX_HTTP_ERICSTEN_WARMUP_VALUE];
+} ngx_http_ericsten_warmup_ctx_t;
+
+static void ngx_http_ericsten_warmup_post(ngx_http_ericsten_warmup_t *warmup, ngx_thread_task_t *task);
+static void ngx_http_ericsten_warmup_task(void *data, ngx_log_t *log);
+static void ngx_http_ericsten_warmup_completion_handler(ngx_event_t *ev);
+static void ngx_http_ericsten_warmup_done(ngx_http_ericsten_warmup_t *warmup);
+
+ngx_http_ericsten_warmup_t *
+ngx_http_ericsten_warmup_create(ngx_conf_t *cf, ngx_http_ericsten_warmup_pt compute)
+{
+    ngx_http_ericsten_warmup_t  *warmup;
+
+    warmup = ngx_pcalloc(cf->pool, sizeof(ngx_http_ericsten_warmup_t));
+    if (warmup == NULL)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&warmup->keys, cf->pool, 16, sizeof(ngx_str_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    warmup->compute = compute;
+
+    return warmup;
+}
+
+ngx_int_t
+ngx_http_ericsten_warmup_add_file(ngx_conf_t *cf, ngx_http_ericsten_warmup_t *warmup, ngx_str_t *path)
+{
+    u_char           *text, *p, *q, *last, *end;
+    size_t            size;
+    ssize_t           n;
+    ngx_fd_t          fd;
+    ngx_str_t         name, *key;
+    ngx_int_t         rc;
+    ngx_file_info_t   fi;
+
+    name = *path;
+
+    if (ngx_conf_full_name(cf->cycle, &name, 1) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+            ngx_open_file_n " \"%V\" failed", &name);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+            ngx_fd_info_n " \"%V\" failed", &name);
+        goto done;
+    }
+
+    //
+    // The keys point into the text, which stays with the configuration.
+    //
+
+    size = (size_t) ngx_file_size(&fi);
+
+    text = ngx_pnalloc(cf->pool, size + 1);
+    if (text == NULL)
+    {
+        goto done;
+    }
+
+    n = ngx_read_fd(fd, text, size);
+
+    if (n == -1)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+            ngx_read_fd_n " \"%V\" failed", &name);
+        goto done;
+    }
+
+    if ((size_t) n != size)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            ngx_read_fd_n " \"%V\" returned only %z bytes instead of %uz", &name, n, size);
+        goto done;
+    }
+
+    end = text + size;
+
+    for (p = text; p < end; p = last + 1)
+    {
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL)
+        {
+            last = end;
+        }
+
+        while (p < last && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+
+        if (p == last || *p == '#' || *p == CR)
+        {
+            continue;
+        }
+
+        for (q = p; q < last && *q != ' ' && *q != '\t' && *q != CR; q++) { /* void */ }
+
+        key = ngx_array_push(&warmup->keys);
+        if (key == NULL)
+        {
+            goto done;
+        }
+
+        key->data = p;
+        key->len = q - p;
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR)
+    {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+            ngx_close_file_n " \"%V\" failed", &name);
+    }
+
+    return rc;
+}
+
+ngx_int_t
+ngx_http_ericsten_warmup_start(ngx_http_ericsten_warmup_t *warmup, ngx_thread_pool_t *tp, ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_core_conf_t                 *ccf;
+    ngx_thread_task_t               *task;
+    ngx_http_ericsten_warmup_ctx_t  *ctx;
+
+    //
+    // Worker n warms keys n, n + worker_processes, ...
+    //
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    warmup->next = ngx_worker;
+    warmup->step = (ngx_process == NGX_PROCESS_SINGLE) ? 1 : (ngx_uint_t) ccf->worker_processes;
+
+    if (warmup->next >= warmup->keys.nelts)
+    {
+        return NGX_OK;
+    }
+
+    warmup->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, cycle->log);
+    if (warmup->pool == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    warmup->thread_pool = tp;
+    warmup->log = cycle->log;
+    warmup->start = ngx_current_msec;
+
+    for (i = 0; i < warmup->concurrency; i++)
+    {
+        task = ngx_thread_task_alloc(cycle->pool, sizeof(ngx_http_ericsten_warmup_ctx_t));
+        if (task == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx = task->ctx;
+        ctx->warmup = warmup;
+
+        task->handler = ngx_http_ericsten_warmup_task;
+        task->event.handler = ngx_http_ericsten_warmup_completion_handler;
+        task->event.data = task;
+
+        ngx_http_ericsten_warmup_post(warmup, task);
+    }
+
+    if (warmup->active == 0)
+    {
+        ngx_http_ericsten_warmup_done(warmup);
+    }
+
+    return NGX_OK;
+}
+
+//
+// Post task with the next key of this worker's share that the store does
+// not have, if any.
+//
+
+static void
+ngx_http_ericsten_warmup_post(ngx_http_ericsten_warmup_t *warmup, ngx_thread_task_t *task)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        value, *keys;
+    ngx_http_ericsten_warmup_ctx_t  *ctx = task->ctx;
+
+    keys = warmup->keys.elts;
+
+    while (warmup->next < warmup->keys.nelts && !ngx_exiting && !ngx_terminate && !ngx_quit)
+    {
+        ctx->key = &keys[warmup->next];
+        warmup->next += warmup->step;
+
+        rc = ngx_http_ericsten_store_get(warmup->store, ctx->key->data, ctx->key->len, warmup->pool, &value);
+
+        ngx_reset_pool(warmup->pool);
+
+        if (rc == NGX_OK)
+        {
+            warmup->cached++;
+            continue;
+        }
+
+        if (ngx_thread_task_post(warmup->thread_pool, task) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, warmup->log, 0,
+                "ericsten warm-up: failed to post task");
+            break;
+        }
+
+        warmup->active++;
+        return;
+    }
+}
+
+//
+// Thread Pool Task Function
+//
+
+static void
+ngx_http_ericsten_warmup_task(void *data, ngx_log_t *log)
+{
+    ngx_http_ericsten_warmup_ctx_t  *ctx = data;
+
+    ctx->rc = ctx->warmup->compute(ctx->key, ctx->value, &ctx->len, log);
+}
+
+static void
+ngx_http_ericsten_warmup_completion_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t               *task = ev->data;
+    ngx_http_ericsten_warmup_ctx_t  *ctx = task->ctx;
+    ngx_http_ericsten_warmup_t      *warmup = ctx->warmup;
+
+    warmup->active--;
+
+    if (ctx->rc == NGX_OK)
+    {
+        ngx_http_ericsten_store_put(warmup->store, ctx->key->data, ctx->key->len, ctx->value, ctx->len);
+        warmup->computed++;
+    }
+    else
+    {
+        warmup->failed++;
+    }
+
+    ngx_http_ericsten_warmup_post(warmup, task);
+
+    if (warmup->active == 0)
+    {
+        ngx_http_ericsten_warmup_done(warmup);
+    }
+}
+
+static void
+ngx_http_ericsten_warmup_done(ngx_http_ericsten_warmup_t *warmup)
+{
+    ngx_destroy_pool(warmup->pool);
+    warmup->pool = NULL;
+
+    ngx_log_error(NGX_LOG_NOTICE, warmup->log, 0,
+        "ericsten warm-up: %ui keys computed, %ui already cached, %ui failed in %M ms",
+        warmup->computed, warmup->cached, warmup->failed, ngx_current_msec - warmup->start);
+}
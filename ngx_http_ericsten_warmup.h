@@ -0,0 +1,81 @@
+/*
+
+Module Description:
+    Cache warm-up for ngx_http_ericsten_module.
+
+    After a deploy, every key is a miss until a request has paid for it,
+    and the first minutes of traffic see the full latency of the offloaded
+    task.  A warm-up list names the keys worth having ready: when a worker
+    starts, it computes them on the thread pool and stores the results in
+    the result cache, a few at a time so that requests, which the worker
+    accepts meanwhile, still find free threads.
+
+    The workers split the list between them, and skip keys the result cache
+    already has, so after a restart with a persistent cache there is little
+    left to do.  The list is read at configuration time.
+
+*/
+
+#ifndef _NGX_HTTP_ERICSTEN_WARMUP_H_INCLUDED_
+#define _NGX_HTTP_ERICSTEN_WARMUP_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_http_ericsten_store.h"
+
+//
+// Largest value a warm-up task may produce.
+//
+#define NGX_HTTP_ERICSTEN_WARMUP_VALUE  64
+
+//
+// On a pool thread: compute the value of key into value, at most
+// NGX_HTTP_ERICSTEN_WARMUP_VALUE bytes, and set *len.  Returns NGX_OK, or
+// NGX_ERROR to leave the key out.
+//
+typedef ngx_int_t (*ngx_http_ericsten_warmup_pt)(ngx_str_t *key, u_char *value, size_t *len, ngx_log_t *log);
+
+typedef struct
+{
+    ngx_array_t                     keys;           // ngx_str_t
+    ngx_uint_t                      concurrency;    // Tasks in flight per worker.
+    ngx_http_ericsten_warmup_pt     compute;
+    ngx_http_ericsten_store_t      *store;
+
+    //
+    // Worker state.
+    //
+
+    ngx_thread_pool_t              *thread_pool;
+    ngx_pool_t                     *pool;           // For lookups in the store.
+    ngx_log_t                      *log;
+    ngx_uint_t                      next;           // Next key of this worker's share.
+    ngx_uint_t                      step;
+    ngx_uint_t                      active;         // Tasks in flight.
+    ngx_uint_t                      computed;
+    ngx_uint_t                      cached;         // Skipped, already in the store.
+    ngx_uint_t                      failed;
+    ngx_msec_t                      start;
+} ngx_http_ericsten_warmup_t;
+
+//
+// At configuration time.
+//
+ngx_http_ericsten_warmup_t *ngx_http_ericsten_warmup_create(ngx_conf_t *cf, ngx_http_ericsten_warmup_pt compute);
+
+//
+// Add the keys of a file: the first word of each line, as in an
+// ericsten_snapshot file.  Empty lines and lines starting with '#' are
+// skipped.
+//
+ngx_int_t ngx_http_ericsten_warmup_add_file(ngx_conf_t *cf, ngx_http_ericsten_warmup_t *warmup, ngx_str_t *path);
+
+//
+// From the module's init_process handler: post the first tasks of this
+// worker's share.
+//
+ngx_int_t ngx_http_ericsten_warmup_start(ngx_http_ericsten_warmup_t *warmup, ngx_thread_pool_t *tp,
+    ngx_cycle_t *cycle);
+
+#endif /* _NGX_HTTP_ERICSTEN_WARMUP_H_INCLUDED_ */